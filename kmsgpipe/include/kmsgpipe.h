@@ -5,6 +5,21 @@
 #include <linux/kernel.h>
 #include <linux/errno.h>
 #include <linux/string.h>
+#include <linux/cache.h>
+#include <linux/bitops.h>
+#include <asm/barrier.h>
+
+#define kmsgpipe_load_acquire(p) smp_load_acquire(p)
+#define kmsgpipe_store_release(p, v) smp_store_release(p, v)
+#define kmsgpipe_cmpxchg(p, old, new) cmpxchg(p, old, new)
+#define kmsgpipe_set_bit_release(nr, addr) \
+    do                                      \
+    {                                       \
+        smp_mb__before_atomic();            \
+        set_bit(nr, addr);                  \
+    } while (0)
+#define kmsgpipe_clear_bit_release(nr, addr) clear_bit_unlock(nr, addr)
+#define KMSGPIPE_CACHELINE_ALIGNED ____cacheline_aligned_in_smp
 #else /* Userland */
 #include <stddef.h>
 #include <stdint.h>
@@ -14,8 +29,30 @@
 #include <string.h>
 #include <stdlib.h>
 typedef uint64_t ktime_t;
+
+#define kmsgpipe_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define kmsgpipe_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define kmsgpipe_cmpxchg(p, old, new) __sync_val_compare_and_swap(p, old, new)
+#define kmsgpipe_set_bit_release(nr, addr) \
+    ((void)__atomic_fetch_or(addr, 1UL << (nr), __ATOMIC_RELEASE))
+#define kmsgpipe_clear_bit_release(nr, addr) \
+    ((void)__atomic_fetch_and(addr, ~(1UL << (nr)), __ATOMIC_RELEASE))
+#define KMSGPIPE_CACHELINE_ALIGNED __attribute__((aligned(64)))
 #endif
 
+/* Lockless read of a field that may change under us (wait_event conditions) */
+#define KMSGPIPE_READ_ONCE(x) (*(const volatile __typeof__(x) *)&(x))
+
+/* Occupancy bitmap geometry: one bit per message slot */
+#define KMSGPIPE_BITS_PER_WORD (sizeof(unsigned long) * 8)
+/*
+ * The occupancy bitmap is stored as (bits, generation) word pairs. A pair
+ * only counts while its tag matches buf->generation, so kmsgpipe_clear()
+ * empties every slot by bumping the generation instead of rewriting the map.
+ */
+#define KMSGPIPE_BITMAP_WORDS(capacity) \
+    (2 * (((capacity) + KMSGPIPE_BITS_PER_WORD - 1) / KMSGPIPE_BITS_PER_WORD))
+
 typedef struct kmsg_record
 {
     ktime_t timestamp;
@@ -23,23 +60,314 @@ typedef struct kmsg_record
     gid_t owner_gid;
     uint16_t len;
     bool valid;
+    uint32_t repeats; /* copies collapsed into this one (kmsgpipe_init_dedup()) */
 } kmsg_record_t;
 
+#define KMSGPIPE_REPEATS_MAX ((uint32_t)~0U)
+
+/*
+ * Storage layouts:
+ *   SLOT    - one fixed data_size slot per message, metadata in records[]
+ *   PACKED  - length-prefixed records packed back to back in one byte ring
+ *   COMPACT - SLOT payloads with metadata split into per-field arrays
+ *   INLINE  - SLOT with one cache line per record; small payloads live in
+ *             the record itself, larger ones in the data_size slot
+ */
+typedef enum kmsgpipe_layout
+{
+    KMSGPIPE_LAYOUT_SLOT = 0,
+    KMSGPIPE_LAYOUT_PACKED,
+    KMSGPIPE_LAYOUT_COMPACT,
+    KMSGPIPE_LAYOUT_INLINE,
+} kmsgpipe_layout_t;
+
+/* In-line header in front of every payload in the packed layout */
+typedef struct kmsg_packed_hdr
+{
+    ktime_t timestamp;
+    uid_t owner_uid;
+    gid_t owner_gid;
+    uint32_t len;     /* payload bytes, or KMSGPIPE_PACKED_PAD */
+    uint32_t raw_len; /* compressed payload: bytes once decompressed, else 0 */
+} kmsg_packed_hdr_t;
+
+#define KMSGPIPE_PACKED_ALIGN 8
+/* Marks the unused tail of the ring when a record did not fit before the end */
+#define KMSGPIPE_PACKED_PAD ((uint32_t)~0U)
+#define KMSGPIPE_PACKED_RECORD_SIZE(len) \
+    ((sizeof(kmsg_packed_hdr_t) + (len) + KMSGPIPE_PACKED_ALIGN - 1) & ~((size_t)KMSGPIPE_PACKED_ALIGN - 1))
+
+#define KMSGPIPE_INLINE_RECORD_SIZE 64
+#define KMSGPIPE_INLINE_MAX (KMSGPIPE_INLINE_RECORD_SIZE - 18)
+
+/* INLINE: metadata and, for len <= inline_max, the payload in one cache line */
+typedef struct kmsg_inline_record
+{
+    ktime_t timestamp;
+    uid_t owner_uid;
+    gid_t owner_gid;
+    uint16_t len;
+    uint8_t data[KMSGPIPE_INLINE_MAX];
+} kmsg_inline_record_t;
+
+/* COMPACT: one owner shared by every queued message it sent */
+typedef struct kmsg_cred
+{
+    uid_t uid;
+    gid_t gid;
+    uint32_t refs;           /* queued messages using this entry, 0 = free */
+} kmsg_cred_t;
+
+#define KMSGPIPE_COMPACT_TS_MAX ((uint32_t)~0U)
+#define KMSGPIPE_COMPACT_MAX_CREDS 65536
+/*
+ * Bytes of metadata a COMPACT ring needs: occupancy bitmap, credential
+ * table, then per slot a 32-bit timestamp delta, a 16-bit length and a
+ * 16-bit credential index (8 bytes, against sizeof(kmsg_record_t)).
+ */
+#define KMSGPIPE_COMPACT_META_SIZE(capacity, ncreds)                  \
+    (KMSGPIPE_BITMAP_WORDS(capacity) * sizeof(unsigned long) +        \
+     (ncreds) * sizeof(kmsg_cred_t) +                                 \
+     (capacity) * (sizeof(uint32_t) + 2 * sizeof(uint16_t)))
+
+/*
+ * Per-message deadlines (LOCKED SLOT, COMPACT and INLINE layouts) are kept
+ * in a hierarchical timer wheel: KMSGPIPE_WHEEL_LEVELS levels of
+ * KMSGPIPE_WHEEL_SIZE buckets, a level n bucket spanning 64^n ticks. Each
+ * armed slot is linked into exactly one bucket through its kmsg_timer_t.
+ */
+#define KMSGPIPE_WHEEL_BITS 6
+#define KMSGPIPE_WHEEL_SIZE (1 << KMSGPIPE_WHEEL_BITS)
+#define KMSGPIPE_WHEEL_LEVELS 4
+#define KMSGPIPE_TIMER_NIL ((uint32_t)~0U)
+#define KMSGPIPE_NO_DEADLINE ((ktime_t)(~0ULL >> 1))
+
+typedef struct kmsg_timer
+{
+    ktime_t deadline;        /* KMSGPIPE_NO_DEADLINE when not armed */
+    uint32_t next;           /* neighbouring slots in the same bucket */
+    uint32_t prev;
+    uint16_t bucket;         /* level * KMSGPIPE_WHEEL_SIZE + index */
+} kmsg_timer_t;
+
+typedef struct kmsgpipe_wheel
+{
+    uint64_t next_tick;      /* first tick not processed yet */
+    unsigned int tick_shift; /* one tick is 2^tick_shift ns */
+    size_t armed;            /* timers linked into buckets */
+    uint64_t pending[KMSGPIPE_WHEEL_LEVELS]; /* bit i: bucket i non-empty */
+    uint32_t bucket[KMSGPIPE_WHEEL_LEVELS * KMSGPIPE_WHEEL_SIZE]; /* first slot or NIL */
+    kmsg_timer_t *timers;    /* one per slot */
+} kmsgpipe_wheel_t;
+
+/*
+ * Per-owner sub-queues (LOCKED SLOT, COMPACT and INLINE layouts). Every
+ * message is linked, in FIFO order, into the queue of its owner uid and
+ * the queue of its owner gid. Queues live in two open-addressed tables of
+ * nqueues entries, uids first, found by hashing the id.
+ */
+#define KMSGPIPE_OWNER_UID 0
+#define KMSGPIPE_OWNER_GID 1
+#define KMSGPIPE_OWNER_NIL ((uint32_t)~0U)
+
+typedef struct kmsg_owner_queue
+{
+    uint32_t id;             /* uid or gid */
+    uint32_t count;          /* 0: entry free */
+    uint32_t first;          /* oldest message's slot */
+    uint32_t last;           /* newest message's slot */
+} kmsg_owner_queue_t;
+
+typedef struct kmsg_owner_link
+{
+    uint32_t next[2];        /* [KMSGPIPE_OWNER_UID] and [KMSGPIPE_OWNER_GID] */
+    uint32_t prev[2];
+} kmsg_owner_link_t;
+
+typedef struct kmsgpipe_owners
+{
+    kmsg_owner_queue_t *queues; /* 2 * nqueues entries */
+    size_t nqueues;          /* power of two */
+    size_t used[2];          /* entries taken per table */
+    kmsg_owner_link_t *links; /* one per slot */
+} kmsgpipe_owners_t;
+
+/*
+ * Last-value index (LOCKED SLOT, COMPACT and INLINE layouts): the slot of
+ * the newest queued message for each key. One open-addressed table with
+ * more entries than the ring has slots, so it never fills.
+ */
+#define KMSGPIPE_KEY_NIL ((uint32_t)~0U)
+
+typedef struct kmsg_key_entry
+{
+    uint64_t key;
+    uint32_t slot;           /* KMSGPIPE_KEY_NIL: entry free */
+} kmsg_key_entry_t;
+
+typedef struct kmsgpipe_keys
+{
+    kmsg_key_entry_t *table;
+    size_t nentries;         /* power of two above capacity */
+    uint64_t *slot_keys;     /* per slot: key of the message there, if it has one */
+    size_t replaced;         /* messages dropped for a newer one with their key */
+} kmsgpipe_keys_t;
+
+/*
+ * Sequence numbers and replay (LOCKED SLOT and INLINE layouts). Slots keep
+ * their message after it is read until head writes over them, so the last
+ * @retained slots before head hold history in sequence order.
+ */
+typedef struct kmsgpipe_history
+{
+    uint64_t *seqs;          /* per slot: sequence number of the message written there */
+    uint64_t next_seq;       /* given to the next message committed */
+    size_t retained;         /* slots before head holding history, at most capacity */
+} kmsgpipe_history_t;
+
+/*
+ * Payload chains (LOCKED SLOT, COMPACT and INLINE layouts): a slot may hold
+ * a message too large for it as an opaque chain the caller allocated, e.g.
+ * a list of pages. The ring owns a committed chain and hands it back to
+ * @free once the message is read, expired, replaced or cleared.
+ */
+typedef void (*kmsgpipe_chain_free_t)(void *chain);
+
+typedef struct kmsgpipe_chains
+{
+    void **chain;            /* per slot: chain of the message there, or NULL */
+    kmsgpipe_chain_free_t free;
+    size_t live;             /* chains held by queued messages */
+} kmsgpipe_chains_t;
+
+/* Who may read a message: root, its owner uid, or members of its owner gid */
+static inline bool kmsgpipe_may_read(uid_t uid, gid_t gid, uid_t owner_uid, gid_t owner_gid)
+{
+    return uid == 0 || uid == owner_uid || gid == owner_gid;
+}
+
+/*
+ * Synchronisation models:
+ *   LOCKED - caller serialises every operation (e.g. with a mutex)
+ *   SPSC   - one producer and one consumer run concurrently without a lock;
+ *            head/tail are free-running and published with acquire/release
+ *   MPMC   - any number of producers and consumers claim slots with CAS on
+ *            head/tail; a per-slot sequence number says whose turn it is
+ */
+typedef enum kmsgpipe_sync
+{
+    KMSGPIPE_SYNC_LOCKED = 0,
+    KMSGPIPE_SYNC_SPSC,
+    KMSGPIPE_SYNC_MPMC,
+} kmsgpipe_sync_t;
+
 typedef struct kmsgpipe_buffer
 {
     uint8_t *base;
-    size_t capacity;
-    size_t data_size;
-    size_t head;
-    size_t tail;
+    size_t capacity;         /* message slots (PACKED: upper bound on messages) */
+    size_t data_size;        /* bytes per slot (PACKED: max payload per message) */
+    size_t count;            /* number of valid messages, kept by push/pop (LOCKED only; atomic when split) */
     kmsg_record_t *records;
+    unsigned long *occupancy; /* bit i set <=> slot i holds a message (LOCKED only) */
+    unsigned long generation; /* LOCKED: occupancy words tagged otherwise are empty */
+    size_t *sequence;        /* MPMC: per-slot turn counter */
+    kmsgpipe_layout_t layout;
+    kmsgpipe_sync_t sync;
+    size_t mask;             /* SPSC/MPMC: capacity - 1 */
+    size_t size;             /* PACKED: ring size in bytes */
+    size_t used;             /* PACKED: bytes taken by records and padding */
+    bool mirrored;           /* PACKED: base[size, 2 * size) maps base[0, size) again */
+    bool split;              /* LOCKED: producer and consumer locked apart (kmsgpipe_init_split()) */
+
+    /* COMPACT: struct-of-arrays replacement for records[] */
+    uint32_t *ts_delta;      /* (timestamp - epoch) >> ts_shift */
+    uint16_t *lens;
+    uint16_t *cred_idx;      /* index into creds[] */
+    kmsg_cred_t *creds;
+    size_t ncreds;
+    ktime_t epoch;
+    unsigned int ts_shift;
+
+    kmsg_inline_record_t *lines; /* INLINE: one record per slot */
+    size_t inline_max;       /* INLINE: largest payload kept in lines[] */
+
+    kmsgpipe_wheel_t *wheel; /* per-message deadlines, or NULL */
+    kmsgpipe_owners_t *owners; /* per-owner sub-queues, or NULL */
+    kmsgpipe_keys_t *keys;   /* last-value index, or NULL */
+    kmsgpipe_history_t *history; /* sequence numbers and replay, or NULL */
+    kmsgpipe_chains_t *chains; /* large payloads held outside the slots, or NULL */
+    bool dedup;              /* collapse repeats of the newest message */
+    uint64_t last_hash;      /* dedup: payload hash of the newest message */
+
+    /* Producer side; own cache line so the consumer does not bounce it */
+    size_t head KMSGPIPE_CACHELINE_ALIGNED; /* slot index (PACKED: byte offset) */
+    size_t cached_tail;      /* SPSC: producer's last view of tail */
+
+    /* Consumer side */
+    size_t tail KMSGPIPE_CACHELINE_ALIGNED; /* slot index (PACKED: byte offset) */
+    size_t cached_head;      /* SPSC: consumer's last view of head */
 } kmsgpipe_buffer_t;
 
+/*
+ * Occupancy words come in (bits, generation) pairs; a pair tagged with an
+ * older generation is empty, whatever its bits say. LOCKED slot rings only.
+ *
+ * In a split ring the bits hand slots between producer and consumer: a set
+ * publishes the slot's payload and metadata, a clear hands the slot back,
+ * so both are atomic release operations and the test is an acquire. The
+ * generation never moves there (kmsgpipe_clear() rewrites the map), so the
+ * words are never retagged under a concurrent test.
+ */
+static inline unsigned long *kmsgpipe_occupancy_word(const kmsgpipe_buffer_t *buf, size_t idx)
+{
+    unsigned long *word = &buf->occupancy[2 * (idx / KMSGPIPE_BITS_PER_WORD)];
+
+    if (word[1] != buf->generation)
+    {
+        word[0] = 0;
+        word[1] = buf->generation;
+    }
+    return word;
+}
+
+static inline bool kmsgpipe_occupancy_test(const kmsgpipe_buffer_t *buf, size_t idx)
+{
+    const unsigned long *word = &buf->occupancy[2 * (idx / KMSGPIPE_BITS_PER_WORD)];
+    unsigned long bits;
+
+    if (word[1] != buf->generation)
+        return false;
+    bits = buf->split ? kmsgpipe_load_acquire(&word[0]) : word[0];
+    return bits & (1UL << (idx % KMSGPIPE_BITS_PER_WORD));
+}
+
+static inline void kmsgpipe_occupancy_set(kmsgpipe_buffer_t *buf, size_t idx)
+{
+    unsigned long *word = kmsgpipe_occupancy_word(buf, idx);
+
+    if (buf->split)
+        kmsgpipe_set_bit_release(idx % KMSGPIPE_BITS_PER_WORD, word);
+    else
+        *word |= 1UL << (idx % KMSGPIPE_BITS_PER_WORD);
+}
+
+static inline void kmsgpipe_occupancy_clear(kmsgpipe_buffer_t *buf, size_t idx)
+{
+    unsigned long *word = kmsgpipe_occupancy_word(buf, idx);
+
+    if (buf->split)
+        kmsgpipe_clear_bit_release(idx % KMSGPIPE_BITS_PER_WORD, word);
+    else
+        *word &= ~(1UL << (idx % KMSGPIPE_BITS_PER_WORD));
+}
+
 /**
  * kmsgpipe_init - Initialize a message pipe buffer
  * @buf:       pointer to buffer struct to initialize
  * @base:      pointer to pre-allocated payload memory
  * @records:   pointer to pre-allocated metadata array
+ * @occupancy: pointer to pre-allocated bitmap of
+ *             KMSGPIPE_BITMAP_WORDS(capacity) words
  * @capacity:  number of message slots
  * @data_size: bytes per message slot
  *
@@ -51,9 +379,613 @@ int kmsgpipe_init(
     kmsgpipe_buffer_t *buf,
     uint8_t *base,
     kmsg_record_t *records,
+    unsigned long *occupancy,
+    size_t capacity,
+    size_t data_size);
+
+/**
+ * kmsgpipe_init_packed - Initialize a message pipe buffer in packed layout
+ * @buf:          pointer to buffer struct to initialize
+ * @base:         pointer to pre-allocated ring memory
+ * @size:         ring size in bytes (multiple of KMSGPIPE_PACKED_ALIGN)
+ * @max_msg_size: largest payload accepted by kmsgpipe_push()
+ *
+ * Messages are stored as a kmsg_packed_hdr_t followed by the payload,
+ * rounded up to KMSGPIPE_PACKED_ALIGN, so a ring holds as many messages as
+ * their actual lengths allow. No records[] or occupancy bitmap is needed.
+ *
+ * Returns:
+ *   0 on success
+ *  -EINVAL if arguments invalid or a max_msg_size record cannot fit
+ */
+int kmsgpipe_init_packed(
+    kmsgpipe_buffer_t *buf,
+    uint8_t *base,
+    size_t size,
+    size_t max_msg_size);
+
+/**
+ * kmsgpipe_init_packed_mirrored - Packed layout over a double-mapped ring
+ * @buf:          pointer to buffer struct to initialize
+ * @base:         @size bytes of ring memory mapped twice, back to back, so
+ *                that base[i + @size] is base[i]
+ * @size:         ring size in bytes (multiple of KMSGPIPE_PACKED_ALIGN, and
+ *                in practice of the page size, for the mapping)
+ * @max_msg_size: largest payload accepted by kmsgpipe_push()
+ *
+ * As kmsgpipe_init_packed(), except that a record running past the end of
+ * the ring continues into the second mapping instead of moving to offset
+ * 0. Records are never split nor preceded by padding, so every payload is
+ * one contiguous range and the whole ring is usable.
+ *
+ * Returns:
+ *   0 on success
+ *  -EINVAL if arguments invalid or a max_msg_size record cannot fit
+ */
+int kmsgpipe_init_packed_mirrored(
+    kmsgpipe_buffer_t *buf,
+    uint8_t *base,
+    size_t size,
+    size_t max_msg_size);
+
+/**
+ * kmsgpipe_init_compact - Initialize a message pipe buffer with compact metadata
+ * @buf:       pointer to buffer struct to initialize
+ * @base:      pointer to pre-allocated payload memory
+ * @meta:      pointer to KMSGPIPE_COMPACT_META_SIZE(@capacity, @ncreds)
+ *             bytes, aligned to unsigned long
+ * @capacity:  number of message slots
+ * @data_size: bytes per message slot, at most 65535
+ * @ncreds:    distinct (uid, gid) owners that may have messages queued at
+ *             once, at most KMSGPIPE_COMPACT_MAX_CREDS
+ * @ts_shift:  timestamps are kept as 32-bit deltas in units of
+ *             1 << @ts_shift, e.g. 20 for ~1ms when timestamps are in ns
+ *
+ * Same semantics as kmsgpipe_init() (LOCKED, slot payloads) but with
+ * about 8 bytes of metadata per slot instead of a kmsg_record_t, so scans
+ * over valid bits, lengths or timestamps touch a fraction of the cache
+ * lines. Timestamps are rounded down to the delta unit, so messages may
+ * expire up to one unit early.
+ *
+ * Returns:
+ *   0 on success
+ *  -EINVAL if arguments invalid
+ */
+int kmsgpipe_init_compact(
+    kmsgpipe_buffer_t *buf,
+    uint8_t *base,
+    void *meta,
+    size_t capacity,
+    size_t data_size,
+    size_t ncreds,
+    unsigned int ts_shift);
+
+/**
+ * kmsgpipe_init_inline - Initialize a message pipe buffer with inline small payloads
+ * @buf:        pointer to buffer struct to initialize
+ * @base:       pointer to pre-allocated payload memory, capacity * data_size
+ *              bytes; may be NULL when @data_size <= @inline_max
+ * @lines:      pointer to pre-allocated array of @capacity records,
+ *              ideally KMSGPIPE_INLINE_RECORD_SIZE aligned
+ * @occupancy:  pointer to pre-allocated bitmap of
+ *              KMSGPIPE_BITMAP_WORDS(capacity) words
+ * @capacity:   number of message slots
+ * @data_size:  largest message accepted
+ * @inline_max: messages up to this many bytes (at most KMSGPIPE_INLINE_MAX)
+ *              are stored inside their record
+ *
+ * Same semantics as kmsgpipe_init() (LOCKED). Pushing or popping a message
+ * of at most @inline_max bytes touches a single record line instead of a
+ * kmsg_record_t plus a separate payload slot.
+ *
+ * Returns:
+ *   0 on success
+ *  -EINVAL if arguments invalid
+ */
+int kmsgpipe_init_inline(
+    kmsgpipe_buffer_t *buf,
+    uint8_t *base,
+    kmsg_inline_record_t *lines,
+    unsigned long *occupancy,
+    size_t capacity,
+    size_t data_size,
+    size_t inline_max);
+
+/**
+ * kmsgpipe_init_spsc - Initialize a lock-free single-producer/single-consumer ring
+ * @buf:       pointer to buffer struct to initialize
+ * @base:      pointer to pre-allocated payload memory
+ * @records:   pointer to pre-allocated metadata array
+ * @capacity:  number of message slots, must be a power of two
+ * @data_size: bytes per message slot
+ *
+ * kmsgpipe_push() may then run on one thread concurrently with
+ * kmsgpipe_pop()/kmsgpipe_cleanup_expired() on one other thread, with no
+ * lock. head and tail count up forever and are masked to a slot index.
+ * kmsgpipe_clear() still needs both sides quiescent.
+ *
+ * Returns:
+ *   0 on success
+ *  -EINVAL if arguments invalid
+ */
+int kmsgpipe_init_spsc(
+    kmsgpipe_buffer_t *buf,
+    uint8_t *base,
+    kmsg_record_t *records,
+    size_t capacity,
+    size_t data_size);
+
+/**
+ * kmsgpipe_init_mpmc - Initialize a lock-free multi-producer/multi-consumer ring
+ * @buf:       pointer to buffer struct to initialize
+ * @base:      pointer to pre-allocated payload memory
+ * @records:   pointer to pre-allocated metadata array
+ * @sequence:  pointer to pre-allocated array of @capacity sequence numbers
+ * @capacity:  number of message slots, must be a power of two
+ * @data_size: bytes per message slot
+ *
+ * kmsgpipe_push(), kmsgpipe_pop() and kmsgpipe_cleanup_expired() may all
+ * run concurrently from any number of threads. Slot i is free for the
+ * producer holding ticket pos when sequence[i] == pos, and readable by the
+ * consumer holding ticket pos when sequence[i] == pos + 1.
+ * kmsgpipe_clear() still needs every producer and consumer quiescent.
+ *
+ * Returns:
+ *   0 on success
+ *  -EINVAL if arguments invalid
+ */
+int kmsgpipe_init_mpmc(
+    kmsgpipe_buffer_t *buf,
+    uint8_t *base,
+    kmsg_record_t *records,
+    size_t *sequence,
     size_t capacity,
     size_t data_size);
 
+/**
+ * kmsgpipe_init_wheel - Enable per-message deadlines on a buffer
+ * @buf:        LOCKED buffer in SLOT, COMPACT or INLINE layout
+ * @wheel:      pointer to pre-allocated wheel
+ * @timers:     pointer to pre-allocated array of capacity timers
+ * @tick_shift: wheel resolution, one tick being 2^tick_shift ns
+ * @now:        current time
+ *
+ * Call right after initialising @buf, before anything is pushed. Messages
+ * given a deadline by kmsgpipe_commit_deadline() are then dropped by
+ * kmsgpipe_expire_deadlines() wherever they are in the ring. The hole they
+ * leave keeps its slot until tail reaches it, so kmsgpipe_is_full() stays
+ * true until then.
+ *
+ * Returns:
+ *   0 on success
+ *  -EINVAL other layouts or sync modes, or capacity beyond 32-bit indices
+ */
+int kmsgpipe_init_wheel(
+    kmsgpipe_buffer_t *buf,
+    kmsgpipe_wheel_t *wheel,
+    kmsg_timer_t *timers,
+    unsigned int tick_shift,
+    ktime_t now);
+
+/**
+ * kmsgpipe_init_owners - Index queued messages by owner
+ * @buf:     LOCKED buffer in SLOT, COMPACT or INLINE layout
+ * @owners:  pointer to pre-allocated index
+ * @queues:  pointer to pre-allocated array of 2 * @nqueues queues
+ * @links:   pointer to pre-allocated array of capacity links
+ * @nqueues: queues per table, a power of two; up to @nqueues - 1 distinct
+ *           uids, and as many gids, may have messages queued at once
+ *
+ * Call right after initialising @buf, before anything is pushed. From then
+ * on kmsgpipe_peek() hands each reader the oldest message it may read, in
+ * O(1), instead of failing with -EACCES on someone else's message at tail.
+ * Messages consumed ahead of tail leave holes like expired deadlines do.
+ * A commit that would need a queue when a table is full fails with
+ * -EUSERS.
+ *
+ * Returns:
+ *   0 on success
+ *  -EINVAL other layouts or sync modes, capacity beyond 32-bit indices, or
+ *          @nqueues not a power of two of at least 2
+ */
+int kmsgpipe_init_owners(
+    kmsgpipe_buffer_t *buf,
+    kmsgpipe_owners_t *owners,
+    kmsg_owner_queue_t *queues,
+    kmsg_owner_link_t *links,
+    size_t nqueues);
+
+/**
+ * kmsgpipe_init_dedup - Collapse repeats of the newest message
+ * @buf: LOCKED buffer in SLOT layout
+ *
+ * From then on a commit whose payload and owner match the newest queued
+ * message, by a payload hash confirmed with memcmp(), bumps that record's
+ * repeats instead of taking a slot; kmsgpipe_peek() reports the count in
+ * span->repeats. The copy still needs a reservation, so a full ring
+ * refuses it like any other message. Messages with a deadline are never
+ * collapsed.
+ *
+ * Returns:
+ *   0 on success
+ *  -EINVAL other layouts or sync modes, or a last-value index or payload
+ *          chains in use
+ */
+int kmsgpipe_init_dedup(kmsgpipe_buffer_t *buf);
+
+/**
+ * kmsgpipe_init_split - Let one producer and one consumer run apart
+ * @buf: LOCKED buffer in SLOT or INLINE layout
+ *
+ * Call right after initialising @buf, before anything is pushed. From then
+ * on the producer side (kmsgpipe_reserve() to commit/cancel) and the
+ * consumer side (kmsgpipe_peek() to kmsgpipe_peek_release()) may run at
+ * the same time under two different locks: occupancy bits and count are
+ * updated atomically, with release/acquire ordering around each slot's
+ * payload, and tail never looks at head. Each side still needs its own
+ * lock if it has several users. kmsgpipe_clear(), kmsgpipe_migrate() and
+ * expiry need both.
+ *
+ * Deadlines, owner and key indexes, dedup, history and payload chains drop
+ * or look up messages across the two sides, so none of them may be set up
+ * on a split buffer, nor a split set up on top of them.
+ *
+ * Returns:
+ *   0 on success
+ *  -EINVAL other layouts or sync modes, or one of the above in use
+ */
+int kmsgpipe_init_split(kmsgpipe_buffer_t *buf);
+
+/**
+ * kmsgpipe_init_keys - Keep only the newest message per key
+ * @buf:       LOCKED buffer in SLOT, COMPACT or INLINE layout
+ * @keys:      pointer to pre-allocated index
+ * @table:     pointer to pre-allocated array of @nentries entries
+ * @slot_keys: pointer to pre-allocated array of capacity keys
+ * @nentries:  a power of two above the capacity; twice that keeps probes
+ *             short
+ *
+ * Call right after initialising @buf, before anything is pushed. From then
+ * on kmsgpipe_commit_keyed() drops the queued message with the same key,
+ * leaving a hole like an expired deadline, so a reader catching up sees
+ * at most one message per key. Messages committed without a key queue as
+ * usual. kmsgpipe_clear() rewrites the table, so it costs O(@nentries).
+ *
+ * Returns:
+ *   0 on success
+ *  -EINVAL other layouts or sync modes, dedup enabled, capacity beyond
+ *          32-bit indices, or @nentries not a power of two above capacity
+ */
+int kmsgpipe_init_keys(
+    kmsgpipe_buffer_t *buf,
+    kmsgpipe_keys_t *keys,
+    kmsg_key_entry_t *table,
+    uint64_t *slot_keys,
+    size_t nentries);
+
+/**
+ * kmsgpipe_init_history - Number messages and keep them for replay
+ * @buf:     LOCKED buffer in SLOT or INLINE layout
+ * @history: pointer to pre-allocated history
+ * @seqs:    pointer to pre-allocated array of capacity sequence numbers
+ *
+ * Call right after initialising @buf, before anything is pushed. Every
+ * message committed from then on gets the next 64-bit sequence number,
+ * counting from 0, which kmsgpipe_peek() reports. A message that was read,
+ * expired or replaced stays readable through kmsgpipe_history_peek() until
+ * a write reuses its slot, so the last capacity messages can be replayed
+ * without disturbing FIFO readers. kmsgpipe_clear() drops the history but
+ * numbering carries on; kmsgpipe_migrate() carries over only the queued
+ * messages, with their numbers.
+ *
+ * Returns:
+ *   0 on success
+ *  -EINVAL other layouts or sync modes, or payload chains in use
+ */
+int kmsgpipe_init_history(
+    kmsgpipe_buffer_t *buf,
+    kmsgpipe_history_t *history,
+    uint64_t *seqs);
+
+/**
+ * kmsgpipe_init_chains - Let slots hold chained payloads of large messages
+ * @buf:    LOCKED buffer in SLOT, COMPACT or INLINE layout
+ * @chains: pointer to pre-allocated chain table
+ * @chain:  pointer to pre-allocated array of capacity pointers
+ * @free:   called with each chain the ring is done with, under the lock
+ *          of its writers
+ *
+ * Call right after initialising @buf, before anything is pushed. Messages
+ * that fit a slot stay in it; larger ones are committed with
+ * kmsgpipe_commit_chain(). Free the ring with kmsgpipe_clear() first, or
+ * the chains still queued leak, unless kmsgpipe_migrate() moved them on.
+ *
+ * Returns:
+ *   0 on success
+ *  -EINVAL other layouts or sync modes, NULL @free, or dedup or history
+ *          in use, which would compare or keep chains after freeing them
+ */
+int kmsgpipe_init_chains(
+    kmsgpipe_buffer_t *buf,
+    kmsgpipe_chains_t *chains,
+    void **chain,
+    kmsgpipe_chain_free_t free);
+
+/*
+ * A message's bytes in ring memory, handed out by kmsgpipe_reserve() and
+ * kmsgpipe_peek() so callers can copy straight in or out of the ring.
+ */
+typedef struct kmsgpipe_span
+{
+    uint8_t *data;           /* payload bytes inside the ring */
+    size_t len;              /* reserve: bytes writable; peek: message length */
+    size_t pos;              /* ring position the span belongs to */
+    size_t raw_len;          /* peek: bytes once decompressed, 0 if stored as is */
+    uint32_t repeats;        /* peek: copies collapsed into the message */
+    uint64_t seq;            /* peek: sequence number (kmsgpipe_init_history()), else 0 */
+    void *chain;             /* peek: payload chain in place of data (kmsgpipe_commit_chain()) */
+} kmsgpipe_span_t;
+
+/**
+ * kmsgpipe_reserve - Claim room for a message without copying it
+ * @buf:  pointer to kmsgpipe_buffer
+ * @len:  largest payload the caller may write
+ * @span: filled with where to write the payload
+ *
+ * The caller writes up to @len bytes to span->data and then publishes them
+ * with kmsgpipe_commit(), or gives up with kmsgpipe_cancel(). Every
+ * reservation must end in exactly one of the two. In LOCKED mode the lock
+ * must be held from reserve to commit/cancel, unless
+ * kmsgpipe_copy_unlocked() allows dropping it in between. In SPSC mode only the
+ * producer may hold a reservation. Nothing is visible to readers before
+ * commit.
+ *
+ * Returns:
+ *   0 on success
+ *  -ENOSPC buffer full
+ *  -EMSGSIZE message too large
+ */
+int kmsgpipe_reserve(kmsgpipe_buffer_t *buf, size_t len, kmsgpipe_span_t *span);
+
+/**
+ * kmsgpipe_commit - Publish a message written into a reservation
+ * @buf:       pointer to kmsgpipe_buffer
+ * @span:      span from kmsgpipe_reserve()
+ * @len:       payload bytes actually written, at most span->len
+ * @uid:       uid of caller
+ * @gid:       gid of caller
+ * @timestamp: time of push operation
+ *
+ * Returns:
+ *   >=0 number of bytes published
+ *  -EINVAL @len exceeds the reservation, which is cancelled
+ *  -EUSERS COMPACT credential table or owner queue table full,
+ *          reservation cancelled
+ */
+ssize_t kmsgpipe_commit(
+    kmsgpipe_buffer_t *buf,
+    const kmsgpipe_span_t *span,
+    size_t len,
+    uid_t uid,
+    gid_t gid,
+    ktime_t timestamp);
+
+/**
+ * kmsgpipe_commit_deadline - kmsgpipe_commit() that also arms a deadline
+ * @buf:       pointer to kmsgpipe_buffer
+ * @span:      span from kmsgpipe_reserve()
+ * @len:       payload bytes actually written, at most span->len
+ * @uid:       uid of caller
+ * @gid:       gid of caller
+ * @timestamp: time of push operation
+ * @deadline:  time from which the message may be dropped, or
+ *             KMSGPIPE_NO_DEADLINE
+ *
+ * A deadline inside a tick the wheel has already processed fires on the
+ * next tick.
+ *
+ * Returns:
+ *   as kmsgpipe_commit()
+ *  -EOPNOTSUPP @deadline set on a buffer without a wheel, reservation
+ *              cancelled
+ */
+ssize_t kmsgpipe_commit_deadline(
+    kmsgpipe_buffer_t *buf,
+    const kmsgpipe_span_t *span,
+    size_t len,
+    uid_t uid,
+    gid_t gid,
+    ktime_t timestamp,
+    ktime_t deadline);
+
+/**
+ * kmsgpipe_commit_compressed - Publish a compressed payload
+ * @buf:       PACKED LOCKED buffer
+ * @span:      span from kmsgpipe_reserve()
+ * @len:       compressed bytes actually written, at most span->len
+ * @raw_len:   payload bytes once decompressed, at most buf->data_size
+ * @uid:       uid of caller
+ * @gid:       gid of caller
+ * @timestamp: time of push operation
+ *
+ * The ring only stores @raw_len next to the message and hands it back in
+ * span->raw_len on peek; compressing and decompressing is up to the caller.
+ *
+ * Returns:
+ *   as kmsgpipe_commit()
+ *  -EMSGSIZE @raw_len exceeds buf->data_size, reservation cancelled
+ *  -EOPNOTSUPP other layouts or sync modes, reservation cancelled
+ */
+ssize_t kmsgpipe_commit_compressed(
+    kmsgpipe_buffer_t *buf,
+    const kmsgpipe_span_t *span,
+    size_t len,
+    size_t raw_len,
+    uid_t uid,
+    gid_t gid,
+    ktime_t timestamp);
+
+/**
+ * kmsgpipe_commit_keyed - Publish a message that replaces its key's last one
+ * @buf:       buffer set up with kmsgpipe_init_keys()
+ * @span:      span from kmsgpipe_reserve()
+ * @len:       payload bytes actually written, at most span->len
+ * @key:       key of the message
+ * @uid:       uid of caller
+ * @gid:       gid of caller
+ * @timestamp: time of push operation
+ * @deadline:  as for kmsgpipe_commit_deadline()
+ *
+ * The queued message with @key, if any, is dropped once this one is in.
+ *
+ * Returns:
+ *   as kmsgpipe_commit_deadline()
+ *  -EOPNOTSUPP buffer has no last-value index, reservation cancelled
+ */
+ssize_t kmsgpipe_commit_keyed(
+    kmsgpipe_buffer_t *buf,
+    const kmsgpipe_span_t *span,
+    size_t len,
+    uint64_t key,
+    uid_t uid,
+    gid_t gid,
+    ktime_t timestamp,
+    ktime_t deadline);
+
+/**
+ * kmsgpipe_commit_chain - Publish a message whose payload is a chain
+ * @buf:       buffer set up with kmsgpipe_init_chains()
+ * @span:      span from kmsgpipe_reserve(), of any length
+ * @chain:     the payload; the ring owns it from here on
+ * @uid:       uid of caller
+ * @gid:       gid of caller
+ * @timestamp: time of push operation
+ * @deadline:  as for kmsgpipe_commit_deadline()
+ *
+ * The message takes a slot but none of its bytes: kmsgpipe_peek() returns
+ * it with span->chain set and span->len 0, and the chain knows its length.
+ * On error the reservation is cancelled and @chain stays the caller's.
+ *
+ * Returns:
+ *   0 on success
+ *  -EOPNOTSUPP buffer has no chains, or a deadline without a wheel
+ *  -EUSERS COMPACT layout: too many distinct owners queued
+ */
+ssize_t kmsgpipe_commit_chain(
+    kmsgpipe_buffer_t *buf,
+    const kmsgpipe_span_t *span,
+    void *chain,
+    uid_t uid,
+    gid_t gid,
+    ktime_t timestamp,
+    ktime_t deadline);
+
+/**
+ * kmsgpipe_cancel - Drop a reservation, e.g. after a failed copy
+ * @buf:  pointer to kmsgpipe_buffer
+ * @span: span from kmsgpipe_reserve()
+ *
+ * The ring is left as if kmsgpipe_reserve() had never been called. In MPMC
+ * mode the claimed slot is instead published empty and skipped by readers.
+ */
+void kmsgpipe_cancel(kmsgpipe_buffer_t *buf, const kmsgpipe_span_t *span);
+
+/**
+ * kmsgpipe_peek - Look at the oldest message without copying it
+ * @buf:  pointer to kmsgpipe_buffer
+ * @uid:  uid of caller
+ * @gid:  gid of caller
+ * @span: filled with the message's payload and length
+ *
+ * The caller reads span->data and then ends the peek with
+ * kmsgpipe_peek_release(). The same locking rules as kmsgpipe_reserve()
+ * apply, on the consumer side.
+ *
+ * With an owner index (kmsgpipe_init_owners()) this is the oldest message
+ * the caller may read, wherever it is in the ring. span->raw_len is
+ * non-zero for payloads stored with kmsgpipe_commit_compressed(), and
+ * span->repeats for messages that collapsed copies (kmsgpipe_init_dedup()).
+ *
+ * Returns:
+ *   0 on success
+ *  -ENODATA buffer empty, or nothing the caller may read with an owner index
+ *  -EACCES unauthorized read
+ */
+int kmsgpipe_peek(kmsgpipe_buffer_t *buf, uid_t uid, gid_t gid, kmsgpipe_span_t *span);
+
+/**
+ * kmsgpipe_peek_release - Finish with a message returned by kmsgpipe_peek()
+ * @buf:     pointer to kmsgpipe_buffer
+ * @span:    span from kmsgpipe_peek()
+ * @consume: remove the message; false leaves it as the oldest message
+ *
+ * In MPMC mode the peek already took the message from other consumers, so
+ * it is always removed.
+ */
+void kmsgpipe_peek_release(kmsgpipe_buffer_t *buf, const kmsgpipe_span_t *span, bool consume);
+
+/**
+ * kmsgpipe_copy_unlocked - Check whether payload copies may run unlocked
+ * @buf: pointer to kmsgpipe_buffer
+ *
+ * True for LOCKED rings whose lock may be dropped between kmsgpipe_reserve()
+ * and kmsgpipe_commit()/kmsgpipe_cancel(), and between kmsgpipe_peek() and
+ * kmsgpipe_peek_release(), while the caller copies the payload. The caller
+ * then keeps to one reservation and one peek at a time, and keeps
+ * kmsgpipe_clear(), kmsgpipe_migrate() and expiry away from both. A slot
+ * reservation sits at head and a peeked message at or after tail, so
+ * neither side moves the other's position.
+ *
+ * Packed rings move head when they drain. Keys, deadlines and dedup drop
+ * or update queued messages from the write side. These rings copy under
+ * the lock.
+ */
+static inline bool kmsgpipe_copy_unlocked(const kmsgpipe_buffer_t *buf)
+{
+    return buf->sync == KMSGPIPE_SYNC_LOCKED && buf->layout != KMSGPIPE_LAYOUT_PACKED &&
+           !buf->keys && !buf->wheel && !buf->dedup;
+}
+
+/**
+ * kmsgpipe_history_peek - Replay a message without consuming it
+ * @buf:  buffer set up with kmsgpipe_init_history()
+ * @seq:  sequence number to replay from
+ * @uid:  uid of caller
+ * @gid:  gid of caller
+ * @span: filled like kmsgpipe_peek(), span->seq included
+ *
+ * Finds the oldest retained message numbered @seq or later that the caller
+ * may read, in O(log capacity) plus the messages of others stepped over.
+ * It may have been read, expired or replaced since; either way it stays
+ * where it is and there is nothing to release. Replay the next one from
+ * span->seq + 1. The span is valid until the next write, so hold the lock
+ * the buffer's writers take while using it.
+ *
+ * Returns:
+ *   0 on success
+ *  -ENODATA nothing at or after @seq the caller may read
+ *  -EOPNOTSUPP buffer has no history
+ */
+int kmsgpipe_history_peek(kmsgpipe_buffer_t *buf, uint64_t seq, uid_t uid, gid_t gid, kmsgpipe_span_t *span);
+
+/**
+ * kmsgpipe_history_seek_time - Find where replay from a point in time starts
+ * @buf:       buffer set up with kmsgpipe_init_history()
+ * @timestamp: time to replay from
+ * @seq:       set to the sequence number of the oldest retained message
+ *             stamped @timestamp or later, or the next number to be given
+ *             out if there is none
+ *
+ * A binary search, so it relies on messages being committed in timestamp
+ * order; writers that stamp messages before taking the lock may be out of
+ * order by as much as they wait for it.
+ *
+ * Returns:
+ *   0 on success
+ *  -EOPNOTSUPP buffer has no history
+ */
+int kmsgpipe_history_seek_time(kmsgpipe_buffer_t *buf, ktime_t timestamp, uint64_t *seq);
+
 /**
  * kmsgpipe_push - Push a data block into the circular buffer
  * @buf:        pointer to kmsgpipe_buffer
@@ -68,6 +1000,7 @@ int kmsgpipe_init(
  *  -EINVAL invalid arguments
  *  -ENOSPC buffer full
  *  -EMSGSIZE message too large
+ *  -EUSERS COMPACT layout: too many distinct owners queued
  */
 ssize_t kmsgpipe_push(
     kmsgpipe_buffer_t *buf,
@@ -107,24 +1040,333 @@ ssize_t kmsgpipe_pop(
  */
 ssize_t kmsgpipe_cleanup_expired(kmsgpipe_buffer_t *buf, ktime_t current_ts);
 
+/**
+ * kmsgpipe_expire_deadlines - Drop messages whose deadline has passed
+ * @buf: buffer set up with kmsgpipe_init_wheel()
+ * @now: current time
+ *
+ * Advances the wheel to @now. The work done is proportional to the
+ * messages dropped and the buckets cascaded on the way, plus one step per
+ * 64 elapsed ticks while any timer is armed, never to the ring capacity.
+ *
+ * Returns:
+ *   >=0 number of messages dropped
+ *  -EOPNOTSUPP buffer has no wheel
+ */
+ssize_t kmsgpipe_expire_deadlines(kmsgpipe_buffer_t *buf, ktime_t now);
+
 /**
  * kmsgpipe_get_message_count - Get number of valid messages
  * @buf: pointer to buffer
  *
+ * O(1): returns the count maintained by push/pop/cleanup/clear.
+ *
  * Returns:
  *   >=0 message count
  *   <0  error code
  */
 ssize_t kmsgpipe_get_message_count(kmsgpipe_buffer_t *buf);
 
+/*
+ * Message count without taking the buffer lock. In SPSC/MPMC mode tail is
+ * read before head, so head - tail can never go negative; MPMC producers
+ * may run ahead of our stale tail, hence the clamp.
+ */
+static inline size_t kmsgpipe_count_hint(const kmsgpipe_buffer_t *buf)
+{
+    if (buf->sync != KMSGPIPE_SYNC_LOCKED)
+    {
+        size_t tail = kmsgpipe_load_acquire(&buf->tail);
+        size_t count = kmsgpipe_load_acquire(&buf->head) - tail;
+        return count < buf->capacity ? count : buf->capacity;
+    }
+    return KMSGPIPE_READ_ONCE(buf->count);
+}
+
+/**
+ * kmsgpipe_is_empty - Check whether the buffer holds no messages
+ * @buf: pointer to buffer
+ *
+ * Safe to call without the buffer lock (e.g. from a wait_event condition);
+ * the result is only a hint until re-checked under the lock.
+ */
+static inline bool kmsgpipe_is_empty(const kmsgpipe_buffer_t *buf)
+{
+    return kmsgpipe_count_hint(buf) == 0;
+}
+
+/**
+ * kmsgpipe_is_full - Check whether every message slot is in use
+ * @buf: pointer to buffer
+ *
+ * Same locking rules as kmsgpipe_is_empty().
+ */
+static inline bool kmsgpipe_is_full(const kmsgpipe_buffer_t *buf)
+{
+    /* Holes left by expiry, owner reads or keyed replacement keep their slot until tail reaches them */
+    if (buf->wheel || buf->owners || buf->keys)
+        return KMSGPIPE_READ_ONCE(buf->count) &&
+               KMSGPIPE_READ_ONCE(buf->head) == KMSGPIPE_READ_ONCE(buf->tail);
+    return kmsgpipe_count_hint(buf) >= buf->capacity;
+}
+
+/**
+ * kmsgpipe_has_room - Check whether a message of @len bytes can be pushed
+ * @buf: pointer to buffer
+ * @len: payload length
+ *
+ * In slot layout this is !kmsgpipe_is_full(). In packed layout it accounts
+ * for the record header and for padding lost when the record has to wrap.
+ * Same locking rules as kmsgpipe_is_empty().
+ */
+bool kmsgpipe_has_room(const kmsgpipe_buffer_t *buf, size_t len);
+
+/**
+ * kmsgpipe_migrate - Copy every queued message into another buffer
+ * @dst: freshly initialised buffer, in any layout and sync mode
+ * @src: buffer to copy from; it is not modified
+ *
+ * Messages keep their FIFO order, owner and timestamp, and into a SLOT
+ * @dst their repeat count. Payload chains are not copied but handed on, so
+ * whichever buffer the caller keeps owns them. Both buffers must be
+ * quiescent, e.g. under the lock that serialises @src. Since @src is left
+ * untouched, a failure part-way only leaves @dst partially filled and the
+ * caller can discard it without losing anything.
+ *
+ * Returns:
+ *   >=0 messages copied
+ *  -ENOSPC   if @dst cannot hold them all
+ *  -EMSGSIZE if a message is longer than dst->data_size
+ *  -EUSERS   if a COMPACT @dst runs out of credential entries
+ *  -EOPNOTSUPP if @src holds compressed payloads and @dst is not PACKED,
+ *              or payload chains and @dst has none
+ */
+ssize_t kmsgpipe_migrate(kmsgpipe_buffer_t *dst, const kmsgpipe_buffer_t *src);
+
 /**
  * kmsgpipe_clear - Clear all messages
  * @buf: pointer to buffer
  *
+ * Neither payload nor records are rewritten: slot layouts bump the bitmap
+ * generation and packed/SPSC rings reset head and tail, so the cost does
+ * not depend on the ring size. MPMC retires each queued slot's sequence.
+ * Stale bytes stay in memory but are never returned, since readers only
+ * ever see the bytes a producer committed. Payload chains are the
+ * exception: the slots are walked to free them while any are queued.
+ *
  * Returns:
  *   >=0 messages cleared
  *   <0  error code
  */
 ssize_t kmsgpipe_clear(kmsgpipe_buffer_t *buf);
 
+#define KMSGPIPE_MAX_LANES 8
+
+/*
+ * Picks which of several priority lanes, each its own kmsgpipe_buffer_t,
+ * is read next. Lane 0 has the highest priority. passed[] counts how often
+ * a non-empty lane was passed over for a higher one since it was last
+ * served.
+ */
+typedef struct kmsgpipe_lanes
+{
+    size_t nr_lanes;
+    unsigned int age_limit; /* 0: strict priority */
+    unsigned int passed[KMSGPIPE_MAX_LANES];
+} kmsgpipe_lanes_t;
+
+/**
+ * kmsgpipe_lanes_init - Initialise a lane scheduler
+ * @lanes:     scheduler to initialise
+ * @nr_lanes:  number of lanes, 1 to KMSGPIPE_MAX_LANES
+ * @age_limit: a lane passed over this many times is served ahead of
+ *             higher lanes; 0 never lets a lower lane jump the queue
+ *
+ * Returns:
+ *   0 on success
+ *  -EINVAL on an invalid lane count
+ */
+int kmsgpipe_lanes_init(kmsgpipe_lanes_t *lanes, size_t nr_lanes, unsigned int age_limit);
+
+/**
+ * kmsgpipe_lanes_pick - Choose the lane to read next
+ * @lanes: scheduler
+ * @bufs:  array of lanes->nr_lanes buffers
+ *
+ * The highest non-empty lane, unless a lower lane has aged past the limit,
+ * in which case the highest such lane. Does not change any state, and
+ * follows the locking rules of kmsgpipe_is_empty(), so it can serve as a
+ * wait condition.
+ *
+ * Returns:
+ *   >=0 lane index
+ *  -ENODATA if every lane is empty
+ */
+int kmsgpipe_lanes_pick(const kmsgpipe_lanes_t *lanes, const kmsgpipe_buffer_t *bufs);
+
+/**
+ * kmsgpipe_lanes_served - Account a message consumed from a lane
+ * @lanes: scheduler
+ * @bufs:  array of lanes->nr_lanes buffers
+ * @lane:  lane the message was consumed from
+ *
+ * Ages every lower non-empty lane that was passed over. Callers must
+ * serialise it against other kmsgpipe_lanes_served() calls.
+ */
+void kmsgpipe_lanes_served(kmsgpipe_lanes_t *lanes, const kmsgpipe_buffer_t *bufs, size_t lane);
+
+/*
+ * KMSGPIPE_DEFINE_FIXED_RING - Generate a SLOT ring with constant geometry
+ * @name:      prefix of the generated type and functions
+ * @CAPACITY:  message slots, a power of two
+ * @DATA_SIZE: bytes per slot, at most 0xFFFF
+ *
+ * Defines name##_t, a kmsgpipe_buffer_t bundled with its storage, and
+ * name##_init(). Also defines name##_reserve(), _commit(), _peek(),
+ * _peek_release(), _push() and _pop(). These work on any kmsgpipe_buffer_t
+ * and behave like the generic calls of the same name. On a LOCKED SLOT
+ * ring of exactly this geometry without a wheel, owner or key index,
+ * history, chains, dedup or split sides, they take a path where slot index wrap is a mask and slot addressing is
+ * a constant stride. Any other buffer falls through to the generic call, so a ring
+ * can be resized to another geometry behind their back.
+ *
+ * Use at file scope, followed by a semicolon.
+ */
+#define KMSGPIPE_DEFINE_FIXED_RING(name, CAPACITY, DATA_SIZE)                       \
+    typedef struct name                                                             \
+    {                                                                               \
+        kmsgpipe_buffer_t buf;                                                      \
+        kmsg_record_t records[CAPACITY];                                            \
+        unsigned long occupancy[KMSGPIPE_BITMAP_WORDS(CAPACITY)];                   \
+        uint8_t base[(size_t)(CAPACITY) * (DATA_SIZE)];                             \
+    } name##_t;                                                                     \
+                                                                                    \
+    static inline int name##_init(name##_t *ring)                                   \
+    {                                                                               \
+        return kmsgpipe_init(&ring->buf, ring->base, ring->records,                 \
+                             ring->occupancy, CAPACITY, DATA_SIZE);                 \
+    }                                                                               \
+                                                                                    \
+    static inline bool name##_fixed(const kmsgpipe_buffer_t *buf)                   \
+    {                                                                               \
+        return buf->capacity == (CAPACITY) && buf->data_size == (DATA_SIZE) &&      \
+               buf->layout == KMSGPIPE_LAYOUT_SLOT &&                               \
+               buf->sync == KMSGPIPE_SYNC_LOCKED && !buf->wheel && !buf->owners &&  \
+               !buf->keys && !buf->history && !buf->chains && !buf->dedup &&        \
+               !buf->split;                                                         \
+    }                                                                               \
+                                                                                    \
+    static inline int name##_reserve(kmsgpipe_buffer_t *buf, size_t len,            \
+                                     kmsgpipe_span_t *span)                         \
+    {                                                                               \
+        if (!name##_fixed(buf))                                                     \
+            return kmsgpipe_reserve(buf, len, span);                                \
+        if (len > (DATA_SIZE))                                                      \
+            return -EMSGSIZE;                                                       \
+        if (kmsgpipe_occupancy_test(buf, buf->head))                                \
+            return -ENOSPC;                                                         \
+                                                                                    \
+        span->pos = buf->head;                                                      \
+        span->len = len;                                                            \
+        span->data = buf->base + buf->head * (DATA_SIZE);                           \
+        return 0;                                                                   \
+    }                                                                               \
+                                                                                    \
+    static inline ssize_t name##_commit(kmsgpipe_buffer_t *buf,                     \
+                                        const kmsgpipe_span_t *span, size_t len,    \
+                                        uid_t uid, gid_t gid, ktime_t timestamp)    \
+    {                                                                               \
+        kmsg_record_t *rec;                                                         \
+                                                                                    \
+        if (!name##_fixed(buf))                                                     \
+            return kmsgpipe_commit(buf, span, len, uid, gid, timestamp);            \
+        /* A LOCKED reservation has nothing to cancel */                            \
+        if (len > span->len)                                                        \
+            return -EINVAL;                                                         \
+                                                                                    \
+        rec = &buf->records[span->pos];                                             \
+        rec->len = len;                                                             \
+        rec->owner_uid = uid;                                                       \
+        rec->owner_gid = gid;                                                       \
+        rec->timestamp = timestamp;                                                 \
+        rec->valid = true;                                                          \
+        rec->repeats = 0;                                                           \
+        kmsgpipe_occupancy_set(buf, span->pos);                                     \
+        buf->count++;                                                               \
+        buf->head = (span->pos + 1) & ((CAPACITY) - 1);                             \
+        return len;                                                                 \
+    }                                                                               \
+                                                                                    \
+    static inline int name##_peek(kmsgpipe_buffer_t *buf, uid_t uid, gid_t gid,     \
+                                  kmsgpipe_span_t *span)                            \
+    {                                                                               \
+        const kmsg_record_t *rec;                                                   \
+                                                                                    \
+        if (!name##_fixed(buf))                                                     \
+            return kmsgpipe_peek(buf, uid, gid, span);                              \
+        if (!kmsgpipe_occupancy_test(buf, buf->tail))                               \
+            return -ENODATA;                                                        \
+        rec = &buf->records[buf->tail];                                             \
+        if (!kmsgpipe_may_read(uid, gid, rec->owner_uid, rec->owner_gid))           \
+            return -EACCES;                                                         \
+                                                                                    \
+        span->pos = buf->tail;                                                      \
+        span->len = rec->len;                                                       \
+        span->data = buf->base + buf->tail * (DATA_SIZE);                           \
+        span->raw_len = 0;                                                          \
+        span->repeats = rec->repeats;                                               \
+        span->seq = 0;                                                              \
+        span->chain = NULL;                                                         \
+        return 0;                                                                   \
+    }                                                                               \
+                                                                                    \
+    static inline void name##_peek_release(kmsgpipe_buffer_t *buf,                  \
+                                           const kmsgpipe_span_t *span,             \
+                                           bool consume)                            \
+    {                                                                               \
+        if (!name##_fixed(buf))                                                     \
+        {                                                                           \
+            kmsgpipe_peek_release(buf, span, consume);                              \
+            return;                                                                 \
+        }                                                                           \
+        if (!consume)                                                               \
+            return;                                                                 \
+                                                                                    \
+        buf->records[span->pos].valid = false;                                      \
+        kmsgpipe_occupancy_clear(buf, span->pos);                                   \
+        buf->count--;                                                               \
+        buf->tail = (span->pos + 1) & ((CAPACITY) - 1);                             \
+    }                                                                               \
+                                                                                    \
+    static inline ssize_t name##_push(kmsgpipe_buffer_t *buf, const uint8_t *data,  \
+                                      size_t len, uid_t uid, gid_t gid,             \
+                                      ktime_t timestamp)                            \
+    {                                                                               \
+        kmsgpipe_span_t span;                                                       \
+        int ret = name##_reserve(buf, len, &span);                                  \
+                                                                                    \
+        if (ret)                                                                    \
+            return ret;                                                             \
+        memcpy(span.data, data, len);                                               \
+        return name##_commit(buf, &span, len, uid, gid, timestamp);                 \
+    }                                                                               \
+                                                                                    \
+    static inline ssize_t name##_pop(kmsgpipe_buffer_t *buf, uint8_t *out_buf,      \
+                                     uid_t uid, gid_t gid)                          \
+    {                                                                               \
+        kmsgpipe_span_t span;                                                       \
+        int ret = name##_peek(buf, uid, gid, &span);                                \
+                                                                                    \
+        if (ret)                                                                    \
+            return ret;                                                             \
+        memcpy(out_buf, span.data, span.len);                                       \
+        name##_peek_release(buf, &span, true);                                      \
+        return span.len;                                                            \
+    }                                                                               \
+                                                                                    \
+    _Static_assert((CAPACITY) > 0 && ((CAPACITY) & ((CAPACITY) - 1)) == 0,          \
+                   #name ": capacity must be a power of two");                      \
+    _Static_assert((DATA_SIZE) > 0 && (DATA_SIZE) <= 0xFFFF,                        \
+                   #name ": data size must fit kmsg_record_t.len")
+
 #endif /* KMSGPIPE_H */
\ No newline at end of file
@@ -30,6 +30,99 @@
 #define KMSGPIPE_IOC_S_EXPIRY_MS _IOW(KMSGPIPE_IOC_MAGIC, 7, long)
 #define KMSGPIPE_IOC_CLEAR _IO(KMSGPIPE_IOC_MAGIC, 8)
 
-#define KMSGPIPE_IOC_MAXNR 8
+/* New ring geometry; queued messages are carried over in order */
+struct kmsgpipe_resize
+{
+    long capacity;
+    long data_size;
+};
+#define KMSGPIPE_IOC_RESIZE _IOW(KMSGPIPE_IOC_MAGIC, 9, struct kmsgpipe_resize)
+
+/* Per open file: messages written through it expire after this many ms, 0 for never */
+#define KMSGPIPE_IOC_S_MSG_TTL_MS _IOW(KMSGPIPE_IOC_MAGIC, 10, long)
+#define KMSGPIPE_IOC_G_MSG_TTL_MS _IOR(KMSGPIPE_IOC_MAGIC, 11, long)
+
+/* Per open file: lane that writes go to, 0 being the highest priority */
+#define KMSGPIPE_IOC_S_LANE _IOW(KMSGPIPE_IOC_MAGIC, 12, long)
+#define KMSGPIPE_IOC_G_LANE _IOR(KMSGPIPE_IOC_MAGIC, 13, long)
+
+#define KMSGPIPE_IOC_MAX_LANES 8
+struct kmsgpipe_lane_counts
+{
+    long nr_lanes;
+    long count[KMSGPIPE_IOC_MAX_LANES]; /* first nr_lanes entries are valid */
+};
+#define KMSGPIPE_IOC_G_LANE_COUNTS _IOR(KMSGPIPE_IOC_MAGIC, 14, struct kmsgpipe_lane_counts)
+
+/* Per open file: metadata of the message last read through it */
+struct kmsgpipe_msg_meta
+{
+    long len;     /* whole message, even if the read was cut short */
+    long repeats; /* copies collapsed into it (dedup), 0 for none */
+    unsigned long long seq; /* sequence number (retain), 0 without */
+};
+#define KMSGPIPE_IOC_G_LAST_META _IOR(KMSGPIPE_IOC_MAGIC, 15, struct kmsgpipe_msg_meta)
+
+/* Per open file: key of messages written through it; a newer one replaces the queued one */
+struct kmsgpipe_msg_key
+{
+    long keyed;             /* 0: messages are queued unkeyed */
+    unsigned long long key;
+};
+#define KMSGPIPE_IOC_S_MSG_KEY _IOW(KMSGPIPE_IOC_MAGIC, 16, struct kmsgpipe_msg_key)
+#define KMSGPIPE_IOC_G_MSG_KEY _IOR(KMSGPIPE_IOC_MAGIC, 17, struct kmsgpipe_msg_key)
+
+/*
+ * Per open file, with retain: reads replay history from the first message
+ * stamped at or after this CLOCK_MONOTONIC time in ns, as lseek() to a
+ * sequence number does, until REPLAY_STOP goes back to consuming reads
+ */
+#define KMSGPIPE_IOC_S_REPLAY_TIME _IOW(KMSGPIPE_IOC_MAGIC, 18, long long)
+#define KMSGPIPE_IOC_REPLAY_STOP _IO(KMSGPIPE_IOC_MAGIC, 19)
+
+/*
+ * Readers are woken, and poll() reports EPOLLIN, once read_lowat messages
+ * are queued in all lanes; writers, and EPOLLOUT, once their lane has
+ * write_hiwat free slots. Both 1 by default and at most the capacity.
+ * A reader of an empty pipe sleeps until read_lowat messages arrive.
+ */
+struct kmsgpipe_watermarks
+{
+    long read_lowat;
+    long write_hiwat;
+};
+#define KMSGPIPE_IOC_S_WATERMARKS _IOW(KMSGPIPE_IOC_MAGIC, 20, struct kmsgpipe_watermarks)
+#define KMSGPIPE_IOC_G_WATERMARKS _IOR(KMSGPIPE_IOC_MAGIC, 21, struct kmsgpipe_watermarks)
+
+/*
+ * With mmap_ring (an SPSC ring) the reader may consume without system
+ * calls, perf ring buffer style. mmap() at offset 0 maps this control page,
+ * the only writable one; at offset KMSGPIPE_MMAP_RING_PGOFF pages it maps
+ * ring_size bytes: the records (kmsg_record_t, see kmsgpipe.h), then the
+ * payload slots, read-only. head and tail count every message ever queued;
+ * message n has its record at records_offset + (n % capacity) * record_size
+ * and its payload at data_offset + (n % capacity) * data_size. The consumer
+ * loads head with acquire, reads the messages before it, then stores tail
+ * with release. MMAP_WAIT hands that tail to the writers and sleeps until
+ * read_lowat messages are queued past it; poll() hands it over too.
+ * Once mapped, writes whose owner the mapper may not read fail with EACCES
+ * and read() with EBUSY. The first mmap() fails with EAGAIN while a write
+ * is filling its slot; retry it.
+ */
+#define KMSGPIPE_MMAP_RING_PGOFF 1
+struct kmsgpipe_mmap_ctrl
+{
+    unsigned long long head; /* written by the kernel */
+    unsigned long long capacity;
+    unsigned long long data_size;
+    unsigned long long record_size;
+    unsigned long long records_offset; /* from the start of the ring mapping */
+    unsigned long long data_offset;
+    unsigned long long ring_size;
+    unsigned long long tail __attribute__((aligned(64))); /* written by the consumer */
+};
+#define KMSGPIPE_IOC_MMAP_WAIT _IO(KMSGPIPE_IOC_MAGIC, 22)
+
+#define KMSGPIPE_IOC_MAXNR 22
 
 #endif
@@ -35,4 +35,8 @@ pub enum IoctlCommands {
     Set { op: IoctlSetCommands, value: i64 },
     /// IOCTL clear command
     Clear,
+    /// IOCTL resize command, keeps queued messages
+    Resize { capacity: i64, data_size: i64 },
+    /// IOCTL lane counts command, one line per priority lane
+    Lanes,
 }
@@ -14,6 +14,24 @@ ioctl_read!(kmsgpipe_ioc_g_writers, KMSGPIPE_IOC_MAGIC, 5, c_long);
 ioctl_read!(kmsgpipe_ioc_g_expiry_ms, KMSGPIPE_IOC_MAGIC, 6, c_long);
 ioctl_write_ptr!(kmsgpipe_ioc_s_expiry_ms, KMSGPIPE_IOC_MAGIC, 7, c_long);
 ioctl_none!(kmsgpipe_ioc_clear, KMSGPIPE_IOC_MAGIC, 8);
+ioctl_write_ptr!(kmsgpipe_ioc_resize, KMSGPIPE_IOC_MAGIC, 9, KmsgpipeResize);
+ioctl_read!(kmsgpipe_ioc_g_lane_counts, KMSGPIPE_IOC_MAGIC, 14, KmsgpipeLaneCounts);
+
+const KMSGPIPE_IOC_MAX_LANES: usize = 8;
+
+/// Mirrors `struct kmsgpipe_resize` in kmsgpipe_ioctl.h
+#[repr(C)]
+pub struct KmsgpipeResize {
+    pub capacity: c_long,
+    pub data_size: c_long,
+}
+
+/// Mirrors `struct kmsgpipe_lane_counts` in kmsgpipe_ioctl.h
+#[repr(C)]
+pub struct KmsgpipeLaneCounts {
+    pub nr_lanes: c_long,
+    pub count: [c_long; KMSGPIPE_IOC_MAX_LANES],
+}
 
 pub struct KmsgpipeDevice {
     file: File,
@@ -90,4 +108,27 @@ impl KmsgpipeDevice {
         }
         Ok(())
     }
+
+    pub fn resize(&self, capacity: c_long, data_size: c_long) -> Result<()> {
+        let req = KmsgpipeResize {
+            capacity,
+            data_size,
+        };
+        unsafe {
+            kmsgpipe_ioc_resize(self.fd(), &req)?;
+        }
+        Ok(())
+    }
+
+    /// Queued messages per priority lane, highest priority first
+    pub fn lane_counts(&self) -> Result<Vec<c_long>> {
+        let mut v = KmsgpipeLaneCounts {
+            nr_lanes: 0,
+            count: [0; KMSGPIPE_IOC_MAX_LANES],
+        };
+        unsafe {
+            kmsgpipe_ioc_g_lane_counts(self.fd(), &mut v)?;
+        }
+        Ok(v.count[..v.nr_lanes as usize].to_vec())
+    }
 }
@@ -30,6 +30,11 @@ fn main() {
             IoctlSetCommands::ExpiryMs => process_set_command(device.set_expiry_ms(value)),
         },
         IoctlCommands::Clear => process_set_command(device.clear()),
+        IoctlCommands::Resize {
+            capacity,
+            data_size,
+        } => process_set_command(device.resize(capacity, data_size)),
+        IoctlCommands::Lanes => process_lanes_command(device.lane_counts()),
     }
 }
 
@@ -43,6 +48,20 @@ fn process_get_command(op_result: nix::Result<c_long>) {
     }
 }
 
+fn process_lanes_command(op_result: nix::Result<Vec<c_long>>) {
+    match op_result {
+        Ok(counts) => {
+            for (lane, count) in counts.iter().enumerate() {
+                println!("lane {}: {}", lane, count);
+            }
+        }
+        Err(e) => {
+            eprintln!("{}", e);
+            process::exit(1);
+        }
+    }
+}
+
 fn process_set_command(op_result: nix::Result<()>) {
     if let Err(e) = op_result {
         eprintln!("{}", e);
@@ -104,11 +104,23 @@ int kmsgpipe_module_init(void)
         return ret;
     }
 
+    /* allocate memory for the slot occupancy bitmap */
+    unsigned long *occupancy_p = kcalloc(KMSGPIPE_BITMAP_WORDS(capacity), sizeof(unsigned long), GFP_KERNEL);
+    if (!occupancy_p)
+    {
+        ret = -ENOMEM;
+        kfree(records_buffer_p);
+        kfree(base_buffer_p);
+        kfree(kmsgpipe_p);
+        return ret;
+    }
+
     kmsgpipe_p->ring_buffer.base = base_buffer_p;
     kmsgpipe_p->ring_buffer.records = records_buffer_p;
+    kmsgpipe_p->ring_buffer.occupancy = occupancy_p;
 
     /* Initialize ring buffer */
-    kmsgpipe_init(&kmsgpipe_p->ring_buffer, base_buffer_p, records_buffer_p, capacity, data_size);
+    kmsgpipe_init(&kmsgpipe_p->ring_buffer, base_buffer_p, records_buffer_p, occupancy_p, capacity, data_size);
 
     /* Initialize wait queues */
     init_waitqueue_head(&kmsgpipe_p->reader_q);
@@ -125,6 +137,7 @@ int kmsgpipe_module_init(void)
         pr_err("kmsgpipe: cdev_add failed: %d\n", ret);
         kfree(base_buffer_p);
         kfree(records_buffer_p);
+        kfree(occupancy_p);
         kfree(kmsgpipe_p);
         return ret;
     }
@@ -151,6 +164,7 @@ void kmsgpipe_module_exit(void)
         cdev_del(&kmsgpipe_p->cdev);
         kfree(kmsgpipe_p->ring_buffer.base);
         kfree(kmsgpipe_p->ring_buffer.records);
+        kfree(kmsgpipe_p->ring_buffer.occupancy);
         kfree(kmsgpipe_p);
         kmsgpipe_p = NULL;
     }
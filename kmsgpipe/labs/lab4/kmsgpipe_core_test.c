@@ -0,0 +1,264 @@
+#include <kunit/test.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/cpumask.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/mm.h>
+
+#include "kmsgpipe.h"
+#include "kmsgpipe_module.h"
+
+#ifndef KBUILD_MODNAME
+#define KBUILD_MODNAME "kmsgpipe"
+#endif
+
+#define TEST_CAPACITY 64
+#define TEST_DATA_SIZE 16
+#define TEST_MESSAGES_PER_THREAD 100000
+#define TEST_LARGE_CAPACITY (1024 * 1024)
+#define TEST_LARGE_DATA_SIZE 64
+
+struct kmsgpipe_test_ring
+{
+    kmsgpipe_buffer_t buf;
+    uint8_t *base;
+    kmsg_record_t *records;
+    unsigned long *occupancy;
+    size_t *sequence;
+};
+
+static int kmsgpipe_test_ring_init(struct kunit *test, struct kmsgpipe_test_ring *ring, bool mpmc)
+{
+    ring->base = kunit_kzalloc(test, TEST_CAPACITY * TEST_DATA_SIZE, GFP_KERNEL);
+    ring->records = kunit_kcalloc(test, TEST_CAPACITY, sizeof(kmsg_record_t), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, ring->base);
+    KUNIT_ASSERT_NOT_NULL(test, ring->records);
+
+    if (mpmc)
+    {
+        ring->sequence = kunit_kcalloc(test, TEST_CAPACITY, sizeof(size_t), GFP_KERNEL);
+        KUNIT_ASSERT_NOT_NULL(test, ring->sequence);
+        return kmsgpipe_init_mpmc(&ring->buf, ring->base, ring->records, ring->sequence,
+                                  TEST_CAPACITY, TEST_DATA_SIZE);
+    }
+
+    ring->occupancy = kunit_kcalloc(test, KMSGPIPE_BITMAP_WORDS(TEST_CAPACITY), sizeof(unsigned long), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, ring->occupancy);
+    return kmsgpipe_init(&ring->buf, ring->base, ring->records, ring->occupancy,
+                         TEST_CAPACITY, TEST_DATA_SIZE);
+}
+
+static void kmsgpipe_mpmc_push_pop_test(struct kunit *test)
+{
+    struct kmsgpipe_test_ring ring;
+    uint8_t out[TEST_DATA_SIZE];
+    char in[TEST_DATA_SIZE];
+    int i;
+
+    KUNIT_ASSERT_EQ(test, kmsgpipe_test_ring_init(test, &ring, true), 0);
+
+    for (i = 0; i < TEST_CAPACITY; i++)
+    {
+        snprintf(in, sizeof(in), "msg-%d", i);
+        KUNIT_ASSERT_EQ(test, kmsgpipe_push(&ring.buf, (const uint8_t *)in, sizeof(in), 0, 0, ktime_get()), (ssize_t)sizeof(in));
+    }
+    KUNIT_EXPECT_EQ(test, kmsgpipe_push(&ring.buf, (const uint8_t *)in, sizeof(in), 0, 0, ktime_get()), (ssize_t)-ENOSPC);
+    KUNIT_EXPECT_TRUE(test, kmsgpipe_is_full(&ring.buf));
+
+    for (i = 0; i < TEST_CAPACITY; i++)
+    {
+        snprintf(in, sizeof(in), "msg-%d", i);
+        KUNIT_ASSERT_EQ(test, kmsgpipe_pop(&ring.buf, out, 0, 0), (ssize_t)sizeof(out));
+        KUNIT_EXPECT_STREQ(test, (char *)out, in);
+    }
+    KUNIT_EXPECT_EQ(test, kmsgpipe_pop(&ring.buf, out, 0, 0), (ssize_t)-ENODATA);
+    KUNIT_EXPECT_TRUE(test, kmsgpipe_is_empty(&ring.buf));
+}
+
+static void kmsgpipe_mpmc_rejects_bad_capacity_test(struct kunit *test)
+{
+    kmsgpipe_buffer_t buf;
+    uint8_t base[3 * TEST_DATA_SIZE];
+    kmsg_record_t records[3];
+    size_t sequence[3];
+
+    KUNIT_EXPECT_EQ(test, kmsgpipe_init_mpmc(&buf, base, records, sequence, 3, TEST_DATA_SIZE), -EINVAL);
+}
+
+/* The module's own allocator with capacity=1M: far beyond what kmalloc can back */
+static void kmsgpipe_ring_alloc_large_test(struct kunit *test)
+{
+    kmsgpipe_buffer_t *ring = kunit_kzalloc(test, sizeof(*ring), GFP_KERNEL);
+    uint8_t msg[TEST_LARGE_DATA_SIZE] = "large";
+    uint8_t out[TEST_LARGE_DATA_SIZE];
+    size_t i;
+
+    KUNIT_ASSERT_NOT_NULL(test, ring);
+    KUNIT_ASSERT_EQ(test, kmsgpipe_ring_alloc(ring, TEST_LARGE_CAPACITY, TEST_LARGE_DATA_SIZE), 0);
+    KUNIT_EXPECT_TRUE(test, is_vmalloc_addr(ring->base));
+
+    for (i = 0; i < TEST_LARGE_CAPACITY; i++)
+    {
+        msg[TEST_LARGE_DATA_SIZE - 1] = i;
+        KUNIT_ASSERT_EQ(test, kmsgpipe_push(ring, msg, sizeof(msg), 0, 0, 0), (ssize_t)sizeof(msg));
+    }
+    KUNIT_EXPECT_TRUE(test, kmsgpipe_is_full(ring));
+    KUNIT_EXPECT_EQ(test, ring->base[TEST_LARGE_CAPACITY * TEST_LARGE_DATA_SIZE - 1], (uint8_t)(TEST_LARGE_CAPACITY - 1));
+
+    KUNIT_EXPECT_EQ(test, kmsgpipe_pop(ring, out, 0, 0), (ssize_t)sizeof(out));
+    KUNIT_EXPECT_EQ(test, out[TEST_LARGE_DATA_SIZE - 1], 0);
+    KUNIT_EXPECT_EQ(test, kmsgpipe_clear(ring), (ssize_t)(TEST_LARGE_CAPACITY - 1));
+
+    kmsgpipe_ring_free(ring);
+}
+
+static void kmsgpipe_ring_alloc_overflow_test(struct kunit *test)
+{
+    kmsgpipe_buffer_t *ring = kunit_kzalloc(test, sizeof(*ring), GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, ring);
+    KUNIT_EXPECT_EQ(test, kmsgpipe_ring_alloc(ring, SIZE_MAX / 2, 4), -EINVAL);
+    KUNIT_EXPECT_EQ(test, kmsgpipe_ring_alloc(ring, 0, TEST_DATA_SIZE), -EINVAL);
+}
+
+/*
+ * Throughput of N producer and N consumer kthreads against one ring, either
+ * lock-free (MPMC) or serialised by a mutex as the driver's default mode is.
+ */
+struct kmsgpipe_scaling_ctx
+{
+    struct kmsgpipe_test_ring ring;
+    struct mutex lock;
+    bool use_lock;
+    long per_thread;
+    atomic_t running;
+    struct completion done;
+};
+
+static ssize_t kmsgpipe_scaling_push(struct kmsgpipe_scaling_ctx *ctx, const uint8_t *msg)
+{
+    ssize_t ret;
+
+    if (!ctx->use_lock)
+        return kmsgpipe_push(&ctx->ring.buf, msg, TEST_DATA_SIZE, 0, 0, 0);
+
+    mutex_lock(&ctx->lock);
+    ret = kmsgpipe_push(&ctx->ring.buf, msg, TEST_DATA_SIZE, 0, 0, 0);
+    mutex_unlock(&ctx->lock);
+    return ret;
+}
+
+static ssize_t kmsgpipe_scaling_pop(struct kmsgpipe_scaling_ctx *ctx, uint8_t *msg)
+{
+    ssize_t ret;
+
+    if (!ctx->use_lock)
+        return kmsgpipe_pop(&ctx->ring.buf, msg, 0, 0);
+
+    mutex_lock(&ctx->lock);
+    ret = kmsgpipe_pop(&ctx->ring.buf, msg, 0, 0);
+    mutex_unlock(&ctx->lock);
+    return ret;
+}
+
+static void kmsgpipe_scaling_exit(struct kmsgpipe_scaling_ctx *ctx)
+{
+    if (atomic_dec_and_test(&ctx->running))
+        complete(&ctx->done);
+}
+
+static int kmsgpipe_scaling_producer(void *data)
+{
+    struct kmsgpipe_scaling_ctx *ctx = data;
+    uint8_t msg[TEST_DATA_SIZE] = "scaling";
+    long i;
+
+    for (i = 0; i < ctx->per_thread; i++)
+        while (kmsgpipe_scaling_push(ctx, msg) < 0)
+            cond_resched();
+
+    kmsgpipe_scaling_exit(ctx);
+    return 0;
+}
+
+static int kmsgpipe_scaling_consumer(void *data)
+{
+    struct kmsgpipe_scaling_ctx *ctx = data;
+    uint8_t msg[TEST_DATA_SIZE];
+    long i;
+
+    for (i = 0; i < ctx->per_thread; i++)
+        while (kmsgpipe_scaling_pop(ctx, msg) < 0)
+            cond_resched();
+
+    kmsgpipe_scaling_exit(ctx);
+    return 0;
+}
+
+static u64 kmsgpipe_scaling_run(struct kunit *test, bool use_lock, int threads)
+{
+    struct kmsgpipe_scaling_ctx *ctx;
+    ktime_t start;
+    int i;
+
+    ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, ctx);
+    KUNIT_ASSERT_EQ(test, kmsgpipe_test_ring_init(test, &ctx->ring, !use_lock), 0);
+
+    mutex_init(&ctx->lock);
+    ctx->use_lock = use_lock;
+    ctx->per_thread = TEST_MESSAGES_PER_THREAD;
+    atomic_set(&ctx->running, 2 * threads);
+    init_completion(&ctx->done);
+
+    start = ktime_get();
+    for (i = 0; i < threads; i++)
+    {
+        KUNIT_ASSERT_FALSE(test, IS_ERR(kthread_run(kmsgpipe_scaling_producer, ctx, "kmsgpipe_p%d", i)));
+        KUNIT_ASSERT_FALSE(test, IS_ERR(kthread_run(kmsgpipe_scaling_consumer, ctx, "kmsgpipe_c%d", i)));
+    }
+    wait_for_completion(&ctx->done);
+
+    KUNIT_EXPECT_TRUE(test, kmsgpipe_is_empty(&ctx->ring.buf));
+    return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+static void kmsgpipe_mpmc_scaling_test(struct kunit *test)
+{
+    int max_threads = num_online_cpus();
+    int threads;
+
+    for (threads = 1; threads <= max_threads; threads *= 2)
+    {
+        u64 messages = (u64)threads * TEST_MESSAGES_PER_THREAD;
+        u64 mutex_ns = kmsgpipe_scaling_run(test, true, threads);
+        u64 mpmc_ns = kmsgpipe_scaling_run(test, false, threads);
+
+        kunit_info(test, "%dP/%dC: mutex %llu msg/s, mpmc %llu msg/s\n",
+                   threads, threads,
+                   div64_u64(messages * NSEC_PER_SEC, mutex_ns ?: 1),
+                   div64_u64(messages * NSEC_PER_SEC, mpmc_ns ?: 1));
+    }
+}
+
+/* Register test cases */
+static struct kunit_case kmsgpipe_core_test_cases[] = {
+    KUNIT_CASE(kmsgpipe_mpmc_push_pop_test),
+    KUNIT_CASE(kmsgpipe_mpmc_rejects_bad_capacity_test),
+    KUNIT_CASE(kmsgpipe_ring_alloc_large_test),
+    KUNIT_CASE(kmsgpipe_ring_alloc_overflow_test),
+    KUNIT_CASE_SLOW(kmsgpipe_mpmc_scaling_test),
+    {}};
+
+static struct kunit_suite kmsgpipe_core_test_suite = {
+    .name = "kmsgpipe-lab4-ring",
+    .test_cases = kmsgpipe_core_test_cases,
+};
+
+kunit_test_suite(kmsgpipe_core_test_suite);
@@ -11,12 +11,23 @@
 
 #include <linux/kernel.h>
 #include <linux/slab.h>  /* kmalloc() */
+#include <linux/vmalloc.h>
+#include <linux/overflow.h>
+#include <linux/minmax.h>
 #include <linux/errno.h> /* error codes */
 #include <linux/proc_fs.h>
 #include <linux/fcntl.h> /* O_ACCMODE */
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/log2.h>
+#include <linux/lz4.h>
+#include <linux/math64.h>
+#include <linux/highmem.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
 
 #include "kmsgpipe_module.h"
 #include "kmsgpipe.h"
@@ -25,6 +36,11 @@
 MODULE_AUTHOR("Dhruv Mohindru");
 MODULE_LICENSE("Dual BSD/GPL");
 
+#ifdef CONFIG_KMSGPIPE_LAB4_FIXED
+KMSGPIPE_DEFINE_FIXED_RING(kmsgpipe_fixed, CONFIG_KMSGPIPE_LAB4_FIXED_CAPACITY,
+                           CONFIG_KMSGPIPE_LAB4_FIXED_DATA_SIZE);
+#endif
+
 static kmsgpipe_t *kmsgpipe_p;
 static struct dentry *kmsgpipe_debugfs_root;
 
@@ -37,14 +53,75 @@ static long expiry_ms = DEFAULT_EXPIRY_MS;
 static int data_size = DEFAULT_DATA_SIZE;
 static int capacity = DEFAULT_CAPCITY;
 
+static bool packed = false;
+static bool mirror = false;
+static bool spsc = false;
+static bool mpmc = false;
+static bool compact = false;
+static int compact_owners = DEFAULT_COMPACT_OWNERS;
+static int inline_max = 0;
+static bool msg_ttl = false;
+static int owner_queues = 0;
+static int lanes = 1;
+static unsigned int lane_age = 0;
+static int compress_min = 0;
+static bool dedup = false;
+static bool keyed = false;
+static bool retain = false;
+static int large_max = 0;
+static int large_pages = 1024;
+static bool split = false;
+static bool mmap_ring = false;
+
 module_param(data_size, int, 0);
 module_param(capacity, int, 0);
-
-ssize_t kmsgpipe_read(struct file *file_p, char __user *buf, size_t count, loff_t *f_pos);
-ssize_t kmsgpipe_write(struct file *file_p, const char __user *buf, size_t count, loff_t *f_pos);
+module_param(packed, bool, 0);
+MODULE_PARM_DESC(packed, "Store length-prefixed messages in one byte ring instead of fixed data_size slots");
+module_param(mirror, bool, 0);
+MODULE_PARM_DESC(mirror, "With packed: map the ring's pages twice, back to back, so no record is padded or split at the end");
+module_param(spsc, bool, 0);
+MODULE_PARM_DESC(spsc, "Lock-free ring for one reader and one writer (capacity must be a power of two)");
+module_param(mpmc, bool, 0);
+MODULE_PARM_DESC(mpmc, "Lock-free ring for many readers and writers (capacity must be a power of two)");
+module_param(compact, bool, 0);
+MODULE_PARM_DESC(compact, "Keep message metadata in ~8 byte per-slot arrays instead of kmsg_record_t");
+module_param(compact_owners, int, 0);
+MODULE_PARM_DESC(compact_owners, "Distinct uid/gid pairs that may have messages queued at once in compact mode");
+module_param(inline_max, int, 0);
+MODULE_PARM_DESC(inline_max, "Store messages up to this size (max 46) inside their cache-line record; 0 disables");
+module_param(msg_ttl, bool, 0);
+MODULE_PARM_DESC(msg_ttl, "Let writers give messages a TTL (KMSGPIPE_IOC_S_MSG_TTL_MS); not for packed, spsc or mpmc rings");
+module_param(owner_queues, int, 0);
+MODULE_PARM_DESC(owner_queues, "Index messages by owner so readers skip others' messages; distinct uids (and gids) queued at once, 0 disables");
+module_param(lanes, int, 0);
+MODULE_PARM_DESC(lanes, "Priority lanes, each a ring of capacity messages; more than one needs the default locked ring");
+module_param(lane_age, uint, 0);
+MODULE_PARM_DESC(lane_age, "Serve a lane once it was passed over this many times for higher ones; 0 for strict priority");
+module_param(compress_min, int, 0);
+MODULE_PARM_DESC(compress_min, "LZ4-compress messages of at least this many bytes (packed rings only); 0 disables");
+module_param(dedup, bool, 0);
+MODULE_PARM_DESC(dedup, "Count a copy of the newest message (same payload and owner) as a repeat instead of queueing it; default slot layout only");
+module_param(keyed, bool, 0);
+MODULE_PARM_DESC(keyed, "Let writers key messages (KMSGPIPE_IOC_S_MSG_KEY) so a newer one replaces the queued one; not for packed, spsc or mpmc rings, nor with dedup");
+module_param(retain, bool, 0);
+MODULE_PARM_DESC(retain, "Number messages and keep read ones for replay via lseek()/KMSGPIPE_IOC_S_REPLAY_TIME; slot or inline layout, one lane");
+module_param(large_max, int, 0);
+MODULE_PARM_DESC(large_max, "Accept messages up to this size, keeping those over data_size in chains of pages; 0 disables. Not for packed, spsc or mpmc rings, nor with dedup, keyed or retain");
+module_param(large_pages, int, 0);
+MODULE_PARM_DESC(large_pages, "Pages that queued large messages may hold in all; writers wait for more");
+module_param(split, bool, 0);
+MODULE_PARM_DESC(split, "Lock writers and readers of a slot or inline ring apart, so one of each never waits for the other; not with msg_ttl, owner_queues, dedup, keyed, retain or large_max");
+module_param(mmap_ring, bool, 0);
+MODULE_PARM_DESC(mmap_ring, "With spsc: let the reader mmap() the ring and consume without system calls (struct kmsgpipe_mmap_ctrl)");
+
+ssize_t kmsgpipe_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t kmsgpipe_write_iter(struct kiocb *iocb, struct iov_iter *from);
 int kmsgpipe_open(struct inode *inode, struct file *file_p);
 int kmsgpipe_release(struct inode *inode, struct file *file_p);
 long kmsgpipe_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+__poll_t kmsgpipe_poll(struct file *file_p, poll_table *wait);
+int kmsgpipe_mmap(struct file *file_p, struct vm_area_struct *vma);
+loff_t kmsgpipe_llseek(struct file *file_p, loff_t offset, int whence);
 /* Function for debug fs support */
 int ksmgpipe_stats_show(struct seq_file *m, void *v);
 int kmsgpipe_stats_open(struct inode *inode, struct file *file);
@@ -52,10 +129,13 @@ void kmsgpipe_cleanup_worker(struct work_struct *work);
 
 struct file_operations kmsgpipe_fops = {
     .owner = THIS_MODULE,
-    .read = kmsgpipe_read,
-    .write = kmsgpipe_write,
+    .read_iter = kmsgpipe_read_iter,
+    .write_iter = kmsgpipe_write_iter,
     .open = kmsgpipe_open,
     .unlocked_ioctl = kmsgpipe_ioctl,
+    .poll = kmsgpipe_poll,
+    .mmap = kmsgpipe_mmap,
+    .llseek = kmsgpipe_llseek,
     .release = kmsgpipe_release,
 };
 
@@ -66,353 +146,2056 @@ struct file_operations kmsgpipe_stats_fops = {
     .llseek = seq_lseek,
     .release = single_release};
 
-int kmsgpipe_module_init(void)
+/*
+ * Ring memory. kvmalloc() uses kmalloc for small rings and falls back to
+ * vmalloc once high-order pages are scarce, but refuses anything above
+ * INT_MAX, so multi-GiB areas go to vmalloc directly. Either way the area
+ * is virtually contiguous and slot i stays at base + i * data_size.
+ */
+static void *kmsgpipe_ring_mem(size_t n, size_t size, gfp_t gfp)
+{
+    size_t bytes;
+
+    if (check_mul_overflow(n, size, &bytes))
+        return NULL;
+    if (bytes > INT_MAX)
+        return __vmalloc(bytes, gfp);
+    return kvmalloc(bytes, gfp);
+}
+
+/*
+ * Per-message TTLs: a timer wheel plus one 24 byte timer per slot, so
+ * expiring costs the messages dropped rather than a scan of the ring.
+ */
+static int kmsgpipe_ring_alloc_wheel(kmsgpipe_buffer_t *ring)
 {
+    kmsgpipe_wheel_t *wheel;
+    kmsg_timer_t *timers;
     int ret;
 
-    ret = alloc_chrdev_region(&kmsgpipe_devno, 0, 1, "kmsgpipe_lab4");
+    wheel = kmalloc(sizeof(*wheel), GFP_KERNEL);
+    timers = kmsgpipe_ring_mem(ring->capacity, sizeof(*timers), GFP_KERNEL);
+    ret = wheel && timers ? kmsgpipe_init_wheel(ring, wheel, timers, KMSGPIPE_TTL_TICK_SHIFT, ktime_get())
+                          : -ENOMEM;
     if (ret)
     {
-        pr_err("kmsgpipe: alloc_chrdev_region failed: %d\n", ret);
-        return ret;
+        kfree(wheel);
+        kvfree(timers);
     }
+    return ret;
+}
 
-    kmsgpipe_char_major = MAJOR(kmsgpipe_devno);
-    kmsgpipe_char_minor = MINOR(kmsgpipe_devno);
+/*
+ * Per-owner sub-queues: 16 bytes of links per slot plus two small tables,
+ * so readers find their own oldest message without walking the ring.
+ */
+static int kmsgpipe_ring_alloc_owners(kmsgpipe_buffer_t *ring)
+{
+    size_t nqueues = roundup_pow_of_two(owner_queues + 1);
+    kmsgpipe_owners_t *owners;
+    kmsg_owner_queue_t *queues;
+    kmsg_owner_link_t *links;
+    int ret;
 
-    kmsgpipe_p = kzalloc(sizeof(*kmsgpipe_p), GFP_KERNEL);
-    if (!kmsgpipe_p)
+    owners = kmalloc(sizeof(*owners), GFP_KERNEL);
+    queues = kmsgpipe_ring_mem(2 * nqueues, sizeof(*queues), GFP_KERNEL);
+    links = kmsgpipe_ring_mem(ring->capacity, sizeof(*links), GFP_KERNEL);
+    ret = owners && queues && links ? kmsgpipe_init_owners(ring, owners, queues, links, nqueues)
+                                    : -ENOMEM;
+    if (ret)
     {
-        ret = -ENOMEM;
-        unregister_chrdev_region(kmsgpipe_devno, 1);
-        return ret;
+        kfree(owners);
+        kvfree(queues);
+        kvfree(links);
     }
+    return ret;
+}
 
-    /* allocate per-device buffer */
-    /* allocate memory for base buffer*/
+/*
+ * Last-value index: twice as many table entries as slots keeps probes
+ * short, plus the key of each slot's message.
+ */
+static int kmsgpipe_ring_alloc_keys(kmsgpipe_buffer_t *ring)
+{
+    size_t nentries = roundup_pow_of_two(2 * ring->capacity);
+    kmsgpipe_keys_t *keys;
+    kmsg_key_entry_t *table;
+    u64 *slot_keys;
+    int ret;
 
-    /* allocate memory for kmsg records metadata*/
-    uint8_t *base_buffer_p = kzalloc(data_size * capacity, GFP_KERNEL);
-    if (!base_buffer_p)
+    keys = kmalloc(sizeof(*keys), GFP_KERNEL);
+    table = kmsgpipe_ring_mem(nentries, sizeof(*table), GFP_KERNEL);
+    slot_keys = kmsgpipe_ring_mem(ring->capacity, sizeof(*slot_keys), GFP_KERNEL);
+    ret = keys && table && slot_keys ? kmsgpipe_init_keys(ring, keys, table, slot_keys, nentries)
+                                     : -ENOMEM;
+    if (ret)
     {
-        ret = -ENOMEM;
-        kfree(kmsgpipe_p);
-        return ret;
+        kfree(keys);
+        kvfree(table);
+        kvfree(slot_keys);
     }
+    return ret;
+}
+
+/* Replay history: the sequence number of each slot's message */
+static int kmsgpipe_ring_alloc_history(kmsgpipe_buffer_t *ring)
+{
+    kmsgpipe_history_t *history;
+    u64 *seqs;
+    int ret;
 
-    kmsg_record_t *records_buffer_p = kzalloc(sizeof(kmsg_record_t) * capacity, GFP_KERNEL);
-    if (!records_buffer_p)
+    history = kmalloc(sizeof(*history), GFP_KERNEL);
+    seqs = kmsgpipe_ring_mem(ring->capacity, sizeof(*seqs), GFP_KERNEL);
+    ret = history && seqs ? kmsgpipe_init_history(ring, history, seqs) : -ENOMEM;
+    if (ret)
     {
-        ret = -ENOMEM;
-        kfree(base_buffer_p);
-        kfree(kmsgpipe_p);
-        return ret;
+        kfree(history);
+        kvfree(seqs);
     }
+    return ret;
+}
 
-    kmsgpipe_p->ring_buffer.base = base_buffer_p;
-    kmsgpipe_p->ring_buffer.records = records_buffer_p;
+static void kmsgpipe_chain_put(kmsgpipe_chain_t *chain)
+{
+    for (unsigned int i = 0; i < chain->nr_pages; i++)
+        __free_page(chain->pages[i]);
+    kfree(chain);
+}
 
-    /* Initialize ring buffer */
-    kmsgpipe_init(&kmsgpipe_p->ring_buffer, base_buffer_p, records_buffer_p, capacity, data_size);
+/* Called by the core, under the mutex, once a large message is gone */
+static void kmsgpipe_chain_free(void *p)
+{
+    kmsgpipe_chain_t *chain = p;
 
-    /* Initialize wait queues */
-    init_waitqueue_head(&kmsgpipe_p->reader_q);
-    init_waitqueue_head(&kmsgpipe_p->writer_q);
+    kmsgpipe_p->chain_pages -= chain->nr_pages;
+    kmsgpipe_chain_put(chain);
+}
 
-    /* Initialize mutex*/
-    mutex_init(&kmsgpipe_p->mutex);
+/* Large messages: one chain pointer per slot, the pages come per message */
+static int kmsgpipe_ring_alloc_chains(kmsgpipe_buffer_t *ring)
+{
+    kmsgpipe_chains_t *chains;
+    void **chain;
+    int ret;
 
-    cdev_init(&kmsgpipe_p->cdev, &kmsgpipe_fops);
-    kmsgpipe_p->cdev.owner = THIS_MODULE;
-    ret = cdev_add(&kmsgpipe_p->cdev, kmsgpipe_devno, 1);
+    chains = kmalloc(sizeof(*chains), GFP_KERNEL);
+    chain = kmsgpipe_ring_mem(ring->capacity, sizeof(*chain), GFP_KERNEL);
+    ret = chains && chain ? kmsgpipe_init_chains(ring, chains, chain, kmsgpipe_chain_free) : -ENOMEM;
     if (ret)
     {
-        pr_err("kmsgpipe: cdev_add failed: %d\n", ret);
-        kfree(base_buffer_p);
-        kfree(records_buffer_p);
-        kfree(kmsgpipe_p);
-        return ret;
+        kfree(chains);
+        kvfree(chain);
     }
+    return ret;
+}
 
-    /* Initialize debug fs entry*/
-    kmsgpipe_debugfs_root = debugfs_create_dir("kmsgpipe", NULL);
-    if (!kmsgpipe_debugfs_root)
+/* Optional indexes of locked slot rings, on top of kmsgpipe_init*() */
+static int kmsgpipe_ring_alloc_indexes(kmsgpipe_buffer_t *ring)
+{
+    int ret = 0;
+
+    if (msg_ttl)
+        ret = kmsgpipe_ring_alloc_wheel(ring);
+    if (!ret && owner_queues > 0)
+        ret = kmsgpipe_ring_alloc_owners(ring);
+    if (!ret && keyed)
+        ret = kmsgpipe_ring_alloc_keys(ring);
+    if (!ret && retain)
+        ret = kmsgpipe_ring_alloc_history(ring);
+    if (!ret && large_max > 0)
+        ret = kmsgpipe_ring_alloc_chains(ring);
+    return ret;
+}
+
+/*
+ * Packed ring over @bytes (a multiple of PAGE_SIZE) of order-0 pages that
+ * vmap() maps twice in a row, so a record running past the end carries on
+ * into the second mapping and reads back as one contiguous range.
+ */
+static int kmsgpipe_ring_alloc_mirrored(kmsgpipe_buffer_t *ring, size_t bytes, size_t ring_data_size)
+{
+    size_t nr_pages = bytes >> PAGE_SHIFT;
+    struct page **pages;
+    size_t i;
+    int ret;
+
+    if (nr_pages > UINT_MAX / 2)
+        return -EINVAL;
+    pages = kvmalloc_array(2 * nr_pages, sizeof(*pages), GFP_KERNEL);
+    if (!pages)
+        return -ENOMEM;
+
+    for (i = 0; i < nr_pages; i++)
     {
-        pr_warn("kmsgpipe: debugfs not available\n");
+        pages[i] = alloc_page(GFP_KERNEL);
+        if (!pages[i])
+            break;
+        pages[nr_pages + i] = pages[i];
     }
-    else
+    if (i == nr_pages)
+        ring->base = vmap(pages, 2 * nr_pages, VM_MAP, PAGE_KERNEL);
+    ret = ring->base ? kmsgpipe_init_packed_mirrored(ring, ring->base, bytes, ring_data_size) : -ENOMEM;
+    if (ret)
     {
-        debugfs_create_file("stats", 0444, kmsgpipe_debugfs_root, NULL, &kmsgpipe_stats_fops);
+        if (ring->base)
+            vunmap(ring->base);
+        ring->base = NULL;
+        while (i--)
+            __free_page(pages[i]);
     }
+    kvfree(pages);
+    return ret;
+}
 
-    /* Initialise delay worker, and schedule it */
-    INIT_DELAYED_WORK(&kmsgpipe_p->kmsg_delayed_work, kmsgpipe_cleanup_worker);
-    schedule_delayed_work(&kmsgpipe_p->kmsg_delayed_work, msecs_to_jiffies(expiry_ms));
+/* The pages are found again through the first mapping */
+static void kmsgpipe_ring_free_mirrored(kmsgpipe_buffer_t *ring)
+{
+    size_t nr_pages = ring->size >> PAGE_SHIFT;
+    size_t i;
 
-    pr_info("kmsgpipe: module loaded (major=%d, minor=%d) and (data_size=%d, capacity=%d)\n", kmsgpipe_char_major, kmsgpipe_char_minor, data_size, capacity);
-    return 0;
+    for (i = 0; i < nr_pages; i++)
+        __free_page(vmalloc_to_page(ring->base + (i << PAGE_SHIFT)));
+    vunmap(ring->base);
 }
 
-void kmsgpipe_module_exit(void)
+/* A mappable ring's control page sits just before its records */
+static struct kmsgpipe_mmap_ctrl *kmsgpipe_mmap_ctrl(const kmsgpipe_buffer_t *ring)
 {
-    debugfs_remove_recursive(kmsgpipe_debugfs_root);
-    if (kmsgpipe_p)
-    {
-        cancel_delayed_work_sync(&kmsgpipe_p->kmsg_delayed_work);
-        cdev_del(&kmsgpipe_p->cdev);
-        kfree(kmsgpipe_p->ring_buffer.base);
-        kfree(kmsgpipe_p->ring_buffer.records);
-        kfree(kmsgpipe_p);
-        kmsgpipe_p = NULL;
-    }
-    unregister_chrdev_region(kmsgpipe_devno, 1);
-    pr_info("kmsgpipe: module unloaded\n");
+    return (void *)((u8 *)ring->records - PAGE_SIZE);
 }
 
-int kmsgpipe_open(struct inode *inode_p, struct file *file_p)
+/*
+ * SPSC ring the reader can mmap(): the control page, the records and the
+ * payload slots, each starting on a page of one vmalloc_user() area, so
+ * the mapping shares no page with other kernel data.
+ */
+static int kmsgpipe_ring_alloc_mappable(kmsgpipe_buffer_t *ring, size_t ring_capacity, size_t ring_data_size)
 {
-    kmsgpipe_t *kmsgpipe_dev;
+    struct kmsgpipe_mmap_ctrl *ctrl;
+    size_t records_bytes, data_bytes;
+    u8 *area;
+    int ret;
 
-    if (!inode_p || !inode_p->i_cdev)
+    BUILD_BUG_ON(sizeof(*ctrl) > PAGE_SIZE);
+    if (check_mul_overflow(ring_capacity, sizeof(kmsg_record_t), &records_bytes) ||
+        check_mul_overflow(ring_capacity, ring_data_size, &data_bytes))
+        return -EINVAL;
+    records_bytes = round_up(records_bytes, PAGE_SIZE);
+    data_bytes = round_up(data_bytes, PAGE_SIZE);
+
+    area = vmalloc_user(PAGE_SIZE + records_bytes + data_bytes);
+    if (!area)
+        return -ENOMEM;
+    ret = kmsgpipe_init_spsc(ring, area + PAGE_SIZE + records_bytes, (kmsg_record_t *)(area + PAGE_SIZE),
+                             ring_capacity, ring_data_size);
+    if (ret)
     {
-        pr_alert("kmsgpipe_open: Uninitialized inode pointer received\n");
-        return -ENODEV;
+        vfree(area);
+        return ret;
     }
 
-    kmsgpipe_dev = container_of(inode_p->i_cdev,
-                                kmsgpipe_t,
-                                cdev);
-    file_p->private_data = kmsgpipe_dev;
-
+    ctrl = (struct kmsgpipe_mmap_ctrl *)area;
+    ctrl->capacity = ring_capacity;
+    ctrl->data_size = ring_data_size;
+    ctrl->record_size = sizeof(kmsg_record_t);
+    ctrl->records_offset = 0;
+    ctrl->data_offset = records_bytes;
+    ctrl->ring_size = records_bytes + data_bytes;
     return 0;
 }
 
-int kmsgpipe_release(struct inode *inode_p, struct file *file_p)
+static void kmsgpipe_ring_free_mappable(kmsgpipe_buffer_t *ring)
 {
-
-    /* For per-device memory ownership we do not free device memory here.
-     * The device buffer is allocated during module init and freed during
-     * module exit. Clear the per-file private pointer to avoid dangling
-     * references. */
-    if (file_p && file_p->private_data)
-        file_p->private_data = NULL;
-
-    return 0;
+    if (ring->records)
+        vfree(kmsgpipe_mmap_ctrl(ring));
+    ring->records = NULL;
+    ring->base = NULL;
 }
 
-ssize_t kmsgpipe_write(struct file *file_p, const char __user *buf, size_t count, loff_t *f_pos)
+/*
+ * Allocate backing memory for a ring and initialise it. The slot layout
+ * needs a payload slot, a record and an occupancy bit per message; the
+ * packed layout uses the same capacity * data_size bytes as one byte ring,
+ * rounded up to whole pages when mirrored;
+ * the inline layout swaps records for cache-line records and skips the
+ * payload slots entirely when every message fits inline. Payload memory is
+ * not zeroed: the core never hands out bytes a producer has not written.
+ */
+int kmsgpipe_ring_alloc(kmsgpipe_buffer_t *ring, size_t ring_capacity, size_t ring_data_size)
 {
-
-    kmsgpipe_t *dev_p;
-    ssize_t op_res;
+    size_t ring_bytes;
     int ret;
 
-    if (!file_p)
+    memset(ring, 0, sizeof(*ring));
+
+    if ((packed + spsc + mpmc + compact + (inline_max > 0)) > 1 || inline_max < 0)
+        return -EINVAL;
+    if ((msg_ttl || owner_queues) && (packed || spsc || mpmc))
+        return -EINVAL;
+    /* Compressed payloads are variable length, so they need the packed store */
+    if (compress_min < 0 || (compress_min && !packed))
+        return -EINVAL;
+    if (dedup && (packed || spsc || mpmc || compact || inline_max))
+        return -EINVAL;
+    if (keyed && (packed || spsc || mpmc || dedup))
+        return -EINVAL;
+    /* Sequence numbers are per ring, so replay needs the one lane */
+    if (retain && (packed || spsc || mpmc || compact || lanes > 1))
+        return -EINVAL;
+    if (large_max < 0 || large_pages < 0 ||
+        (large_max && (packed || spsc || mpmc || dedup || keyed || retain)))
+        return -EINVAL;
+    if (owner_queues < 0 || owner_queues >= KMSGPIPE_COMPACT_MAX_CREDS)
+        return -EINVAL;
+    if (!ring_capacity || check_mul_overflow(ring_capacity, ring_data_size, &ring_bytes))
+        return -EINVAL;
+    if (mirror && !packed)
+        return -EINVAL;
+    if (split && (packed || spsc || mpmc || compact || msg_ttl || owner_queues || dedup || keyed || retain || large_max))
+        return -EINVAL;
+    if (mmap_ring && !spsc)
         return -EINVAL;
 
-    dev_p = file_p->private_data;
-    if (!dev_p)
-        return -ENODEV;
-    /* Return error if writer tries to write with a data size greater than allowed data_size*/
-    if (count > dev_p->ring_buffer.data_size)
+    if (mmap_ring)
+        return kmsgpipe_ring_alloc_mappable(ring, ring_capacity, ring_data_size);
+
+    if (inline_max > 0)
     {
-        return -EINVAL;
+        /* The payload area is only needed for messages too big to inline */
+        if (ring_data_size > (size_t)inline_max)
+        {
+            ring->base = kmsgpipe_ring_mem(ring_capacity, ring_data_size, GFP_KERNEL);
+            if (!ring->base)
+                return -ENOMEM;
+        }
+        ring->lines = kmsgpipe_ring_mem(ring_capacity, sizeof(kmsg_inline_record_t), GFP_KERNEL);
+        ring->occupancy = kmsgpipe_ring_mem(KMSGPIPE_BITMAP_WORDS(ring_capacity), sizeof(unsigned long), GFP_KERNEL | __GFP_ZERO);
+        ret = ring->lines && ring->occupancy
+                  ? kmsgpipe_init_inline(ring, ring->base, ring->lines, ring->occupancy,
+                                         ring_capacity, ring_data_size, inline_max)
+                  : -ENOMEM;
+        if (!ret)
+            ret = kmsgpipe_ring_alloc_indexes(ring);
+        if (!ret && split)
+            ret = kmsgpipe_init_split(ring);
+        if (ret)
+            kmsgpipe_ring_free(ring);
+        return ret;
     }
-    count = min(count, dev_p->ring_buffer.data_size);
 
-    /* Scratch buffer */
-    uint8_t *data = kzalloc(count, GFP_KERNEL);
-    if (!data)
-    {
+    /* The double mapping works in whole pages */
+    if (mirror)
+        return kmsgpipe_ring_alloc_mirrored(ring, round_up(ring_bytes, PAGE_SIZE), ring_data_size);
+
+    ring->base = kmsgpipe_ring_mem(ring_capacity, ring_data_size, GFP_KERNEL);
+    if (!ring->base)
         return -ENOMEM;
-    }
 
-    if (mutex_lock_interruptible(&dev_p->mutex))
+    if (packed)
     {
-        kfree(data);
-        return -ERESTARTSYS;
+        ret = kmsgpipe_init_packed(ring, ring->base, ring_bytes, ring_data_size);
+        if (ret)
+            kmsgpipe_ring_free(ring);
+        return ret;
     }
 
-    while (kmsgpipe_get_message_count(&dev_p->ring_buffer) == dev_p->ring_buffer.capacity)
+    if (compact)
     {
-        mutex_unlock(&dev_p->mutex);
-        if (file_p->f_flags & O_NONBLOCK)
-        {
-            return -EAGAIN;
-        }
-        atomic_inc(&dev_p->writer_waiting);
-        ret = wait_event_interruptible(
-            dev_p->writer_q,
-            (kmsgpipe_get_message_count(&dev_p->ring_buffer) < dev_p->ring_buffer.capacity));
-        atomic_dec(&dev_p->writer_waiting);
+        /* One block for all compact metadata; it starts with the occupancy bitmap */
+        void *meta = kmsgpipe_ring_mem(1, KMSGPIPE_COMPACT_META_SIZE(ring_capacity, compact_owners), GFP_KERNEL | __GFP_ZERO);
+
+        ret = meta ? kmsgpipe_init_compact(ring, ring->base, meta, ring_capacity, ring_data_size,
+                                           compact_owners, KMSGPIPE_COMPACT_TS_SHIFT)
+                   : -ENOMEM;
         if (ret)
         {
-            return -ERESTARTSYS;
-        }
-        if (mutex_lock_interruptible(&dev_p->mutex))
-        {
-            return -ERESTARTSYS;
+            kvfree(meta);
+            kmsgpipe_ring_free(ring);
+            return ret;
         }
+        ret = kmsgpipe_ring_alloc_indexes(ring);
+        if (ret)
+            kmsgpipe_ring_free(ring);
+        return ret;
     }
 
-    uid_t uid = from_kuid(&init_user_ns, current_uid());
-    gid_t gid = from_kgid(&init_user_ns, current_gid());
-    ktime_t timestamp = ktime_get();
-
-    if (copy_from_user(data, buf, count))
+    ring->records = kmsgpipe_ring_mem(ring_capacity, sizeof(kmsg_record_t), GFP_KERNEL | __GFP_ZERO);
+    if (!ring->records)
     {
-        mutex_unlock(&dev_p->mutex);
-        kfree(data);
-        return -EFAULT;
+        kmsgpipe_ring_free(ring);
+        return -ENOMEM;
     }
 
-    op_res = kmsgpipe_push(&dev_p->ring_buffer, data, count, uid, gid, timestamp);
+    if (spsc)
+    {
+        ret = kmsgpipe_init_spsc(ring, ring->base, ring->records, ring_capacity, ring_data_size);
+        if (ret)
+            kmsgpipe_ring_free(ring);
+        return ret;
+    }
 
-    if (op_res < 0)
+    if (mpmc)
     {
-        pr_err("kmsgpipe_write: error pushing data from circular buffer");
+        ring->sequence = kmsgpipe_ring_mem(ring_capacity, sizeof(size_t), GFP_KERNEL);
+        ret = ring->sequence ? kmsgpipe_init_mpmc(ring, ring->base, ring->records, ring->sequence, ring_capacity, ring_data_size)
+                             : -ENOMEM;
+        if (ret)
+            kmsgpipe_ring_free(ring);
+        return ret;
     }
-    else
+
+    ring->occupancy = kmsgpipe_ring_mem(KMSGPIPE_BITMAP_WORDS(ring_capacity), sizeof(unsigned long), GFP_KERNEL | __GFP_ZERO);
+    if (!ring->occupancy)
     {
-        /* We got some data pushed to circular buffer wake up any sleeping readers */
-        wake_up_interruptible(&dev_p->reader_q);
+        kmsgpipe_ring_free(ring);
+        return -ENOMEM;
     }
 
-    mutex_unlock(&dev_p->mutex);
-    /* free temporary allocated buffer */
-    kfree(data);
-    return op_res;
+    ret = kmsgpipe_init(ring, ring->base, ring->records, ring->occupancy, ring_capacity, ring_data_size);
+    if (!ret && dedup)
+        ret = kmsgpipe_init_dedup(ring);
+    if (!ret)
+        ret = kmsgpipe_ring_alloc_indexes(ring);
+    if (!ret && split)
+        ret = kmsgpipe_init_split(ring);
+    if (ret)
+        kmsgpipe_ring_free(ring);
+    return ret;
 }
 
-ssize_t kmsgpipe_read(struct file *file_p, char __user *buf, size_t count, loff_t *f_pos)
+void kmsgpipe_ring_free(kmsgpipe_buffer_t *ring)
 {
-    kmsgpipe_t *dev_p;
-    ssize_t op_res;
-    int ret;
-
-    if (!file_p)
-        return -EINVAL;
-
-    dev_p = file_p->private_data;
-    if (!dev_p)
-        return -ENODEV;
-
-    /* Return error if reader tries to read a data size greater than allowed data_size */
-    if (count > dev_p->ring_buffer.data_size)
+    if (ring->wheel)
     {
-        return -EINVAL;
+        kvfree(ring->wheel->timers);
+        kfree(ring->wheel);
+        ring->wheel = NULL;
     }
-
-    count = min(count, dev_p->ring_buffer.data_size);
-
-    /* Scratch buffer */
-    uint8_t *out_buf = kzalloc(count, GFP_KERNEL);
-    if (!out_buf)
+    if (ring->owners)
     {
-        return -ENOMEM;
+        kvfree(ring->owners->links);
+        kvfree(ring->owners->queues);
+        kfree(ring->owners);
+        ring->owners = NULL;
     }
-
-    if (mutex_lock_interruptible(&dev_p->mutex))
+    if (ring->keys)
     {
-        kfree(out_buf);
-        return -ERESTARTSYS;
+        kvfree(ring->keys->slot_keys);
+        kvfree(ring->keys->table);
+        kfree(ring->keys);
+        ring->keys = NULL;
     }
+    if (ring->history)
+    {
+        kvfree(ring->history->seqs);
+        kfree(ring->history);
+        ring->history = NULL;
+    }
+    /* Chains still queued belong to whichever ring a resize kept */
+    if (ring->chains)
+    {
+        kvfree(ring->chains->chain);
+        kfree(ring->chains);
+        ring->chains = NULL;
+    }
+    if (ring->mirrored)
+        kmsgpipe_ring_free_mirrored(ring);
+    else if (mmap_ring)
+        kmsgpipe_ring_free_mappable(ring);
+    else
+        kvfree(ring->base);
+    kvfree(ring->records);
+    kvfree(ring->occupancy);
+    kvfree(ring->sequence);
+    kvfree(ring->lines);
+    ring->base = NULL;
+    ring->records = NULL;
+    ring->occupancy = NULL;
+    ring->sequence = NULL;
+    ring->lines = NULL;
+}
+
+/* Allocate every lane of a device the same way; all or nothing */
+static int kmsgpipe_lanes_alloc(kmsgpipe_buffer_t *rings, size_t nr_lanes, size_t ring_capacity, size_t ring_data_size)
+{
+    int ret;
 
-    while (kmsgpipe_get_message_count(&dev_p->ring_buffer) == 0)
+    for (size_t lane = 0; lane < nr_lanes; lane++)
     {
-        mutex_unlock(&dev_p->mutex);
-        if (file_p->f_flags & O_NONBLOCK)
-        {
-            return -EAGAIN;
-        }
-        atomic_inc(&dev_p->reader_waiting);
-        ret = wait_event_interruptible(dev_p->reader_q, (kmsgpipe_get_message_count(&dev_p->ring_buffer) > 0));
-        atomic_dec(&dev_p->reader_waiting);
+        ret = kmsgpipe_ring_alloc(&rings[lane], ring_capacity, ring_data_size);
         if (ret)
         {
-            return -ERESTARTSYS;
-        }
-        if (mutex_lock_interruptible(&dev_p->mutex))
-        {
-            return -ERESTARTSYS;
+            while (lane--)
+                kmsgpipe_ring_free(&rings[lane]);
+            return ret;
         }
     }
+    return 0;
+}
 
-    uid_t uid = from_kuid(&init_user_ns, current_uid());
-    gid_t gid = from_kgid(&init_user_ns, current_gid());
-
-    /* Allocate buffer to read data item from ring buffer */
+static void kmsgpipe_lanes_free(kmsgpipe_buffer_t *rings, size_t nr_lanes)
+{
+    for (size_t lane = 0; lane < nr_lanes; lane++)
+        kmsgpipe_ring_free(&rings[lane]);
+}
 
-    op_res = kmsgpipe_pop(&dev_p->ring_buffer, out_buf, uid, gid);
+static void kmsgpipe_lz4_free(kmsgpipe_lz4_t *lz4)
+{
+    kvfree(lz4->wrkmem);
+    kvfree(lz4->buf);
+    lz4->wrkmem = NULL;
+    lz4->buf = NULL;
+}
 
-    if (op_res < 0)
+/* Scratch space for compressing and decompressing one payload at a time */
+static int kmsgpipe_lz4_alloc(kmsgpipe_lz4_t *lz4, size_t ring_data_size)
+{
+    lz4->wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+    lz4->buf = kvmalloc(ring_data_size, GFP_KERNEL);
+    if (!lz4->wrkmem || !lz4->buf)
     {
-        pr_err("kmsgpipe_read: error poping data from circular buffer");
-        kfree(out_buf);
-        mutex_unlock(&dev_p->mutex);
-        return op_res;
+        kmsgpipe_lz4_free(lz4);
+        return -ENOMEM;
     }
+    return 0;
+}
 
-    /* We popped some data from circular buffer wake up any sleeping writers */
-    wake_up_interruptible(&dev_p->writer_q);
+/*
+ * Compress a user payload into a reservation made for its raw size. LZ4
+ * is only allowed fewer bytes than that, so a payload that does not shrink
+ * fails to compress and is stored as is. Returns the bytes taken from the
+ * user either way.
+ */
+static ssize_t kmsgpipe_lz4_commit(kmsgpipe_t *dev_p, kmsgpipe_buffer_t *ring, const kmsgpipe_span_t *span,
+                                   struct iov_iter *from, size_t count, uid_t uid, gid_t gid, ktime_t timestamp)
+{
+    kmsgpipe_lz4_t *lz4 = &dev_p->lz4;
+    ssize_t ret;
+    u64 start;
+    int clen;
 
-    if (copy_to_user(buf, out_buf, count))
+    if (!copy_from_iter_full(lz4->buf, count, from))
     {
-        mutex_unlock(&dev_p->mutex);
-        kfree(out_buf);
+        kmsgpipe_cancel(ring, span);
         return -EFAULT;
     }
 
-    mutex_unlock(&dev_p->mutex);
-    /* free temporary allocated buffer */
-    kfree(out_buf);
-    return op_res;
+    start = ktime_get_ns();
+    clen = LZ4_compress_default(lz4->buf, (char *)span->data, count, count - 1, lz4->wrkmem);
+    lz4->compress_ns += ktime_get_ns() - start;
+    lz4->tried++;
+    lz4->in_bytes += count;
+
+    if (clen <= 0)
+    {
+        memcpy(span->data, lz4->buf, count);
+        lz4->stored_bytes += count;
+        return kmsgpipe_commit(ring, span, count, uid, gid, timestamp);
+    }
+
+    ret = kmsgpipe_commit_compressed(ring, span, clen, count, uid, gid, timestamp);
+    if (ret < 0)
+        return ret;
+    lz4->compressed++;
+    lz4->stored_bytes += clen;
+    return count;
 }
 
-int ksmgpipe_stats_show(struct seq_file *m, void *v)
+/* Decompress a peeked payload and copy up to @count bytes of it to the user */
+static ssize_t kmsgpipe_lz4_copy_out(kmsgpipe_t *dev_p, const kmsgpipe_span_t *span,
+                                     struct iov_iter *to, size_t count)
 {
-    kmsgpipe_t *dev_p = kmsgpipe_p;
-    ssize_t count;
-    mutex_lock(&dev_p->mutex);
-    count = kmsgpipe_get_message_count(&dev_p->ring_buffer);
-    seq_printf(m, "capacity: %zu\n", dev_p->ring_buffer.capacity);
-    seq_printf(m, "data_size: %zu\n", dev_p->ring_buffer.data_size);
-    seq_printf(m, "message count: %zu\n", count);
-    seq_printf(m, "readers waiting: %d\n", atomic_read(&dev_p->reader_waiting));
-    seq_printf(m, "writers waiting: %d\n", atomic_read(&dev_p->writer_waiting));
-    mutex_unlock(&dev_p->mutex);
+    kmsgpipe_lz4_t *lz4 = &dev_p->lz4;
+    u64 start = ktime_get_ns();
+    int len = LZ4_decompress_safe((const char *)span->data, lz4->buf, span->len, span->raw_len);
 
-    return 0;
+    lz4->decompress_ns += ktime_get_ns() - start;
+    if (len < 0 || len != span->raw_len)
+        return -EIO;
+    lz4->decompressed_bytes += len;
+
+    count = min(count, span->raw_len);
+    if (copy_to_iter(lz4->buf, count, to) != count)
+        return -EFAULT;
+    return count;
 }
 
-int kmsgpipe_stats_open(struct inode *inode, struct file *file)
+/*
+ * Large messages (large_max > 0): one over data_size takes a slot but none
+ * of its bytes, and keeps its payload in pages allocated per message,
+ * within large_pages for the whole device. Smaller ones stay in the slot.
+ */
+static size_t kmsgpipe_slot_bytes(const kmsgpipe_buffer_t *ring, size_t count)
 {
-    return single_open(file, ksmgpipe_stats_show, inode->i_private);
+    return count > ring->data_size ? 0 : count;
 }
 
-long kmsgpipe_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+static bool kmsgpipe_chain_fits(kmsgpipe_t *dev_p, const kmsgpipe_buffer_t *ring, size_t count)
 {
-    kmsgpipe_t *dev_p = kmsgpipe_p;
-    long ret_val = 0, tmp;
+    return count <= ring->data_size ||
+           READ_ONCE(dev_p->chain_pages) + DIV_ROUND_UP(count, PAGE_SIZE) <= large_pages;
+}
 
-    if (_IOC_TYPE(cmd) != KMSGPIPE_IOC_MAGIC)
-        return -ENOTTY;
-    if (_IOC_NR(cmd) > KMSGPIPE_IOC_MAXNR)
-        return -ENOTTY;
+/*
+ * Copy a user payload into fresh pages. The pages only count against
+ * large_pages once the message is committed, so this needs no lock.
+ */
+static kmsgpipe_chain_t *kmsgpipe_chain_alloc(struct iov_iter *from, size_t count)
+{
+    unsigned int nr_pages = DIV_ROUND_UP(count, PAGE_SIZE);
+    kmsgpipe_chain_t *chain = kmalloc(struct_size(chain, pages, nr_pages), GFP_KERNEL);
+
+    if (!chain)
+        return ERR_PTR(-ENOMEM);
+    chain->len = count;
+    chain->nr_pages = 0;
+    while (chain->nr_pages < nr_pages)
+    {
+        size_t off = (size_t)chain->nr_pages * PAGE_SIZE;
+        struct page *page = alloc_page(GFP_KERNEL);
+        bool copied;
+        void *p;
+
+        if (!page)
+        {
+            kmsgpipe_chain_put(chain);
+            return ERR_PTR(-ENOMEM);
+        }
+        chain->pages[chain->nr_pages++] = page;
+
+        p = kmap_local_page(page);
+        copied = copy_from_iter_full(p, min_t(size_t, count - off, PAGE_SIZE), from);
+        kunmap_local(p);
+        if (!copied)
+        {
+            kmsgpipe_chain_put(chain);
+            return ERR_PTR(-EFAULT);
+        }
+    }
+    return chain;
+}
+
+static ssize_t kmsgpipe_chain_copy_out(const kmsgpipe_chain_t *chain, struct iov_iter *to, size_t count)
+{
+    count = min(count, chain->len);
+    for (size_t off = 0; off < count; off += PAGE_SIZE)
+    {
+        size_t len = min_t(size_t, count - off, PAGE_SIZE);
+
+        if (copy_page_to_iter(chain->pages[off / PAGE_SIZE], 0, len, to) != len)
+            return -EFAULT;
+    }
+    return count;
+}
+
+/*
+ * SPSC and MPMC rings synchronise push/pop themselves, so the read/write
+ * paths skip dev_p->mutex for them; only sleeping goes through the wait
+ * queues. SPSC additionally relies on one reader and one writer.
+ */
+static bool kmsgpipe_is_lockless(kmsgpipe_t *dev_p)
+{
+    return dev_p->ring_buffer[0].sync != KMSGPIPE_SYNC_LOCKED;
+}
+
+static bool kmsgpipe_is_spsc(kmsgpipe_t *dev_p)
+{
+    return dev_p->ring_buffer[0].sync == KMSGPIPE_SYNC_SPSC;
+}
+
+/* Split rings (kmsgpipe_init_split()) keep writers and readers on their own mutex only */
+static bool kmsgpipe_is_split(kmsgpipe_t *dev_p)
+{
+    return dev_p->ring_buffer[0].split;
+}
+
+/* Readers and writers share no lock, so sleepers re-check and wakers test for them */
+static bool kmsgpipe_sides_apart(kmsgpipe_t *dev_p)
+{
+    return kmsgpipe_is_lockless(dev_p) || kmsgpipe_is_split(dev_p);
+}
+
+static int kmsgpipe_lock_ring(kmsgpipe_t *dev_p)
+{
+    if (kmsgpipe_is_lockless(dev_p))
+        return 0;
+    return mutex_lock_interruptible(&dev_p->mutex);
+}
+
+static void kmsgpipe_unlock_ring(kmsgpipe_t *dev_p)
+{
+    if (!kmsgpipe_is_lockless(dev_p))
+        mutex_unlock(&dev_p->mutex);
+}
+
+/* IOCB_NOWAIT callers may not sleep on a lock either */
+static int kmsgpipe_trylock_ring(kmsgpipe_t *dev_p)
+{
+    if (kmsgpipe_is_lockless(dev_p) || mutex_trylock(&dev_p->mutex))
+        return 0;
+    return -EAGAIN;
+}
+
+/*
+ * Writers and readers of locked rings also take write_mutex / read_mutex,
+ * which keep the other writers / readers off a reservation or peek while
+ * its payload is copied with the ring lock dropped (kmsgpipe_copy_unlocked()).
+ * Split rings stop there: the side mutex is all a writer or reader takes,
+ * and the ring hands slots across with atomic occupancy bits. The side
+ * locks stay mutexes as they are held across copy_{from,to}_user(), which
+ * may fault and sleep. Clear, resize and expiry take all three, in the
+ * order below.
+ */
+static int kmsgpipe_lock_side(kmsgpipe_t *dev_p, struct mutex *side)
+{
+    if (kmsgpipe_is_lockless(dev_p))
+        return 0;
+    if (mutex_lock_interruptible(side))
+        return -ERESTARTSYS;
+    if (kmsgpipe_is_split(dev_p))
+        return 0;
+    if (mutex_lock_interruptible(&dev_p->mutex))
+    {
+        mutex_unlock(side);
+        return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+static int kmsgpipe_trylock_side(kmsgpipe_t *dev_p, struct mutex *side)
+{
+    if (kmsgpipe_is_lockless(dev_p))
+        return 0;
+    if (!mutex_trylock(side))
+        return -EAGAIN;
+    if (kmsgpipe_is_split(dev_p) || !kmsgpipe_trylock_ring(dev_p))
+        return 0;
+    mutex_unlock(side);
+    return -EAGAIN;
+}
+
+static void kmsgpipe_unlock_side(kmsgpipe_t *dev_p, struct mutex *side)
+{
+    if (kmsgpipe_is_lockless(dev_p))
+        return;
+    if (!kmsgpipe_is_split(dev_p))
+        mutex_unlock(&dev_p->mutex);
+    mutex_unlock(side);
+}
+
+static int kmsgpipe_lock_all(kmsgpipe_t *dev_p)
+{
+    if (mutex_lock_interruptible(&dev_p->write_mutex))
+        return -ERESTARTSYS;
+    if (mutex_lock_interruptible(&dev_p->read_mutex))
+    {
+        mutex_unlock(&dev_p->write_mutex);
+        return -ERESTARTSYS;
+    }
+    if (mutex_lock_interruptible(&dev_p->mutex))
+    {
+        mutex_unlock(&dev_p->read_mutex);
+        mutex_unlock(&dev_p->write_mutex);
+        return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+static void kmsgpipe_unlock_all(kmsgpipe_t *dev_p)
+{
+    mutex_unlock(&dev_p->mutex);
+    mutex_unlock(&dev_p->read_mutex);
+    mutex_unlock(&dev_p->write_mutex);
+}
+
+static size_t kmsgpipe_msg_count(kmsgpipe_t *dev_p)
+{
+    size_t count = 0;
+
+    for (size_t lane = 0; lane < dev_p->lanes.nr_lanes; lane++)
+        count += kmsgpipe_get_message_count(&dev_p->ring_buffer[lane]);
+    return count;
+}
+
+/*
+ * Watermarks (KMSGPIPE_IOC_S_WATERMARKS): readers are woken, and poll()
+ * reports EPOLLIN, once read_lowat messages are queued; writers are woken,
+ * and poll() reports EPOLLOUT, once the lane has write_hiwat free slots.
+ * Both default to 1. A resize may leave them above the capacity, so they
+ * are capped there.
+ */
+static bool kmsgpipe_readable(kmsgpipe_t *dev_p)
+{
+    size_t lowat = min_t(size_t, READ_ONCE(dev_p->read_lowat), dev_p->ring_buffer[0].capacity);
+
+    return kmsgpipe_lanes_pick(&dev_p->lanes, dev_p->ring_buffer) >= 0 && kmsgpipe_msg_count(dev_p) >= lowat;
+}
+
+static bool kmsgpipe_writable(kmsgpipe_t *dev_p, kmsgpipe_buffer_t *ring)
+{
+    size_t hiwat = min_t(size_t, READ_ONCE(dev_p->write_hiwat), ring->capacity);
+    size_t queued = min(kmsgpipe_count_hint(ring), ring->capacity);
+
+    return kmsgpipe_has_room(ring, 1) && ring->capacity - queued >= hiwat;
+}
+
+/*
+ * Paths whose sides share no lock only take the wait queue lock when
+ * somebody sleeps. Wake-ups carry the event they signal, so an epoll entry
+ * waiting only for the other one is left alone.
+ */
+static void kmsgpipe_wake(kmsgpipe_t *dev_p, wait_queue_head_t *q)
+{
+    __poll_t events = q == &dev_p->reader_q ? EPOLLIN | EPOLLRDNORM : EPOLLOUT | EPOLLWRNORM;
+
+    if (!kmsgpipe_sides_apart(dev_p) || wq_has_sleeper(q))
+        wake_up_interruptible_poll(q, events);
+}
+
+/* Owner of a new message, passed to reader wake functions as the key */
+struct kmsgpipe_owner_key
+{
+    uid_t uid;
+    gid_t gid;
+};
+
+struct kmsgpipe_reader_wait
+{
+    struct wait_queue_entry entry;
+    kmsgpipe_t *dev;
+    uid_t uid;
+    gid_t gid;
+};
+
+/*
+ * Owner-filtered wake-ups only reach readers allowed to read the new
+ * message. The wake key is the poll mask epoll entries on the same queue
+ * expect, so the owner travels in dev_p->wake_owner instead. It is only
+ * set under reader_q.lock, for the writer's own wake-up: every other
+ * wake-up of reader_q (resize, watermarks, expiry) reaches all readers.
+ */
+static int kmsgpipe_reader_wake(struct wait_queue_entry *entry, unsigned int mode, int sync, void *key)
+{
+    struct kmsgpipe_reader_wait *wait = container_of(entry, struct kmsgpipe_reader_wait, entry);
+    const struct kmsgpipe_owner_key *owner = wait->dev->wake_owner;
+
+    if (owner && !kmsgpipe_may_read(wait->uid, wait->gid, owner->uid, owner->gid))
+        return 0;
+    return autoremove_wake_function(entry, mode, sync, key);
+}
+
+static void kmsgpipe_wake_owner(kmsgpipe_t *dev_p, const struct kmsgpipe_owner_key *owner)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev_p->reader_q.lock, flags);
+    dev_p->wake_owner = owner;
+    __wake_up_locked_key(&dev_p->reader_q, TASK_INTERRUPTIBLE, poll_to_key(EPOLLIN | EPOLLRDNORM));
+    dev_p->wake_owner = NULL;
+    spin_unlock_irqrestore(&dev_p->reader_q.lock, flags);
+}
+
+static void kmsgpipe_wake_readers(kmsgpipe_t *dev_p, uid_t uid, gid_t gid)
+{
+    struct kmsgpipe_owner_key owner = {.uid = uid, .gid = gid};
+
+    /* Below the low watermark nobody is woken; the reader that brings it there will */
+    if (!kmsgpipe_readable(dev_p))
+        return;
+
+    /* Without an owner index any reader may be stuck behind this message */
+    if (!dev_p->ring_buffer[0].owners)
+    {
+        kmsgpipe_wake(dev_p, &dev_p->reader_q);
+        return;
+    }
+    kmsgpipe_wake_owner(dev_p, &owner);
+}
+
+/*
+ * Sleep until a message this reader may read could be queued. Called with
+ * the reader locks held; returns 0 with them held again, or an error without.
+ * Locked rings are only written under the lock, so queueing the wait entry
+ * before dropping it is enough not to miss a commit; lock-free and split
+ * rings re-check instead.
+ */
+static int kmsgpipe_wait_readable(kmsgpipe_t *dev_p, uid_t uid, gid_t gid)
+{
+    struct kmsgpipe_reader_wait wait = {.dev = dev_p, .uid = uid, .gid = gid};
+
+    init_wait_func(&wait.entry, kmsgpipe_reader_wake);
+    atomic_inc(&dev_p->reader_waiting);
+    prepare_to_wait(&dev_p->reader_q, &wait.entry, TASK_INTERRUPTIBLE);
+    kmsgpipe_unlock_side(dev_p, &dev_p->read_mutex);
+    if (!(kmsgpipe_sides_apart(dev_p) && kmsgpipe_readable(dev_p)) &&
+        !signal_pending(current))
+        schedule();
+    finish_wait(&dev_p->reader_q, &wait.entry);
+    atomic_dec(&dev_p->reader_waiting);
+
+    if (signal_pending(current) || kmsgpipe_lock_side(dev_p, &dev_p->read_mutex))
+        return -ERESTARTSYS;
+    return 0;
+}
+
+/*
+ * Data path entry points. The fixed-geometry build routes them through the
+ * specialised ring, which itself falls back to the generic calls for rings
+ * it does not match; messages with a TTL always go the generic way.
+ */
+static int kmsgpipe_ring_reserve(kmsgpipe_buffer_t *ring, size_t len, kmsgpipe_span_t *span)
+{
+#ifdef CONFIG_KMSGPIPE_LAB4_FIXED
+    return kmsgpipe_fixed_reserve(ring, len, span);
+#else
+    return kmsgpipe_reserve(ring, len, span);
+#endif
+}
+
+static ssize_t kmsgpipe_ring_commit(kmsgpipe_buffer_t *ring, const kmsgpipe_span_t *span, size_t len,
+                                    uid_t uid, gid_t gid, ktime_t timestamp, ktime_t deadline)
+{
+#ifdef CONFIG_KMSGPIPE_LAB4_FIXED
+    if (deadline == KMSGPIPE_NO_DEADLINE)
+        return kmsgpipe_fixed_commit(ring, span, len, uid, gid, timestamp);
+#endif
+    return kmsgpipe_commit_deadline(ring, span, len, uid, gid, timestamp, deadline);
+}
+
+static int kmsgpipe_ring_peek(kmsgpipe_buffer_t *ring, uid_t uid, gid_t gid, kmsgpipe_span_t *span)
+{
+#ifdef CONFIG_KMSGPIPE_LAB4_FIXED
+    return kmsgpipe_fixed_peek(ring, uid, gid, span);
+#else
+    return kmsgpipe_peek(ring, uid, gid, span);
+#endif
+}
+
+static void kmsgpipe_ring_peek_release(kmsgpipe_buffer_t *ring, const kmsgpipe_span_t *span, bool consume)
+{
+#ifdef CONFIG_KMSGPIPE_LAB4_FIXED
+    kmsgpipe_fixed_peek_release(ring, span, consume);
+#else
+    kmsgpipe_peek_release(ring, span, consume);
+#endif
+}
+
+/*
+ * Peek the lane the scheduler picks. With an owner index that lane may
+ * hold nothing this reader may read, so fall back to the others by
+ * priority.
+ */
+static int kmsgpipe_peek_lanes(kmsgpipe_t *dev_p, uid_t uid, gid_t gid, kmsgpipe_span_t *span, int *lane)
+{
+    int ret;
+
+    *lane = kmsgpipe_lanes_pick(&dev_p->lanes, dev_p->ring_buffer);
+    if (*lane < 0)
+        return -ENODATA;
+    ret = kmsgpipe_ring_peek(&dev_p->ring_buffer[*lane], uid, gid, span);
+    if (ret != -ENODATA || !dev_p->ring_buffer[0].owners)
+        return ret;
+
+    for (size_t other = 0; other < dev_p->lanes.nr_lanes; other++)
+    {
+        if (other == *lane)
+            continue;
+        ret = kmsgpipe_ring_peek(&dev_p->ring_buffer[other], uid, gid, span);
+        if (ret != -ENODATA)
+        {
+            *lane = other;
+            return ret;
+        }
+    }
+    return -ENODATA;
+}
+
+/* Drop messages whose TTL ran out; the caller holds the ring lock */
+static void kmsgpipe_expire_ttl(kmsgpipe_t *dev_p)
+{
+    ssize_t expired = 0;
+
+    if (!dev_p->ring_buffer[0].wheel)
+        return;
+    for (size_t lane = 0; lane < dev_p->lanes.nr_lanes; lane++)
+        expired += kmsgpipe_expire_deadlines(&dev_p->ring_buffer[lane], ktime_get());
+    if (expired > 0)
+        kmsgpipe_wake(dev_p, &dev_p->writer_q);
+}
+
+/*
+ * A mapped ring's consumer moves its tail with a store to the control page.
+ * That is user memory, so the tail is only taken when it lies between the
+ * one the ring has and head, and only ever forward, whichever of the
+ * writer, poll(), MMAP_WAIT or the worker gets here first. Returns whether
+ * it moved.
+ */
+static bool kmsgpipe_mmap_sync(kmsgpipe_t *dev_p)
+{
+    kmsgpipe_buffer_t *ring = &dev_p->ring_buffer[0];
+    size_t user, tail, head, prev;
+
+    if (!READ_ONCE(dev_p->mappings))
+        return false;
+    /* Pairs with the consumer's release store: it is done with the slots */
+    user = smp_load_acquire(&kmsgpipe_mmap_ctrl(ring)->tail);
+    tail = smp_load_acquire(&ring->tail);
+    for (;;)
+    {
+        head = smp_load_acquire(&ring->head);
+        if (user == tail || user - tail > head - tail)
+            return false;
+        prev = cmpxchg(&ring->tail, tail, user);
+        if (prev == tail)
+            return true;
+        tail = prev;
+    }
+}
+
+/* The consumer's reads only reach the kernel here: pass the room they made on */
+static void kmsgpipe_mmap_consumed(kmsgpipe_t *dev_p)
+{
+    if (kmsgpipe_mmap_sync(dev_p) && kmsgpipe_writable(dev_p, &dev_p->ring_buffer[0]))
+        kmsgpipe_wake(dev_p, &dev_p->writer_q);
+}
+
+/*
+ * Every slot of a mapped ring is in its consumer's view, a payload still
+ * being copied in included, so a writer whose messages it may not read is
+ * refused before it copies anything. An admitted writer holds off
+ * kmsgpipe_mmap_bind() with map_writing until its message is committed or
+ * cancelled: no consumer it was not checked against appears meanwhile.
+ */
+static int kmsgpipe_mmap_admit(kmsgpipe_t *dev_p, uid_t uid, gid_t gid, bool nowait)
+{
+    int ret = 0;
+
+    if (!mmap_ring)
+        return 0;
+    /* Held only briefly, so not worth a failed sleep dropping the writer locks */
+    if (!nowait)
+        mutex_lock(&dev_p->map_lock);
+    else if (!mutex_trylock(&dev_p->map_lock))
+        return -EAGAIN;
+    if (dev_p->mappings && !kmsgpipe_may_read(dev_p->map_uid, dev_p->map_gid, uid, gid))
+        ret = -EACCES;
+    else
+        WRITE_ONCE(dev_p->map_writing, true);
+    mutex_unlock(&dev_p->map_lock);
+    return ret;
+}
+
+/* Pairs with kmsgpipe_mmap_bind(): the message, if any, is in the ring by now */
+static void kmsgpipe_mmap_done(kmsgpipe_t *dev_p)
+{
+    if (mmap_ring)
+        smp_store_release(&dev_p->map_writing, false);
+}
+
+int kmsgpipe_module_init(void)
+{
+    int ret;
+
+    if (capacity <= 0 || data_size <= 0)
+    {
+        pr_err("kmsgpipe: capacity and data_size must be positive\n");
+        return -EINVAL;
+    }
+    if (lanes <= 0 || lanes > KMSGPIPE_MAX_LANES || (lanes > 1 && (spsc || mpmc)))
+    {
+        pr_err("kmsgpipe: lanes must be 1 to %d, and 1 for spsc or mpmc rings\n", KMSGPIPE_MAX_LANES);
+        return -EINVAL;
+    }
+
+    ret = alloc_chrdev_region(&kmsgpipe_devno, 0, 1, "kmsgpipe_lab4");
+    if (ret)
+    {
+        pr_err("kmsgpipe: alloc_chrdev_region failed: %d\n", ret);
+        return ret;
+    }
+
+    kmsgpipe_char_major = MAJOR(kmsgpipe_devno);
+    kmsgpipe_char_minor = MINOR(kmsgpipe_devno);
+
+    kmsgpipe_p = kzalloc(sizeof(*kmsgpipe_p), GFP_KERNEL);
+    if (!kmsgpipe_p)
+    {
+        ret = -ENOMEM;
+        unregister_chrdev_region(kmsgpipe_devno, 1);
+        return ret;
+    }
+
+    /* allocate per-device buffers, one per lane */
+    kmsgpipe_lanes_init(&kmsgpipe_p->lanes, lanes, lane_age);
+    ret = kmsgpipe_lanes_alloc(kmsgpipe_p->ring_buffer, lanes, capacity, data_size);
+    if (!ret && compress_min)
+    {
+        ret = kmsgpipe_lz4_alloc(&kmsgpipe_p->lz4, data_size);
+        if (ret)
+            kmsgpipe_lanes_free(kmsgpipe_p->ring_buffer, lanes);
+    }
+    if (ret)
+    {
+        pr_err("kmsgpipe: ring allocation failed: %d\n", ret);
+        kfree(kmsgpipe_p);
+        unregister_chrdev_region(kmsgpipe_devno, 1);
+        return ret;
+    }
+
+    /* Initialize wait queues */
+    init_waitqueue_head(&kmsgpipe_p->reader_q);
+    init_waitqueue_head(&kmsgpipe_p->writer_q);
+    kmsgpipe_p->read_lowat = 1;
+    kmsgpipe_p->write_hiwat = 1;
+
+    /* Initialize mutex*/
+    mutex_init(&kmsgpipe_p->write_mutex);
+    mutex_init(&kmsgpipe_p->read_mutex);
+    mutex_init(&kmsgpipe_p->mutex);
+    mutex_init(&kmsgpipe_p->map_lock);
+
+    cdev_init(&kmsgpipe_p->cdev, &kmsgpipe_fops);
+    kmsgpipe_p->cdev.owner = THIS_MODULE;
+    ret = cdev_add(&kmsgpipe_p->cdev, kmsgpipe_devno, 1);
+    if (ret)
+    {
+        pr_err("kmsgpipe: cdev_add failed: %d\n", ret);
+        kmsgpipe_lanes_free(kmsgpipe_p->ring_buffer, lanes);
+        kmsgpipe_lz4_free(&kmsgpipe_p->lz4);
+        kfree(kmsgpipe_p);
+        return ret;
+    }
+
+    /* Initialize debug fs entry*/
+    kmsgpipe_debugfs_root = debugfs_create_dir("kmsgpipe", NULL);
+    if (!kmsgpipe_debugfs_root)
+    {
+        pr_warn("kmsgpipe: debugfs not available\n");
+    }
+    else
+    {
+        debugfs_create_file("stats", 0444, kmsgpipe_debugfs_root, NULL, &kmsgpipe_stats_fops);
+    }
+
+    /* Initialise delay worker, and schedule it */
+    INIT_DELAYED_WORK(&kmsgpipe_p->kmsg_delayed_work, kmsgpipe_cleanup_worker);
+    schedule_delayed_work(&kmsgpipe_p->kmsg_delayed_work, msecs_to_jiffies(expiry_ms));
+
+    pr_info("kmsgpipe: module loaded (major=%d, minor=%d) and (data_size=%d, capacity=%d, lanes=%d)\n", kmsgpipe_char_major, kmsgpipe_char_minor, data_size, capacity, lanes);
+    return 0;
+}
+
+void kmsgpipe_module_exit(void)
+{
+    debugfs_remove_recursive(kmsgpipe_debugfs_root);
+    if (kmsgpipe_p)
+    {
+        cancel_delayed_work_sync(&kmsgpipe_p->kmsg_delayed_work);
+        cdev_del(&kmsgpipe_p->cdev);
+        /* Queued large messages hand their pages back */
+        for (size_t lane = 0; lane < kmsgpipe_p->lanes.nr_lanes; lane++)
+            kmsgpipe_clear(&kmsgpipe_p->ring_buffer[lane]);
+        kmsgpipe_lanes_free(kmsgpipe_p->ring_buffer, kmsgpipe_p->lanes.nr_lanes);
+        kmsgpipe_lz4_free(&kmsgpipe_p->lz4);
+        kfree(kmsgpipe_p);
+        kmsgpipe_p = NULL;
+    }
+    unregister_chrdev_region(kmsgpipe_devno, 1);
+    pr_info("kmsgpipe: module unloaded\n");
+}
+
+int kmsgpipe_open(struct inode *inode_p, struct file *file_p)
+{
+    kmsgpipe_t *kmsgpipe_dev;
+    kmsgpipe_file_t *file_state;
+
+    if (!inode_p || !inode_p->i_cdev)
+    {
+        pr_alert("kmsgpipe_open: Uninitialized inode pointer received\n");
+        return -ENODEV;
+    }
+
+    kmsgpipe_dev = container_of(inode_p->i_cdev,
+                                kmsgpipe_t,
+                                cdev);
+
+    file_state = kzalloc(sizeof(*file_state), GFP_KERNEL);
+    if (!file_state)
+        return -ENOMEM;
+    file_state->dev = kmsgpipe_dev;
+
+    if (kmsgpipe_is_spsc(kmsgpipe_dev))
+    {
+        /* Enforce the single reader / single writer contract */
+        if ((file_p->f_mode & FMODE_READ) && atomic_inc_return(&kmsgpipe_dev->readers_open) > 1)
+        {
+            atomic_dec(&kmsgpipe_dev->readers_open);
+            kfree(file_state);
+            return -EBUSY;
+        }
+        if ((file_p->f_mode & FMODE_WRITE) && atomic_inc_return(&kmsgpipe_dev->writers_open) > 1)
+        {
+            atomic_dec(&kmsgpipe_dev->writers_open);
+            if (file_p->f_mode & FMODE_READ)
+                atomic_dec(&kmsgpipe_dev->readers_open);
+            kfree(file_state);
+            return -EBUSY;
+        }
+    }
+
+    file_p->private_data = file_state;
+    /* read_iter/write_iter honour IOCB_NOWAIT, so io_uring need not punt to a worker */
+    file_p->f_mode |= FMODE_NOWAIT;
+
+    return 0;
+}
+
+int kmsgpipe_release(struct inode *inode_p, struct file *file_p)
+{
+
+    /* For per-device memory ownership we do not free device memory here.
+     * The device buffer is allocated during module init and freed during
+     * module exit. Only the per-file state is freed here. */
+    if (file_p && file_p->private_data)
+    {
+        kmsgpipe_file_t *file_state = file_p->private_data;
+        kmsgpipe_t *kmsgpipe_dev = file_state->dev;
+
+        if (kmsgpipe_is_spsc(kmsgpipe_dev))
+        {
+            if (file_p->f_mode & FMODE_READ)
+                atomic_dec(&kmsgpipe_dev->readers_open);
+            if (file_p->f_mode & FMODE_WRITE)
+                atomic_dec(&kmsgpipe_dev->writers_open);
+        }
+        kfree(file_state);
+        file_p->private_data = NULL;
+    }
+
+    return 0;
+}
+
+/*
+ * Queue one message of @count bytes from @from. Called with the writer
+ * locks held and returns with them held, unless it slept for room and
+ * could not take them back. Only @may_wait callers sleep; the others get
+ * -EAGAIN from a full ring. IOCB_NOWAIT (@nowait) callers also keep the
+ * ring lock across the copy, rather than wait to take it back, and leave
+ * large messages, whose pages are allocated as they fill, to a worker.
+ */
+static ssize_t kmsgpipe_enqueue(kmsgpipe_file_t *file_state, kmsgpipe_buffer_t *ring, struct iov_iter *from,
+                                size_t count, uid_t uid, gid_t gid, bool may_wait, bool nowait)
+{
+    kmsgpipe_t *dev_p = file_state->dev;
+    kmsgpipe_span_t span;
+    kmsgpipe_chain_t *chain = NULL;
+    ktime_t timestamp = ktime_get();
+    ktime_t deadline;
+    ssize_t op_res;
+    bool unlocked;
+    int ret;
+
+    /* Messages over data_size only fit as large messages, within the page budget */
+    if (count > ring->data_size && (count > large_max || DIV_ROUND_UP(count, PAGE_SIZE) > large_pages))
+        return -EMSGSIZE;
+    if (nowait && count > ring->data_size)
+        return -EAGAIN;
+
+    /* Lock-free producers can lose the race for the last slot, hence the loop */
+    while ((ret = kmsgpipe_ring_reserve(ring, kmsgpipe_slot_bytes(ring, count), &span)) == -ENOSPC ||
+           (!ret && !kmsgpipe_chain_fits(dev_p, ring, count)))
+    {
+        if (!ret)
+            kmsgpipe_cancel(ring, &span);
+        if (!may_wait)
+            return -EAGAIN;
+        kmsgpipe_unlock_side(dev_p, &dev_p->write_mutex);
+        atomic_inc(&dev_p->writer_waiting);
+        ret = wait_event_interruptible(
+            dev_p->writer_q,
+            kmsgpipe_has_room(ring, kmsgpipe_slot_bytes(ring, count)) &&
+                kmsgpipe_chain_fits(dev_p, ring, count));
+        atomic_dec(&dev_p->writer_waiting);
+        if (ret || kmsgpipe_lock_side(dev_p, &dev_p->write_mutex))
+            return -ERESTARTSYS;
+    }
+
+    if (ret)
+        return ret;
+    ret = kmsgpipe_mmap_admit(dev_p, uid, gid, nowait);
+    if (ret)
+    {
+        kmsgpipe_cancel(ring, &span);
+        return ret;
+    }
+
+    /*
+     * Copy straight into the reservation. write_mutex keeps other writers
+     * off it, so the ring lock is dropped meanwhile where the ring allows:
+     * a fault in the user buffer then stalls no reader. The ring is left
+     * untouched if the copy fails.
+     */
+    unlocked = !nowait && !kmsgpipe_is_split(dev_p) && kmsgpipe_copy_unlocked(ring);
+    if (unlocked)
+        kmsgpipe_unlock_ring(dev_p);
+    if (count > ring->data_size)
+    {
+        chain = kmsgpipe_chain_alloc(from, count);
+        ret = PTR_ERR_OR_ZERO(chain);
+    }
+    else if (!(compress_min && count >= compress_min) && !copy_from_iter_full(span.data, count, from))
+    {
+        ret = -EFAULT;
+    }
+    if (unlocked)
+        mutex_lock(&dev_p->mutex);
+
+    if (ret)
+    {
+        kmsgpipe_cancel(ring, &span);
+        kmsgpipe_mmap_done(dev_p);
+        return ret;
+    }
+
+    deadline = file_state->msg_ttl ? ktime_add(timestamp, file_state->msg_ttl) : KMSGPIPE_NO_DEADLINE;
+    if (chain)
+    {
+        op_res = kmsgpipe_commit_chain(ring, &span, chain, uid, gid, timestamp, deadline);
+        if (op_res < 0)
+        {
+            kmsgpipe_chain_put(chain);
+        }
+        else
+        {
+            dev_p->chain_pages += chain->nr_pages;
+            op_res = count;
+        }
+    }
+    else if (compress_min && count >= compress_min)
+        op_res = kmsgpipe_lz4_commit(dev_p, ring, &span, from, count, uid, gid, timestamp);
+    else if (file_state->msg_key.keyed)
+        op_res = kmsgpipe_commit_keyed(ring, &span, count, file_state->msg_key.key,
+                                       uid, gid, timestamp, deadline);
+    else
+        op_res = kmsgpipe_ring_commit(ring, &span, count, uid, gid, timestamp, deadline);
+
+    kmsgpipe_mmap_done(dev_p);
+
+    if (op_res < 0 && op_res != -EFAULT)
+        pr_err("kmsgpipe_write: error pushing data from circular buffer");
+    return op_res;
+}
+
+/*
+ * Each non-empty iovec is one message, all queued under one take of the
+ * writer locks, with one wake-up for the lot. A write of nothing at all
+ * still queues an empty message. Only the first message waits for room:
+ * a batch that meets a full ring, or a failing message, ends there and
+ * returns the bytes queued so far.
+ */
+ssize_t kmsgpipe_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    kmsgpipe_file_t *file_state = iocb->ki_filp->private_data;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    bool nonblock = nowait || (iocb->ki_filp->f_flags & O_NONBLOCK);
+    kmsgpipe_t *dev_p;
+    kmsgpipe_buffer_t *ring;
+    size_t count, queued, msgs = 0, total = 0;
+    ssize_t ret;
+
+    if (!file_state)
+        return -ENODEV;
+    dev_p = file_state->dev;
+    ring = &dev_p->ring_buffer[file_state->lane];
+
+    uid_t uid = from_kuid(&init_user_ns, current_uid());
+    gid_t gid = from_kgid(&init_user_ns, current_gid());
+
+    ret = nowait ? kmsgpipe_trylock_side(dev_p, &dev_p->write_mutex)
+                 : kmsgpipe_lock_side(dev_p, &dev_p->write_mutex);
+    if (ret)
+        return ret;
+
+    /* Messages past their TTL, or read by a mapped consumer, may be holding the slot we need */
+    kmsgpipe_expire_ttl(dev_p);
+    kmsgpipe_mmap_sync(dev_p);
+
+    queued = ring->count;
+    do
+    {
+        count = iov_iter_single_seg_count(from);
+        if (!count && iov_iter_count(from))
+        {
+            /* Step over an empty iovec */
+            iov_iter_advance(from, 0);
+            continue;
+        }
+        ret = kmsgpipe_enqueue(file_state, ring, from, count, uid, gid, !msgs && !nonblock, nowait);
+        if (ret < 0)
+            break;
+        total += ret;
+        msgs++;
+    } while (iov_iter_count(from));
+
+    /* Only a failed sleep leaves the locks dropped, and it comes before any message */
+    if (ret == -ERESTARTSYS)
+        return ret;
+
+    /* Only this writer moves head, so it reaches the control page in order */
+    if (mmap_ring && msgs)
+        smp_store_release(&kmsgpipe_mmap_ctrl(ring)->head, (unsigned long long)ring->head);
+
+    /*
+     * We got some data pushed to circular buffer wake up the readers
+     * allowed to read it; copies counted as repeats give them nothing new
+     */
+    if (msgs && (!ring->dedup || ring->count != queued))
+        kmsgpipe_wake_readers(dev_p, uid, gid);
+
+    kmsgpipe_unlock_side(dev_p, &dev_p->write_mutex);
+    return msgs ? total : ret;
+}
+
+/*
+ * Read the messages of history from *pos on without consuming them, one
+ * per iovec. At the newest message this returns 0 like the end of a
+ * file; writes bring more.
+ */
+static ssize_t kmsgpipe_replay_read(kmsgpipe_file_t *file_state, struct iov_iter *to, loff_t *pos, bool nowait)
+{
+    kmsgpipe_t *dev_p = file_state->dev;
+    size_t max_len = dev_p->ring_buffer[0].data_size;
+    kmsgpipe_span_t span;
+    size_t count, len, msgs = 0, total = 0;
+    ssize_t ret;
+
+    uid_t uid = from_kuid(&init_user_ns, current_uid());
+    gid_t gid = from_kgid(&init_user_ns, current_gid());
+
+    ret = nowait ? kmsgpipe_trylock_ring(dev_p) : kmsgpipe_lock_ring(dev_p);
+    if (ret)
+        return ret;
+
+    do
+    {
+        count = iov_iter_single_seg_count(to);
+        if (!count && iov_iter_count(to))
+        {
+            iov_iter_advance(to, 0);
+            continue;
+        }
+        if (count > max_len)
+        {
+            ret = -EINVAL;
+            break;
+        }
+        ret = kmsgpipe_history_peek(&dev_p->ring_buffer[0], *pos, uid, gid, &span);
+        if (ret)
+            break;
+
+        len = min(count, span.len);
+        if (copy_to_iter(span.data, len, to) != len)
+        {
+            ret = -EFAULT;
+            break;
+        }
+        iov_iter_advance(to, count - len);
+        file_state->last_read.len = span.len;
+        file_state->last_read.repeats = span.repeats;
+        file_state->last_read.seq = span.seq;
+        *pos = span.seq + 1;
+        total += len;
+        msgs++;
+    } while (iov_iter_count(to));
+
+    kmsgpipe_unlock_ring(dev_p);
+    if (msgs)
+        return total;
+    return ret == -ENODATA ? 0 : ret;
+}
+
+/*
+ * Take the next message into the next @count bytes of @to; the rest of
+ * them is skipped. Same locking and waiting rules as kmsgpipe_enqueue().
+ * Sets bit lane in *served for every lane a message left.
+ */
+static ssize_t kmsgpipe_dequeue(kmsgpipe_file_t *file_state, struct iov_iter *to, size_t count,
+                                uid_t uid, gid_t gid, bool may_wait, bool nowait, unsigned long *served)
+{
+    kmsgpipe_t *dev_p = file_state->dev;
+    kmsgpipe_buffer_t *ring;
+    kmsgpipe_span_t span;
+    ssize_t op_res;
+    bool unlocked;
+    int lane, ret;
+
+    /*
+     * Always drain the highest non-empty lane (or one that aged past
+     * lane_age). Lock-free consumers can lose the race for the last
+     * message, hence the loop.
+     */
+    while ((ret = kmsgpipe_peek_lanes(dev_p, uid, gid, &span, &lane)) == -ENODATA)
+    {
+        if (!may_wait)
+            return -EAGAIN;
+        ret = kmsgpipe_wait_readable(dev_p, uid, gid);
+        if (ret)
+            return ret;
+    }
+
+    if (ret)
+    {
+        pr_err("kmsgpipe_read: error poping data from circular buffer");
+        return ret;
+    }
+
+    /*
+     * Copy straight out of the ring; the message is only consumed once that
+     * worked. As for writes, read_mutex covers the copy where the ring lock
+     * can be dropped.
+     */
+    ring = &dev_p->ring_buffer[lane];
+    unlocked = !nowait && !kmsgpipe_is_split(dev_p) && kmsgpipe_copy_unlocked(ring);
+    if (unlocked)
+        kmsgpipe_unlock_ring(dev_p);
+    if (span.chain)
+        op_res = kmsgpipe_chain_copy_out(span.chain, to, count);
+    else if (span.raw_len)
+        op_res = kmsgpipe_lz4_copy_out(dev_p, &span, to, count);
+    else
+    {
+        op_res = min(count, span.len);
+        if (copy_to_iter(span.data, op_res, to) != op_res)
+            op_res = -EFAULT;
+    }
+    if (unlocked)
+        mutex_lock(&dev_p->mutex);
+    if (op_res == -EFAULT)
+    {
+        kmsgpipe_ring_peek_release(ring, &span, false);
+        return -EFAULT;
+    }
+
+    if (op_res >= 0)
+    {
+        file_state->last_read.len = span.chain    ? ((kmsgpipe_chain_t *)span.chain)->len
+                                    : span.raw_len ? span.raw_len
+                                                   : span.len;
+        file_state->last_read.repeats = span.repeats;
+        file_state->last_read.seq = span.seq;
+        iov_iter_advance(to, count - op_res);
+    }
+
+    /* A payload that fails to decompress is dropped so it cannot wedge the ring */
+    kmsgpipe_ring_peek_release(ring, &span, true);
+    kmsgpipe_lanes_served(&dev_p->lanes, dev_p->ring_buffer, lane);
+    *served |= 1UL << lane;
+    return op_res;
+}
+
+/*
+ * Each non-empty iovec takes one message, cut to its length, all under
+ * one take of the reader locks. A read into nothing at all still consumes
+ * a message. Only the first message is waited for: a batch that empties
+ * the ring, or meets a failing message, ends there and returns the bytes
+ * read so far.
+ */
+ssize_t kmsgpipe_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    kmsgpipe_file_t *file_state = iocb->ki_filp->private_data;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    bool nonblock = nowait || (iocb->ki_filp->f_flags & O_NONBLOCK);
+    unsigned long served = 0;
+    kmsgpipe_t *dev_p;
+    size_t count, max_len, msgs = 0, total = 0;
+    ssize_t ret;
+
+    if (!file_state)
+        return -ENODEV;
+    dev_p = file_state->dev;
+
+    if (file_state->replay)
+        return kmsgpipe_replay_read(file_state, to, &iocb->ki_pos, nowait);
+    /* A mapped ring's tail belongs to its consumer */
+    if (READ_ONCE(dev_p->mappings))
+        return -EBUSY;
+
+    uid_t uid = from_kuid(&init_user_ns, current_uid());
+    gid_t gid = from_kgid(&init_user_ns, current_gid());
+
+    ret = nowait ? kmsgpipe_trylock_side(dev_p, &dev_p->read_mutex)
+                 : kmsgpipe_lock_side(dev_p, &dev_p->read_mutex);
+    if (ret)
+        return ret;
+
+    /* SPSC rings cannot be trimmed by the worker; their reader does it */
+    if (kmsgpipe_is_spsc(dev_p) &&
+        kmsgpipe_cleanup_expired(&dev_p->ring_buffer[0], READ_ONCE(dev_p->discard_before)) > 0)
+        kmsgpipe_wake(dev_p, &dev_p->writer_q);
+    kmsgpipe_expire_ttl(dev_p);
+
+    /* Return error if reader tries to read a data size greater than any message */
+    max_len = max_t(size_t, dev_p->ring_buffer[0].data_size, large_max);
+    do
+    {
+        count = iov_iter_single_seg_count(to);
+        if (!count && iov_iter_count(to))
+        {
+            iov_iter_advance(to, 0);
+            continue;
+        }
+        if (count > max_len)
+        {
+            ret = -EINVAL;
+            break;
+        }
+        ret = kmsgpipe_dequeue(file_state, to, count, uid, gid, !msgs && !nonblock, nowait, &served);
+        if (ret < 0)
+            break;
+        total += ret;
+        msgs++;
+    } while (iov_iter_count(to));
+
+    /* As for writes, a failed sleep comes before any message and leaves no lock */
+    if (ret == -ERESTARTSYS)
+        return ret;
+
+    /* We popped some data from circular buffer wake up any sleeping writers, once there is enough room */
+    for (size_t lane = 0; lane < dev_p->lanes.nr_lanes; lane++)
+    {
+        if ((served & (1UL << lane)) && kmsgpipe_writable(dev_p, &dev_p->ring_buffer[lane]))
+        {
+            kmsgpipe_wake(dev_p, &dev_p->writer_q);
+            break;
+        }
+    }
+
+    kmsgpipe_unlock_side(dev_p, &dev_p->read_mutex);
+    return msgs ? total : ret;
+}
+
+/*
+ * Readiness against the watermarks. With an owner index a queued message
+ * may belong to somebody else, so the reader's own queue is peeked as a
+ * read would. Replay reads never block, like reads of a regular file.
+ */
+__poll_t kmsgpipe_poll(struct file *file_p, poll_table *wait)
+{
+    kmsgpipe_file_t *file_state = file_p->private_data;
+    kmsgpipe_t *dev_p = file_state->dev;
+    __poll_t mask = 0;
+    kmsgpipe_span_t span;
+    int lane;
+
+    poll_wait(file_p, &dev_p->reader_q, wait);
+    poll_wait(file_p, &dev_p->writer_q, wait);
+    /* Pairs with wq_has_sleeper() in kmsgpipe_wake() */
+    smp_mb();
+    kmsgpipe_mmap_consumed(dev_p);
+
+    if (file_state->replay)
+    {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    else if (kmsgpipe_readable(dev_p))
+    {
+        if (!dev_p->ring_buffer[0].owners)
+        {
+            mask |= EPOLLIN | EPOLLRDNORM;
+        }
+        else if (!kmsgpipe_lock_ring(dev_p))
+        {
+            uid_t uid = from_kuid(&init_user_ns, current_uid());
+            gid_t gid = from_kgid(&init_user_ns, current_gid());
+
+            int ret = kmsgpipe_peek_lanes(dev_p, uid, gid, &span, &lane);
+
+            if (ret != -ENODATA)
+                mask |= EPOLLIN | EPOLLRDNORM;
+            if (!ret)
+                kmsgpipe_ring_peek_release(&dev_p->ring_buffer[lane], &span, false);
+            kmsgpipe_unlock_ring(dev_p);
+        }
+    }
+
+    if (kmsgpipe_writable(dev_p, &dev_p->ring_buffer[file_state->lane]))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    return mask;
+}
+
+/*
+ * Slots outside tail..head still hold whatever was last consumed from
+ * them, maybe by a reader the mapper is not. Nothing is filling them:
+ * the one writer is held off by map_lock and map_writing.
+ */
+static void kmsgpipe_mmap_scrub(kmsgpipe_buffer_t *ring)
+{
+    size_t queued = ring->head - ring->tail;
+
+    for (size_t idx = 0; idx < ring->capacity; idx++)
+    {
+        if (((idx - ring->tail) & ring->mask) < queued)
+            continue;
+        memset(&ring->records[idx], 0, sizeof(ring->records[idx]));
+        memset(ring->base + idx * ring->data_size, 0, ring->data_size);
+    }
+}
+
+/*
+ * The first mapping binds the ring to the mapper's credentials, once every
+ * message already queued is one they may read and no write checked against
+ * nobody is still filling its slot; writers they may not read are refused
+ * from then on (kmsgpipe_mmap_admit()). Further mappings must come with
+ * the same credentials.
+ */
+static int kmsgpipe_mmap_bind(kmsgpipe_t *dev_p, uid_t uid, gid_t gid)
+{
+    kmsgpipe_buffer_t *ring = &dev_p->ring_buffer[0];
+    const kmsg_record_t *rec;
+    int ret = 0;
+
+    if (mutex_lock_interruptible(&dev_p->map_lock))
+        return -ERESTARTSYS;
+    if (dev_p->mappings)
+    {
+        if (uid != dev_p->map_uid || gid != dev_p->map_gid)
+            ret = -EBUSY;
+    }
+    else if (smp_load_acquire(&dev_p->map_writing))
+    {
+        ret = -EAGAIN;
+    }
+    else
+    {
+        for (size_t pos = ring->tail; pos != ring->head && !ret; pos++)
+        {
+            rec = &ring->records[pos & ring->mask];
+            if (!kmsgpipe_may_read(uid, gid, rec->owner_uid, rec->owner_gid))
+                ret = -EACCES;
+        }
+    }
+    if (!ret && !dev_p->mappings)
+    {
+        kmsgpipe_mmap_scrub(ring);
+        dev_p->map_uid = uid;
+        dev_p->map_gid = gid;
+        /* The consumer carries on where read() left off */
+        WRITE_ONCE(kmsgpipe_mmap_ctrl(ring)->tail, ring->tail);
+    }
+    if (!ret)
+        WRITE_ONCE(dev_p->mappings, dev_p->mappings + 1);
+    mutex_unlock(&dev_p->map_lock);
+    return ret;
+}
+
+static void kmsgpipe_mmap_unbind(kmsgpipe_t *dev_p)
+{
+    mutex_lock(&dev_p->map_lock);
+    WRITE_ONCE(dev_p->mappings, dev_p->mappings - 1);
+    mutex_unlock(&dev_p->map_lock);
+}
+
+/* fork() and partial munmap() make more VMAs of the same binding */
+static void kmsgpipe_vm_open(struct vm_area_struct *vma)
+{
+    kmsgpipe_t *dev_p = vma->vm_private_data;
+
+    mutex_lock(&dev_p->map_lock);
+    WRITE_ONCE(dev_p->mappings, dev_p->mappings + 1);
+    mutex_unlock(&dev_p->map_lock);
+}
+
+/* Take the tail once more, so read() resumes where the consumer stopped */
+static void kmsgpipe_vm_close(struct vm_area_struct *vma)
+{
+    kmsgpipe_t *dev_p = vma->vm_private_data;
+
+    kmsgpipe_mmap_consumed(dev_p);
+    kmsgpipe_mmap_unbind(dev_p);
+}
+
+static const struct vm_operations_struct kmsgpipe_vm_ops = {
+    .open = kmsgpipe_vm_open,
+    .close = kmsgpipe_vm_close,
+};
+
+/*
+ * mmap_ring pipes map to their reader: offset 0 is the control page, one
+ * page that may be writable; KMSGPIPE_MMAP_RING_PGOFF on the records and
+ * payload slots, which may not. See struct kmsgpipe_mmap_ctrl.
+ */
+int kmsgpipe_mmap(struct file *file_p, struct vm_area_struct *vma)
+{
+    kmsgpipe_file_t *file_state = file_p->private_data;
+    kmsgpipe_t *dev_p = file_state->dev;
+    int ret;
+
+    uid_t uid = from_kuid(&init_user_ns, current_uid());
+    gid_t gid = from_kgid(&init_user_ns, current_gid());
+
+    if (!mmap_ring)
+        return -ENODEV;
+    if (!(file_p->f_mode & FMODE_READ))
+        return -EACCES;
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+    if (vma->vm_pgoff < KMSGPIPE_MMAP_RING_PGOFF)
+    {
+        if (vma->vm_end - vma->vm_start != PAGE_SIZE)
+            return -EINVAL;
+    }
+    else
+    {
+        if (vma->vm_flags & VM_WRITE)
+            return -EPERM;
+        vm_flags_clear(vma, VM_MAYWRITE);
+    }
+
+    ret = kmsgpipe_mmap_bind(dev_p, uid, gid);
+    if (ret)
+        return ret;
+    /* Checks the range against the area, and keeps it from growing or being dumped */
+    ret = remap_vmalloc_range(vma, kmsgpipe_mmap_ctrl(&dev_p->ring_buffer[0]), vma->vm_pgoff);
+    if (ret)
+    {
+        kmsgpipe_mmap_unbind(dev_p);
+        return ret;
+    }
+    vma->vm_private_data = dev_p;
+    vma->vm_ops = &kmsgpipe_vm_ops;
+    return 0;
+}
+
+int ksmgpipe_stats_show(struct seq_file *m, void *v)
+{
+    kmsgpipe_t *dev_p = kmsgpipe_p;
+    kmsgpipe_buffer_t *ring = &dev_p->ring_buffer[0];
+    size_t nr_lanes = dev_p->lanes.nr_lanes;
+    size_t count, used = 0;
+    mutex_lock(&dev_p->mutex);
+    count = kmsgpipe_msg_count(dev_p);
+    seq_printf(m, "capacity: %zu\n", ring->capacity);
+    seq_printf(m, "data_size: %zu\n", ring->data_size);
+    seq_printf(m, "message count: %zu\n", count);
+    if (ring->layout == KMSGPIPE_LAYOUT_PACKED)
+    {
+        for (size_t lane = 0; lane < nr_lanes; lane++)
+            used += dev_p->ring_buffer[lane].used;
+        seq_printf(m, "layout: packed%s\n", ring->mirrored ? " (mirrored)" : "");
+        seq_printf(m, "bytes used: %zu/%zu\n", used, ring->size * nr_lanes);
+    }
+    else if (ring->layout == KMSGPIPE_LAYOUT_COMPACT ||
+             ring->layout == KMSGPIPE_LAYOUT_INLINE)
+    {
+        seq_printf(m, "layout: %s%s\n", ring->layout == KMSGPIPE_LAYOUT_INLINE ? "inline" : "compact",
+                   ring->split ? " (split)" : "");
+        seq_printf(m, "free slots: %zu\n", ring->capacity * nr_lanes - count);
+    }
+    else
+    {
+        seq_printf(m, "layout: slot%s\n", kmsgpipe_is_spsc(dev_p)       ? " (spsc)"
+                                           : kmsgpipe_is_lockless(dev_p) ? " (mpmc)"
+                                           : ring->split                 ? " (split)"
+                                                                         : "");
+        seq_printf(m, "free slots: %zu\n", ring->capacity * nr_lanes - count);
+    }
+    if (nr_lanes > 1)
+    {
+        for (size_t lane = 0; lane < nr_lanes; lane++)
+            seq_printf(m, "lane %zu: %zd messages, passed over %u times\n", lane,
+                       kmsgpipe_get_message_count(&dev_p->ring_buffer[lane]), dev_p->lanes.passed[lane]);
+    }
+    if (compress_min)
+    {
+        kmsgpipe_lz4_t *lz4 = &dev_p->lz4;
+        u64 ratio = lz4->stored_bytes ? div64_u64(lz4->in_bytes * 100, lz4->stored_bytes) : 0;
+
+        seq_printf(m, "lz4: %llu of %llu messages compressed, %llu -> %llu bytes (ratio %llu.%02llu)\n",
+                   lz4->compressed, lz4->tried, lz4->in_bytes, lz4->stored_bytes, ratio / 100, ratio % 100);
+        seq_printf(m, "lz4 cpu: compress %llu ns/MiB, decompress %llu ns/MiB\n",
+                   lz4->in_bytes ? mul_u64_u64_div_u64(lz4->compress_ns, 1 << 20, lz4->in_bytes) : 0,
+                   lz4->decompressed_bytes ? mul_u64_u64_div_u64(lz4->decompress_ns, 1 << 20, lz4->decompressed_bytes) : 0);
+    }
+    if (ring->keys)
+    {
+        size_t replaced = 0;
+
+        for (size_t lane = 0; lane < nr_lanes; lane++)
+            replaced += dev_p->ring_buffer[lane].keys->replaced;
+        seq_printf(m, "keyed: %zu messages replaced by a newer one\n", replaced);
+    }
+    if (large_max)
+        seq_printf(m, "large messages: %zu of %d pages in use\n", dev_p->chain_pages, large_pages);
+    if (ring->history)
+        seq_printf(m, "history: %zu messages retained, next seq %llu\n",
+                   ring->history->retained, ring->history->next_seq);
+    if (mmap_ring)
+        seq_printf(m, "mmap: %u mappings, uid %u gid %u\n", READ_ONCE(dev_p->mappings),
+                   dev_p->map_uid, dev_p->map_gid);
+    seq_printf(m, "readers waiting: %d\n", atomic_read(&dev_p->reader_waiting));
+    seq_printf(m, "writers waiting: %d\n", atomic_read(&dev_p->writer_waiting));
+    mutex_unlock(&dev_p->mutex);
+
+    return 0;
+}
+
+int kmsgpipe_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, ksmgpipe_stats_show, inode->i_private);
+}
+
+/*
+ * Grow or shrink a live ring. Every lane gets the new geometry. The new
+ * rings are allocated while readers and writers carry on; the locks are only
+ * held to copy the queued messages across and swap the rings, and the old
+ * rings are freed after it is dropped. Sleepers are woken to re-check
+ * against the new geometry.
+ */
+static long kmsgpipe_resize(kmsgpipe_t *dev_p, const struct kmsgpipe_resize *req)
+{
+    size_t nr_lanes = dev_p->lanes.nr_lanes;
+    kmsgpipe_buffer_t *fresh;
+    char *lz4_buf = NULL;
+    ssize_t moved = 0, lane_moved;
+    size_t lane;
+    int ret;
+
+    /* Lock-free rings have no lock that would hold their users off */
+    if (kmsgpipe_is_lockless(dev_p))
+        return -EOPNOTSUPP;
+    if (req->capacity <= 0 || req->data_size <= 0)
+        return -EINVAL;
+
+    fresh = kcalloc(nr_lanes, sizeof(*fresh), GFP_KERNEL);
+    if (!fresh)
+        return -ENOMEM;
+    ret = kmsgpipe_lanes_alloc(fresh, nr_lanes, req->capacity, req->data_size);
+    if (ret)
+    {
+        kfree(fresh);
+        return ret;
+    }
+    /* LZ4 scratch holds one raw payload, so it follows data_size */
+    if (compress_min)
+    {
+        lz4_buf = kvmalloc(req->data_size, GFP_KERNEL);
+        if (!lz4_buf)
+        {
+            kmsgpipe_lanes_free(fresh, nr_lanes);
+            kfree(fresh);
+            return -ENOMEM;
+        }
+    }
+
+    if (kmsgpipe_lock_all(dev_p))
+    {
+        kmsgpipe_lanes_free(fresh, nr_lanes);
+        kfree(fresh);
+        kvfree(lz4_buf);
+        return -ERESTARTSYS;
+    }
+    /* The old rings are left intact if the messages of any lane do not fit */
+    for (lane = 0; lane < nr_lanes; lane++)
+    {
+        lane_moved = kmsgpipe_migrate(&fresh[lane], &dev_p->ring_buffer[lane]);
+        if (lane_moved < 0)
+        {
+            moved = lane_moved;
+            break;
+        }
+        moved += lane_moved;
+    }
+    if (moved >= 0)
+    {
+        for (lane = 0; lane < nr_lanes; lane++)
+            swap(dev_p->ring_buffer[lane], fresh[lane]);
+        if (lz4_buf)
+            swap(dev_p->lz4.buf, lz4_buf);
+    }
+    kmsgpipe_unlock_all(dev_p);
+
+    kmsgpipe_lanes_free(fresh, nr_lanes);
+    kfree(fresh);
+    kvfree(lz4_buf);
+    if (moved < 0)
+        return moved;
+
+    wake_up_interruptible(&dev_p->writer_q);
+    wake_up_interruptible(&dev_p->reader_q);
+    pr_info("kmsgpipe: resized to capacity=%ld, data_size=%ld with %zd messages\n",
+            req->capacity, req->data_size, moved);
+    return 0;
+}
+
+/*
+ * With retain, the file position is a sequence number: seeking anywhere
+ * switches reads to replaying history from there, SEEK_END being relative
+ * to the next message to be written.
+ */
+loff_t kmsgpipe_llseek(struct file *file_p, loff_t offset, int whence)
+{
+    kmsgpipe_file_t *file_state = file_p->private_data;
+    kmsgpipe_t *dev_p = file_state->dev;
+    kmsgpipe_buffer_t *ring = &dev_p->ring_buffer[0];
+    loff_t pos;
+
+    if (!ring->history)
+        return -ESPIPE;
+
+    switch (whence)
+    {
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = file_p->f_pos + offset;
+        break;
+    case SEEK_END:
+        if (kmsgpipe_lock_ring(dev_p))
+            return -ERESTARTSYS;
+        pos = ring->history->next_seq + offset;
+        kmsgpipe_unlock_ring(dev_p);
+        break;
+    default:
+        return -EINVAL;
+    }
+    if (pos < 0)
+        return -EINVAL;
+
+    file_p->f_pos = pos;
+    file_state->replay = true;
+    return pos;
+}
+
+long kmsgpipe_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    kmsgpipe_t *dev_p = kmsgpipe_p;
+    kmsgpipe_file_t *file_state = filp->private_data;
+    struct kmsgpipe_resize resize;
+    struct kmsgpipe_lane_counts lane_counts;
+    struct kmsgpipe_msg_key msg_key;
+    struct kmsgpipe_watermarks watermarks;
+    long long replay_ns;
+    u64 seq;
+    long ret_val = 0, tmp;
+
+    if (_IOC_TYPE(cmd) != KMSGPIPE_IOC_MAGIC)
+        return -ENOTTY;
+    if (_IOC_NR(cmd) > KMSGPIPE_IOC_MAXNR)
+        return -ENOTTY;
 
     switch (cmd)
     {
     case KMSGPIPE_IOC_G_DATA_SIZE:
-        ret_val = put_user(dev_p->ring_buffer.data_size, (long __user *)arg);
+        ret_val = put_user(dev_p->ring_buffer[0].data_size, (long __user *)arg);
         break;
 
     case KMSGPIPE_IOC_G_CAPACITY:
-        ret_val = put_user(dev_p->ring_buffer.capacity, (long __user *)arg);
+        ret_val = put_user(dev_p->ring_buffer[0].capacity, (long __user *)arg);
         break;
 
     case KMSGPIPE_IOC_G_MSG_COUNT:
-        ssize_t count = kmsgpipe_get_message_count(&dev_p->ring_buffer);
-        ret_val = put_user(count, (long __user *)arg);
+        ret_val = put_user(kmsgpipe_msg_count(dev_p), (long __user *)arg);
         break;
 
     case KMSGPIPE_IOC_G_READERS:
@@ -434,8 +2217,136 @@ long kmsgpipe_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     case KMSGPIPE_IOC_CLEAR:
         if (!capable(CAP_SYS_ADMIN))
             return -EPERM;
-        tmp = kmsgpipe_clear(&dev_p->ring_buffer);
-        ret_val = tmp < 0 ? tmp : 0;
+        if (kmsgpipe_is_spsc(dev_p))
+        {
+            /* Only the reader may move tail: have it drop everything queued so far */
+            WRITE_ONCE(dev_p->discard_before, ktime_get());
+            break;
+        }
+        if (kmsgpipe_is_lockless(dev_p))
+        {
+            /* MPMC consumers are safe to race with: drain as one of them */
+            kmsgpipe_cleanup_expired(&dev_p->ring_buffer[0], ktime_get());
+            kmsgpipe_wake(dev_p, &dev_p->writer_q);
+            break;
+        }
+        /* Wait out copies into and out of the ring */
+        if (kmsgpipe_lock_all(dev_p))
+            return -ERESTARTSYS;
+        for (size_t lane = 0; lane < dev_p->lanes.nr_lanes && !ret_val; lane++)
+        {
+            tmp = kmsgpipe_clear(&dev_p->ring_buffer[lane]);
+            ret_val = tmp < 0 ? tmp : 0;
+        }
+        kmsgpipe_unlock_all(dev_p);
+        break;
+
+    case KMSGPIPE_IOC_RESIZE:
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (copy_from_user(&resize, (struct kmsgpipe_resize __user *)arg, sizeof(resize)))
+            return -EFAULT;
+        ret_val = kmsgpipe_resize(dev_p, &resize);
+        break;
+
+    case KMSGPIPE_IOC_S_MSG_TTL_MS:
+        if (!dev_p->ring_buffer[0].wheel)
+            return -EOPNOTSUPP;
+        if (get_user(tmp, (long __user *)arg))
+            return -EFAULT;
+        if (tmp < 0)
+            return -EINVAL;
+        file_state->msg_ttl = ms_to_ktime(tmp);
+        break;
+    case KMSGPIPE_IOC_G_MSG_TTL_MS:
+        ret_val = put_user(ktime_to_ms(file_state->msg_ttl), (long __user *)arg);
+        break;
+
+    case KMSGPIPE_IOC_S_LANE:
+        if (get_user(tmp, (long __user *)arg))
+            return -EFAULT;
+        if (tmp < 0 || tmp >= dev_p->lanes.nr_lanes)
+            return -EINVAL;
+        file_state->lane = tmp;
+        break;
+    case KMSGPIPE_IOC_G_LANE:
+        ret_val = put_user(file_state->lane, (long __user *)arg);
+        break;
+    case KMSGPIPE_IOC_G_LANE_COUNTS:
+        BUILD_BUG_ON(KMSGPIPE_IOC_MAX_LANES != KMSGPIPE_MAX_LANES);
+        memset(&lane_counts, 0, sizeof(lane_counts));
+        lane_counts.nr_lanes = dev_p->lanes.nr_lanes;
+        for (size_t lane = 0; lane < dev_p->lanes.nr_lanes; lane++)
+            lane_counts.count[lane] = kmsgpipe_get_message_count(&dev_p->ring_buffer[lane]);
+        if (copy_to_user((struct kmsgpipe_lane_counts __user *)arg, &lane_counts, sizeof(lane_counts)))
+            return -EFAULT;
+        break;
+
+    case KMSGPIPE_IOC_G_LAST_META:
+        if (copy_to_user((struct kmsgpipe_msg_meta __user *)arg, &file_state->last_read, sizeof(file_state->last_read)))
+            return -EFAULT;
+        break;
+
+    case KMSGPIPE_IOC_S_MSG_KEY:
+        if (!dev_p->ring_buffer[0].keys)
+            return -EOPNOTSUPP;
+        if (copy_from_user(&msg_key, (struct kmsgpipe_msg_key __user *)arg, sizeof(msg_key)))
+            return -EFAULT;
+        file_state->msg_key = msg_key;
+        break;
+    case KMSGPIPE_IOC_G_MSG_KEY:
+        if (copy_to_user((struct kmsgpipe_msg_key __user *)arg, &file_state->msg_key, sizeof(file_state->msg_key)))
+            return -EFAULT;
+        break;
+
+    case KMSGPIPE_IOC_S_REPLAY_TIME:
+        if (!dev_p->ring_buffer[0].history)
+            return -EOPNOTSUPP;
+        if (get_user(replay_ns, (long long __user *)arg))
+            return -EFAULT;
+        if (kmsgpipe_lock_ring(dev_p))
+            return -ERESTARTSYS;
+        kmsgpipe_history_seek_time(&dev_p->ring_buffer[0], replay_ns, &seq);
+        kmsgpipe_unlock_ring(dev_p);
+        filp->f_pos = seq;
+        file_state->replay = true;
+        break;
+    case KMSGPIPE_IOC_REPLAY_STOP:
+        file_state->replay = false;
+        break;
+
+    case KMSGPIPE_IOC_S_WATERMARKS:
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (copy_from_user(&watermarks, (struct kmsgpipe_watermarks __user *)arg, sizeof(watermarks)))
+            return -EFAULT;
+        if (watermarks.read_lowat < 1 || watermarks.read_lowat > dev_p->ring_buffer[0].capacity ||
+            watermarks.write_hiwat < 1 || watermarks.write_hiwat > dev_p->ring_buffer[0].capacity)
+            return -EINVAL;
+        if (kmsgpipe_lock_all(dev_p))
+            return -ERESTARTSYS;
+        WRITE_ONCE(dev_p->read_lowat, watermarks.read_lowat);
+        WRITE_ONCE(dev_p->write_hiwat, watermarks.write_hiwat);
+        kmsgpipe_unlock_all(dev_p);
+        /* Lowered marks may already be met */
+        wake_up_interruptible(&dev_p->reader_q);
+        wake_up_interruptible(&dev_p->writer_q);
+        break;
+    case KMSGPIPE_IOC_MMAP_WAIT:
+        if (!READ_ONCE(dev_p->mappings))
+            return -EINVAL;
+        kmsgpipe_mmap_consumed(dev_p);
+        if (filp->f_flags & O_NONBLOCK)
+            return kmsgpipe_readable(dev_p) ? 0 : -EAGAIN;
+        if (wait_event_interruptible(dev_p->reader_q, kmsgpipe_readable(dev_p)))
+            return -ERESTARTSYS;
+        break;
+
+    case KMSGPIPE_IOC_G_WATERMARKS:
+        watermarks.read_lowat = READ_ONCE(dev_p->read_lowat);
+        watermarks.write_hiwat = READ_ONCE(dev_p->write_hiwat);
+        if (copy_to_user((struct kmsgpipe_watermarks __user *)arg, &watermarks, sizeof(watermarks)))
+            return -EFAULT;
         break;
     }
 
@@ -451,14 +2362,35 @@ void kmsgpipe_cleanup_worker(struct work_struct *work)
                                 kmsgpipe_t,
                                 kmsg_delayed_work.work);
 
-    if (mutex_lock_interruptible(&kmsgpipe_dev->mutex))
+    if (kmsgpipe_is_spsc(kmsgpipe_dev))
+    {
+        /* Applied by the reader on its next kmsgpipe_read() */
+        WRITE_ONCE(kmsgpipe_dev->discard_before, timestamp);
+        /* Writers stuck behind a mapped consumer that never polls */
+        kmsgpipe_mmap_consumed(kmsgpipe_dev);
+        schedule_delayed_work(&kmsgpipe_dev->kmsg_delayed_work, msecs_to_jiffies(expiry_ms));
+        return;
+    }
+
+    if (kmsgpipe_is_lockless(kmsgpipe_dev))
+    {
+        /* MPMC consumers may race freely, so expire records in place */
+        if (kmsgpipe_cleanup_expired(&kmsgpipe_dev->ring_buffer[0], timestamp) > 0)
+            kmsgpipe_wake(kmsgpipe_dev, &kmsgpipe_dev->writer_q);
+        schedule_delayed_work(&kmsgpipe_dev->kmsg_delayed_work, msecs_to_jiffies(expiry_ms));
+        return;
+    }
+
+    if (kmsgpipe_lock_all(kmsgpipe_dev))
     {
         return;
     }
 
-    kmsgpipe_cleanup_expired(&kmsgpipe_dev->ring_buffer, timestamp);
+    for (size_t lane = 0; lane < kmsgpipe_dev->lanes.nr_lanes; lane++)
+        kmsgpipe_cleanup_expired(&kmsgpipe_dev->ring_buffer[lane], timestamp);
+    kmsgpipe_expire_ttl(kmsgpipe_dev);
     wake_up_interruptible(&kmsgpipe_dev->writer_q);
 
-    mutex_unlock(&kmsgpipe_dev->mutex);
+    kmsgpipe_unlock_all(kmsgpipe_dev);
     schedule_delayed_work(&kmsgpipe_dev->kmsg_delayed_work, msecs_to_jiffies(expiry_ms));
 }
\ No newline at end of file
@@ -7,25 +7,79 @@
 #include <linux/cdev.h>
 #include <linux/workqueue.h>
 #include "kmsgpipe.h"
+#include "kmsgpipe_ioctl.h"
 
+#ifdef CONFIG_KMSGPIPE_LAB4_FIXED
+#define DEFAULT_DATA_SIZE CONFIG_KMSGPIPE_LAB4_FIXED_DATA_SIZE
+#define DEFAULT_CAPCITY CONFIG_KMSGPIPE_LAB4_FIXED_CAPACITY
+#else
 #define DEFAULT_DATA_SIZE 1024
 #define DEFAULT_CAPCITY 10
+#endif
 #define DEFAULT_EXPIRY_MS 30000 /* 30 Seconds */
+#define DEFAULT_COMPACT_OWNERS 64
+#define KMSGPIPE_COMPACT_TS_SHIFT 20 /* ktime_get() ns in ~1ms units */
+#define KMSGPIPE_TTL_TICK_SHIFT 20   /* TTL wheel ticks of ~1ms */
+
+/* LZ4 compression of stored payloads (compress_min > 0); guarded by the mutex */
+typedef struct
+{
+    void *wrkmem;             /* LZ4_MEM_COMPRESS bytes */
+    char *buf;                /* data_size bytes: a raw payload on its way in or out */
+    u64 tried, compressed;    /* messages given to LZ4 / stored compressed */
+    u64 in_bytes, stored_bytes; /* their raw bytes / bytes they take in the ring */
+    u64 compress_ns, decompress_ns;
+    u64 decompressed_bytes;
+} kmsgpipe_lz4_t;
+
+/* Payload of a message larger than a slot (large_max > 0), in order-0 pages */
+typedef struct
+{
+    size_t len;
+    unsigned int nr_pages;
+    struct page *pages[];
+} kmsgpipe_chain_t;
 
 typedef struct
 {
     wait_queue_head_t writer_q, reader_q;
+    const struct kmsgpipe_owner_key *wake_owner; /* owner of the message reader_q is woken for; guarded by reader_q.lock */
+    unsigned int read_lowat, write_hiwat; /* KMSGPIPE_IOC_S_WATERMARKS; guarded by all three mutexes */
     atomic_t reader_waiting, writer_waiting;
-    kmsgpipe_buffer_t ring_buffer;
-    struct mutex mutex;
+    atomic_t readers_open, writers_open; /* enforced only for SPSC rings */
+    ktime_t discard_before;              /* SPSC: reader drops older messages */
+    kmsgpipe_buffer_t ring_buffer[KMSGPIPE_MAX_LANES]; /* one ring per priority lane */
+    kmsgpipe_lanes_t lanes;
+    kmsgpipe_lz4_t lz4;
+    size_t chain_pages;                  /* pages held by large messages; guarded by the mutex */
+    struct mutex write_mutex, read_mutex; /* one writer / reader at a time, held across its user copy */
+    struct mutex mutex;                   /* ring indexes and metadata; taken after the two above */
+    struct mutex map_lock;                /* mmap_ring: binds a consumer against admitted writers */
+    unsigned int mappings;                /* consumer VMAs of a mmap_ring pipe; guarded by map_lock */
+    bool map_writing;                     /* a writer admitted by map_lock is filling a slot */
+    uid_t map_uid;                        /* credentials the ring is mapped with */
+    gid_t map_gid;
     struct cdev cdev;
     struct delayed_work kmsg_delayed_work;
 } kmsgpipe_t;
 
+/* Per open file state, kept in file->private_data */
+typedef struct
+{
+    kmsgpipe_t *dev;
+    ktime_t msg_ttl; /* TTL given to messages written through this file, 0 for none */
+    size_t lane;     /* lane written to, 0 being the highest priority */
+    struct kmsgpipe_msg_meta last_read; /* message last read through this file */
+    struct kmsgpipe_msg_key msg_key;    /* key given to messages written through this file */
+    bool replay;                        /* reads replay history from f_pos, a sequence number */
+} kmsgpipe_file_t;
+
+int kmsgpipe_ring_alloc(kmsgpipe_buffer_t *ring, size_t capacity, size_t data_size);
+void kmsgpipe_ring_free(kmsgpipe_buffer_t *ring);
 int kmsgpipe_module_init(void);
 void kmsgpipe_module_exit(void);
-ssize_t kmsgpipe_read(struct file *file_p, char __user *buf, size_t count, loff_t *f_pos);
-ssize_t kmsgpipe_write(struct file *file_p, const char __user *buf, size_t count, loff_t *f_pos);
+ssize_t kmsgpipe_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t kmsgpipe_write_iter(struct kiocb *iocb, struct iov_iter *from);
 int kmsgpipe_open(struct inode *inode, struct file *file_p);
 int kmsgpipe_release(struct inode *inode, struct file *file_p);
 
@@ -1,136 +1,2010 @@
 #include "kmsgpipe.h"
 
-static bool is_valid_access(
-    uid_t requesting_uid,
-    gid_t requesting_gid,
-    uid_t record_uid,
-    gid_t record_gid)
+/* COMPACT: find or claim the credential table entry for (uid, gid) */
+static int compact_cred_get(kmsgpipe_buffer_t *buf, uid_t uid, gid_t gid)
 {
-    if (requesting_uid == 0)
-        return true;
+    size_t free_idx = buf->ncreds;
 
-    if (requesting_uid == record_uid)
-        return true;
+    for (size_t i = 0; i < buf->ncreds; i++)
+    {
+        kmsg_cred_t *cred = &buf->creds[i];
+
+        if (cred->refs && cred->uid == uid && cred->gid == gid)
+        {
+            cred->refs++;
+            return i;
+        }
+        if (!cred->refs && free_idx == buf->ncreds)
+            free_idx = i;
+    }
+
+    if (free_idx == buf->ncreds)
+        return -EUSERS;
+
+    buf->creds[free_idx].uid = uid;
+    buf->creds[free_idx].gid = gid;
+    buf->creds[free_idx].refs = 1;
+    return free_idx;
+}
+
+/*
+ * Slide the epoch up to the oldest queued message so a newer timestamp
+ * fits in 32 bits again. Only needed once messages stay queued for
+ * 2^32 delta units; an empty ring just restarts the epoch. TTLs, owner
+ * queues and keys free slots out of order, so every slot from tail to
+ * head is visited and the holes skipped.
+ */
+static void compact_rebase(kmsgpipe_buffer_t *buf)
+{
+    uint32_t shift = buf->ts_delta[buf->tail];
+    size_t idx = buf->tail;
+    size_t span = (buf->head + buf->capacity - buf->tail) % buf->capacity;
+
+    /* head meets tail on a full ring too */
+    if (span == 0)
+        span = buf->capacity;
+    for (size_t n = 0; n < span; n++)
+    {
+        if (kmsgpipe_occupancy_test(buf, idx))
+            buf->ts_delta[idx] = buf->ts_delta[idx] > shift ? buf->ts_delta[idx] - shift : 0;
+        idx = (idx + 1) % buf->capacity;
+    }
+    buf->epoch += (ktime_t)shift << buf->ts_shift;
+}
+
+static uint32_t compact_ts_delta(kmsgpipe_buffer_t *buf, ktime_t timestamp)
+{
+    uint64_t delta;
+
+    if (buf->count == 0)
+        buf->epoch = timestamp;
+    if (timestamp < buf->epoch)
+        return 0;
+
+    delta = (uint64_t)(timestamp - buf->epoch) >> buf->ts_shift;
+    if (delta > KMSGPIPE_COMPACT_TS_MAX)
+    {
+        compact_rebase(buf);
+        delta = (uint64_t)(timestamp - buf->epoch) >> buf->ts_shift;
+    }
+    return delta > KMSGPIPE_COMPACT_TS_MAX ? KMSGPIPE_COMPACT_TS_MAX : delta;
+}
+
+/*
+ * Per-owner queues. Tables are probed linearly from the id's hash; at least
+ * one entry per table stays free, so every probe ends.
+ */
+static inline size_t owner_hash(const kmsgpipe_owners_t *owners, uint32_t id)
+{
+    return (id * 2654435761u) & (owners->nqueues - 1);
+}
+
+/* The queue of @id, or the free entry where it would be created */
+static kmsg_owner_queue_t *owner_queue(const kmsgpipe_owners_t *owners, int kind, uint32_t id)
+{
+    kmsg_owner_queue_t *table = owners->queues + kind * owners->nqueues;
+    size_t i = owner_hash(owners, id);
+
+    while (table[i].count && table[i].id != id)
+        i = (i + 1) & (owners->nqueues - 1);
+    return &table[i];
+}
+
+/* Free an emptied queue entry, pulling later entries of its probe run back */
+static void owner_queue_free(kmsgpipe_owners_t *owners, int kind, kmsg_owner_queue_t *queue)
+{
+    kmsg_owner_queue_t *table = owners->queues + kind * owners->nqueues;
+    size_t mask = owners->nqueues - 1;
+    size_t i = queue - table;
+    size_t j = i;
+
+    for (;;)
+    {
+        j = (j + 1) & mask;
+        if (!table[j].count)
+            break;
+        /* table[j] may fill the gap unless its home lies after the gap */
+        if (((j - owner_hash(owners, table[j].id)) & mask) >= ((j - i) & mask))
+        {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i].count = 0;
+    owners->used[kind]--;
+}
+
+/* Append slot idx to the queues of its owner uid and gid, or change nothing */
+static int owners_link(kmsgpipe_owners_t *owners, uint32_t idx, uid_t uid, gid_t gid)
+{
+    const uint32_t id[2] = {uid, gid};
+    kmsg_owner_queue_t *queue[2];
+    kmsg_owner_link_t *link = &owners->links[idx];
+
+    for (int kind = 0; kind < 2; kind++)
+    {
+        queue[kind] = owner_queue(owners, kind, id[kind]);
+        if (!queue[kind]->count && owners->used[kind] == owners->nqueues - 1)
+            return -EUSERS;
+    }
+
+    for (int kind = 0; kind < 2; kind++)
+    {
+        kmsg_owner_queue_t *q = queue[kind];
+
+        if (!q->count)
+        {
+            q->id = id[kind];
+            q->first = idx;
+            owners->used[kind]++;
+            link->prev[kind] = KMSGPIPE_OWNER_NIL;
+        }
+        else
+        {
+            owners->links[q->last].next[kind] = idx;
+            link->prev[kind] = q->last;
+        }
+        link->next[kind] = KMSGPIPE_OWNER_NIL;
+        q->last = idx;
+        q->count++;
+    }
+    return 0;
+}
+
+static void owners_unlink(kmsgpipe_owners_t *owners, uint32_t idx, uid_t uid, gid_t gid)
+{
+    const uint32_t id[2] = {uid, gid};
+    kmsg_owner_link_t *link = &owners->links[idx];
+
+    for (int kind = 0; kind < 2; kind++)
+    {
+        kmsg_owner_queue_t *q = owner_queue(owners, kind, id[kind]);
+
+        if (link->prev[kind] != KMSGPIPE_OWNER_NIL)
+            owners->links[link->prev[kind]].next[kind] = link->next[kind];
+        else
+            q->first = link->next[kind];
+        if (link->next[kind] != KMSGPIPE_OWNER_NIL)
+            owners->links[link->next[kind]].prev[kind] = link->prev[kind];
+        else
+            q->last = link->prev[kind];
+        if (--q->count == 0)
+            owner_queue_free(owners, kind, q);
+    }
+}
+
+static void owners_reset(kmsgpipe_owners_t *owners)
+{
+    memset(owners->queues, 0, 2 * owners->nqueues * sizeof(kmsg_owner_queue_t));
+    owners->used[KMSGPIPE_OWNER_UID] = 0;
+    owners->used[KMSGPIPE_OWNER_GID] = 0;
+}
+
+/*
+ * Last-value index. Probed linearly like the owner tables; an entry names
+ * the slot of the newest message with its key, and a slot's message holds
+ * the key only while the entry points back at it.
+ */
+static inline size_t key_hash(const kmsgpipe_keys_t *keys, uint64_t key)
+{
+    uint64_t h = key * 0x9E3779B97F4A7C15ull;
+
+    return (h ^ (h >> 32)) & (keys->nentries - 1);
+}
+
+/* The entry of @key, or the free entry where it would be created */
+static kmsg_key_entry_t *key_entry(const kmsgpipe_keys_t *keys, uint64_t key)
+{
+    size_t i = key_hash(keys, key);
+
+    while (keys->table[i].slot != KMSGPIPE_KEY_NIL && keys->table[i].key != key)
+        i = (i + 1) & (keys->nentries - 1);
+    return &keys->table[i];
+}
+
+/* Free an entry, pulling later entries of its probe run back */
+static void key_entry_free(kmsgpipe_keys_t *keys, kmsg_key_entry_t *entry)
+{
+    size_t mask = keys->nentries - 1;
+    size_t i = entry - keys->table;
+    size_t j = i;
+
+    for (;;)
+    {
+        j = (j + 1) & mask;
+        if (keys->table[j].slot == KMSGPIPE_KEY_NIL)
+            break;
+        if (((j - key_hash(keys, keys->table[j].key)) & mask) >= ((j - i) & mask))
+        {
+            keys->table[i] = keys->table[j];
+            i = j;
+        }
+    }
+    keys->table[i].slot = KMSGPIPE_KEY_NIL;
+}
+
+/* Slot idx is being dropped; forget it if it is its key's newest message */
+static void keys_unlink(kmsgpipe_keys_t *keys, uint32_t idx)
+{
+    kmsg_key_entry_t *entry = key_entry(keys, keys->slot_keys[idx]);
+
+    if (entry->slot == idx)
+        key_entry_free(keys, entry);
+}
+
+static void keys_reset(kmsgpipe_keys_t *keys)
+{
+    memset(keys->table, 0xff, keys->nentries * sizeof(kmsg_key_entry_t));
+}
+
+/* Split rings count from both sides at once (kmsgpipe_init_split()) */
+static void slot_count_add(kmsgpipe_buffer_t *buf, size_t delta)
+{
+    size_t old;
+
+    if (!buf->split)
+    {
+        buf->count += delta;
+        return;
+    }
+    do
+        old = KMSGPIPE_READ_ONCE(buf->count);
+    while (kmsgpipe_cmpxchg(&buf->count, old, old + delta) != old);
+}
+
+/*
+ * Per-slot metadata of a LOCKED slot ring, kept either in records[] (SLOT)
+ * or in the COMPACT arrays. Slot idx must be occupied unless storing.
+ */
+static int slot_store(kmsgpipe_buffer_t *buf, size_t idx, size_t len, uid_t uid, gid_t gid, ktime_t timestamp)
+{
+    if (buf->owners)
+    {
+        int ret = owners_link(buf->owners, idx, uid, gid);
+
+        if (ret)
+            return ret;
+    }
+
+    if (buf->layout == KMSGPIPE_LAYOUT_COMPACT)
+    {
+        int cred = compact_cred_get(buf, uid, gid);
+
+        if (cred < 0)
+        {
+            if (buf->owners)
+                owners_unlink(buf->owners, idx, uid, gid);
+            return cred;
+        }
+        buf->cred_idx[idx] = cred;
+        buf->lens[idx] = len;
+        buf->ts_delta[idx] = compact_ts_delta(buf, timestamp);
+    }
+    else if (buf->layout == KMSGPIPE_LAYOUT_INLINE)
+    {
+        buf->lines[idx].len = len;
+        buf->lines[idx].owner_uid = uid;
+        buf->lines[idx].owner_gid = gid;
+        buf->lines[idx].timestamp = timestamp;
+    }
+    else
+    {
+        buf->records[idx].len = len;
+        buf->records[idx].owner_uid = uid;
+        buf->records[idx].owner_gid = gid;
+        buf->records[idx].timestamp = timestamp;
+        buf->records[idx].valid = true;
+        buf->records[idx].repeats = 0;
+    }
+
+    if (buf->wheel)
+        buf->wheel->timers[idx].deadline = KMSGPIPE_NO_DEADLINE;
+
+    /* Counted before it is published, so a split ring's count never runs short */
+    slot_count_add(buf, 1);
+    kmsgpipe_occupancy_set(buf, idx);
+    return 0;
+}
+
+static size_t slot_len(const kmsgpipe_buffer_t *buf, size_t idx)
+{
+    if (buf->layout == KMSGPIPE_LAYOUT_COMPACT)
+        return buf->lens[idx];
+    if (buf->layout == KMSGPIPE_LAYOUT_INLINE)
+        return buf->lines[idx].len;
+    return buf->records[idx].len;
+}
+
+static ktime_t slot_timestamp(const kmsgpipe_buffer_t *buf, size_t idx)
+{
+    if (buf->layout == KMSGPIPE_LAYOUT_COMPACT)
+        return buf->epoch + ((ktime_t)buf->ts_delta[idx] << buf->ts_shift);
+    if (buf->layout == KMSGPIPE_LAYOUT_INLINE)
+        return buf->lines[idx].timestamp;
+    return buf->records[idx].timestamp;
+}
+
+static void slot_owner(const kmsgpipe_buffer_t *buf, size_t idx, uid_t *uid, gid_t *gid)
+{
+    if (buf->layout == KMSGPIPE_LAYOUT_COMPACT)
+    {
+        const kmsg_cred_t *cred = &buf->creds[buf->cred_idx[idx]];
+
+        *uid = cred->uid;
+        *gid = cred->gid;
+    }
+    else if (buf->layout == KMSGPIPE_LAYOUT_INLINE)
+    {
+        *uid = buf->lines[idx].owner_uid;
+        *gid = buf->lines[idx].owner_gid;
+    }
+    else
+    {
+        *uid = buf->records[idx].owner_uid;
+        *gid = buf->records[idx].owner_gid;
+    }
+}
+
+static bool slot_may_read(const kmsgpipe_buffer_t *buf, size_t idx, uid_t uid, gid_t gid)
+{
+    uid_t owner_uid;
+    gid_t owner_gid;
+
+    slot_owner(buf, idx, &owner_uid, &owner_gid);
+    return kmsgpipe_may_read(uid, gid, owner_uid, owner_gid);
+}
+
+/* Where the payload of a @len byte message in slot idx lives */
+static uint8_t *slot_data(const kmsgpipe_buffer_t *buf, size_t idx, size_t len)
+{
+    if (buf->layout == KMSGPIPE_LAYOUT_INLINE && len <= buf->inline_max)
+        return buf->lines[idx].data;
+    return buf->base + idx * buf->data_size;
+}
+
+static uint32_t slot_repeats(const kmsgpipe_buffer_t *buf, size_t idx)
+{
+    return buf->layout == KMSGPIPE_LAYOUT_SLOT ? buf->records[idx].repeats : 0;
+}
+
+/* Word-at-a-time multiplicative hash; only a filter ahead of memcmp() */
+static uint64_t payload_hash(const uint8_t *data, size_t len)
+{
+    uint64_t hash = len, word;
+
+    for (; len >= sizeof(word); data += sizeof(word), len -= sizeof(word))
+    {
+        memcpy(&word, data, sizeof(word));
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
+    if (len)
+    {
+        word = 0;
+        memcpy(&word, data, len);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+/* SLOT with dedup: count a copy of the newest message against it instead of a slot */
+static bool slot_collapse_repeat(kmsgpipe_buffer_t *buf, const uint8_t *data, size_t len,
+                                 uid_t uid, gid_t gid, uint64_t hash)
+{
+    size_t newest = (buf->head + buf->capacity - 1) % buf->capacity;
+    kmsg_record_t *rec = &buf->records[newest];
+
+    if (hash != buf->last_hash || !kmsgpipe_occupancy_test(buf, newest) ||
+        rec->len != len || rec->owner_uid != uid || rec->owner_gid != gid ||
+        rec->repeats == KMSGPIPE_REPEATS_MAX ||
+        (buf->wheel && buf->wheel->timers[newest].deadline != KMSGPIPE_NO_DEADLINE))
+        return false;
+    if (memcmp(buf->base + newest * buf->data_size, data, len))
+        return false;
+
+    rec->repeats++;
+    return true;
+}
+
+static void wheel_unlink(kmsgpipe_wheel_t *wheel, uint32_t idx);
+
+static void slot_free_chain(kmsgpipe_chains_t *chains, size_t idx)
+{
+    if (!chains->chain[idx])
+        return;
+    chains->free(chains->chain[idx]);
+    chains->chain[idx] = NULL;
+    chains->live--;
+}
+
+/* Forget the message in slot idx; it is a hole until tail passes it */
+static void slot_drop(kmsgpipe_buffer_t *buf, size_t idx)
+{
+    if (buf->keys)
+        keys_unlink(buf->keys, idx);
+
+    if (buf->chains)
+        slot_free_chain(buf->chains, idx);
+
+    if (buf->owners)
+    {
+        uid_t uid;
+        gid_t gid;
+
+        slot_owner(buf, idx, &uid, &gid);
+        owners_unlink(buf->owners, idx, uid, gid);
+    }
+
+    if (buf->layout == KMSGPIPE_LAYOUT_COMPACT)
+        buf->creds[buf->cred_idx[idx]].refs--;
+    else if (buf->layout == KMSGPIPE_LAYOUT_SLOT)
+        buf->records[idx].valid = false;
+
+    if (buf->wheel && buf->wheel->timers[idx].deadline != KMSGPIPE_NO_DEADLINE)
+        wheel_unlink(buf->wheel, idx);
+
+    kmsgpipe_occupancy_clear(buf, idx);
+    slot_count_add(buf, (size_t)-1);
+}
+
+/* Move tail over holes to the oldest live message, or to head once empty */
+static void slot_reclaim_tail(kmsgpipe_buffer_t *buf)
+{
+    /* Split rings leave no holes, and head belongs to the producer */
+    if (buf->split)
+        return;
+    if (buf->count == 0)
+    {
+        buf->tail = buf->head;
+        return;
+    }
+    while (!kmsgpipe_occupancy_test(buf, buf->tail))
+        buf->tail = (buf->tail + 1) % buf->capacity;
+}
+
+/* Drop the message at tail and advance past it */
+static void slot_consume_tail(kmsgpipe_buffer_t *buf)
+{
+    slot_drop(buf, buf->tail);
+    buf->tail = (buf->tail + 1) % buf->capacity;
+    slot_reclaim_tail(buf);
+}
+
+static void wheel_link(kmsgpipe_wheel_t *wheel, uint32_t idx, unsigned int bucket)
+{
+    kmsg_timer_t *timer = &wheel->timers[idx];
+
+    timer->bucket = bucket;
+    timer->prev = KMSGPIPE_TIMER_NIL;
+    timer->next = wheel->bucket[bucket];
+    if (timer->next != KMSGPIPE_TIMER_NIL)
+        wheel->timers[timer->next].prev = idx;
+    wheel->bucket[bucket] = idx;
+    wheel->pending[bucket / KMSGPIPE_WHEEL_SIZE] |= 1ULL << (bucket % KMSGPIPE_WHEEL_SIZE);
+}
+
+static void wheel_unlink(kmsgpipe_wheel_t *wheel, uint32_t idx)
+{
+    kmsg_timer_t *timer = &wheel->timers[idx];
+
+    if (timer->prev != KMSGPIPE_TIMER_NIL)
+        wheel->timers[timer->prev].next = timer->next;
+    else if ((wheel->bucket[timer->bucket] = timer->next) == KMSGPIPE_TIMER_NIL)
+        wheel->pending[timer->bucket / KMSGPIPE_WHEEL_SIZE] &= ~(1ULL << (timer->bucket % KMSGPIPE_WHEEL_SIZE));
+    if (timer->next != KMSGPIPE_TIMER_NIL)
+        wheel->timers[timer->next].prev = timer->prev;
+
+    timer->deadline = KMSGPIPE_NO_DEADLINE;
+    wheel->armed--;
+}
+
+/* Take a whole bucket's list out of the wheel */
+static uint32_t wheel_detach(kmsgpipe_wheel_t *wheel, unsigned int bucket)
+{
+    uint32_t first = wheel->bucket[bucket];
+
+    wheel->bucket[bucket] = KMSGPIPE_TIMER_NIL;
+    wheel->pending[bucket / KMSGPIPE_WHEEL_SIZE] &= ~(1ULL << (bucket % KMSGPIPE_WHEEL_SIZE));
+    return first;
+}
+
+/*
+ * File slot idx's timer by its distance from next_tick: level n holds
+ * timers due within 64^(n+1) ticks, in the bucket of their 64^n-tick
+ * period. Deadlines past the last level wait in its farthest bucket and
+ * are re-filed when it cascades.
+ */
+static void wheel_insert(kmsgpipe_wheel_t *wheel, uint32_t idx)
+{
+    const uint64_t range = 1ULL << (KMSGPIPE_WHEEL_BITS * KMSGPIPE_WHEEL_LEVELS);
+    uint64_t expires = (uint64_t)wheel->timers[idx].deadline >> wheel->tick_shift;
+    unsigned int level = 0;
+
+    if (expires < wheel->next_tick)
+        expires = wheel->next_tick;
+    if (expires - wheel->next_tick >= range)
+        expires = wheel->next_tick + range - 1;
+    while (level < KMSGPIPE_WHEEL_LEVELS - 1 &&
+           expires - wheel->next_tick >= 1ULL << (KMSGPIPE_WHEEL_BITS * (level + 1)))
+        level++;
+
+    wheel_link(wheel, idx, level * KMSGPIPE_WHEEL_SIZE +
+                               ((expires >> (KMSGPIPE_WHEEL_BITS * level)) & (KMSGPIPE_WHEEL_SIZE - 1)));
+}
+
+static void wheel_reset(kmsgpipe_wheel_t *wheel)
+{
+    memset(wheel->bucket, 0xFF, sizeof(wheel->bucket));
+    memset(wheel->pending, 0, sizeof(wheel->pending));
+    wheel->armed = 0;
+}
+
+/*
+ * Process tick next_tick: when level 0 wraps, re-file the buckets of the
+ * levels above that are now due, then drop every message in the level 0
+ * bucket, all of which expire on this tick.
+ */
+static ssize_t wheel_run_tick(kmsgpipe_buffer_t *buf)
+{
+    kmsgpipe_wheel_t *wheel = buf->wheel;
+    uint64_t tick = wheel->next_tick;
+    ssize_t expired = 0;
+    uint32_t idx, next;
+
+    if (!(tick & (KMSGPIPE_WHEEL_SIZE - 1)))
+    {
+        for (unsigned int level = 1; level < KMSGPIPE_WHEEL_LEVELS; level++)
+        {
+            unsigned int index = (tick >> (KMSGPIPE_WHEEL_BITS * level)) & (KMSGPIPE_WHEEL_SIZE - 1);
+
+            for (idx = wheel_detach(wheel, level * KMSGPIPE_WHEEL_SIZE + index); idx != KMSGPIPE_TIMER_NIL; idx = next)
+            {
+                next = wheel->timers[idx].next;
+                wheel_insert(wheel, idx);
+            }
+            if (index)
+                break;
+        }
+    }
+
+    for (idx = wheel_detach(wheel, tick & (KMSGPIPE_WHEEL_SIZE - 1)); idx != KMSGPIPE_TIMER_NIL; idx = next)
+    {
+        next = wheel->timers[idx].next;
+        wheel->timers[idx].deadline = KMSGPIPE_NO_DEADLINE;
+        wheel->armed--;
+        slot_drop(buf, idx);
+        expired++;
+    }
+    return expired;
+}
+
+int kmsgpipe_init(
+    kmsgpipe_buffer_t *buf,
+    uint8_t *base,
+    kmsg_record_t *records,
+    unsigned long *occupancy,
+    size_t capacity,
+    size_t data_size)
+{
+    buf->base = base;
+    buf->records = records;
+    buf->occupancy = occupancy;
+    buf->generation = 0;
+    buf->sequence = NULL;
+    buf->ts_delta = NULL;
+    buf->lens = NULL;
+    buf->cred_idx = NULL;
+    buf->creds = NULL;
+    buf->ncreds = 0;
+    buf->lines = NULL;
+    buf->inline_max = 0;
+    buf->wheel = NULL;
+    buf->owners = NULL;
+    buf->keys = NULL;
+    buf->history = NULL;
+    buf->chains = NULL;
+    buf->dedup = false;
+    buf->last_hash = 0;
+    buf->head = 0;
+    buf->tail = 0;
+    buf->count = 0;
+    buf->capacity = capacity;
+    buf->data_size = data_size;
+    buf->layout = KMSGPIPE_LAYOUT_SLOT;
+    buf->sync = KMSGPIPE_SYNC_LOCKED;
+    buf->mask = 0;
+    buf->size = capacity * data_size;
+    buf->used = 0;
+    buf->mirrored = false;
+    buf->split = false;
+    buf->cached_head = 0;
+    buf->cached_tail = 0;
+
+    /*
+     * Only metadata is initialised; payload pages are left untouched since a
+     * slot is never read before a producer has written it.
+     */
+    memset(occupancy, 0, KMSGPIPE_BITMAP_WORDS(capacity) * sizeof(unsigned long));
+    if (records)
+    {
+        memset(records, 0, capacity * sizeof(kmsg_record_t));
+        for (size_t i = 0; i < capacity; i++)
+            records[i].valid = false;
+    }
+
+    return 0;
+}
+
+int kmsgpipe_init_compact(
+    kmsgpipe_buffer_t *buf,
+    uint8_t *base,
+    void *meta,
+    size_t capacity,
+    size_t data_size,
+    size_t ncreds,
+    unsigned int ts_shift)
+{
+    uint8_t *p = meta;
+
+    if (!base || !meta || capacity == 0 || data_size > 0xFFFF ||
+        ncreds == 0 || ncreds > KMSGPIPE_COMPACT_MAX_CREDS || ts_shift >= 64)
+        return -EINVAL;
+
+    kmsgpipe_init(buf, base, NULL, (unsigned long *)p, capacity, data_size);
+    buf->layout = KMSGPIPE_LAYOUT_COMPACT;
+
+    /* Carve @meta largest alignment first so every array stays aligned */
+    p += KMSGPIPE_BITMAP_WORDS(capacity) * sizeof(unsigned long);
+    buf->creds = (kmsg_cred_t *)p;
+    p += ncreds * sizeof(kmsg_cred_t);
+    buf->ts_delta = (uint32_t *)p;
+    p += capacity * sizeof(uint32_t);
+    buf->lens = (uint16_t *)p;
+    p += capacity * sizeof(uint16_t);
+    buf->cred_idx = (uint16_t *)p;
+
+    buf->ncreds = ncreds;
+    buf->epoch = 0;
+    buf->ts_shift = ts_shift;
+    memset(buf->creds, 0, ncreds * sizeof(kmsg_cred_t));
+
+    return 0;
+}
+
+int kmsgpipe_init_inline(
+    kmsgpipe_buffer_t *buf,
+    uint8_t *base,
+    kmsg_inline_record_t *lines,
+    unsigned long *occupancy,
+    size_t capacity,
+    size_t data_size,
+    size_t inline_max)
+{
+    if (!lines || !occupancy || capacity == 0 || data_size > 0xFFFF ||
+        inline_max > KMSGPIPE_INLINE_MAX || (!base && data_size > inline_max))
+        return -EINVAL;
+
+    kmsgpipe_init(buf, base, NULL, occupancy, capacity, data_size);
+    buf->layout = KMSGPIPE_LAYOUT_INLINE;
+    buf->lines = lines;
+    buf->inline_max = inline_max;
+
+    return 0;
+}
+
+int kmsgpipe_init_packed(
+    kmsgpipe_buffer_t *buf,
+    uint8_t *base,
+    size_t size,
+    size_t max_msg_size)
+{
+    if (!base || size % KMSGPIPE_PACKED_ALIGN ||
+        max_msg_size >= KMSGPIPE_PACKED_PAD ||
+        KMSGPIPE_PACKED_RECORD_SIZE(max_msg_size) > size)
+        return -EINVAL;
+
+    buf->base = base;
+    buf->records = NULL;
+    buf->occupancy = NULL;
+    buf->generation = 0;
+    buf->sequence = NULL;
+    buf->ts_delta = NULL;
+    buf->lens = NULL;
+    buf->cred_idx = NULL;
+    buf->creds = NULL;
+    buf->ncreds = 0;
+    buf->lines = NULL;
+    buf->inline_max = 0;
+    buf->wheel = NULL;
+    buf->owners = NULL;
+    buf->keys = NULL;
+    buf->history = NULL;
+    buf->chains = NULL;
+    buf->dedup = false;
+    buf->last_hash = 0;
+    buf->head = 0;
+    buf->tail = 0;
+    buf->count = 0;
+    buf->capacity = size / KMSGPIPE_PACKED_RECORD_SIZE(0);
+    buf->data_size = max_msg_size;
+    buf->layout = KMSGPIPE_LAYOUT_PACKED;
+    buf->sync = KMSGPIPE_SYNC_LOCKED;
+    buf->mask = 0;
+    buf->size = size;
+    buf->used = 0;
+    buf->mirrored = false;
+    buf->split = false;
+    buf->cached_head = 0;
+    buf->cached_tail = 0;
+
+    return 0;
+}
+
+int kmsgpipe_init_packed_mirrored(
+    kmsgpipe_buffer_t *buf,
+    uint8_t *base,
+    size_t size,
+    size_t max_msg_size)
+{
+    int ret = kmsgpipe_init_packed(buf, base, size, max_msg_size);
+
+    if (ret)
+        return ret;
+
+    buf->mirrored = true;
+
+    return 0;
+}
+
+int kmsgpipe_init_spsc(
+    kmsgpipe_buffer_t *buf,
+    uint8_t *base,
+    kmsg_record_t *records,
+    size_t capacity,
+    size_t data_size)
+{
+    if (!base || !records || capacity == 0 || (capacity & (capacity - 1)))
+        return -EINVAL;
+
+    buf->base = base;
+    buf->records = records;
+    buf->occupancy = NULL;
+    buf->generation = 0;
+    buf->sequence = NULL;
+    buf->ts_delta = NULL;
+    buf->lens = NULL;
+    buf->cred_idx = NULL;
+    buf->creds = NULL;
+    buf->ncreds = 0;
+    buf->lines = NULL;
+    buf->inline_max = 0;
+    buf->wheel = NULL;
+    buf->owners = NULL;
+    buf->keys = NULL;
+    buf->history = NULL;
+    buf->chains = NULL;
+    buf->dedup = false;
+    buf->last_hash = 0;
+    buf->head = 0;
+    buf->tail = 0;
+    buf->cached_head = 0;
+    buf->cached_tail = 0;
+    buf->count = 0;
+    buf->capacity = capacity;
+    buf->data_size = data_size;
+    buf->layout = KMSGPIPE_LAYOUT_SLOT;
+    buf->sync = KMSGPIPE_SYNC_SPSC;
+    buf->mask = capacity - 1;
+    buf->size = capacity * data_size;
+    buf->used = 0;
+    buf->mirrored = false;
+    buf->split = false;
+
+    memset(records, 0, capacity * sizeof(kmsg_record_t));
+
+    return 0;
+}
+
+static void fill_record(kmsg_record_t *rec, size_t len, uid_t uid, gid_t gid, ktime_t timestamp)
+{
+    rec->len = len;
+    rec->owner_uid = uid;
+    rec->owner_gid = gid;
+    rec->timestamp = timestamp;
+    rec->valid = true;
+}
+
+/*
+ * Producer side of the SPSC ring. Only the producer writes head, so it is
+ * read plainly; tail is re-read (acquire) only when the cached copy says
+ * the ring is full. The release store of head in spsc_commit() publishes
+ * payload and record.
+ */
+static int spsc_reserve(kmsgpipe_buffer_t *buf, kmsgpipe_span_t *span)
+{
+    size_t head = buf->head;
+
+    if (head - buf->cached_tail >= buf->capacity)
+    {
+        buf->cached_tail = kmsgpipe_load_acquire(&buf->tail);
+        if (head - buf->cached_tail >= buf->capacity)
+            return -ENOSPC;
+    }
+
+    span->pos = head;
+    span->data = buf->base + (head & buf->mask) * buf->data_size;
+    return 0;
+}
+
+static void spsc_commit(kmsgpipe_buffer_t *buf, const kmsgpipe_span_t *span,
+                        size_t len, uid_t uid, gid_t gid, ktime_t timestamp)
+{
+    fill_record(&buf->records[span->pos & buf->mask], len, uid, gid, timestamp);
+    kmsgpipe_store_release(&buf->head, span->pos + 1);
+}
+
+/* Consumer side: returns the record at tail, or NULL if the ring is empty */
+static kmsg_record_t *spsc_peek_tail(kmsgpipe_buffer_t *buf)
+{
+    size_t tail = buf->tail;
+
+    if (tail == buf->cached_head)
+    {
+        buf->cached_head = kmsgpipe_load_acquire(&buf->head);
+        if (tail == buf->cached_head)
+            return NULL;
+    }
+
+    return &buf->records[tail & buf->mask];
+}
+
+/* Hand the tail slot back to the producer once we are done reading it */
+static void spsc_advance_tail(kmsgpipe_buffer_t *buf, kmsg_record_t *rec)
+{
+    rec->valid = false;
+    kmsgpipe_store_release(&buf->tail, buf->tail + 1);
+}
+
+int kmsgpipe_init_mpmc(
+    kmsgpipe_buffer_t *buf,
+    uint8_t *base,
+    kmsg_record_t *records,
+    size_t *sequence,
+    size_t capacity,
+    size_t data_size)
+{
+    int ret = kmsgpipe_init_spsc(buf, base, records, capacity, data_size);
+
+    if (ret)
+        return ret;
+    if (!sequence)
+        return -EINVAL;
+
+    buf->sync = KMSGPIPE_SYNC_MPMC;
+    buf->sequence = sequence;
+    for (size_t i = 0; i < capacity; i++)
+        sequence[i] = i;
+
+    return 0;
+}
+
+int kmsgpipe_init_wheel(
+    kmsgpipe_buffer_t *buf,
+    kmsgpipe_wheel_t *wheel,
+    kmsg_timer_t *timers,
+    unsigned int tick_shift,
+    ktime_t now)
+{
+    if (!wheel || !timers || buf->sync != KMSGPIPE_SYNC_LOCKED || buf->split ||
+        buf->layout == KMSGPIPE_LAYOUT_PACKED || buf->capacity >= KMSGPIPE_TIMER_NIL ||
+        tick_shift >= 64)
+        return -EINVAL;
+
+    wheel->timers = timers;
+    wheel->tick_shift = tick_shift;
+    wheel->next_tick = (uint64_t)now >> tick_shift;
+    wheel_reset(wheel);
+    buf->wheel = wheel;
+
+    return 0;
+}
+
+int kmsgpipe_init_owners(
+    kmsgpipe_buffer_t *buf,
+    kmsgpipe_owners_t *owners,
+    kmsg_owner_queue_t *queues,
+    kmsg_owner_link_t *links,
+    size_t nqueues)
+{
+    if (!owners || !queues || !links || buf->sync != KMSGPIPE_SYNC_LOCKED || buf->split ||
+        buf->layout == KMSGPIPE_LAYOUT_PACKED || buf->capacity >= KMSGPIPE_OWNER_NIL ||
+        nqueues < 2 || (nqueues & (nqueues - 1)))
+        return -EINVAL;
+
+    owners->queues = queues;
+    owners->nqueues = nqueues;
+    owners->links = links;
+    owners_reset(owners);
+    buf->owners = owners;
+
+    return 0;
+}
+
+int kmsgpipe_init_keys(
+    kmsgpipe_buffer_t *buf,
+    kmsgpipe_keys_t *keys,
+    kmsg_key_entry_t *table,
+    uint64_t *slot_keys,
+    size_t nentries)
+{
+    if (!keys || !table || !slot_keys || buf->sync != KMSGPIPE_SYNC_LOCKED || buf->split ||
+        buf->layout == KMSGPIPE_LAYOUT_PACKED || buf->capacity >= KMSGPIPE_KEY_NIL || buf->dedup ||
+        nentries <= buf->capacity || (nentries & (nentries - 1)))
+        return -EINVAL;
+
+    keys->table = table;
+    keys->nentries = nentries;
+    keys->slot_keys = slot_keys;
+    keys->replaced = 0;
+    keys_reset(keys);
+    buf->keys = keys;
+
+    return 0;
+}
+
+int kmsgpipe_init_history(kmsgpipe_buffer_t *buf, kmsgpipe_history_t *history, uint64_t *seqs)
+{
+    /* COMPACT recycles the credentials of messages read, so history would lose its owners */
+    if (!history || !seqs || buf->sync != KMSGPIPE_SYNC_LOCKED || buf->chains || buf->split ||
+        (buf->layout != KMSGPIPE_LAYOUT_SLOT && buf->layout != KMSGPIPE_LAYOUT_INLINE))
+        return -EINVAL;
+
+    history->seqs = seqs;
+    history->next_seq = 0;
+    history->retained = 0;
+    buf->history = history;
+
+    return 0;
+}
+
+int kmsgpipe_init_chains(
+    kmsgpipe_buffer_t *buf,
+    kmsgpipe_chains_t *chains,
+    void **chain,
+    kmsgpipe_chain_free_t free)
+{
+    if (!chains || !chain || !free || buf->sync != KMSGPIPE_SYNC_LOCKED ||
+        buf->layout == KMSGPIPE_LAYOUT_PACKED || buf->dedup || buf->history || buf->split)
+        return -EINVAL;
+
+    for (size_t i = 0; i < buf->capacity; i++)
+        chain[i] = NULL;
+    chains->chain = chain;
+    chains->free = free;
+    chains->live = 0;
+    buf->chains = chains;
+
+    return 0;
+}
+
+int kmsgpipe_init_dedup(kmsgpipe_buffer_t *buf)
+{
+    /* A collapsed repeat would carry no key of its own */
+    if (buf->layout != KMSGPIPE_LAYOUT_SLOT || buf->sync != KMSGPIPE_SYNC_LOCKED || buf->keys || buf->chains ||
+        buf->split)
+        return -EINVAL;
+
+    buf->dedup = true;
+    buf->last_hash = 0;
+    return 0;
+}
+
+int kmsgpipe_init_split(kmsgpipe_buffer_t *buf)
+{
+    if (buf->sync != KMSGPIPE_SYNC_LOCKED ||
+        (buf->layout != KMSGPIPE_LAYOUT_SLOT && buf->layout != KMSGPIPE_LAYOUT_INLINE) ||
+        buf->wheel || buf->owners || buf->keys || buf->history || buf->chains || buf->dedup)
+        return -EINVAL;
+
+    buf->split = true;
+    return 0;
+}
+
+/*
+ * Producer side of the MPMC ring (Vyukov's bounded queue). A producer owns
+ * ticket pos once it moves head from pos to pos + 1; the release store of
+ * sequence[] in mpmc_commit() then hands the filled slot to the consumer
+ * with that ticket.
+ */
+static int mpmc_reserve(kmsgpipe_buffer_t *buf, kmsgpipe_span_t *span)
+{
+    size_t pos = KMSGPIPE_READ_ONCE(buf->head);
+    size_t idx, prev;
+
+    for (;;)
+    {
+        long diff;
+
+        idx = pos & buf->mask;
+        diff = (long)(kmsgpipe_load_acquire(&buf->sequence[idx]) - pos);
+        if (diff == 0)
+        {
+            prev = kmsgpipe_cmpxchg(&buf->head, pos, pos + 1);
+            if (prev == pos)
+                break;
+            pos = prev;
+        }
+        else if (diff < 0)
+        {
+            /* Slot still holds the message from one lap ago */
+            return -ENOSPC;
+        }
+        else
+        {
+            pos = KMSGPIPE_READ_ONCE(buf->head);
+        }
+    }
+
+    span->pos = pos;
+    span->data = buf->base + idx * buf->data_size;
+    return 0;
+}
+
+static void mpmc_commit(kmsgpipe_buffer_t *buf, const kmsgpipe_span_t *span,
+                        size_t len, uid_t uid, gid_t gid, ktime_t timestamp)
+{
+    size_t idx = span->pos & buf->mask;
+
+    fill_record(&buf->records[idx], len, uid, gid, timestamp);
+    kmsgpipe_store_release(&buf->sequence[idx], span->pos + 1);
+}
+
+/*
+ * The ticket cannot be handed back once head has moved past it, so a
+ * cancelled slot is published as invalid and consumers step over it.
+ */
+static void mpmc_cancel(kmsgpipe_buffer_t *buf, const kmsgpipe_span_t *span)
+{
+    size_t idx = span->pos & buf->mask;
+
+    buf->records[idx].len = 0;
+    buf->records[idx].valid = false;
+    kmsgpipe_store_release(&buf->sequence[idx], span->pos + 1);
+}
+
+/* Give a consumed slot back to the producer that will hold ticket pos + capacity */
+static void mpmc_release_slot(kmsgpipe_buffer_t *buf, size_t pos)
+{
+    size_t idx = pos & buf->mask;
+
+    buf->records[idx].valid = false;
+    kmsgpipe_store_release(&buf->sequence[idx], pos + buf->mask + 1);
+}
+
+/*
+ * Consumer side: claim the oldest published slot. The record is checked
+ * (access rights, or expiry when @expiring) before the CAS so a consumer
+ * that may not take the message leaves it in place. Slots left behind by
+ * mpmc_cancel() are retired on the way past.
+ *
+ * Returns 0 with *out_pos set, -ENODATA when empty, -EACCES when the oldest
+ * message is not ours, -EAGAIN when @expiring and it has not expired.
+ */
+static int mpmc_claim_tail(kmsgpipe_buffer_t *buf,
+                           size_t *out_pos,
+                           uid_t uid,
+                           gid_t gid,
+                           bool expiring,
+                           ktime_t current_ts)
+{
+    size_t pos = KMSGPIPE_READ_ONCE(buf->tail);
+
+    for (;;)
+    {
+        size_t idx = pos & buf->mask;
+        long diff = (long)(kmsgpipe_load_acquire(&buf->sequence[idx]) - (pos + 1));
+
+        if (diff == 0)
+        {
+            kmsg_record_t *rec = &buf->records[idx];
+            size_t prev;
+
+            if (!rec->valid)
+            {
+                prev = kmsgpipe_cmpxchg(&buf->tail, pos, pos + 1);
+                if (prev == pos)
+                {
+                    mpmc_release_slot(buf, pos);
+                    prev = pos + 1;
+                }
+                pos = prev;
+                continue;
+            }
+            if (expiring && rec->timestamp >= current_ts)
+                return -EAGAIN;
+            if (!expiring && !kmsgpipe_may_read(uid, gid, rec->owner_uid, rec->owner_gid))
+                return -EACCES;
+
+            prev = kmsgpipe_cmpxchg(&buf->tail, pos, pos + 1);
+            if (prev == pos)
+            {
+                *out_pos = pos;
+                return 0;
+            }
+            pos = prev;
+        }
+        else if (diff < 0)
+        {
+            return -ENODATA;
+        }
+        else
+        {
+            pos = KMSGPIPE_READ_ONCE(buf->tail);
+        }
+    }
+}
+
+bool kmsgpipe_has_room(const kmsgpipe_buffer_t *buf, size_t len)
+{
+    size_t rec, head, used, contiguous;
+
+    if (buf->layout != KMSGPIPE_LAYOUT_PACKED)
+        return !kmsgpipe_is_full(buf);
+
+    rec = KMSGPIPE_PACKED_RECORD_SIZE(len);
+    head = KMSGPIPE_READ_ONCE(buf->head);
+    used = KMSGPIPE_READ_ONCE(buf->used);
+    contiguous = buf->size - head;
+
+    if (rec <= contiguous || buf->mirrored)
+        return rec <= buf->size - used;
+
+    /* Record must wrap: the bytes up to the end are lost to padding */
+    return contiguous + rec <= buf->size - used;
+}
+
+static inline kmsg_packed_hdr_t *packed_hdr(const kmsgpipe_buffer_t *buf, size_t off)
+{
+    return (kmsg_packed_hdr_t *)(buf->base + off);
+}
+
+/* Move tail past wrap padding so it points at the oldest real record */
+static void packed_skip_padding(kmsgpipe_buffer_t *buf)
+{
+    size_t contiguous = buf->size - buf->tail;
+
+    if (buf->mirrored)
+        return;
+
+    if (contiguous < sizeof(kmsg_packed_hdr_t) ||
+        packed_hdr(buf, buf->tail)->len == KMSGPIPE_PACKED_PAD)
+    {
+        buf->used -= contiguous;
+        buf->tail = 0;
+    }
+}
+
+static void packed_consume(kmsgpipe_buffer_t *buf)
+{
+    size_t rec = KMSGPIPE_PACKED_RECORD_SIZE(packed_hdr(buf, buf->tail)->len);
+
+    buf->used -= rec;
+    buf->tail = (buf->tail + rec) % buf->size;
+    buf->count--;
+
+    /* Restart from offset 0 when empty to keep free space contiguous */
+    if (buf->count == 0)
+    {
+        buf->head = 0;
+        buf->tail = 0;
+        buf->used = 0;
+    }
+}
+
+/*
+ * Nothing is written until commit: the span only remembers whether the
+ * record goes at head or, after wrap padding, at offset 0. A mirrored ring
+ * never pads: a record past the end runs on into the second mapping.
+ */
+static int packed_reserve(kmsgpipe_buffer_t *buf, size_t len, kmsgpipe_span_t *span)
+{
+    if (!kmsgpipe_has_room(buf, len))
+        return -ENOSPC;
+
+    span->pos = !buf->mirrored && KMSGPIPE_PACKED_RECORD_SIZE(len) > buf->size - buf->head ?
+                0 : buf->head;
+    span->data = (uint8_t *)(packed_hdr(buf, span->pos) + 1);
+    return 0;
+}
+
+static void packed_commit(kmsgpipe_buffer_t *buf, const kmsgpipe_span_t *span,
+                          size_t len, size_t raw_len, uid_t uid, gid_t gid, ktime_t timestamp)
+{
+    kmsg_packed_hdr_t *hdr;
 
-    if (requesting_gid == record_gid)
-        return true;
+    if (span->pos != buf->head)
+    {
+        size_t contiguous = buf->size - buf->head;
+
+        /* A short remainder cannot hold a header; readers skip it implicitly */
+        if (contiguous >= sizeof(kmsg_packed_hdr_t))
+            packed_hdr(buf, buf->head)->len = KMSGPIPE_PACKED_PAD;
+        buf->used += contiguous;
+        buf->head = 0;
+    }
+
+    hdr = packed_hdr(buf, buf->head);
+    hdr->timestamp = timestamp;
+    hdr->owner_uid = uid;
+    hdr->owner_gid = gid;
+    hdr->len = len;
+    hdr->raw_len = raw_len;
 
-    return false;
+    buf->used += KMSGPIPE_PACKED_RECORD_SIZE(len);
+    buf->head = (buf->head + KMSGPIPE_PACKED_RECORD_SIZE(len)) % buf->size;
+    buf->count++;
 }
 
-int kmsgpipe_init(
-    kmsgpipe_buffer_t *buf,
-    uint8_t *base,
-    kmsg_record_t *records,
-    size_t capacity,
-    size_t data_size)
+int kmsgpipe_reserve(kmsgpipe_buffer_t *buf, size_t len, kmsgpipe_span_t *span)
 {
-    buf->base = base;
-    buf->records = records;
-    buf->head = 0;
-    buf->tail = 0;
-    buf->capacity = capacity;
-    buf->data_size = data_size;
+    if (len > buf->data_size)
+        return -EMSGSIZE;
 
-    /* Zero-initialize payload and metadata buffers */
-    memset(base, 0, capacity * data_size);
-    memset(records, 0, capacity * sizeof(kmsg_record_t));
-    for (size_t i = 0; i < capacity; i++)
-        records[i].valid = false;
+    span->len = len;
+
+    if (buf->sync == KMSGPIPE_SYNC_SPSC)
+        return spsc_reserve(buf, span);
+
+    if (buf->sync == KMSGPIPE_SYNC_MPMC)
+        return mpmc_reserve(buf, span);
+
+    if (buf->layout == KMSGPIPE_LAYOUT_PACKED)
+        return packed_reserve(buf, len, span);
+
+    if (kmsgpipe_occupancy_test(buf, buf->head))
+        return -ENOSPC;
+
+    /* The writer may scribble on the oldest history slot before committing or cancelling */
+    if (buf->history && buf->history->retained == buf->capacity)
+        buf->history->retained--;
 
+    span->pos = buf->head;
+    span->data = slot_data(buf, buf->head, len);
     return 0;
 }
 
-ssize_t kmsgpipe_push(kmsgpipe_buffer_t *buf,
-                      const uint8_t *data,
-                      size_t len,
-                      uid_t uid,
-                      gid_t gid,
-                      ktime_t timestamp)
+/* Point @key at the message just stored in slot pos, dropping the one it replaces */
+static void keys_replace(kmsgpipe_buffer_t *buf, size_t pos, uint64_t key)
 {
-    if (len > buf->data_size)
-        return -EMSGSIZE;
+    kmsg_key_entry_t *entry = key_entry(buf->keys, key);
+    uint32_t old = entry->slot;
 
-    if (buf->records[buf->head].valid)
-        return -ENOSPC;
+    buf->keys->slot_keys[pos] = key;
+    entry->key = key;
+    entry->slot = pos;
+    if (old == KMSGPIPE_KEY_NIL)
+        return;
+
+    /* The entry has moved on, so slot_drop() leaves it alone */
+    slot_drop(buf, old);
+    buf->keys->replaced++;
+    if (old == buf->tail)
+        slot_reclaim_tail(buf);
+}
+
+/* Commit into a LOCKED slot ring; checks on @span and @deadline are done */
+static ssize_t slot_commit(kmsgpipe_buffer_t *buf,
+                           const kmsgpipe_span_t *span,
+                           size_t len,
+                           uid_t uid,
+                           gid_t gid,
+                           ktime_t timestamp,
+                           ktime_t deadline,
+                           bool keyed,
+                           uint64_t key)
+{
+    uint64_t hash = 0;
+    int ret;
+
+    if (buf->dedup)
+    {
+        hash = payload_hash(span->data, len);
+        if (deadline == KMSGPIPE_NO_DEADLINE &&
+            slot_collapse_repeat(buf, span->data, len, uid, gid, hash))
+            return len;
+    }
 
-    uint8_t *src_addr = buf->base + (buf->head * buf->data_size);
+    /* Reserved for a large message but committed a small one: move it inline */
+    if (span->data != slot_data(buf, span->pos, len))
+        memcpy(slot_data(buf, span->pos, len), span->data, len);
 
-    memcpy(src_addr, data, len);
+    ret = slot_store(buf, span->pos, len, uid, gid, timestamp);
+    if (ret)
+        return ret;
+    buf->head = (span->pos + 1) % buf->capacity;
+    buf->last_hash = hash;
+
+    if (buf->history)
+    {
+        buf->history->seqs[span->pos] = buf->history->next_seq++;
+        if (buf->history->retained < buf->capacity)
+            buf->history->retained++;
+    }
 
-    buf->records[buf->head].len = len;
-    buf->records[buf->head].owner_uid = uid;
-    buf->records[buf->head].owner_gid = gid;
-    buf->records[buf->head].valid = true;
-    buf->records[buf->head].timestamp = timestamp;
+    if (keyed)
+        keys_replace(buf, span->pos, key);
 
-    buf->head = (buf->head + 1) % buf->capacity;
+    if (deadline != KMSGPIPE_NO_DEADLINE)
+    {
+        buf->wheel->timers[span->pos].deadline = deadline;
+        buf->wheel->armed++;
+        wheel_insert(buf->wheel, span->pos);
+    }
 
     return len;
 }
 
-ssize_t kmsgpipe_pop(
-    kmsgpipe_buffer_t *buf,
-    uint8_t *out_buf,
-    uid_t uid,
-    gid_t gid)
+ssize_t kmsgpipe_commit(kmsgpipe_buffer_t *buf,
+                        const kmsgpipe_span_t *span,
+                        size_t len,
+                        uid_t uid,
+                        gid_t gid,
+                        ktime_t timestamp)
+{
+    return kmsgpipe_commit_deadline(buf, span, len, uid, gid, timestamp, KMSGPIPE_NO_DEADLINE);
+}
+
+ssize_t kmsgpipe_commit_deadline(kmsgpipe_buffer_t *buf,
+                                 const kmsgpipe_span_t *span,
+                                 size_t len,
+                                 uid_t uid,
+                                 gid_t gid,
+                                 ktime_t timestamp,
+                                 ktime_t deadline)
+{
+    if (len > span->len)
+    {
+        kmsgpipe_cancel(buf, span);
+        return -EINVAL;
+    }
+    if (deadline != KMSGPIPE_NO_DEADLINE && !buf->wheel)
+    {
+        kmsgpipe_cancel(buf, span);
+        return -EOPNOTSUPP;
+    }
+
+    if (buf->sync == KMSGPIPE_SYNC_SPSC)
+        spsc_commit(buf, span, len, uid, gid, timestamp);
+    else if (buf->sync == KMSGPIPE_SYNC_MPMC)
+        mpmc_commit(buf, span, len, uid, gid, timestamp);
+    else if (buf->layout == KMSGPIPE_LAYOUT_PACKED)
+        packed_commit(buf, span, len, 0, uid, gid, timestamp);
+    else
+        return slot_commit(buf, span, len, uid, gid, timestamp, deadline, false, 0);
+
+    return len;
+}
+
+ssize_t kmsgpipe_commit_keyed(kmsgpipe_buffer_t *buf,
+                              const kmsgpipe_span_t *span,
+                              size_t len,
+                              uint64_t key,
+                              uid_t uid,
+                              gid_t gid,
+                              ktime_t timestamp,
+                              ktime_t deadline)
+{
+    if (!buf->keys || (deadline != KMSGPIPE_NO_DEADLINE && !buf->wheel))
+    {
+        kmsgpipe_cancel(buf, span);
+        return -EOPNOTSUPP;
+    }
+    if (len > span->len)
+    {
+        kmsgpipe_cancel(buf, span);
+        return -EINVAL;
+    }
+
+    return slot_commit(buf, span, len, uid, gid, timestamp, deadline, true, key);
+}
+
+ssize_t kmsgpipe_commit_chain(kmsgpipe_buffer_t *buf,
+                              const kmsgpipe_span_t *span,
+                              void *chain,
+                              uid_t uid,
+                              gid_t gid,
+                              ktime_t timestamp,
+                              ktime_t deadline)
+{
+    ssize_t ret;
+
+    if (!buf->chains || (deadline != KMSGPIPE_NO_DEADLINE && !buf->wheel))
+    {
+        kmsgpipe_cancel(buf, span);
+        return -EOPNOTSUPP;
+    }
+
+    ret = slot_commit(buf, span, 0, uid, gid, timestamp, deadline, false, 0);
+    if (ret < 0)
+        return ret;
+    buf->chains->chain[span->pos] = chain;
+    buf->chains->live++;
+    return 0;
+}
+
+ssize_t kmsgpipe_commit_compressed(kmsgpipe_buffer_t *buf,
+                                   const kmsgpipe_span_t *span,
+                                   size_t len,
+                                   size_t raw_len,
+                                   uid_t uid,
+                                   gid_t gid,
+                                   ktime_t timestamp)
+{
+    if (buf->layout != KMSGPIPE_LAYOUT_PACKED || buf->sync != KMSGPIPE_SYNC_LOCKED)
+    {
+        kmsgpipe_cancel(buf, span);
+        return -EOPNOTSUPP;
+    }
+    if (len > span->len || raw_len > buf->data_size)
+    {
+        kmsgpipe_cancel(buf, span);
+        return len > span->len ? -EINVAL : -EMSGSIZE;
+    }
+
+    packed_commit(buf, span, len, raw_len, uid, gid, timestamp);
+    return len;
+}
+
+void kmsgpipe_cancel(kmsgpipe_buffer_t *buf, const kmsgpipe_span_t *span)
+{
+    /* Other modes only move head in commit, so there is nothing to undo */
+    if (buf->sync == KMSGPIPE_SYNC_MPMC)
+        mpmc_cancel(buf, span);
+}
+
+/* Oldest message of the reader's uid queue and gid queue; root reads at tail */
+static int owners_peek(kmsgpipe_buffer_t *buf, uid_t uid, gid_t gid, kmsgpipe_span_t *span)
 {
-    if (!buf->records[buf->tail].valid)
+    const kmsg_owner_queue_t *by_uid, *by_gid;
+    size_t idx;
+
+    if (buf->count == 0)
         return -ENODATA;
 
-    if (!is_valid_access(
-            uid,
-            gid,
-            buf->records[buf->tail].owner_uid,
-            buf->records[buf->tail].owner_gid))
+    if (uid == 0)
+        idx = buf->tail;
+    else
+    {
+        by_uid = owner_queue(buf->owners, KMSGPIPE_OWNER_UID, uid);
+        by_gid = owner_queue(buf->owners, KMSGPIPE_OWNER_GID, gid);
+        if (!by_uid->count && !by_gid->count)
+            return -ENODATA;
+        if (!by_gid->count)
+            idx = by_uid->first;
+        else if (!by_uid->count)
+            idx = by_gid->first;
+        else
+            /* Every message sits between tail and head, oldest nearest tail */
+            idx = (by_uid->first + buf->capacity - buf->tail) % buf->capacity <
+                          (by_gid->first + buf->capacity - buf->tail) % buf->capacity
+                      ? by_uid->first
+                      : by_gid->first;
+    }
+
+    span->pos = idx;
+    span->len = slot_len(buf, idx);
+    span->data = slot_data(buf, idx, span->len);
+    span->repeats = slot_repeats(buf, idx);
+    span->seq = buf->history ? buf->history->seqs[idx] : 0;
+    span->chain = buf->chains ? buf->chains->chain[idx] : NULL;
+    return 0;
+}
+
+int kmsgpipe_peek(kmsgpipe_buffer_t *buf, uid_t uid, gid_t gid, kmsgpipe_span_t *span)
+{
+    kmsg_record_t *rec;
+
+    span->raw_len = 0;
+    span->repeats = 0;
+    span->seq = 0;
+    span->chain = NULL;
+
+    if (buf->sync == KMSGPIPE_SYNC_MPMC)
+    {
+        int ret = mpmc_claim_tail(buf, &span->pos, uid, gid, false, 0);
+
+        if (ret)
+            return ret;
+        span->data = buf->base + (span->pos & buf->mask) * buf->data_size;
+        span->len = buf->records[span->pos & buf->mask].len;
+        return 0;
+    }
+
+    if (buf->layout == KMSGPIPE_LAYOUT_PACKED)
+    {
+        kmsg_packed_hdr_t *hdr;
+
+        if (buf->count == 0)
+            return -ENODATA;
+
+        packed_skip_padding(buf);
+        hdr = packed_hdr(buf, buf->tail);
+        if (!kmsgpipe_may_read(uid, gid, hdr->owner_uid, hdr->owner_gid))
+            return -EACCES;
+
+        span->pos = buf->tail;
+        span->data = (uint8_t *)(hdr + 1);
+        span->len = hdr->len;
+        span->raw_len = hdr->raw_len;
+        return 0;
+    }
+
+    if (buf->sync == KMSGPIPE_SYNC_SPSC)
+    {
+        rec = spsc_peek_tail(buf);
+        if (!rec)
+            return -ENODATA;
+        if (!kmsgpipe_may_read(uid, gid, rec->owner_uid, rec->owner_gid))
+            return -EACCES;
+
+        span->pos = buf->tail;
+        span->data = buf->base + (buf->tail & buf->mask) * buf->data_size;
+        span->len = rec->len;
+        return 0;
+    }
+
+    if (buf->owners)
+        return owners_peek(buf, uid, gid, span);
+
+    if (!kmsgpipe_occupancy_test(buf, buf->tail))
+        return -ENODATA;
+    if (!slot_may_read(buf, buf->tail, uid, gid))
         return -EACCES;
 
-    uint8_t *src_addr = buf->base + (buf->tail * buf->data_size);
-    memcpy(out_buf, src_addr, buf->records[buf->tail].len);
-    buf->records[buf->tail].valid = false;
-    ssize_t ret_val = buf->records[buf->tail].len;
-    buf->tail = (buf->tail + 1) % buf->capacity;
+    span->pos = buf->tail;
+    span->len = slot_len(buf, buf->tail);
+    span->data = slot_data(buf, buf->tail, span->len);
+    span->repeats = slot_repeats(buf, buf->tail);
+    span->seq = buf->history ? buf->history->seqs[buf->tail] : 0;
+    span->chain = buf->chains ? buf->chains->chain[buf->tail] : NULL;
+    return 0;
+}
 
-    return ret_val;
+/* Slot of the i-th oldest retained message */
+static inline size_t history_slot(const kmsgpipe_buffer_t *buf, size_t i)
+{
+    return (buf->head + buf->capacity - buf->history->retained + i) % buf->capacity;
 }
 
-ssize_t kmsgpipe_get_message_count(kmsgpipe_buffer_t *buf)
+int kmsgpipe_history_peek(kmsgpipe_buffer_t *buf, uint64_t seq, uid_t uid, gid_t gid, kmsgpipe_span_t *span)
 {
-    ssize_t count = 0;
+    const kmsgpipe_history_t *history = buf->history;
+    size_t lo = 0, hi;
 
-    /* Count all valid messages in the buffer */
-    for (size_t i = 0; i < buf->capacity; i++)
+    if (!history)
+        return -EOPNOTSUPP;
+
+    /* Retained slots run oldest to newest in sequence order */
+    hi = history->retained;
+    while (lo < hi)
     {
-        if (buf->records[i].valid)
-            count++;
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (history->seqs[history_slot(buf, mid)] < seq)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
 
-    return count;
+    for (; lo < history->retained; lo++)
+    {
+        size_t idx = history_slot(buf, lo);
+
+        if (!slot_may_read(buf, idx, uid, gid))
+            continue;
+        span->pos = idx;
+        span->len = slot_len(buf, idx);
+        span->data = slot_data(buf, idx, span->len);
+        span->raw_len = 0;
+        span->repeats = slot_repeats(buf, idx);
+        span->seq = history->seqs[idx];
+        span->chain = NULL;
+        return 0;
+    }
+    return -ENODATA;
+}
+
+int kmsgpipe_history_seek_time(kmsgpipe_buffer_t *buf, ktime_t timestamp, uint64_t *seq)
+{
+    size_t lo = 0, hi;
+
+    if (!buf->history)
+        return -EOPNOTSUPP;
+
+    hi = buf->history->retained;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (slot_timestamp(buf, history_slot(buf, mid)) < timestamp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *seq = lo < buf->history->retained ? buf->history->seqs[history_slot(buf, lo)] : buf->history->next_seq;
+    return 0;
+}
+
+void kmsgpipe_peek_release(kmsgpipe_buffer_t *buf, const kmsgpipe_span_t *span, bool consume)
+{
+    /* The MPMC slot was claimed by kmsgpipe_peek() and cannot be put back */
+    if (buf->sync == KMSGPIPE_SYNC_MPMC)
+    {
+        mpmc_release_slot(buf, span->pos);
+        return;
+    }
+
+    if (!consume)
+        return;
+
+    if (buf->layout == KMSGPIPE_LAYOUT_PACKED)
+    {
+        packed_consume(buf);
+        return;
+    }
+
+    if (buf->sync == KMSGPIPE_SYNC_SPSC)
+    {
+        spsc_advance_tail(buf, &buf->records[span->pos & buf->mask]);
+        return;
+    }
+
+    /* Owner reads may take a message ahead of tail, leaving a hole */
+    if (span->pos == buf->tail)
+        slot_consume_tail(buf);
+    else
+        slot_drop(buf, span->pos);
+}
+
+ssize_t kmsgpipe_push(kmsgpipe_buffer_t *buf,
+                      const uint8_t *data,
+                      size_t len,
+                      uid_t uid,
+                      gid_t gid,
+                      ktime_t timestamp)
+{
+    kmsgpipe_span_t span;
+    int ret = kmsgpipe_reserve(buf, len, &span);
+
+    if (ret)
+        return ret;
+
+    memcpy(span.data, data, len);
+    return kmsgpipe_commit(buf, &span, len, uid, gid, timestamp);
+}
+
+ssize_t kmsgpipe_pop(
+    kmsgpipe_buffer_t *buf,
+    uint8_t *out_buf,
+    uid_t uid,
+    gid_t gid)
+{
+    kmsgpipe_span_t span;
+    int ret = kmsgpipe_peek(buf, uid, gid, &span);
+
+    if (ret)
+        return ret;
+
+    memcpy(out_buf, span.data, span.len);
+    kmsgpipe_peek_release(buf, &span, true);
+    return span.len;
+}
+
+ssize_t kmsgpipe_get_message_count(kmsgpipe_buffer_t *buf)
+{
+    return kmsgpipe_count_hint(buf);
 }
 
 ssize_t kmsgpipe_cleanup_expired(kmsgpipe_buffer_t *buf, ktime_t current_ts)
 {
     int expired_count = 0;
-    while (buf->records[buf->tail].valid && buf->records[buf->tail].timestamp < current_ts)
+
+    if (buf->sync == KMSGPIPE_SYNC_SPSC)
     {
-        buf->records[buf->tail].valid = false;
-        buf->tail = (buf->tail + 1) % buf->capacity;
+        kmsg_record_t *rec;
+
+        /* Runs on the consumer side, like kmsgpipe_pop() */
+        while ((rec = spsc_peek_tail(buf)) && rec->timestamp < current_ts)
+        {
+            spsc_advance_tail(buf, rec);
+            expired_count++;
+        }
+        return expired_count;
+    }
+
+    if (buf->sync == KMSGPIPE_SYNC_MPMC)
+    {
+        size_t pos;
+
+        /* Competes with readers like any other consumer */
+        while (mpmc_claim_tail(buf, &pos, 0, 0, true, current_ts) == 0)
+        {
+            mpmc_release_slot(buf, pos);
+            expired_count++;
+        }
+        return expired_count;
+    }
+
+    if (buf->layout == KMSGPIPE_LAYOUT_PACKED)
+    {
+        while (buf->count > 0)
+        {
+            packed_skip_padding(buf);
+            if (packed_hdr(buf, buf->tail)->timestamp >= current_ts)
+                break;
+            packed_consume(buf);
+            expired_count++;
+        }
+        return expired_count;
+    }
+
+    while (kmsgpipe_occupancy_test(buf, buf->tail) && slot_timestamp(buf, buf->tail) < current_ts)
+    {
+        slot_consume_tail(buf);
         expired_count++;
     }
     return expired_count;
 }
 
+ssize_t kmsgpipe_expire_deadlines(kmsgpipe_buffer_t *buf, ktime_t now)
+{
+    kmsgpipe_wheel_t *wheel = buf->wheel;
+    uint64_t target;
+    ssize_t expired = 0;
+
+    if (!wheel)
+        return -EOPNOTSUPP;
+
+    target = (uint64_t)now >> wheel->tick_shift;
+    while (wheel->next_tick <= target)
+    {
+        uint64_t tick = wheel->next_tick;
+        /* Next tick with work: a level 0 bucket to fire or a cascade */
+        uint64_t event = (tick + KMSGPIPE_WHEEL_SIZE - 1) & ~(uint64_t)(KMSGPIPE_WHEEL_SIZE - 1);
+        uint64_t pending = wheel->pending[0] >> (tick & (KMSGPIPE_WHEEL_SIZE - 1));
+
+        if (pending && tick + __builtin_ctzll(pending) < event)
+            event = tick + __builtin_ctzll(pending);
+        if (!wheel->armed || event > target)
+        {
+            wheel->next_tick = target + 1;
+            break;
+        }
+
+        wheel->next_tick = event;
+        expired += wheel_run_tick(buf);
+        wheel->next_tick = event + 1;
+    }
+
+    if (expired)
+        slot_reclaim_tail(buf);
+    return expired;
+}
+
+/* Copy one message into @dst, keeping its deadline and key if @dst can track them */
+static ssize_t migrate_one(kmsgpipe_buffer_t *dst, const uint8_t *data, size_t len,
+                           uid_t uid, gid_t gid, ktime_t timestamp, ktime_t deadline, uint32_t repeats,
+                           const uint64_t *key, void *chain)
+{
+    kmsgpipe_span_t span;
+    ssize_t ret = kmsgpipe_reserve(dst, len, &span);
+    uint32_t *newest_repeats;
+
+    if (ret)
+        return ret;
+
+    memcpy(span.data, data, len);
+    if (!dst->wheel)
+        deadline = KMSGPIPE_NO_DEADLINE;
+    if (chain)
+        return kmsgpipe_commit_chain(dst, &span, chain, uid, gid, timestamp, deadline);
+    if (key && dst->keys)
+        ret = kmsgpipe_commit_keyed(dst, &span, len, *key, uid, gid, timestamp, deadline);
+    else
+        ret = kmsgpipe_commit_deadline(dst, &span, len, uid, gid, timestamp, deadline);
+    if (ret < 0 || !repeats || dst->layout != KMSGPIPE_LAYOUT_SLOT || dst->sync != KMSGPIPE_SYNC_LOCKED)
+        return ret;
+
+    /* Whether it took a slot or collapsed into the newest one, it is now the newest */
+    newest_repeats = &dst->records[(dst->head + dst->capacity - 1) % dst->capacity].repeats;
+    *newest_repeats = repeats > KMSGPIPE_REPEATS_MAX - *newest_repeats ? KMSGPIPE_REPEATS_MAX
+                                                                       : *newest_repeats + repeats;
+    return ret;
+}
+
+ssize_t kmsgpipe_migrate(kmsgpipe_buffer_t *dst, const kmsgpipe_buffer_t *src)
+{
+    size_t count = kmsgpipe_count_hint(src);
+    ssize_t ret;
+
+    if (src->sync != KMSGPIPE_SYNC_LOCKED)
+    {
+        /* Free-running tickets; MPMC may hold cancelled slots in between */
+        for (size_t pos = src->tail; pos != src->head; pos++)
+        {
+            const kmsg_record_t *rec = &src->records[pos & src->mask];
+
+            if (!rec->valid)
+            {
+                count--;
+                continue;
+            }
+            ret = kmsgpipe_push(dst, src->base + (pos & src->mask) * src->data_size, rec->len,
+                                rec->owner_uid, rec->owner_gid, rec->timestamp);
+            if (ret < 0)
+                return ret;
+        }
+        return count;
+    }
+
+    if (src->layout == KMSGPIPE_LAYOUT_PACKED)
+    {
+        size_t off = src->tail;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const kmsg_packed_hdr_t *hdr;
+
+            if (!src->mirrored &&
+                (src->size - off < sizeof(kmsg_packed_hdr_t) ||
+                 packed_hdr(src, off)->len == KMSGPIPE_PACKED_PAD))
+                off = 0;
+            hdr = packed_hdr(src, off);
+            if (hdr->raw_len)
+            {
+                kmsgpipe_span_t span;
+
+                ret = kmsgpipe_reserve(dst, hdr->len, &span);
+                if (ret)
+                    return ret;
+                memcpy(span.data, hdr + 1, hdr->len);
+                ret = kmsgpipe_commit_compressed(dst, &span, hdr->len, hdr->raw_len,
+                                                 hdr->owner_uid, hdr->owner_gid, hdr->timestamp);
+            }
+            else
+                ret = kmsgpipe_push(dst, (const uint8_t *)(hdr + 1), hdr->len,
+                                    hdr->owner_uid, hdr->owner_gid, hdr->timestamp);
+            if (ret < 0)
+                return ret;
+            off = (off + KMSGPIPE_PACKED_RECORD_SIZE(hdr->len)) % src->size;
+        }
+        return count;
+    }
+
+    for (size_t i = 0, idx = src->tail; i < count; idx = (idx + 1) % src->capacity)
+    {
+        size_t len = slot_len(src, idx);
+        const uint64_t *key = NULL;
+        uid_t uid;
+        gid_t gid;
+
+        /* Expired holes between tail and head */
+        if (!kmsgpipe_occupancy_test(src, idx))
+            continue;
+
+        if (src->keys && key_entry(src->keys, src->keys->slot_keys[idx])->slot == idx)
+            key = &src->keys->slot_keys[idx];
+        /* Committed next, so it keeps its number */
+        if (src->history && dst->history)
+            dst->history->next_seq = src->history->seqs[idx];
+        slot_owner(src, idx, &uid, &gid);
+        ret = migrate_one(dst, slot_data(src, idx, len), len, uid, gid, slot_timestamp(src, idx),
+                          src->wheel ? src->wheel->timers[idx].deadline : KMSGPIPE_NO_DEADLINE,
+                          slot_repeats(src, idx), key, src->chains ? src->chains->chain[idx] : NULL);
+        if (ret < 0)
+            return ret;
+        i++;
+    }
+    if (src->history && dst->history)
+        dst->history->next_seq = src->history->next_seq;
+    return count;
+}
+
 ssize_t kmsgpipe_clear(kmsgpipe_buffer_t *buf)
 {
     ssize_t count = kmsgpipe_get_message_count(buf);
-    /* Clear the data buffer: capacity * data_size (not data_size * data_size) */
-    memset(buf->base, 0, buf->capacity * buf->data_size);
-    memset(buf->records, 0, buf->capacity * sizeof(kmsg_record_t));
+
+    if (buf->sync == KMSGPIPE_SYNC_MPMC)
+    {
+        /* Retire every queued ticket as if a consumer had taken it */
+        for (size_t pos = buf->tail; pos != buf->head; pos++)
+            buf->sequence[pos & buf->mask] = pos + buf->capacity;
+        buf->tail = buf->head;
+        return count;
+    }
+
+    if (buf->sync == KMSGPIPE_SYNC_SPSC)
+    {
+        buf->head = 0;
+        buf->tail = 0;
+        buf->cached_head = 0;
+        buf->cached_tail = 0;
+        return count;
+    }
+
+    if (buf->layout == KMSGPIPE_LAYOUT_PACKED)
+    {
+        buf->head = 0;
+        buf->tail = 0;
+        buf->used = 0;
+        buf->count = 0;
+        return count;
+    }
+
+    /* Every occupancy word still carries the old tag, so every slot is now empty; split rings are wiped instead */
+    if (buf->split || ++buf->generation == 0)
+        memset(buf->occupancy, 0, KMSGPIPE_BITMAP_WORDS(buf->capacity) * sizeof(unsigned long));
+    if (buf->creds)
+        memset(buf->creds, 0, buf->ncreds * sizeof(kmsg_cred_t));
+    if (buf->wheel)
+        wheel_reset(buf->wheel);
+    if (buf->owners)
+        owners_reset(buf->owners);
+    if (buf->keys)
+        keys_reset(buf->keys);
+    if (buf->history)
+        buf->history->retained = 0;
+    for (size_t idx = 0; buf->chains && buf->chains->live; idx++)
+        slot_free_chain(buf->chains, idx);
     buf->head = 0;
     buf->tail = 0;
-
-    for (size_t i = 0; i < buf->capacity; i++)
-        buf->records[i].valid = false;
+    buf->count = 0;
 
     return count;
 }
+
+int kmsgpipe_lanes_init(kmsgpipe_lanes_t *lanes, size_t nr_lanes, unsigned int age_limit)
+{
+    if (!lanes || nr_lanes == 0 || nr_lanes > KMSGPIPE_MAX_LANES)
+        return -EINVAL;
+
+    memset(lanes, 0, sizeof(*lanes));
+    lanes->nr_lanes = nr_lanes;
+    lanes->age_limit = age_limit;
+    return 0;
+}
+
+int kmsgpipe_lanes_pick(const kmsgpipe_lanes_t *lanes, const kmsgpipe_buffer_t *bufs)
+{
+    int pick = -ENODATA;
+
+    for (size_t lane = 0; lane < lanes->nr_lanes; lane++)
+    {
+        if (kmsgpipe_is_empty(&bufs[lane]))
+            continue;
+        if (pick < 0)
+        {
+            pick = lane;
+            if (!lanes->age_limit)
+                break;
+        }
+        if (lanes->age_limit && KMSGPIPE_READ_ONCE(lanes->passed[lane]) >= lanes->age_limit)
+            return lane;
+    }
+    return pick;
+}
+
+void kmsgpipe_lanes_served(kmsgpipe_lanes_t *lanes, const kmsgpipe_buffer_t *bufs, size_t lane)
+{
+    if (!lanes->age_limit)
+        return;
+
+    lanes->passed[lane] = 0;
+    for (size_t lower = lane + 1; lower < lanes->nr_lanes; lower++)
+    {
+        if (!kmsgpipe_is_empty(&bufs[lower]))
+            lanes->passed[lower]++;
+    }
+}
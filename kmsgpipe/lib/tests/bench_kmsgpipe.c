@@ -0,0 +1,1374 @@
+#define _GNU_SOURCE
+#include "kmsgpipe.h"
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_RING_BYTES (1024 * 1024)
+#define BENCH_DATA_SIZE 1024
+#define BENCH_ITERATIONS 2000000
+#define BENCH_THREAD_MESSAGES 2000000
+#define BENCH_THREAD_CAPACITY 1024
+#define BENCH_THREAD_DATA_SIZE 64
+#define BENCH_META_SLOTS (1024 * 1024)
+#define BENCH_META_DATA_SIZE 16
+#define BENCH_META_OWNERS 8
+#define BENCH_INLINE_SLOTS (64 * 1024)
+#define BENCH_INLINE_DATA_SIZE 256
+#define BENCH_CLEAR_MAX_BYTES (256ul * 1024 * 1024)
+#define BENCH_KEYED_SLOTS 4096
+#define BENCH_KEYED_DATA_SIZE 64
+#define BENCH_KEYED_READ_EVERY 4
+#define BENCH_MIRROR_BYTES (64 * 1024)
+#define BENCH_FAULT_SLOTS 64
+#define BENCH_FAULT_DATA_SIZE (16 * 1024)
+#define BENCH_FAULT_MESSAGES 100000
+#define BENCH_FAULT_SAMPLES (8 * BENCH_FAULT_MESSAGES)
+#define BENCH_MIXED_CAPACITY 256
+#define BENCH_MIXED_DATA_SIZE 256
+#define BENCH_MIXED_MESSAGES 1000000
+#define BENCH_BATCH_CAPACITY 1024
+#define BENCH_BATCH_DATA_SIZE 64
+#define BENCH_BATCH_MESSAGES 2000000
+
+typedef struct bench
+{
+    const char *name;
+    void (*run)(void);
+} bench_t;
+
+/* Backing memory for one ring, in whichever layout is being measured */
+typedef struct bench_ring
+{
+    kmsgpipe_buffer_t buf;
+    uint8_t *base;
+    kmsg_record_t *records;
+    unsigned long *occupancy;
+} bench_ring_t;
+
+static uint8_t payload[BENCH_DATA_SIZE];
+static uint8_t out_buf[BENCH_DATA_SIZE];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *xcalloc(size_t n, size_t size)
+{
+    void *p = calloc(n, size);
+    if (!p)
+    {
+        fprintf(stderr, "bench: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void slot_ring_init(bench_ring_t *ring, size_t ring_bytes, size_t data_size)
+{
+    size_t capacity = ring_bytes / data_size;
+
+    ring->base = xcalloc(capacity, data_size);
+    ring->records = xcalloc(capacity, sizeof(kmsg_record_t));
+    ring->occupancy = xcalloc(KMSGPIPE_BITMAP_WORDS(capacity), sizeof(unsigned long));
+    kmsgpipe_init(&ring->buf, ring->base, ring->records, ring->occupancy, capacity, data_size);
+}
+
+static void packed_ring_init(bench_ring_t *ring, size_t ring_bytes, size_t data_size)
+{
+    ring->base = xcalloc(1, ring_bytes);
+    ring->records = NULL;
+    ring->occupancy = NULL;
+    kmsgpipe_init_packed(&ring->buf, ring->base, ring_bytes, data_size);
+}
+
+static void ring_free(bench_ring_t *ring)
+{
+    free(ring->base);
+    free(ring->records);
+    free(ring->occupancy);
+}
+
+/* Cheap deterministic message-length generator */
+static size_t next_len(uint32_t *state, size_t min_len, size_t max_len)
+{
+    *state = *state * 1103515245u + 12345u;
+    return min_len + (*state >> 8) % (max_len - min_len + 1);
+}
+
+static size_t fill_until_full(kmsgpipe_buffer_t *buf, size_t min_len, size_t max_len)
+{
+    uint32_t state = 1;
+    size_t n = 0;
+
+    while (kmsgpipe_push(buf, payload, next_len(&state, min_len, max_len), 1000, 1000, n) >= 0)
+        n++;
+    return n;
+}
+
+static double push_pop_ns(kmsgpipe_buffer_t *buf, size_t min_len, size_t max_len)
+{
+    uint32_t state = 1;
+    uint64_t start;
+
+    kmsgpipe_clear(buf);
+    /* Keep the ring half-full so indices wrap during the run */
+    for (size_t i = 0; i < 64; i++)
+        kmsgpipe_push(buf, payload, next_len(&state, min_len, max_len), 1000, 1000, i);
+
+    start = now_ns();
+    for (size_t i = 0; i < BENCH_ITERATIONS; i++)
+    {
+        kmsgpipe_push(buf, payload, next_len(&state, min_len, max_len), 1000, 1000, i);
+        kmsgpipe_pop(buf, out_buf, 1000, 1000);
+    }
+    return (double)(now_ns() - start) / BENCH_ITERATIONS;
+}
+
+static void bench_layout(void)
+{
+    static const struct
+    {
+        const char *label;
+        size_t min_len, max_len;
+    } mixes[] = {
+        {"40B log lines", 40, 40},
+        {"16-128B", 16, 128},
+        {"16-1024B", 16, 1024},
+    };
+
+    printf("== layout: slot vs packed, %d KiB ring, data_size %d ==\n", BENCH_RING_BYTES / 1024, BENCH_DATA_SIZE);
+    printf("%-14s %12s %12s %8s %14s %14s\n", "mix", "slot msgs", "packed msgs", "ratio", "slot ns/op", "packed ns/op");
+
+    for (size_t i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++)
+    {
+        bench_ring_t slot, packed;
+        size_t slot_n, packed_n;
+        double slot_ns, packed_ns;
+
+        slot_ring_init(&slot, BENCH_RING_BYTES, BENCH_DATA_SIZE);
+        packed_ring_init(&packed, BENCH_RING_BYTES, BENCH_DATA_SIZE);
+
+        slot_n = fill_until_full(&slot.buf, mixes[i].min_len, mixes[i].max_len);
+        packed_n = fill_until_full(&packed.buf, mixes[i].min_len, mixes[i].max_len);
+        slot_ns = push_pop_ns(&slot.buf, mixes[i].min_len, mixes[i].max_len);
+        packed_ns = push_pop_ns(&packed.buf, mixes[i].min_len, mixes[i].max_len);
+
+        printf("%-14s %12zu %12zu %7.1fx %14.1f %14.1f\n", mixes[i].label, slot_n, packed_n,
+               (double)packed_n / slot_n, slot_ns, packed_ns);
+
+        ring_free(&slot);
+        ring_free(&packed);
+    }
+}
+
+#define BENCH_MAX_THREADS 64
+
+/*
+ * Producer/consumer threads sharing one ring. With a lock every push/pop
+ * takes ring->lock, otherwise the ring must be SPSC (one thread per side)
+ * or MPMC and no lock is taken. Each thread moves messages / threads.
+ */
+typedef struct thread_ring
+{
+    bench_ring_t ring;
+    pthread_mutex_t lock;
+    bool use_lock;
+    size_t messages;
+    int threads;
+} thread_ring_t;
+
+static void *thread_ring_producer(void *arg)
+{
+    thread_ring_t *tr = arg;
+    uint8_t msg[BENCH_THREAD_DATA_SIZE] = {0};
+
+    for (size_t i = 0; i < tr->messages / tr->threads;)
+    {
+        ssize_t ret;
+
+        if (tr->use_lock)
+            pthread_mutex_lock(&tr->lock);
+        ret = kmsgpipe_push(&tr->ring.buf, msg, sizeof(msg), 1000, 1000, i);
+        if (tr->use_lock)
+            pthread_mutex_unlock(&tr->lock);
+
+        if (ret > 0)
+            i++;
+        else
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void *thread_ring_consumer(void *arg)
+{
+    thread_ring_t *tr = arg;
+    uint8_t msg[BENCH_THREAD_DATA_SIZE];
+
+    for (size_t i = 0; i < tr->messages / tr->threads;)
+    {
+        ssize_t ret;
+
+        if (tr->use_lock)
+            pthread_mutex_lock(&tr->lock);
+        ret = kmsgpipe_pop(&tr->ring.buf, msg, 1000, 1000);
+        if (tr->use_lock)
+            pthread_mutex_unlock(&tr->lock);
+
+        if (ret > 0)
+            i++;
+        else
+            sched_yield();
+    }
+    return NULL;
+}
+
+/* Runs tr->threads producers and consumers to completion, returns messages/s */
+static double thread_ring_run(thread_ring_t *tr)
+{
+    pthread_t producers[BENCH_MAX_THREADS], consumers[BENCH_MAX_THREADS];
+    uint64_t start = now_ns();
+
+    for (int i = 0; i < tr->threads; i++)
+    {
+        pthread_create(&consumers[i], NULL, thread_ring_consumer, tr);
+        pthread_create(&producers[i], NULL, thread_ring_producer, tr);
+    }
+    for (int i = 0; i < tr->threads; i++)
+    {
+        pthread_join(producers[i], NULL);
+        pthread_join(consumers[i], NULL);
+    }
+
+    return (tr->messages / tr->threads) * tr->threads * 1e9 / (double)(now_ns() - start);
+}
+
+static void bench_spsc(void)
+{
+    thread_ring_t locked = {.use_lock = true, .messages = BENCH_THREAD_MESSAGES, .threads = 1};
+    thread_ring_t spsc = {.use_lock = false, .messages = BENCH_THREAD_MESSAGES, .threads = 1};
+    double locked_rate, spsc_rate;
+
+    slot_ring_init(&locked.ring, BENCH_THREAD_CAPACITY * BENCH_THREAD_DATA_SIZE, BENCH_THREAD_DATA_SIZE);
+    pthread_mutex_init(&locked.lock, NULL);
+
+    spsc.ring.base = xcalloc(BENCH_THREAD_CAPACITY, BENCH_THREAD_DATA_SIZE);
+    spsc.ring.records = xcalloc(BENCH_THREAD_CAPACITY, sizeof(kmsg_record_t));
+    spsc.ring.occupancy = NULL;
+    kmsgpipe_init_spsc(&spsc.ring.buf, spsc.ring.base, spsc.ring.records, BENCH_THREAD_CAPACITY, BENCH_THREAD_DATA_SIZE);
+
+    locked_rate = thread_ring_run(&locked);
+    spsc_rate = thread_ring_run(&spsc);
+
+    printf("== spsc: 1 producer / 1 consumer, %d x %dB slots, %d messages ==\n",
+           BENCH_THREAD_CAPACITY, BENCH_THREAD_DATA_SIZE, BENCH_THREAD_MESSAGES);
+    printf("%-10s %14.0f msgs/s\n", "mutex", locked_rate);
+    printf("%-10s %14.0f msgs/s (%.2fx)\n", "spsc", spsc_rate, spsc_rate / locked_rate);
+
+    pthread_mutex_destroy(&locked.lock);
+    ring_free(&locked.ring);
+    ring_free(&spsc.ring);
+}
+
+static void bench_mpmc(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus < 4 ? 4 : (cpus > BENCH_MAX_THREADS ? BENCH_MAX_THREADS : cpus);
+    thread_ring_t locked = {.use_lock = true, .messages = BENCH_THREAD_MESSAGES};
+    thread_ring_t mpmc = {.use_lock = false, .messages = BENCH_THREAD_MESSAGES};
+    size_t *sequence = xcalloc(BENCH_THREAD_CAPACITY, sizeof(size_t));
+
+    slot_ring_init(&locked.ring, BENCH_THREAD_CAPACITY * BENCH_THREAD_DATA_SIZE, BENCH_THREAD_DATA_SIZE);
+    pthread_mutex_init(&locked.lock, NULL);
+
+    mpmc.ring.base = xcalloc(BENCH_THREAD_CAPACITY, BENCH_THREAD_DATA_SIZE);
+    mpmc.ring.records = xcalloc(BENCH_THREAD_CAPACITY, sizeof(kmsg_record_t));
+    mpmc.ring.occupancy = NULL;
+    kmsgpipe_init_mpmc(&mpmc.ring.buf, mpmc.ring.base, mpmc.ring.records, sequence, BENCH_THREAD_CAPACITY, BENCH_THREAD_DATA_SIZE);
+
+    printf("== mpmc: N producers + N consumers, %d x %dB slots, %ld cpus ==\n",
+           BENCH_THREAD_CAPACITY, BENCH_THREAD_DATA_SIZE, cpus);
+    printf("%-8s %16s %16s %8s\n", "threads", "mutex msgs/s", "mpmc msgs/s", "ratio");
+
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        double locked_rate, mpmc_rate;
+
+        locked.threads = threads;
+        mpmc.threads = threads;
+        locked_rate = thread_ring_run(&locked);
+        mpmc_rate = thread_ring_run(&mpmc);
+        printf("%-8d %16.0f %16.0f %7.2fx\n", threads, locked_rate, mpmc_rate, mpmc_rate / locked_rate);
+    }
+
+    pthread_mutex_destroy(&locked.lock);
+    ring_free(&locked.ring);
+    ring_free(&mpmc.ring);
+    free(sequence);
+}
+
+/* Hardware cache-miss counter for this thread, or -1 if perf is unavailable */
+static int cache_miss_counter_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long long cache_miss_counter_read(int fd)
+{
+    long long misses;
+
+    if (fd < 0 || read(fd, &misses, sizeof(misses)) != sizeof(misses))
+        return -1;
+    return misses;
+}
+
+static void meta_ring_fill(kmsgpipe_buffer_t *buf)
+{
+    for (size_t i = 0; i < BENCH_META_SLOTS; i++)
+        kmsgpipe_push(buf, payload, 8, 1000 + i % BENCH_META_OWNERS, 1000, i);
+}
+
+/* Expire every queued message: a scan that only needs valid bits and timestamps */
+static void meta_expire_scan(const char *label, kmsgpipe_buffer_t *buf, size_t meta_bytes)
+{
+    int fd = cache_miss_counter_open();
+    long long misses;
+    uint64_t start;
+
+    meta_ring_fill(buf);
+    if (fd >= 0)
+    {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    start = now_ns();
+    kmsgpipe_cleanup_expired(buf, BENCH_META_SLOTS);
+    start = now_ns() - start;
+    if (fd >= 0)
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    misses = cache_miss_counter_read(fd);
+
+    printf("%-10s %14.2f %14.2f ", label, (double)meta_bytes / BENCH_META_SLOTS, (double)start / BENCH_META_SLOTS);
+    if (misses < 0)
+        printf("%16s\n", "n/a");
+    else
+        printf("%16.3f\n", (double)misses / BENCH_META_SLOTS);
+
+    if (fd >= 0)
+        close(fd);
+}
+
+static void bench_meta(void)
+{
+    bench_ring_t slot;
+    kmsgpipe_buffer_t compact;
+    uint8_t *compact_base = xcalloc(BENCH_META_SLOTS, BENCH_META_DATA_SIZE);
+    size_t compact_bytes = KMSGPIPE_COMPACT_META_SIZE(BENCH_META_SLOTS, BENCH_META_OWNERS);
+    void *compact_meta = xcalloc(1, compact_bytes);
+
+    slot_ring_init(&slot, BENCH_META_SLOTS * BENCH_META_DATA_SIZE, BENCH_META_DATA_SIZE);
+    kmsgpipe_init_compact(&compact, compact_base, compact_meta, BENCH_META_SLOTS, BENCH_META_DATA_SIZE, BENCH_META_OWNERS, 0);
+
+    printf("== meta: expire scan over %d slots, records[] vs compact arrays ==\n", BENCH_META_SLOTS);
+    printf("%-10s %14s %14s %16s\n", "layout", "meta B/slot", "ns/msg", "cache misses/msg");
+    meta_expire_scan("slot", &slot.buf,
+                     BENCH_META_SLOTS * sizeof(kmsg_record_t) + KMSGPIPE_BITMAP_WORDS(BENCH_META_SLOTS) * sizeof(unsigned long));
+    meta_expire_scan("compact", &compact, compact_bytes);
+
+    ring_free(&slot);
+    free(compact_base);
+    free(compact_meta);
+}
+
+/* Size mix: small_pct% of messages in [small_min, small_max], the rest in [large_min, large_max] */
+typedef struct size_mix
+{
+    const char *label;
+    unsigned int small_pct;
+    size_t small_min, small_max;
+    size_t large_min, large_max;
+} size_mix_t;
+
+static size_t next_mixed_len(uint32_t *state, const size_mix_t *mix)
+{
+    *state = *state * 1103515245u + 12345u;
+    if ((*state >> 8) % 100 < mix->small_pct)
+        return next_len(state, mix->small_min, mix->small_max);
+    return next_len(state, mix->large_min, mix->large_max);
+}
+
+/*
+ * Push/pop through a half-full ring far larger than L1/L2, so every pop
+ * lands on metadata and payload lines that have gone cold since the push.
+ */
+static double mixed_push_pop_ns(kmsgpipe_buffer_t *buf, const size_mix_t *mix)
+{
+    uint32_t state = 1;
+    uint64_t start;
+
+    kmsgpipe_clear(buf);
+    for (size_t i = 0; i < BENCH_INLINE_SLOTS / 2; i++)
+        kmsgpipe_push(buf, payload, next_mixed_len(&state, mix), 1000, 1000, i);
+
+    start = now_ns();
+    for (size_t i = 0; i < BENCH_ITERATIONS; i++)
+    {
+        kmsgpipe_push(buf, payload, next_mixed_len(&state, mix), 1000, 1000, i);
+        kmsgpipe_pop(buf, out_buf, 1000, 1000);
+    }
+    return (double)(now_ns() - start) / BENCH_ITERATIONS;
+}
+
+static void bench_inline(void)
+{
+    static const size_mix_t mixes[] = {
+        {"8-40B", 100, 8, 40, 0, 0},
+        {"90% <=40B", 90, 8, 40, 64, BENCH_INLINE_DATA_SIZE},
+        {"50% <=40B", 50, 8, 40, 64, BENCH_INLINE_DATA_SIZE},
+        {"16-256B", 0, 0, 0, 16, BENCH_INLINE_DATA_SIZE},
+    };
+    bench_ring_t slot;
+    kmsgpipe_buffer_t inl;
+    uint8_t *inline_base = xcalloc(BENCH_INLINE_SLOTS, BENCH_INLINE_DATA_SIZE);
+    kmsg_inline_record_t *lines = aligned_alloc(KMSGPIPE_INLINE_RECORD_SIZE, BENCH_INLINE_SLOTS * sizeof(*lines));
+    unsigned long *occupancy = xcalloc(KMSGPIPE_BITMAP_WORDS(BENCH_INLINE_SLOTS), sizeof(unsigned long));
+
+    if (!lines)
+    {
+        fprintf(stderr, "bench: out of memory\n");
+        exit(1);
+    }
+
+    slot_ring_init(&slot, BENCH_INLINE_SLOTS * BENCH_INLINE_DATA_SIZE, BENCH_INLINE_DATA_SIZE);
+    kmsgpipe_init_inline(&inl, inline_base, lines, occupancy, BENCH_INLINE_SLOTS, BENCH_INLINE_DATA_SIZE, KMSGPIPE_INLINE_MAX);
+
+    printf("== inline: slot vs inline records (<= %dB inline), %d x %dB slots, half full ==\n",
+           KMSGPIPE_INLINE_MAX, BENCH_INLINE_SLOTS, BENCH_INLINE_DATA_SIZE);
+    printf("%-12s %14s %14s %8s\n", "mix", "slot ns/op", "inline ns/op", "speedup");
+
+    for (size_t i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++)
+    {
+        double slot_ns = mixed_push_pop_ns(&slot.buf, &mixes[i]);
+        double inline_ns = mixed_push_pop_ns(&inl, &mixes[i]);
+
+        printf("%-12s %14.1f %14.1f %7.2fx\n", mixes[i].label, slot_ns, inline_ns, slot_ns / inline_ns);
+    }
+
+    ring_free(&slot);
+    free(inline_base);
+    free(lines);
+    free(occupancy);
+}
+
+/*
+ * Module load and KMSGPIPE_IOC_CLEAR cost for large rings: init on freshly
+ * allocated (untouched) payload pages, then clear of a half-full ring,
+ * against the memset of payload and metadata both used to do.
+ */
+static void bench_clear(void)
+{
+    printf("== clear: init and clear latency, %dB slots ==\n", BENCH_DATA_SIZE);
+    printf("%-10s %12s %12s %14s\n", "ring MiB", "init us", "clear us", "eager zero us");
+
+    for (size_t bytes = 16ul * 1024 * 1024; bytes <= BENCH_CLEAR_MAX_BYTES; bytes *= 4)
+    {
+        size_t capacity = bytes / BENCH_DATA_SIZE;
+        bench_ring_t ring;
+        uint64_t start, init_ns, clear_ns, eager_ns;
+
+        ring.base = malloc(bytes);
+        ring.records = xcalloc(capacity, sizeof(kmsg_record_t));
+        ring.occupancy = xcalloc(KMSGPIPE_BITMAP_WORDS(capacity), sizeof(unsigned long));
+        if (!ring.base)
+        {
+            fprintf(stderr, "bench: out of memory\n");
+            exit(1);
+        }
+
+        start = now_ns();
+        kmsgpipe_init(&ring.buf, ring.base, ring.records, ring.occupancy, capacity, BENCH_DATA_SIZE);
+        init_ns = now_ns() - start;
+
+        for (size_t i = 0; i < capacity / 2; i++)
+            kmsgpipe_push(&ring.buf, payload, BENCH_DATA_SIZE, 1000, 1000, i);
+
+        start = now_ns();
+        kmsgpipe_clear(&ring.buf);
+        clear_ns = now_ns() - start;
+
+        start = now_ns();
+        memset(ring.base, 0, bytes);
+        memset(ring.records, 0, capacity * sizeof(kmsg_record_t));
+        memset(ring.occupancy, 0, KMSGPIPE_BITMAP_WORDS(capacity) * sizeof(unsigned long));
+        eager_ns = now_ns() - start;
+
+        printf("%-10zu %12.1f %12.3f %14.1f\n", bytes >> 20,
+               init_ns / 1e3, clear_ns / 1e3, eager_ns / 1e3);
+        ring_free(&ring);
+    }
+}
+
+/*
+ * Fixed-geometry rings: the same push/pop loop as push_pop_ns(), through
+ * the KMSGPIPE_DEFINE_FIXED_RING() calls instead of the generic ones.
+ */
+#define BENCH_FIXED_RING(name, CAPACITY, DATA_SIZE)                                 \
+    KMSGPIPE_DEFINE_FIXED_RING(name, CAPACITY, DATA_SIZE);                          \
+    static name##_t name##_ring;                                                    \
+                                                                                    \
+    static double name##_push_pop_ns(size_t min_len, size_t max_len)                \
+    {                                                                               \
+        kmsgpipe_buffer_t *buf = &name##_ring.buf;                                  \
+        uint32_t state = 1;                                                         \
+        uint64_t start;                                                             \
+                                                                                    \
+        kmsgpipe_clear(buf);                                                        \
+        for (size_t i = 0; i < 64; i++)                                             \
+            name##_push(buf, payload, next_len(&state, min_len, max_len), 1000, 1000, i); \
+                                                                                    \
+        start = now_ns();                                                           \
+        for (size_t i = 0; i < BENCH_ITERATIONS; i++)                               \
+        {                                                                           \
+            name##_push(buf, payload, next_len(&state, min_len, max_len), 1000, 1000, i); \
+            name##_pop(buf, out_buf, 1000, 1000);                                   \
+        }                                                                           \
+        return (double)(now_ns() - start) / BENCH_ITERATIONS;                       \
+    }
+
+BENCH_FIXED_RING(fixed_small, BENCH_THREAD_CAPACITY, BENCH_THREAD_DATA_SIZE)
+BENCH_FIXED_RING(fixed_large, BENCH_RING_BYTES / BENCH_DATA_SIZE, BENCH_DATA_SIZE)
+
+static void bench_fixed(void)
+{
+    static const struct
+    {
+        const char *label;
+        kmsgpipe_buffer_t *buf;
+        double (*fixed_ns)(size_t min_len, size_t max_len);
+        size_t min_len, max_len;
+    } runs[] = {
+        {"1024 x 64B", &fixed_small_ring.buf, fixed_small_push_pop_ns, 16, 64},
+        {"1024 x 1KiB", &fixed_large_ring.buf, fixed_large_push_pop_ns, 40, 40},
+        {"1024 x 1KiB", &fixed_large_ring.buf, fixed_large_push_pop_ns, 16, 1024},
+    };
+
+    fixed_small_init(&fixed_small_ring);
+    fixed_large_init(&fixed_large_ring);
+
+    printf("== fixed: generic vs compile-time geometry, slot layout ==\n");
+    printf("%-12s %-10s %14s %14s %8s\n", "geometry", "mix", "generic ns/op", "fixed ns/op", "speedup");
+
+    for (size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+    {
+        char mix[32];
+        double generic_ns = push_pop_ns(runs[i].buf, runs[i].min_len, runs[i].max_len);
+        double fixed_ns = runs[i].fixed_ns(runs[i].min_len, runs[i].max_len);
+
+        snprintf(mix, sizeof(mix), "%zu-%zuB", runs[i].min_len, runs[i].max_len);
+        printf("%-12s %-10s %14.1f %14.1f %7.2fx\n", runs[i].label, mix, generic_ns, fixed_ns, generic_ns / fixed_ns);
+    }
+}
+
+/* Key with a cubed-uniform skew: the lowest few keys take most writes */
+static uint64_t next_skewed_key(uint32_t *state, size_t nkeys)
+{
+    double u;
+
+    *state = *state * 1103515245u + 12345u;
+    u = (double)(*state >> 8) / (1u << 24);
+    return (uint64_t)(nkeys * u * u * u);
+}
+
+/*
+ * Writer outpacing its reader BENCH_KEYED_READ_EVERY to one with status
+ * updates for skewed keys: a plain ring fills and refuses the newest
+ * updates, the keyed one only ever holds one message per key.
+ */
+static void keyed_run(const char *label, kmsgpipe_buffer_t *buf, size_t nkeys)
+{
+    uint32_t state = 1;
+    uint64_t backlog = 0, refused = 0, start;
+
+    kmsgpipe_clear(buf);
+    start = now_ns();
+    for (size_t i = 0; i < BENCH_ITERATIONS; i++)
+    {
+        uint64_t key = next_skewed_key(&state, nkeys);
+        kmsgpipe_span_t span;
+
+        if (kmsgpipe_reserve(buf, 32, &span))
+            refused++;
+        else if (buf->keys)
+            kmsgpipe_commit_keyed(buf, &span, 32, key, 1000, 1000, i, KMSGPIPE_NO_DEADLINE);
+        else
+            kmsgpipe_commit(buf, &span, 32, 1000, 1000, i);
+        if (i % BENCH_KEYED_READ_EVERY == 0)
+            kmsgpipe_pop(buf, out_buf, 1000, 1000);
+        backlog += buf->count;
+    }
+    start = now_ns() - start;
+
+    printf("%-8zu %-8s %12.1f %12.2f %10.1f\n", nkeys, label, (double)backlog / BENCH_ITERATIONS,
+           100.0 * refused / BENCH_ITERATIONS, (double)start / BENCH_ITERATIONS);
+}
+
+static void bench_keyed(void)
+{
+    static const size_t nkeys[] = {64, 1024, 16384};
+    size_t nentries = 2 * BENCH_KEYED_SLOTS;
+    bench_ring_t fifo, keyed;
+    kmsgpipe_keys_t keys;
+    kmsg_key_entry_t *table = xcalloc(nentries, sizeof(kmsg_key_entry_t));
+    uint64_t *slot_keys = xcalloc(BENCH_KEYED_SLOTS, sizeof(uint64_t));
+
+    slot_ring_init(&fifo, BENCH_KEYED_SLOTS * BENCH_KEYED_DATA_SIZE, BENCH_KEYED_DATA_SIZE);
+    slot_ring_init(&keyed, BENCH_KEYED_SLOTS * BENCH_KEYED_DATA_SIZE, BENCH_KEYED_DATA_SIZE);
+    kmsgpipe_init_keys(&keyed.buf, &keys, table, slot_keys, nentries);
+
+    printf("== keyed: %d slots, one read per %d writes, skewed keys ==\n", BENCH_KEYED_SLOTS, BENCH_KEYED_READ_EVERY);
+    printf("%-8s %-8s %12s %12s %10s\n", "keys", "ring", "mean backlog", "refused %", "ns/op");
+    for (size_t i = 0; i < sizeof(nkeys) / sizeof(nkeys[0]); i++)
+    {
+        keyed_run("fifo", &fifo.buf, nkeys[i]);
+        keyed_run("keyed", &keyed.buf, nkeys[i]);
+    }
+
+    ring_free(&fifo);
+    ring_free(&keyed);
+    free(table);
+    free(slot_keys);
+}
+
+/* Byte ring whose records wrap by splitting, as a stream over base would */
+typedef struct split_ring
+{
+    uint8_t *base;
+    size_t size, head, tail, used, count;
+} split_ring_t;
+
+static void split_copy_in(split_ring_t *ring, const void *src, size_t len)
+{
+    size_t first = ring->size - ring->head < len ? ring->size - ring->head : len;
+
+    memcpy(ring->base + ring->head, src, first);
+    memcpy(ring->base, (const uint8_t *)src + first, len - first);
+    ring->head = (ring->head + len) % ring->size;
+}
+
+static void split_copy_out(split_ring_t *ring, void *dst, size_t len)
+{
+    size_t first = ring->size - ring->tail < len ? ring->size - ring->tail : len;
+
+    memcpy(dst, ring->base + ring->tail, first);
+    memcpy((uint8_t *)dst + first, ring->base, len - first);
+    ring->tail = (ring->tail + len) % ring->size;
+}
+
+static int split_push(split_ring_t *ring, const uint8_t *data, size_t len, ktime_t timestamp)
+{
+    kmsg_packed_hdr_t hdr = {.timestamp = timestamp, .owner_uid = 1000, .owner_gid = 1000, .len = len};
+    size_t rec = KMSGPIPE_PACKED_RECORD_SIZE(len);
+
+    if (rec > ring->size - ring->used)
+        return -ENOSPC;
+    split_copy_in(ring, &hdr, sizeof(hdr));
+    split_copy_in(ring, data, len);
+    ring->head = (ring->head + rec - sizeof(hdr) - len) % ring->size;
+    ring->used += rec;
+    ring->count++;
+    return 0;
+}
+
+static int split_pop(split_ring_t *ring, uint8_t *out)
+{
+    kmsg_packed_hdr_t hdr;
+    size_t rec;
+
+    if (!ring->count)
+        return -ENODATA;
+    split_copy_out(ring, &hdr, sizeof(hdr));
+    split_copy_out(ring, out, hdr.len);
+    rec = KMSGPIPE_PACKED_RECORD_SIZE(hdr.len);
+    ring->tail = (ring->tail + rec - sizeof(hdr) - hdr.len) % ring->size;
+    ring->used -= rec;
+    ring->count--;
+    return 0;
+}
+
+/* One memfd mapped twice, back to back, as the driver does with vmap() */
+static uint8_t *mirror_map(size_t size)
+{
+    int fd = memfd_create("kmsgpipe_bench", 0);
+    uint8_t *base;
+
+    if (fd < 0 || ftruncate(fd, size))
+    {
+        fprintf(stderr, "bench: memfd failed\n");
+        exit(1);
+    }
+    base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED ||
+        mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        fprintf(stderr, "bench: mirror mapping failed\n");
+        exit(1);
+    }
+    close(fd);
+    return base;
+}
+
+/* Messages held once full again after half were read, so records meet the end */
+static size_t refill_after_wrap(kmsgpipe_buffer_t *buf, size_t min_len, size_t max_len)
+{
+    uint32_t state = 7;
+    size_t n;
+
+    kmsgpipe_clear(buf);
+    n = fill_until_full(buf, min_len, max_len);
+    for (size_t i = 0; i < n / 2; i++)
+        kmsgpipe_pop(buf, out_buf, 1000, 1000);
+    while (kmsgpipe_push(buf, payload, next_len(&state, min_len, max_len), 1000, 1000, 0) >= 0)
+        ;
+    return kmsgpipe_get_message_count(buf);
+}
+
+/* Same refill and half-full push/pop loop as for kmsgpipe rings, over the split ring */
+static void split_run(split_ring_t *ring, size_t min_len, size_t max_len, size_t *held, double *ns)
+{
+    uint32_t state = 1;
+    uint64_t start;
+    size_t n;
+
+    ring->head = ring->tail = ring->used = ring->count = 0;
+    while (split_push(ring, payload, next_len(&state, min_len, max_len), 0) == 0)
+        ;
+    n = ring->count;
+    for (size_t i = 0; i < n / 2; i++)
+        split_pop(ring, out_buf);
+    state = 7;
+    while (split_push(ring, payload, next_len(&state, min_len, max_len), 0) == 0)
+        ;
+    *held = ring->count;
+
+    state = 1;
+    ring->head = ring->tail = ring->used = ring->count = 0;
+    for (size_t i = 0; i < 64; i++)
+        split_push(ring, payload, next_len(&state, min_len, max_len), i);
+    start = now_ns();
+    for (size_t i = 0; i < BENCH_ITERATIONS; i++)
+    {
+        split_push(ring, payload, next_len(&state, min_len, max_len), i);
+        split_pop(ring, out_buf);
+    }
+    *ns = (double)(now_ns() - start) / BENCH_ITERATIONS;
+}
+
+/*
+ * Records past the end of a small ring: padded (packed layout), split in
+ * two copies, or contiguous through the second mapping of a mirrored ring.
+ */
+static void bench_mirror(void)
+{
+    static const struct
+    {
+        const char *label;
+        size_t min_len, max_len;
+    } mixes[] = {
+        {"16-128B", 16, 128},
+        {"16-1024B", 16, 1024},
+        {"512-1024B", 512, 1024},
+    };
+    uint8_t *mirror = mirror_map(BENCH_MIRROR_BYTES);
+    split_ring_t split = {.base = xcalloc(1, BENCH_MIRROR_BYTES), .size = BENCH_MIRROR_BYTES};
+
+    printf("== mirror: padded vs split-copy vs double-mapped, %d KiB ring ==\n", BENCH_MIRROR_BYTES / 1024);
+    printf("%-10s %9s %9s %9s %11s %11s %11s\n", "mix", "pad msgs", "split", "mirror",
+           "pad ns/op", "split", "mirror");
+    for (size_t i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++)
+    {
+        bench_ring_t padded;
+        kmsgpipe_buffer_t mirrored;
+        size_t padded_n, split_n, mirrored_n;
+        double padded_ns, split_ns, mirrored_ns;
+
+        packed_ring_init(&padded, BENCH_MIRROR_BYTES, BENCH_DATA_SIZE);
+        kmsgpipe_init_packed_mirrored(&mirrored, mirror, BENCH_MIRROR_BYTES, BENCH_DATA_SIZE);
+
+        padded_n = refill_after_wrap(&padded.buf, mixes[i].min_len, mixes[i].max_len);
+        mirrored_n = refill_after_wrap(&mirrored, mixes[i].min_len, mixes[i].max_len);
+        padded_ns = push_pop_ns(&padded.buf, mixes[i].min_len, mixes[i].max_len);
+        mirrored_ns = push_pop_ns(&mirrored, mixes[i].min_len, mixes[i].max_len);
+        split_run(&split, mixes[i].min_len, mixes[i].max_len, &split_n, &split_ns);
+
+        printf("%-10s %9zu %9zu %9zu %11.1f %11.1f %11.1f\n", mixes[i].label, padded_n, split_n,
+               mirrored_n, padded_ns, split_ns, mirrored_ns);
+        ring_free(&padded);
+    }
+
+    munmap(mirror, 2 * BENCH_MIRROR_BYTES);
+    free(split.base);
+}
+
+/*
+ * One writer and one reader moving 16 KiB messages, one of them copying
+ * to or from a user buffer whose pages were just dropped, as the driver
+ * does under page faults. The modes follow the driver's data path: a
+ * scratch buffer per call with copy_to_user under the lock, copies
+ * straight into the ring under the lock, and copies with only the
+ * per-side lock held.
+ */
+enum fault_mode
+{
+    FAULT_SCRATCH,
+    FAULT_LOCKED,
+    FAULT_UNLOCKED,
+};
+
+typedef struct fault_side
+{
+    uint8_t *user;        /* BENCH_FAULT_DATA_SIZE bytes standing in for the user buffer */
+    bool faults;          /* drop its pages before every copy */
+    uint32_t *latency_ns; /* per call, the first BENCH_FAULT_SAMPLES */
+    size_t samples;
+} fault_side_t;
+
+typedef struct fault_ring
+{
+    bench_ring_t ring;
+    pthread_mutex_t lock, write_lock, read_lock;
+    enum fault_mode mode;
+    fault_side_t writer, reader;
+    size_t allocs;
+} fault_ring_t;
+
+static void fault_user_copy(const fault_side_t *side, void *dst, const void *src, size_t len)
+{
+    if (side->faults)
+        madvise(side->user, BENCH_FAULT_DATA_SIZE, MADV_DONTNEED);
+    memcpy(dst, src, len);
+}
+
+static uint8_t *fault_scratch(fault_ring_t *fr)
+{
+    __atomic_fetch_add(&fr->allocs, 1, __ATOMIC_RELAXED);
+    return xcalloc(1, BENCH_FAULT_DATA_SIZE);
+}
+
+static bool fault_write(fault_ring_t *fr)
+{
+    kmsgpipe_buffer_t *buf = &fr->ring.buf;
+    fault_side_t *side = &fr->writer;
+    kmsgpipe_span_t span;
+    uint8_t *scratch;
+    bool ok;
+
+    switch (fr->mode)
+    {
+    case FAULT_SCRATCH:
+        scratch = fault_scratch(fr);
+        fault_user_copy(side, scratch, side->user, BENCH_FAULT_DATA_SIZE);
+        pthread_mutex_lock(&fr->lock);
+        ok = kmsgpipe_push(buf, scratch, BENCH_FAULT_DATA_SIZE, 1000, 1000, 0) > 0;
+        pthread_mutex_unlock(&fr->lock);
+        free(scratch);
+        return ok;
+    case FAULT_LOCKED:
+        pthread_mutex_lock(&fr->lock);
+        ok = kmsgpipe_reserve(buf, BENCH_FAULT_DATA_SIZE, &span) == 0;
+        if (ok)
+        {
+            fault_user_copy(side, span.data, side->user, BENCH_FAULT_DATA_SIZE);
+            kmsgpipe_commit(buf, &span, BENCH_FAULT_DATA_SIZE, 1000, 1000, 0);
+        }
+        pthread_mutex_unlock(&fr->lock);
+        return ok;
+    case FAULT_UNLOCKED:
+        pthread_mutex_lock(&fr->write_lock);
+        pthread_mutex_lock(&fr->lock);
+        ok = kmsgpipe_reserve(buf, BENCH_FAULT_DATA_SIZE, &span) == 0;
+        pthread_mutex_unlock(&fr->lock);
+        if (ok)
+        {
+            fault_user_copy(side, span.data, side->user, BENCH_FAULT_DATA_SIZE);
+            pthread_mutex_lock(&fr->lock);
+            kmsgpipe_commit(buf, &span, BENCH_FAULT_DATA_SIZE, 1000, 1000, 0);
+            pthread_mutex_unlock(&fr->lock);
+        }
+        pthread_mutex_unlock(&fr->write_lock);
+        return ok;
+    }
+    return false;
+}
+
+static bool fault_read(fault_ring_t *fr)
+{
+    kmsgpipe_buffer_t *buf = &fr->ring.buf;
+    fault_side_t *side = &fr->reader;
+    kmsgpipe_span_t span;
+    uint8_t *scratch;
+    bool ok;
+
+    switch (fr->mode)
+    {
+    case FAULT_SCRATCH:
+        scratch = fault_scratch(fr);
+        pthread_mutex_lock(&fr->lock);
+        ok = kmsgpipe_pop(buf, scratch, 1000, 1000) > 0;
+        if (ok)
+            fault_user_copy(side, side->user, scratch, BENCH_FAULT_DATA_SIZE);
+        pthread_mutex_unlock(&fr->lock);
+        free(scratch);
+        return ok;
+    case FAULT_LOCKED:
+        pthread_mutex_lock(&fr->lock);
+        ok = kmsgpipe_peek(buf, 1000, 1000, &span) == 0;
+        if (ok)
+        {
+            fault_user_copy(side, side->user, span.data, span.len);
+            kmsgpipe_peek_release(buf, &span, true);
+        }
+        pthread_mutex_unlock(&fr->lock);
+        return ok;
+    case FAULT_UNLOCKED:
+        pthread_mutex_lock(&fr->read_lock);
+        pthread_mutex_lock(&fr->lock);
+        ok = kmsgpipe_peek(buf, 1000, 1000, &span) == 0;
+        pthread_mutex_unlock(&fr->lock);
+        if (ok)
+        {
+            fault_user_copy(side, side->user, span.data, span.len);
+            pthread_mutex_lock(&fr->lock);
+            kmsgpipe_peek_release(buf, &span, true);
+            pthread_mutex_unlock(&fr->lock);
+        }
+        pthread_mutex_unlock(&fr->read_lock);
+        return ok;
+    }
+    return false;
+}
+
+/*
+ * Every call counts, as a non-blocking read or write that found the ring
+ * empty or full still waited for the lock first.
+ */
+static void fault_side_run(fault_ring_t *fr, fault_side_t *side, bool (*call)(fault_ring_t *))
+{
+    side->samples = 0;
+    for (size_t i = 0; i < BENCH_FAULT_MESSAGES;)
+    {
+        uint64_t start = now_ns();
+        bool ok = call(fr);
+
+        if (side->samples < BENCH_FAULT_SAMPLES)
+            side->latency_ns[side->samples++] = now_ns() - start;
+        if (ok)
+            i++;
+        else
+            sched_yield();
+    }
+}
+
+static void *fault_writer(void *arg)
+{
+    fault_ring_t *fr = arg;
+
+    fault_side_run(fr, &fr->writer, fault_write);
+    return NULL;
+}
+
+static void *fault_reader(void *arg)
+{
+    fault_ring_t *fr = arg;
+
+    fault_side_run(fr, &fr->reader, fault_read);
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(uint32_t *samples, size_t n, unsigned int pct)
+{
+    qsort(samples, n, sizeof(*samples), cmp_u32);
+    return samples[n * pct / 100];
+}
+
+static void bench_fault(void)
+{
+    static const char *const modes[] = {"scratch", "locked", "unlocked"};
+    fault_ring_t fr;
+    pthread_t writer, reader;
+
+    memset(&fr, 0, sizeof(fr));
+    slot_ring_init(&fr.ring, BENCH_FAULT_SLOTS * BENCH_FAULT_DATA_SIZE, BENCH_FAULT_DATA_SIZE);
+    pthread_mutex_init(&fr.lock, NULL);
+    pthread_mutex_init(&fr.write_lock, NULL);
+    pthread_mutex_init(&fr.read_lock, NULL);
+    fr.writer.latency_ns = xcalloc(BENCH_FAULT_SAMPLES, sizeof(uint32_t));
+    fr.reader.latency_ns = xcalloc(BENCH_FAULT_SAMPLES, sizeof(uint32_t));
+    fr.writer.user = mmap(NULL, BENCH_FAULT_DATA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    fr.reader.user = mmap(NULL, BENCH_FAULT_DATA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (fr.writer.user == MAP_FAILED || fr.reader.user == MAP_FAILED)
+    {
+        fprintf(stderr, "bench: mmap failed\n");
+        exit(1);
+    }
+
+    printf("== fault: 1 writer + 1 reader, %d x %d KiB slots, one side faulting on every copy ==\n",
+           BENCH_FAULT_SLOTS, BENCH_FAULT_DATA_SIZE / 1024);
+    printf("%-8s %-10s %10s %14s %14s %14s %14s\n", "faults", "path", "allocs/msg",
+           "writer p50 ns", "writer p99 ns", "reader p50 ns", "reader p99 ns");
+    for (int faulting = 0; faulting < 2; faulting++)
+    {
+        for (int mode = FAULT_SCRATCH; mode <= FAULT_UNLOCKED; mode++)
+        {
+            fr.mode = mode;
+            fr.allocs = 0;
+            fr.writer.faults = faulting == 0;
+            fr.reader.faults = faulting == 1;
+            kmsgpipe_clear(&fr.ring.buf);
+
+            pthread_create(&reader, NULL, fault_reader, &fr);
+            pthread_create(&writer, NULL, fault_writer, &fr);
+            pthread_join(writer, NULL);
+            pthread_join(reader, NULL);
+
+            printf("%-8s %-10s %10.1f %14u %14u %14u %14u\n", faulting ? "reader" : "writer", modes[mode],
+                   (double)fr.allocs / BENCH_FAULT_MESSAGES,
+                   percentile(fr.writer.latency_ns, fr.writer.samples, 50),
+                   percentile(fr.writer.latency_ns, fr.writer.samples, 99),
+                   percentile(fr.reader.latency_ns, fr.reader.samples, 50),
+                   percentile(fr.reader.latency_ns, fr.reader.samples, 99));
+        }
+    }
+
+    munmap(fr.writer.user, BENCH_FAULT_DATA_SIZE);
+    munmap(fr.reader.user, BENCH_FAULT_DATA_SIZE);
+    free(fr.writer.latency_ns);
+    free(fr.reader.latency_ns);
+    pthread_mutex_destroy(&fr.lock);
+    pthread_mutex_destroy(&fr.write_lock);
+    pthread_mutex_destroy(&fr.read_lock);
+    ring_free(&fr.ring);
+}
+
+/*
+ * Writers and readers of one locked slot ring, each copying a payload in
+ * or out as the driver does. The modes follow its locking: one mutex for
+ * everything, per-side mutexes with the ring mutex dropped across the
+ * copy (kmsgpipe_copy_unlocked()), and per-side mutexes only on a split
+ * ring (kmsgpipe_init_split()).
+ */
+enum mixed_mode
+{
+    MIXED_SHARED,
+    MIXED_UNLOCKED,
+    MIXED_SPLIT,
+};
+
+typedef struct mixed_ring
+{
+    bench_ring_t ring;
+    pthread_mutex_t lock, write_lock, read_lock;
+    enum mixed_mode mode;
+    int threads;
+} mixed_ring_t;
+
+static void mixed_lock(mixed_ring_t *mr, pthread_mutex_t *side)
+{
+    if (mr->mode != MIXED_SHARED)
+        pthread_mutex_lock(side);
+    if (mr->mode != MIXED_SPLIT)
+        pthread_mutex_lock(&mr->lock);
+}
+
+static void mixed_unlock(mixed_ring_t *mr, pthread_mutex_t *side)
+{
+    if (mr->mode != MIXED_SPLIT)
+        pthread_mutex_unlock(&mr->lock);
+    if (mr->mode != MIXED_SHARED)
+        pthread_mutex_unlock(side);
+}
+
+/* Drops the ring mutex across a copy in MIXED_UNLOCKED mode, and takes it back */
+static void mixed_copy(mixed_ring_t *mr, void *dst, const void *src, size_t len)
+{
+    if (mr->mode == MIXED_UNLOCKED)
+        pthread_mutex_unlock(&mr->lock);
+    memcpy(dst, src, len);
+    if (mr->mode == MIXED_UNLOCKED)
+        pthread_mutex_lock(&mr->lock);
+}
+
+static void *mixed_writer(void *arg)
+{
+    mixed_ring_t *mr = arg;
+    kmsgpipe_buffer_t *buf = &mr->ring.buf;
+    kmsgpipe_span_t span;
+
+    for (size_t i = 0; i < BENCH_MIXED_MESSAGES / (size_t)mr->threads;)
+    {
+        bool ok;
+
+        mixed_lock(mr, &mr->write_lock);
+        ok = kmsgpipe_reserve(buf, BENCH_MIXED_DATA_SIZE, &span) == 0;
+        if (ok)
+        {
+            mixed_copy(mr, span.data, payload, BENCH_MIXED_DATA_SIZE);
+            kmsgpipe_commit(buf, &span, BENCH_MIXED_DATA_SIZE, 1000, 1000, i);
+        }
+        mixed_unlock(mr, &mr->write_lock);
+
+        if (ok)
+            i++;
+        else
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void *mixed_reader(void *arg)
+{
+    mixed_ring_t *mr = arg;
+    kmsgpipe_buffer_t *buf = &mr->ring.buf;
+    uint8_t msg[BENCH_MIXED_DATA_SIZE];
+    kmsgpipe_span_t span;
+
+    for (size_t i = 0; i < BENCH_MIXED_MESSAGES / (size_t)mr->threads;)
+    {
+        bool ok;
+
+        mixed_lock(mr, &mr->read_lock);
+        ok = kmsgpipe_peek(buf, 1000, 1000, &span) == 0;
+        if (ok)
+        {
+            mixed_copy(mr, msg, span.data, span.len);
+            kmsgpipe_peek_release(buf, &span, true);
+        }
+        mixed_unlock(mr, &mr->read_lock);
+
+        if (ok)
+            i++;
+        else
+            sched_yield();
+    }
+    return NULL;
+}
+
+/* Runs mr->threads writers and readers to completion, returns messages/s */
+static double mixed_run(mixed_ring_t *mr)
+{
+    pthread_t writers[BENCH_MAX_THREADS], readers[BENCH_MAX_THREADS];
+    uint64_t start = now_ns();
+
+    for (int i = 0; i < mr->threads; i++)
+    {
+        pthread_create(&readers[i], NULL, mixed_reader, mr);
+        pthread_create(&writers[i], NULL, mixed_writer, mr);
+    }
+    for (int i = 0; i < mr->threads; i++)
+    {
+        pthread_join(writers[i], NULL);
+        pthread_join(readers[i], NULL);
+    }
+
+    return (BENCH_MIXED_MESSAGES / mr->threads) * mr->threads * 1e9 / (double)(now_ns() - start);
+}
+
+static void bench_mixed(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    mixed_ring_t rings[MIXED_SPLIT + 1];
+
+    for (int mode = MIXED_SHARED; mode <= MIXED_SPLIT; mode++)
+    {
+        mixed_ring_t *mr = &rings[mode];
+
+        memset(mr, 0, sizeof(*mr));
+        mr->mode = mode;
+        slot_ring_init(&mr->ring, BENCH_MIXED_CAPACITY * BENCH_MIXED_DATA_SIZE, BENCH_MIXED_DATA_SIZE);
+        if (mode == MIXED_SPLIT)
+            kmsgpipe_init_split(&mr->ring.buf);
+        pthread_mutex_init(&mr->lock, NULL);
+        pthread_mutex_init(&mr->write_lock, NULL);
+        pthread_mutex_init(&mr->read_lock, NULL);
+    }
+
+    printf("== mixed: N writers + N readers copying %dB messages, %d slots, %ld cpus ==\n",
+           BENCH_MIXED_DATA_SIZE, BENCH_MIXED_CAPACITY, cpus);
+    printf("%-8s %16s %16s %16s %8s\n", "threads", "shared msgs/s", "unlocked msgs/s", "split msgs/s", "split/sh");
+    for (int threads = 1; threads <= 4; threads *= 2)
+    {
+        double rate[MIXED_SPLIT + 1];
+
+        for (int mode = MIXED_SHARED; mode <= MIXED_SPLIT; mode++)
+        {
+            rings[mode].threads = threads;
+            rate[mode] = mixed_run(&rings[mode]);
+        }
+        printf("%-8d %16.0f %16.0f %16.0f %7.2fx\n", threads, rate[MIXED_SHARED], rate[MIXED_UNLOCKED],
+               rate[MIXED_SPLIT], rate[MIXED_SPLIT] / rate[MIXED_SHARED]);
+    }
+
+    for (int mode = MIXED_SHARED; mode <= MIXED_SPLIT; mode++)
+    {
+        pthread_mutex_destroy(&rings[mode].lock);
+        pthread_mutex_destroy(&rings[mode].write_lock);
+        pthread_mutex_destroy(&rings[mode].read_lock);
+        ring_free(&rings[mode].ring);
+    }
+}
+
+/*
+ * One writer and one reader moving messages in calls of up to batch
+ * messages each, as writev()/readv() do with one iovec per message. Every
+ * call pays for one syscall, stood in for by getppid(), and one take of
+ * the ring lock; a call stops early at a full or empty ring.
+ */
+typedef struct batch_ring
+{
+    bench_ring_t ring;
+    pthread_mutex_t lock;
+    size_t batch;
+    size_t write_calls, read_calls;
+} batch_ring_t;
+
+static void *batch_writer(void *arg)
+{
+    batch_ring_t *br = arg;
+    uint8_t msg[BENCH_BATCH_DATA_SIZE] = {0};
+
+    for (size_t i = 0; i < BENCH_BATCH_MESSAGES;)
+    {
+        size_t n = 0;
+
+        syscall(SYS_getppid);
+        pthread_mutex_lock(&br->lock);
+        while (n < br->batch && i + n < BENCH_BATCH_MESSAGES &&
+               kmsgpipe_push(&br->ring.buf, msg, sizeof(msg), 1000, 1000, i + n) > 0)
+            n++;
+        pthread_mutex_unlock(&br->lock);
+
+        br->write_calls++;
+        i += n;
+        if (!n)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void *batch_reader(void *arg)
+{
+    batch_ring_t *br = arg;
+    uint8_t msg[BENCH_BATCH_DATA_SIZE];
+
+    for (size_t i = 0; i < BENCH_BATCH_MESSAGES;)
+    {
+        size_t n = 0;
+
+        syscall(SYS_getppid);
+        pthread_mutex_lock(&br->lock);
+        while (n < br->batch && kmsgpipe_pop(&br->ring.buf, msg, 1000, 1000) > 0)
+            n++;
+        pthread_mutex_unlock(&br->lock);
+
+        br->read_calls++;
+        i += n;
+        if (!n)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void bench_batch(void)
+{
+    static const size_t batches[] = {1, 16, 256};
+    batch_ring_t br;
+
+    memset(&br, 0, sizeof(br));
+    slot_ring_init(&br.ring, BENCH_BATCH_CAPACITY * BENCH_BATCH_DATA_SIZE, BENCH_BATCH_DATA_SIZE);
+    pthread_mutex_init(&br.lock, NULL);
+
+    printf("== batch: 1 writer + 1 reader, %d x %dB slots, %d messages ==\n",
+           BENCH_BATCH_CAPACITY, BENCH_BATCH_DATA_SIZE, BENCH_BATCH_MESSAGES);
+    printf("%-8s %14s %14s %16s\n", "batch", "write calls", "read calls", "msgs/s");
+    for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++)
+    {
+        pthread_t writer, reader;
+        uint64_t start;
+        double rate;
+
+        br.batch = batches[b];
+        br.write_calls = 0;
+        br.read_calls = 0;
+        kmsgpipe_clear(&br.ring.buf);
+
+        start = now_ns();
+        pthread_create(&reader, NULL, batch_reader, &br);
+        pthread_create(&writer, NULL, batch_writer, &br);
+        pthread_join(writer, NULL);
+        pthread_join(reader, NULL);
+        rate = BENCH_BATCH_MESSAGES * 1e9 / (double)(now_ns() - start);
+
+        printf("%-8zu %14zu %14zu %16.0f\n", br.batch, br.write_calls, br.read_calls, rate);
+    }
+
+    pthread_mutex_destroy(&br.lock);
+    ring_free(&br.ring);
+}
+
+static const bench_t benches[] = {
+    {"layout", bench_layout},
+    {"spsc", bench_spsc},
+    {"mpmc", bench_mpmc},
+    {"meta", bench_meta},
+    {"inline", bench_inline},
+    {"clear", bench_clear},
+    {"fixed", bench_fixed},
+    {"keyed", bench_keyed},
+    {"mirror", bench_mirror},
+    {"fault", bench_fault},
+    {"mixed", bench_mixed},
+    {"batch", bench_batch},
+};
+
+int main(int argc, char **argv)
+{
+    memset(payload, 'k', sizeof(payload));
+
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+    {
+        bool selected = argc < 2;
+        for (int a = 1; a < argc; a++)
+            if (strcmp(argv[a], benches[i].name) == 0)
+                selected = true;
+        if (selected)
+            benches[i].run();
+    }
+    return 0;
+}
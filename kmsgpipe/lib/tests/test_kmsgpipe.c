@@ -1,6 +1,11 @@
+#define _GNU_SOURCE /* memfd_create */
 #include "kmsgpipe.h"
 #include "unity.h"
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #define TEST_CAPACITY 4
 #define TEST_DATA_SIZE 32
@@ -28,10 +33,36 @@ static ktime_t forth_ts = 10030;
 static kmsgpipe_buffer_t buf;
 static uint8_t base_buffer[TEST_CAPACITY * TEST_DATA_SIZE];
 static kmsg_record_t record_buf[TEST_CAPACITY];
+static unsigned long occupancy_buf[KMSGPIPE_BITMAP_WORDS(TEST_CAPACITY)];
+
+/* Packed ring sized for exactly four "first data" records */
+#define TEST_PACKED_SIZE (4 * KMSGPIPE_PACKED_RECORD_SIZE(10))
+
+static kmsgpipe_buffer_t packed_buf;
+static uint8_t packed_base[TEST_PACKED_SIZE];
+
+static bool slot_occupied(size_t idx)
+{
+    const unsigned long *word = &occupancy_buf[2 * (idx / KMSGPIPE_BITS_PER_WORD)];
+
+    return word[1] == buf.generation && (word[0] & (1UL << (idx % KMSGPIPE_BITS_PER_WORD)));
+}
+
+static void assert_occupancy_matches_records(void)
+{
+    size_t valid = 0;
+    for (size_t i = 0; i < TEST_CAPACITY; i++)
+    {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(record_buf[i].valid, slot_occupied(i), "Failed on occupancy bit mirroring valid flag");
+        if (record_buf[i].valid)
+            valid++;
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(valid, buf.count, "Failed on maintained count matching valid records");
+}
 
 void setUp(void)
 {
-    int ret_val = kmsgpipe_init(&buf, base_buffer, record_buf, TEST_CAPACITY, TEST_DATA_SIZE);
+    int ret_val = kmsgpipe_init(&buf, base_buffer, record_buf, occupancy_buf, TEST_CAPACITY, TEST_DATA_SIZE);
     TEST_ASSERT_EQUAL_INT_MESSAGE(0, ret_val, "Init should return 0");
     // assert all the buffer fields
     TEST_ASSERT_EQUAL_UINT64_MESSAGE(base_buffer, buf.base, "Failed on base buffer memory address");
@@ -40,6 +71,9 @@ void setUp(void)
     TEST_ASSERT_EQUAL_INT_MESSAGE(TEST_CAPACITY, buf.capacity, "Failed on capacity field");
     TEST_ASSERT_EQUAL_INT_MESSAGE(0, buf.head, "Failed on head field");
     TEST_ASSERT_EQUAL_INT_MESSAGE(0, buf.tail, "Failed on tail field");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, buf.count, "Failed on count field");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(occupancy_buf, buf.occupancy, "Failed on occupancy bitmap memory address");
+    TEST_ASSERT_EACH_EQUAL_UINT8(0x00, occupancy_buf, sizeof(occupancy_buf));
 
     for (ssize_t i = 0; i < TEST_CAPACITY; i++)
     {
@@ -260,8 +294,1546 @@ void should_clear_all_messages_from_buffer(void)
     TEST_ASSERT_EQUAL_INT_MESSAGE(0, count, "Failed on getting right message count after clearing buffer");
     TEST_ASSERT_EQUAL_INT_MESSAGE(0, buf.head, "Failed on setting buffer.head after clearing buffer");
     TEST_ASSERT_EQUAL_INT_MESSAGE(0, buf.tail, "Failed on setting buffer.tail after clearing buffer");
-    TEST_ASSERT_EACH_EQUAL_UINT8(0x00, buf.base, TEST_CAPACITY * TEST_DATA_SIZE);
-    TEST_ASSERT_EACH_EQUAL_UINT8(0x00, buf.records, TEST_CAPACITY * sizeof(kmsg_record_t));
+    for (ssize_t i = 0; i < TEST_CAPACITY; i++)
+    {
+        TEST_ASSERT_FALSE_MESSAGE(slot_occupied(i), "Failed on occupancy after clearing buffer");
+    }
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&buf), "Failed on empty check after clearing buffer");
+}
+
+void should_not_leak_stale_payload_after_clear(void)
+{
+    uint8_t out_buf[TEST_DATA_SIZE];
+    uint8_t long_data[TEST_DATA_SIZE];
+
+    memset(long_data, 'x', sizeof(long_data));
+    kmsgpipe_push(&buf, long_data, sizeof(long_data), first_uid, first_gid, first_ts);
+    kmsgpipe_push(&buf, second_data, strlen((char *)second_data), second_uid, second_gid, second_ts);
+    kmsgpipe_clear(&buf);
+
+    /* Old payload and records are still in memory but nothing may reach them */
+    TEST_ASSERT_EQUAL_INT_MESSAGE('x', base_buffer[0], "Failed on clear leaving payload untouched");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENODATA, kmsgpipe_pop(&buf, out_buf, 0, 0), "Failed on pop after clear");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_cleanup_expired(&buf, forth_ts), "Failed on expiry after clear");
+
+    memset(out_buf, 0xA5, sizeof(out_buf));
+    kmsgpipe_push(&buf, third_data, 2, third_uid, third_gid, third_ts);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_get_message_count(&buf), "Failed on count after push into cleared ring");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, kmsgpipe_pop(&buf, out_buf, third_uid, third_gid), "Failed on pop after clear and push");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(third_data, out_buf, 2, "Failed on payload pushed after clear");
+    TEST_ASSERT_EACH_EQUAL_UINT8_MESSAGE(0xA5, out_buf + 2, sizeof(out_buf) - 2, "Failed on stale bytes past message length");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENODATA, kmsgpipe_pop(&buf, out_buf, 0, 0), "Failed on stale second slot");
+}
+
+void should_reset_occupancy_when_generation_wraps(void)
+{
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    kmsgpipe_push(&buf, first_data, 4, first_uid, first_gid, first_ts);
+    buf.generation = (unsigned long)-1;
+    occupancy_buf[1] = buf.generation;
+    kmsgpipe_push(&buf, second_data, 4, second_uid, second_gid, second_ts);
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, kmsgpipe_clear(&buf), "Failed on clear at last generation");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, buf.generation, "Failed on generation wrapping to zero");
+    TEST_ASSERT_FALSE_MESSAGE(slot_occupied(0), "Failed on first slot after wrap");
+    TEST_ASSERT_FALSE_MESSAGE(slot_occupied(1), "Failed on second slot after wrap");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENODATA, kmsgpipe_pop(&buf, out_buf, 0, 0), "Failed on pop after wrap");
+}
+
+void should_keep_count_and_occupancy_through_wraparound(void)
+{
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    for (int round = 0; round < 3; round++)
+    {
+        kmsgpipe_push(&buf, first_data, strlen((char *)first_data), first_uid, first_gid, first_ts);
+        kmsgpipe_push(&buf, second_data, strlen((char *)second_data), second_uid, second_gid, second_ts);
+        assert_occupancy_matches_records();
+
+        kmsgpipe_pop(&buf, out_buf, 0, 0);
+        assert_occupancy_matches_records();
+        TEST_ASSERT_EQUAL_INT_MESSAGE(round + 1, kmsgpipe_get_message_count(&buf), "Failed on count after wrapped push/pop round");
+    }
+
+    /* Three messages left behind, one more fills the ring */
+    kmsgpipe_push(&buf, forth_data, strlen((char *)forth_data), forth_uid, forth_gid, forth_ts);
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_full(&buf), "Failed on full check after wraparound");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENOSPC, kmsgpipe_push(&buf, first_data, 1, first_uid, first_gid, first_ts), "Failed on push into full wrapped buffer");
+    assert_occupancy_matches_records();
+
+    while (kmsgpipe_pop(&buf, out_buf, 0, 0) > 0)
+        ;
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&buf), "Failed on empty check after draining wrapped buffer");
+    assert_occupancy_matches_records();
+}
+
+void should_keep_count_and_occupancy_through_expiry(void)
+{
+    kmsgpipe_push(&buf, first_data, strlen((char *)first_data), first_uid, first_gid, first_ts);
+    kmsgpipe_push(&buf, second_data, strlen((char *)second_data), second_uid, second_gid, second_ts);
+    kmsgpipe_push(&buf, third_data, strlen((char *)third_data), third_uid, third_gid, third_ts);
+    kmsgpipe_push(&buf, forth_data, strlen((char *)forth_data), forth_uid, forth_gid, forth_ts);
+
+    kmsgpipe_cleanup_expired(&buf, second_ts + 5);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, kmsgpipe_get_message_count(&buf), "Failed on count after expiry");
+    TEST_ASSERT_FALSE_MESSAGE(slot_occupied(0), "Failed on occupancy of first expired slot");
+    TEST_ASSERT_FALSE_MESSAGE(slot_occupied(1), "Failed on occupancy of second expired slot");
+    assert_occupancy_matches_records();
+
+    /* Refill the two expired slots (head wraps) and expire across the wrap */
+    kmsgpipe_push(&buf, first_data, strlen((char *)first_data), first_uid, first_gid, forth_ts + 10);
+    kmsgpipe_push(&buf, second_data, strlen((char *)second_data), second_uid, second_gid, forth_ts + 20);
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_full(&buf), "Failed on full check after refilling expired slots");
+
+    ssize_t expired = kmsgpipe_cleanup_expired(&buf, forth_ts + 15);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, expired, "Failed on expiry across wraparound");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_get_message_count(&buf), "Failed on count after expiry across wraparound");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, buf.tail, "Failed on tail after expiry across wraparound");
+    assert_occupancy_matches_records();
+}
+
+void should_reject_packed_ring_that_cannot_hold_largest_message(void)
+{
+    int ret_val = kmsgpipe_init_packed(&packed_buf, packed_base, TEST_PACKED_SIZE, TEST_PACKED_SIZE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, ret_val, "Failed on rejecting max message larger than packed ring");
+
+    ret_val = kmsgpipe_init_packed(&packed_buf, packed_base, TEST_PACKED_SIZE - 1, TEST_DATA_SIZE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, ret_val, "Failed on rejecting unaligned packed ring size");
+}
+
+void should_pack_messages_by_length_in_packed_layout(void)
+{
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    kmsgpipe_init_packed(&packed_buf, packed_base, TEST_PACKED_SIZE, TEST_DATA_SIZE);
+
+    /* Short messages take less than a record sized for "first data" */
+    for (int i = 0; i < 4; i++)
+        TEST_ASSERT_EQUAL_INT_MESSAGE(5, kmsgpipe_push(&packed_buf, forth_data, 5, forth_uid, forth_gid, forth_ts), "Failed on packed push");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4 * KMSGPIPE_PACKED_RECORD_SIZE(5), packed_buf.used, "Failed on packed bytes used");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, kmsgpipe_get_message_count(&packed_buf), "Failed on packed message count");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EMSGSIZE, kmsgpipe_push(&packed_buf, first_data, TEST_DATA_SIZE + 1, first_uid, first_gid, first_ts), "Failed on packed oversized push");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EACCES, kmsgpipe_pop(&packed_buf, out_buf, first_uid, first_gid), "Failed on packed unauthorized pop");
+
+    for (int i = 0; i < 4; i++)
+    {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(5, kmsgpipe_pop(&packed_buf, out_buf, forth_uid, forth_gid), "Failed on packed pop");
+        TEST_ASSERT_EQUAL_MEMORY_MESSAGE(forth_data, out_buf, 5, "Failed on packed popped payload");
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENODATA, kmsgpipe_pop(&packed_buf, out_buf, 0, 0), "Failed on packed pop from empty ring");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, packed_buf.used, "Failed on packed bytes used after draining");
+}
+
+void should_wrap_packed_records_with_padding(void)
+{
+    uint8_t out_buf[TEST_DATA_SIZE];
+    uint8_t long_data[TEST_DATA_SIZE];
+
+    memset(long_data, 'x', sizeof(long_data));
+    kmsgpipe_init_packed(&packed_buf, packed_base, TEST_PACKED_SIZE, TEST_DATA_SIZE);
+
+    /* Two max-size records leave less than a third one before the end */
+    kmsgpipe_push(&packed_buf, long_data, TEST_DATA_SIZE, first_uid, first_gid, first_ts);
+    kmsgpipe_push(&packed_buf, long_data, TEST_DATA_SIZE, second_uid, second_gid, second_ts);
+    TEST_ASSERT_TRUE_MESSAGE(TEST_PACKED_SIZE - packed_buf.head < KMSGPIPE_PACKED_RECORD_SIZE(TEST_DATA_SIZE), "Failed on test precondition for padding");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENOSPC, kmsgpipe_push(&packed_buf, long_data, TEST_DATA_SIZE, third_uid, third_gid, third_ts), "Failed on push that does not fit before or after the end");
+
+    /* Freeing the first record makes room at offset 0, the remainder becomes padding */
+    kmsgpipe_pop(&packed_buf, out_buf, first_uid, first_gid);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(TEST_DATA_SIZE, kmsgpipe_push(&packed_buf, long_data, TEST_DATA_SIZE, third_uid, third_gid, third_ts), "Failed on padded packed push");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(KMSGPIPE_PACKED_RECORD_SIZE(TEST_DATA_SIZE), packed_buf.head, "Failed on packed head after padded push");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(TEST_PACKED_SIZE, packed_buf.used, "Failed on padding counted as used bytes");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(TEST_DATA_SIZE, kmsgpipe_pop(&packed_buf, out_buf, second_uid, second_gid), "Failed on pop before padding");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(TEST_DATA_SIZE, kmsgpipe_pop(&packed_buf, out_buf, third_uid, third_gid), "Failed on pop across padding");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(long_data, out_buf, TEST_DATA_SIZE, "Failed on payload after padding");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, packed_buf.used, "Failed on packed bytes used after padding");
+
+    /* Leave a remainder too short for a header: it is skipped without a pad marker */
+    for (int i = 0; i < 3; i++)
+        kmsgpipe_push(&packed_buf, first_data, 10, first_uid, first_gid, first_ts);
+    kmsgpipe_push(&packed_buf, first_data, 0, first_uid, first_gid, first_ts);
+    TEST_ASSERT_TRUE_MESSAGE(TEST_PACKED_SIZE - packed_buf.head < sizeof(kmsg_packed_hdr_t), "Failed on test precondition for short remainder");
+
+    kmsgpipe_pop(&packed_buf, out_buf, first_uid, first_gid);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(6, kmsgpipe_push(&packed_buf, second_data, 6, second_uid, second_gid, second_ts), "Failed on push wrapping past short remainder");
+    for (int i = 0; i < 3; i++)
+        kmsgpipe_pop(&packed_buf, out_buf, first_uid, first_gid);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(6, kmsgpipe_pop(&packed_buf, out_buf, second_uid, second_gid), "Failed on pop past short remainder");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(second_data, out_buf, 6, "Failed on payload past short remainder");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&packed_buf), "Failed on empty packed ring after short remainder");
+}
+
+void should_expire_and_clear_packed_records(void)
+{
+    kmsgpipe_init_packed(&packed_buf, packed_base, TEST_PACKED_SIZE, TEST_DATA_SIZE);
+
+    kmsgpipe_push(&packed_buf, first_data, 10, first_uid, first_gid, first_ts);
+    kmsgpipe_push(&packed_buf, second_data, 6, second_uid, second_gid, second_ts);
+    kmsgpipe_push(&packed_buf, third_data, 8, third_uid, third_gid, third_ts);
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, kmsgpipe_cleanup_expired(&packed_buf, second_ts + 5), "Failed on packed expiry count");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_get_message_count(&packed_buf), "Failed on packed count after expiry");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(KMSGPIPE_PACKED_RECORD_SIZE(8), packed_buf.used, "Failed on packed bytes used after expiry");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_clear(&packed_buf), "Failed on packed clear count");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&packed_buf), "Failed on packed empty after clear");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, packed_buf.used, "Failed on packed bytes used after clear");
+}
+
+void should_reject_spsc_ring_with_non_power_of_two_capacity(void)
+{
+    kmsgpipe_buffer_t spsc_buf;
+    int ret_val = kmsgpipe_init_spsc(&spsc_buf, base_buffer, record_buf, TEST_CAPACITY - 1, TEST_DATA_SIZE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, ret_val, "Failed on rejecting non power of two SPSC capacity");
+}
+
+void should_push_and_pop_in_order_with_free_running_spsc_indices(void)
+{
+    kmsgpipe_buffer_t spsc_buf;
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_init_spsc(&spsc_buf, base_buffer, record_buf, TEST_CAPACITY, TEST_DATA_SIZE), "Failed on SPSC init");
+
+    for (int round = 0; round < 3; round++)
+    {
+        kmsgpipe_push(&spsc_buf, first_data, strlen((char *)first_data), first_uid, first_gid, first_ts);
+        kmsgpipe_push(&spsc_buf, second_data, strlen((char *)second_data), second_uid, second_gid, second_ts);
+        kmsgpipe_push(&spsc_buf, third_data, strlen((char *)third_data), third_uid, third_gid, third_ts);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(3, kmsgpipe_get_message_count(&spsc_buf), "Failed on SPSC count");
+
+        TEST_ASSERT_EQUAL_INT_MESSAGE(-EACCES, kmsgpipe_pop(&spsc_buf, out_buf, second_uid, second_gid), "Failed on SPSC unauthorized pop");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(strlen((char *)first_data), kmsgpipe_pop(&spsc_buf, out_buf, first_uid, first_gid), "Failed on SPSC first pop");
+        TEST_ASSERT_EQUAL_MEMORY_MESSAGE(first_data, out_buf, strlen((char *)first_data), "Failed on SPSC first payload");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(strlen((char *)second_data), kmsgpipe_pop(&spsc_buf, out_buf, second_uid, second_gid), "Failed on SPSC second pop");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(strlen((char *)third_data), kmsgpipe_pop(&spsc_buf, out_buf, third_uid, third_gid), "Failed on SPSC third pop");
+        TEST_ASSERT_EQUAL_MEMORY_MESSAGE(third_data, out_buf, strlen((char *)third_data), "Failed on SPSC third payload");
+    }
+
+    /* Indices are not reduced modulo capacity, only masked on access */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(9, spsc_buf.head, "Failed on SPSC free-running head");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(9, spsc_buf.tail, "Failed on SPSC free-running tail");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&spsc_buf), "Failed on SPSC empty check");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENODATA, kmsgpipe_pop(&spsc_buf, out_buf, 0, 0), "Failed on SPSC pop from empty ring");
+}
+
+void should_report_full_and_expire_in_spsc_ring(void)
+{
+    kmsgpipe_buffer_t spsc_buf;
+
+    kmsgpipe_init_spsc(&spsc_buf, base_buffer, record_buf, TEST_CAPACITY, TEST_DATA_SIZE);
+    kmsgpipe_push(&spsc_buf, first_data, strlen((char *)first_data), first_uid, first_gid, first_ts);
+    kmsgpipe_push(&spsc_buf, second_data, strlen((char *)second_data), second_uid, second_gid, second_ts);
+    kmsgpipe_push(&spsc_buf, third_data, strlen((char *)third_data), third_uid, third_gid, third_ts);
+    kmsgpipe_push(&spsc_buf, forth_data, strlen((char *)forth_data), forth_uid, forth_gid, forth_ts);
+
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_full(&spsc_buf), "Failed on SPSC full check");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENOSPC, kmsgpipe_push(&spsc_buf, first_data, 1, first_uid, first_gid, first_ts), "Failed on push into full SPSC ring");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, kmsgpipe_cleanup_expired(&spsc_buf, second_ts + 5), "Failed on SPSC expiry count");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, kmsgpipe_get_message_count(&spsc_buf), "Failed on SPSC count after expiry");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_has_room(&spsc_buf, 1), "Failed on SPSC room after expiry");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, kmsgpipe_clear(&spsc_buf), "Failed on SPSC clear count");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&spsc_buf), "Failed on SPSC empty after clear");
+}
+
+#define SPSC_THREAD_MESSAGES 200000
+
+static void *spsc_producer(void *arg)
+{
+    kmsgpipe_buffer_t *spsc_buf = arg;
+
+    for (uint32_t seq = 0; seq < SPSC_THREAD_MESSAGES;)
+    {
+        if (kmsgpipe_push(spsc_buf, (uint8_t *)&seq, sizeof(seq), first_uid, first_gid, seq) > 0)
+            seq++;
+        else
+            sched_yield();
+    }
+    return NULL;
+}
+
+void should_deliver_every_message_in_order_across_spsc_threads(void)
+{
+    kmsgpipe_buffer_t spsc_buf;
+    pthread_t producer;
+    uint32_t expected = 0, got;
+    bool in_order = true;
+
+    kmsgpipe_init_spsc(&spsc_buf, base_buffer, record_buf, TEST_CAPACITY, TEST_DATA_SIZE);
+    pthread_create(&producer, NULL, spsc_producer, &spsc_buf);
+
+    while (expected < SPSC_THREAD_MESSAGES)
+    {
+        if (kmsgpipe_pop(&spsc_buf, (uint8_t *)&got, first_uid, first_gid) < 0)
+        {
+            sched_yield();
+            continue;
+        }
+        if (got != expected)
+            in_order = false;
+        expected++;
+    }
+    pthread_join(producer, NULL);
+
+    TEST_ASSERT_TRUE_MESSAGE(in_order, "Failed on SPSC message order across threads");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&spsc_buf), "Failed on SPSC empty after threaded run");
+}
+
+static void *split_producer(void *arg)
+{
+    (void)arg;
+    for (uint32_t seq = 0; seq < SPSC_THREAD_MESSAGES;)
+    {
+        if (kmsgpipe_push(&buf, (uint8_t *)&seq, sizeof(seq), first_uid, first_gid, seq) > 0)
+            seq++;
+        else
+            sched_yield();
+    }
+    return NULL;
+}
+
+void should_deliver_every_message_in_order_across_split_sides(void)
+{
+    pthread_t producer;
+    uint32_t expected = 0, got;
+    bool in_order = true;
+
+    /* Features that drop messages across the two sides rule a split out, and back */
+    kmsgpipe_init_dedup(&buf);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, kmsgpipe_init_split(&buf), "Failed on rejecting split with dedup");
+    kmsgpipe_init(&buf, base_buffer, record_buf, occupancy_buf, TEST_CAPACITY, TEST_DATA_SIZE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_init_split(&buf), "Failed on split init");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, kmsgpipe_init_dedup(&buf), "Failed on rejecting dedup on split ring");
+
+    /* The producer thread stands in for the write lock, this one for the read lock */
+    pthread_create(&producer, NULL, split_producer, NULL);
+    while (expected < SPSC_THREAD_MESSAGES)
+    {
+        if (kmsgpipe_pop(&buf, (uint8_t *)&got, first_uid, first_gid) < 0)
+        {
+            sched_yield();
+            continue;
+        }
+        if (got != expected)
+            in_order = false;
+        expected++;
+    }
+    pthread_join(producer, NULL);
+
+    TEST_ASSERT_TRUE_MESSAGE(in_order, "Failed on split message order across threads");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&buf), "Failed on split empty after threaded run");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(buf.head, buf.tail, "Failed on split tail caught up with head");
+
+    /* Clear wipes the map rather than retagging it under a running consumer */
+    kmsgpipe_push(&buf, first_data, sizeof(first_data), first_uid, first_gid, first_ts);
+    kmsgpipe_push(&buf, second_data, sizeof(second_data), second_uid, second_gid, second_ts);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, kmsgpipe_clear(&buf), "Failed on split clear count");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, buf.generation, "Failed on split generation kept by clear");
+    TEST_ASSERT_EACH_EQUAL_UINT8(0x00, occupancy_buf, sizeof(occupancy_buf));
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&buf), "Failed on split empty after clear");
+}
+
+void should_push_and_pop_in_order_in_mpmc_ring(void)
+{
+    kmsgpipe_buffer_t mpmc_buf;
+    size_t sequence[TEST_CAPACITY];
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, kmsgpipe_init_mpmc(&mpmc_buf, base_buffer, record_buf, sequence, 3, TEST_DATA_SIZE), "Failed on rejecting non power of two MPMC capacity");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_init_mpmc(&mpmc_buf, base_buffer, record_buf, sequence, TEST_CAPACITY, TEST_DATA_SIZE), "Failed on MPMC init");
+
+    for (int round = 0; round < 3; round++)
+    {
+        kmsgpipe_push(&mpmc_buf, first_data, strlen((char *)first_data), first_uid, first_gid, first_ts);
+        kmsgpipe_push(&mpmc_buf, second_data, strlen((char *)second_data), second_uid, second_gid, second_ts);
+        kmsgpipe_push(&mpmc_buf, third_data, strlen((char *)third_data), third_uid, third_gid, third_ts);
+        kmsgpipe_push(&mpmc_buf, forth_data, strlen((char *)forth_data), forth_uid, forth_gid, forth_ts);
+        TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_full(&mpmc_buf), "Failed on MPMC full check");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(-ENOSPC, kmsgpipe_push(&mpmc_buf, first_data, 1, first_uid, first_gid, first_ts), "Failed on push into full MPMC ring");
+
+        /* A refused reader must not claim the slot */
+        TEST_ASSERT_EQUAL_INT_MESSAGE(-EACCES, kmsgpipe_pop(&mpmc_buf, out_buf, second_uid, second_gid), "Failed on MPMC unauthorized pop");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(strlen((char *)first_data), kmsgpipe_pop(&mpmc_buf, out_buf, first_uid, first_gid), "Failed on MPMC first pop");
+        TEST_ASSERT_EQUAL_MEMORY_MESSAGE(first_data, out_buf, strlen((char *)first_data), "Failed on MPMC first payload");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(strlen((char *)second_data), kmsgpipe_pop(&mpmc_buf, out_buf, second_uid, second_gid), "Failed on MPMC second pop");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(strlen((char *)third_data), kmsgpipe_pop(&mpmc_buf, out_buf, third_uid, third_gid), "Failed on MPMC third pop");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(strlen((char *)forth_data), kmsgpipe_pop(&mpmc_buf, out_buf, forth_uid, forth_gid), "Failed on MPMC forth pop");
+        TEST_ASSERT_EQUAL_MEMORY_MESSAGE(forth_data, out_buf, strlen((char *)forth_data), "Failed on MPMC forth payload");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(-ENODATA, kmsgpipe_pop(&mpmc_buf, out_buf, 0, 0), "Failed on MPMC pop from empty ring");
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(12, mpmc_buf.head, "Failed on MPMC free-running head");
+}
+
+void should_expire_and_clear_mpmc_ring(void)
+{
+    kmsgpipe_buffer_t mpmc_buf;
+    size_t sequence[TEST_CAPACITY];
+
+    kmsgpipe_init_mpmc(&mpmc_buf, base_buffer, record_buf, sequence, TEST_CAPACITY, TEST_DATA_SIZE);
+    kmsgpipe_push(&mpmc_buf, first_data, strlen((char *)first_data), first_uid, first_gid, first_ts);
+    kmsgpipe_push(&mpmc_buf, second_data, strlen((char *)second_data), second_uid, second_gid, second_ts);
+    kmsgpipe_push(&mpmc_buf, third_data, strlen((char *)third_data), third_uid, third_gid, third_ts);
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, kmsgpipe_cleanup_expired(&mpmc_buf, second_ts + 5), "Failed on MPMC expiry count");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_get_message_count(&mpmc_buf), "Failed on MPMC count after expiry");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_clear(&mpmc_buf), "Failed on MPMC clear count");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&mpmc_buf), "Failed on MPMC empty after clear");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, kmsgpipe_push(&mpmc_buf, first_data, 4, first_uid, first_gid, first_ts), "Failed on MPMC push after clear");
+
+    /* Clear with a full ring: every ticket has to be handed back to producers */
+    for (int i = 1; i < TEST_CAPACITY; i++)
+        kmsgpipe_push(&mpmc_buf, second_data, 4, second_uid, second_gid, second_ts);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(TEST_CAPACITY, kmsgpipe_clear(&mpmc_buf), "Failed on MPMC clear of full ring");
+    for (int i = 0; i < TEST_CAPACITY; i++)
+        TEST_ASSERT_EQUAL_INT_MESSAGE(4, kmsgpipe_push(&mpmc_buf, third_data, 4, third_uid, third_gid, third_ts), "Failed on MPMC refill after clear");
+    uint8_t out_buf[TEST_DATA_SIZE];
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, kmsgpipe_pop(&mpmc_buf, out_buf, third_uid, third_gid), "Failed on MPMC pop after refill");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(third_data, out_buf, 4, "Failed on MPMC payload after refill");
+}
+
+#define MPMC_THREADS 4
+#define MPMC_MESSAGES_PER_THREAD 50000
+
+static kmsgpipe_buffer_t mpmc_thread_buf;
+static uint8_t mpmc_seen[MPMC_THREADS * MPMC_MESSAGES_PER_THREAD];
+
+static void *mpmc_producer(void *arg)
+{
+    uint32_t first = (uint32_t)(uintptr_t)arg * MPMC_MESSAGES_PER_THREAD;
+
+    for (uint32_t seq = first; seq < first + MPMC_MESSAGES_PER_THREAD;)
+    {
+        if (kmsgpipe_push(&mpmc_thread_buf, (uint8_t *)&seq, sizeof(seq), first_uid, first_gid, seq) > 0)
+            seq++;
+        else
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void *mpmc_consumer(void *arg)
+{
+    uint32_t got;
+
+    (void)arg;
+    for (int n = 0; n < MPMC_MESSAGES_PER_THREAD;)
+    {
+        if (kmsgpipe_pop(&mpmc_thread_buf, (uint8_t *)&got, first_uid, first_gid) > 0)
+        {
+            __atomic_fetch_add(&mpmc_seen[got], 1, __ATOMIC_RELAXED);
+            n++;
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+void should_deliver_every_message_exactly_once_across_mpmc_threads(void)
+{
+    size_t sequence[TEST_CAPACITY];
+    pthread_t producers[MPMC_THREADS], consumers[MPMC_THREADS];
+
+    memset(mpmc_seen, 0, sizeof(mpmc_seen));
+    kmsgpipe_init_mpmc(&mpmc_thread_buf, base_buffer, record_buf, sequence, TEST_CAPACITY, TEST_DATA_SIZE);
+
+    for (uintptr_t i = 0; i < MPMC_THREADS; i++)
+    {
+        pthread_create(&consumers[i], NULL, mpmc_consumer, NULL);
+        pthread_create(&producers[i], NULL, mpmc_producer, (void *)i);
+    }
+    for (int i = 0; i < MPMC_THREADS; i++)
+    {
+        pthread_join(producers[i], NULL);
+        pthread_join(consumers[i], NULL);
+    }
+
+    TEST_ASSERT_EACH_EQUAL_UINT8_MESSAGE(1, mpmc_seen, sizeof(mpmc_seen), "Failed on every MPMC message delivered exactly once");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&mpmc_thread_buf), "Failed on MPMC empty after threaded run");
+}
+
+void should_reserve_commit_and_cancel_in_slot_layout(void)
+{
+    kmsgpipe_span_t span;
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    /* A cancelled reservation leaves no trace */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EMSGSIZE, kmsgpipe_reserve(&buf, TEST_DATA_SIZE + 1, &span), "Failed on oversized reservation");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_reserve(&buf, TEST_DATA_SIZE, &span), "Failed on reservation");
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(base_buffer, span.data, "Failed on reservation pointing into slot 0");
+    memcpy(span.data, first_data, sizeof(first_data));
+    kmsgpipe_cancel(&buf, &span);
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&buf), "Failed on empty ring after cancel");
+    assert_occupancy_matches_records();
+
+    /* Committing less than reserved, or more, which cancels */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_reserve(&buf, TEST_DATA_SIZE, &span), "Failed on second reservation");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, kmsgpipe_commit(&buf, &span, TEST_DATA_SIZE + 1, first_uid, first_gid, first_ts), "Failed on commit past reservation");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&buf), "Failed on empty ring after bad commit");
+    kmsgpipe_reserve(&buf, TEST_DATA_SIZE, &span);
+    memcpy(span.data, first_data, sizeof(first_data));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(sizeof(first_data), kmsgpipe_commit(&buf, &span, sizeof(first_data), first_uid, first_gid, first_ts), "Failed on commit");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, buf.head, "Failed on head after commit");
+    assert_occupancy_matches_records();
+
+    /* Peeking does not consume until released with consume set */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EACCES, kmsgpipe_peek(&buf, second_uid, second_gid, &span), "Failed on unauthorized peek");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_peek(&buf, first_uid, first_gid, &span), "Failed on peek");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(sizeof(first_data), span.len, "Failed on peeked length");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(first_data, span.data, sizeof(first_data), "Failed on peeked payload");
+    kmsgpipe_peek_release(&buf, &span, false);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_get_message_count(&buf), "Failed on count after release without consume");
+
+    kmsgpipe_peek(&buf, first_uid, first_gid, &span);
+    kmsgpipe_peek_release(&buf, &span, true);
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&buf), "Failed on empty ring after consuming release");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENODATA, kmsgpipe_pop(&buf, out_buf, first_uid, first_gid), "Failed on pop after consuming release");
+    assert_occupancy_matches_records();
+}
+
+void should_interleave_one_reservation_with_one_peek(void)
+{
+    kmsgpipe_span_t reserved, peeked;
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_copy_unlocked(&buf), "Failed on slot ring copying unlocked");
+    kmsgpipe_push(&buf, first_data, sizeof(first_data), first_uid, first_gid, first_ts);
+
+    /* A writer copies into its slot while a reader copies out and drains the ring */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_reserve(&buf, TEST_DATA_SIZE, &reserved), "Failed on reservation");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_peek(&buf, first_uid, first_gid, &peeked), "Failed on peek beside reservation");
+    memcpy(reserved.data, second_data, sizeof(second_data));
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(first_data, peeked.data, sizeof(first_data), "Failed on peeked payload beside reservation");
+    kmsgpipe_peek_release(&buf, &peeked, true);
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&buf), "Failed on ring drained under reservation");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENODATA, kmsgpipe_peek(&buf, second_uid, second_gid, &peeked), "Failed on reservation hidden from readers");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(sizeof(second_data), kmsgpipe_commit(&buf, &reserved, sizeof(second_data), second_uid, second_gid, second_ts), "Failed on commit after drain");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(sizeof(second_data), kmsgpipe_pop(&buf, out_buf, second_uid, second_gid), "Failed on pop of committed reservation");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(second_data, out_buf, sizeof(second_data), "Failed on payload written beside a reader");
+    assert_occupancy_matches_records();
+
+    /* Rings that move head or drop messages from the write side copy locked */
+    kmsgpipe_init_packed(&packed_buf, packed_base, TEST_PACKED_SIZE, TEST_DATA_SIZE);
+    TEST_ASSERT_FALSE_MESSAGE(kmsgpipe_copy_unlocked(&packed_buf), "Failed on packed ring copying locked");
+    kmsgpipe_init_dedup(&buf);
+    TEST_ASSERT_FALSE_MESSAGE(kmsgpipe_copy_unlocked(&buf), "Failed on dedup ring copying locked");
+}
+
+void should_reserve_across_wrap_padding_in_packed_layout(void)
+{
+    kmsgpipe_span_t span;
+    uint8_t out_buf[TEST_DATA_SIZE];
+    uint8_t long_data[TEST_DATA_SIZE];
+    size_t head, used;
+
+    memset(long_data, 'x', sizeof(long_data));
+    kmsgpipe_init_packed(&packed_buf, packed_base, TEST_PACKED_SIZE, TEST_DATA_SIZE);
+    kmsgpipe_push(&packed_buf, long_data, TEST_DATA_SIZE, first_uid, first_gid, first_ts);
+    kmsgpipe_push(&packed_buf, long_data, TEST_DATA_SIZE, second_uid, second_gid, second_ts);
+    kmsgpipe_pop(&packed_buf, out_buf, first_uid, first_gid);
+    head = packed_buf.head;
+    used = packed_buf.used;
+
+    /* The reservation lands after wrap padding, but nothing moves until commit */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_reserve(&packed_buf, TEST_DATA_SIZE, &span), "Failed on packed reservation");
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(packed_base + sizeof(kmsg_packed_hdr_t), span.data, "Failed on packed reservation after wrap");
+    kmsgpipe_cancel(&packed_buf, &span);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(head, packed_buf.head, "Failed on packed head after cancel");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(used, packed_buf.used, "Failed on packed bytes used after cancel");
+
+    kmsgpipe_reserve(&packed_buf, TEST_DATA_SIZE, &span);
+    memcpy(span.data, third_data, sizeof(third_data));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(sizeof(third_data), kmsgpipe_commit(&packed_buf, &span, sizeof(third_data), third_uid, third_gid, third_ts), "Failed on packed commit");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(KMSGPIPE_PACKED_RECORD_SIZE(sizeof(third_data)), packed_buf.head, "Failed on packed head sized by committed length");
+
+    kmsgpipe_pop(&packed_buf, out_buf, second_uid, second_gid);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_peek(&packed_buf, third_uid, third_gid, &span), "Failed on packed peek across padding");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(third_data, span.data, sizeof(third_data), "Failed on packed peeked payload");
+    kmsgpipe_peek_release(&packed_buf, &span, true);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, packed_buf.used, "Failed on packed bytes used after release");
+}
+
+void should_keep_message_on_release_without_consume_in_spsc_ring(void)
+{
+    kmsgpipe_buffer_t spsc_buf;
+    kmsgpipe_span_t span;
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    kmsgpipe_init_spsc(&spsc_buf, base_buffer, record_buf, TEST_CAPACITY, TEST_DATA_SIZE);
+    kmsgpipe_reserve(&spsc_buf, TEST_DATA_SIZE, &span);
+    kmsgpipe_cancel(&spsc_buf, &span);
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&spsc_buf), "Failed on SPSC empty after cancel");
+
+    kmsgpipe_reserve(&spsc_buf, TEST_DATA_SIZE, &span);
+    memcpy(span.data, second_data, sizeof(second_data));
+    kmsgpipe_commit(&spsc_buf, &span, sizeof(second_data), second_uid, second_gid, second_ts);
+
+    kmsgpipe_peek(&spsc_buf, second_uid, second_gid, &span);
+    kmsgpipe_peek_release(&spsc_buf, &span, false);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(sizeof(second_data), kmsgpipe_pop(&spsc_buf, out_buf, second_uid, second_gid), "Failed on SPSC pop after release without consume");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(second_data, out_buf, sizeof(second_data), "Failed on SPSC payload after release without consume");
+}
+
+void should_skip_cancelled_reservation_in_mpmc_ring(void)
+{
+    kmsgpipe_buffer_t mpmc_buf;
+    size_t sequence[TEST_CAPACITY];
+    kmsgpipe_span_t first_span, second_span;
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    kmsgpipe_init_mpmc(&mpmc_buf, base_buffer, record_buf, sequence, TEST_CAPACITY, TEST_DATA_SIZE);
+
+    /* Two producers hold slots; the earlier one gives up after the later commits */
+    kmsgpipe_reserve(&mpmc_buf, TEST_DATA_SIZE, &first_span);
+    kmsgpipe_reserve(&mpmc_buf, TEST_DATA_SIZE, &second_span);
+    memcpy(second_span.data, second_data, sizeof(second_data));
+    kmsgpipe_commit(&mpmc_buf, &second_span, sizeof(second_data), second_uid, second_gid, second_ts);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENODATA, kmsgpipe_pop(&mpmc_buf, out_buf, second_uid, second_gid), "Failed on MPMC pop behind open reservation");
+    kmsgpipe_cancel(&mpmc_buf, &first_span);
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(sizeof(second_data), kmsgpipe_pop(&mpmc_buf, out_buf, second_uid, second_gid), "Failed on MPMC pop past cancelled slot");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(second_data, out_buf, sizeof(second_data), "Failed on MPMC payload past cancelled slot");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&mpmc_buf), "Failed on MPMC empty after skipping cancelled slot");
+
+    /* A cancelled slot is retired by expiry too, and the ring keeps cycling */
+    kmsgpipe_reserve(&mpmc_buf, TEST_DATA_SIZE, &first_span);
+    kmsgpipe_cancel(&mpmc_buf, &first_span);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_cleanup_expired(&mpmc_buf, forth_ts), "Failed on MPMC expiry of cancelled slot");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&mpmc_buf), "Failed on MPMC empty after expiring cancelled slot");
+    for (int i = 0; i < TEST_CAPACITY; i++)
+        TEST_ASSERT_EQUAL_INT_MESSAGE(5, kmsgpipe_push(&mpmc_buf, forth_data, 5, forth_uid, forth_gid, forth_ts), "Failed on MPMC push after cancelled slots");
+}
+
+#define TEST_COMPACT_CREDS 2
+#define TEST_COMPACT_META_WORDS \
+    ((KMSGPIPE_COMPACT_META_SIZE(TEST_CAPACITY, TEST_COMPACT_CREDS) + sizeof(unsigned long) - 1) / sizeof(unsigned long))
+
+static unsigned long compact_meta[TEST_COMPACT_META_WORDS];
+
+void should_push_pop_and_check_access_in_compact_layout(void)
+{
+    kmsgpipe_buffer_t compact_buf;
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, kmsgpipe_init_compact(&compact_buf, base_buffer, compact_meta, TEST_CAPACITY, TEST_DATA_SIZE, 0, 0), "Failed on rejecting empty credential table");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_init_compact(&compact_buf, base_buffer, compact_meta, TEST_CAPACITY, TEST_DATA_SIZE, TEST_COMPACT_CREDS, 0), "Failed on compact init");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(KMSGPIPE_LAYOUT_COMPACT, compact_buf.layout, "Failed on compact layout field");
+    TEST_ASSERT_TRUE_MESSAGE(KMSGPIPE_COMPACT_META_SIZE(TEST_CAPACITY, 0) / TEST_CAPACITY <= 8 + sizeof(unsigned long), "Failed on compact metadata per slot");
+
+    kmsgpipe_push(&compact_buf, first_data, sizeof(first_data), first_uid, first_gid, first_ts);
+    kmsgpipe_push(&compact_buf, second_data, sizeof(second_data), first_uid, first_gid, second_ts);
+    kmsgpipe_push(&compact_buf, third_data, sizeof(third_data), third_uid, third_gid, third_ts);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, compact_buf.creds[0].refs, "Failed on shared credential entry");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, compact_buf.creds[1].refs, "Failed on second credential entry");
+
+    /* Every entry is in use: a third owner has to wait for the table to drain */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EUSERS, kmsgpipe_push(&compact_buf, forth_data, sizeof(forth_data), forth_uid, forth_gid, forth_ts), "Failed on full credential table");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, kmsgpipe_get_message_count(&compact_buf), "Failed on count after refused push");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, compact_buf.head, "Failed on head after refused push");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EACCES, kmsgpipe_pop(&compact_buf, out_buf, second_uid, second_gid), "Failed on compact unauthorized pop");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(sizeof(first_data), kmsgpipe_pop(&compact_buf, out_buf, first_uid, first_gid), "Failed on compact first pop");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(first_data, out_buf, sizeof(first_data), "Failed on compact first payload");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(sizeof(second_data), kmsgpipe_pop(&compact_buf, out_buf, 0, 0), "Failed on compact root pop");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, compact_buf.creds[0].refs, "Failed on credential entry released");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(sizeof(forth_data), kmsgpipe_push(&compact_buf, forth_data, sizeof(forth_data), forth_uid, forth_gid, forth_ts), "Failed on push reusing freed credential entry");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(sizeof(third_data), kmsgpipe_pop(&compact_buf, out_buf, third_uid, third_gid), "Failed on compact third pop");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(sizeof(forth_data), kmsgpipe_pop(&compact_buf, out_buf, forth_uid, forth_gid), "Failed on compact forth pop");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(forth_data, out_buf, sizeof(forth_data), "Failed on compact forth payload");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&compact_buf), "Failed on compact empty ring");
+}
+
+void should_expire_by_timestamp_delta_in_compact_layout(void)
+{
+    kmsgpipe_buffer_t compact_buf;
+
+    kmsgpipe_init_compact(&compact_buf, base_buffer, compact_meta, TEST_CAPACITY, TEST_DATA_SIZE, TEST_COMPACT_CREDS, 0);
+    kmsgpipe_push(&compact_buf, first_data, 4, first_uid, first_gid, first_ts);
+    kmsgpipe_push(&compact_buf, second_data, 4, first_uid, first_gid, second_ts);
+    kmsgpipe_push(&compact_buf, third_data, 4, first_uid, first_gid, third_ts);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(first_ts, compact_buf.epoch, "Failed on epoch taken from first message");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(third_ts - first_ts, compact_buf.ts_delta[2], "Failed on stored timestamp delta");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, kmsgpipe_cleanup_expired(&compact_buf, second_ts + 5), "Failed on compact expiry count");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, compact_buf.creds[0].refs, "Failed on credential refs after expiry");
+
+    /* A delta past 32 bits slides the epoch up to the oldest message */
+    ktime_t newest_ts = third_ts + KMSGPIPE_COMPACT_TS_MAX;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, kmsgpipe_push(&compact_buf, forth_data, 4, first_uid, first_gid, newest_ts), "Failed on push past 32-bit delta");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(third_ts, compact_buf.epoch, "Failed on rebased epoch");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, compact_buf.ts_delta[2], "Failed on rebased oldest delta");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_cleanup_expired(&compact_buf, third_ts + 1), "Failed on expiry after rebase");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_cleanup_expired(&compact_buf, newest_ts), "Failed on keeping newest after rebase");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_cleanup_expired(&compact_buf, newest_ts + 1), "Failed on expiring newest after rebase");
+
+    kmsgpipe_push(&compact_buf, first_data, 4, first_uid, first_gid, first_ts);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_clear(&compact_buf), "Failed on compact clear count");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, compact_buf.creds[0].refs, "Failed on credential table after clear");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&compact_buf), "Failed on compact empty after clear");
+}
+
+static kmsg_inline_record_t inline_lines[TEST_CAPACITY];
+
+void should_store_small_messages_inline_and_large_in_slots(void)
+{
+    kmsgpipe_buffer_t inline_buf;
+    kmsgpipe_span_t span;
+    uint8_t out_buf[TEST_DATA_SIZE];
+    uint8_t long_data[TEST_DATA_SIZE];
+
+    memset(long_data, 'x', sizeof(long_data));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(KMSGPIPE_INLINE_RECORD_SIZE, sizeof(kmsg_inline_record_t), "Failed on inline record filling one cache line");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, kmsgpipe_init_inline(&inline_buf, base_buffer, inline_lines, occupancy_buf, TEST_CAPACITY, TEST_DATA_SIZE, KMSGPIPE_INLINE_MAX + 1), "Failed on rejecting oversized inline threshold");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, kmsgpipe_init_inline(&inline_buf, NULL, inline_lines, occupancy_buf, TEST_CAPACITY, TEST_DATA_SIZE, 16), "Failed on rejecting missing payload area");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_init_inline(&inline_buf, base_buffer, inline_lines, occupancy_buf, TEST_CAPACITY, TEST_DATA_SIZE, 16), "Failed on inline init");
+
+    kmsgpipe_push(&inline_buf, first_data, sizeof(first_data), first_uid, first_gid, first_ts);
+    kmsgpipe_push(&inline_buf, long_data, sizeof(long_data), second_uid, second_gid, second_ts);
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(first_data, inline_lines[0].data, sizeof(first_data), "Failed on small payload stored in its record");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(long_data, base_buffer + TEST_DATA_SIZE, sizeof(long_data), "Failed on large payload stored in its slot");
+
+    /* Reserved large, committed small: the payload must still be found inline */
+    kmsgpipe_reserve(&inline_buf, TEST_DATA_SIZE, &span);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(base_buffer + 2 * TEST_DATA_SIZE, span.data, "Failed on large reservation pointing at slot");
+    memcpy(span.data, third_data, sizeof(third_data));
+    kmsgpipe_commit(&inline_buf, &span, sizeof(third_data), third_uid, third_gid, third_ts);
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(third_data, inline_lines[2].data, sizeof(third_data), "Failed on short commit moved inline");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EACCES, kmsgpipe_pop(&inline_buf, out_buf, second_uid, second_gid), "Failed on inline unauthorized pop");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(sizeof(first_data), kmsgpipe_pop(&inline_buf, out_buf, first_uid, first_gid), "Failed on inline first pop");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(first_data, out_buf, sizeof(first_data), "Failed on inline first payload");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(sizeof(long_data), kmsgpipe_pop(&inline_buf, out_buf, second_uid, second_gid), "Failed on inline large pop");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(long_data, out_buf, sizeof(long_data), "Failed on inline large payload");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_cleanup_expired(&inline_buf, forth_ts), "Failed on inline expiry");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&inline_buf), "Failed on inline empty ring");
+}
+
+void should_run_inline_ring_without_payload_area(void)
+{
+    kmsgpipe_buffer_t inline_buf;
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_init_inline(&inline_buf, NULL, inline_lines, occupancy_buf, TEST_CAPACITY, 12, 12), "Failed on inline init without payload area");
+    for (int round = 0; round < 2; round++)
+    {
+        for (int i = 0; i < TEST_CAPACITY; i++)
+            TEST_ASSERT_EQUAL_INT_MESSAGE(sizeof(first_data), kmsgpipe_push(&inline_buf, first_data, sizeof(first_data), first_uid, first_gid, first_ts), "Failed on inline-only push");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(-ENOSPC, kmsgpipe_push(&inline_buf, first_data, 1, first_uid, first_gid, first_ts), "Failed on inline-only full ring");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(-EMSGSIZE, kmsgpipe_push(&inline_buf, base_buffer, 13, first_uid, first_gid, first_ts), "Failed on inline-only oversized push");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(sizeof(first_data), kmsgpipe_pop(&inline_buf, out_buf, first_uid, first_gid), "Failed on inline-only pop");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(TEST_CAPACITY - 1, kmsgpipe_clear(&inline_buf), "Failed on inline-only clear");
+    }
+}
+
+#define TEST_RESIZE_CAPACITY (2 * TEST_CAPACITY)
+
+static uint8_t resize_base[TEST_RESIZE_CAPACITY * TEST_DATA_SIZE];
+static kmsg_record_t resize_records[TEST_RESIZE_CAPACITY];
+static unsigned long resize_occupancy[KMSGPIPE_BITMAP_WORDS(TEST_RESIZE_CAPACITY)];
+
+/* Queue third, forth, first, second with head wrapped past the end */
+static void fill_wrapped_queue(void)
+{
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    kmsgpipe_push(&buf, first_data, strlen((char *)first_data), first_uid, first_gid, first_ts);
+    kmsgpipe_push(&buf, second_data, strlen((char *)second_data), second_uid, second_gid, second_ts);
+    kmsgpipe_push(&buf, third_data, strlen((char *)third_data), third_uid, third_gid, third_ts);
+    kmsgpipe_push(&buf, forth_data, strlen((char *)forth_data), forth_uid, forth_gid, forth_ts);
+    kmsgpipe_pop(&buf, out_buf, first_uid, first_gid);
+    kmsgpipe_pop(&buf, out_buf, second_uid, second_gid);
+    kmsgpipe_push(&buf, first_data, strlen((char *)first_data), first_uid, first_gid, first_ts);
+    kmsgpipe_push(&buf, second_data, strlen((char *)second_data), second_uid, second_gid, second_ts);
+}
+
+void should_migrate_messages_in_fifo_order_across_layouts(void)
+{
+    kmsgpipe_buffer_t resized;
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    fill_wrapped_queue();
+    kmsgpipe_init_packed(&packed_buf, packed_base, TEST_PACKED_SIZE, TEST_DATA_SIZE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, kmsgpipe_migrate(&packed_buf, &buf), "Failed on migrating slot ring into packed ring");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, kmsgpipe_get_message_count(&buf), "Failed on leaving source untouched");
+
+    kmsgpipe_init(&resized, resize_base, resize_records, resize_occupancy, TEST_RESIZE_CAPACITY, TEST_DATA_SIZE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, kmsgpipe_migrate(&resized, &packed_buf), "Failed on migrating packed ring into larger ring");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(third_ts, resize_records[0].timestamp, "Failed on keeping timestamp");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(forth_uid, resize_records[1].owner_uid, "Failed on keeping owner");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(strlen((char *)third_data), kmsgpipe_pop(&resized, out_buf, third_uid, third_gid), "Failed on first migrated pop");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(third_data, out_buf, strlen((char *)third_data), "Failed on first migrated payload");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(strlen((char *)forth_data), kmsgpipe_pop(&resized, out_buf, forth_uid, forth_gid), "Failed on second migrated pop");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(strlen((char *)first_data), kmsgpipe_pop(&resized, out_buf, first_uid, first_gid), "Failed on third migrated pop");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(strlen((char *)second_data), kmsgpipe_pop(&resized, out_buf, second_uid, second_gid), "Failed on fourth migrated pop");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(second_data, out_buf, strlen((char *)second_data), "Failed on last migrated payload");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&resized), "Failed on migrated ring drained");
+}
+
+void should_fail_migration_without_losing_messages(void)
+{
+    kmsgpipe_buffer_t resized;
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    fill_wrapped_queue();
+    kmsgpipe_init(&resized, resize_base, resize_records, resize_occupancy, 2, TEST_DATA_SIZE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENOSPC, kmsgpipe_migrate(&resized, &buf), "Failed on shrinking below queued count");
+    kmsgpipe_init(&resized, resize_base, resize_records, resize_occupancy, TEST_RESIZE_CAPACITY, 6);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EMSGSIZE, kmsgpipe_migrate(&resized, &buf), "Failed on shrinking below queued message size");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, kmsgpipe_get_message_count(&buf), "Failed on source count after failed migration");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(strlen((char *)third_data), kmsgpipe_pop(&buf, out_buf, third_uid, third_gid), "Failed on source pop after failed migration");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(third_data, out_buf, strlen((char *)third_data), "Failed on source payload after failed migration");
+}
+
+static uint8_t migrated_base[TEST_PACKED_SIZE];
+
+void should_keep_compressed_length_through_peek_and_migration(void)
+{
+    kmsgpipe_buffer_t migrated;
+    kmsgpipe_span_t span;
+
+    kmsgpipe_init_packed(&packed_buf, packed_base, TEST_PACKED_SIZE, TEST_DATA_SIZE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_reserve(&packed_buf, 8, &span), "Failed on reserve");
+    memcpy(span.data, third_data, 8);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EMSGSIZE, kmsgpipe_commit_compressed(&packed_buf, &span, 8, TEST_DATA_SIZE + 1, third_uid, third_gid, third_ts), "Failed on raw length above data_size");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_reserve(&packed_buf, 8, &span), "Failed on reserve after refused commit");
+    memcpy(span.data, third_data, 8);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(8, kmsgpipe_commit_compressed(&packed_buf, &span, 8, 30, third_uid, third_gid, third_ts), "Failed on compressed commit");
+    kmsgpipe_push(&packed_buf, first_data, 10, first_uid, first_gid, first_ts);
+
+    kmsgpipe_init_packed(&migrated, migrated_base, TEST_PACKED_SIZE, TEST_DATA_SIZE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, kmsgpipe_migrate(&migrated, &packed_buf), "Failed on packed migration");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EOPNOTSUPP, kmsgpipe_migrate(&buf, &packed_buf), "Failed on refusing compressed payloads to a slot ring");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_peek(&migrated, third_uid, third_gid, &span), "Failed on compressed peek");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(8, span.len, "Failed on stored length");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(30, span.raw_len, "Failed on raw length");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(third_data, span.data, 8, "Failed on compressed payload");
+    kmsgpipe_peek_release(&migrated, &span, true);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_peek(&migrated, first_uid, first_gid, &span), "Failed on raw peek");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, span.raw_len, "Failed on raw payload flagged as compressed");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_reserve(&buf, 8, &span), "Failed on slot reserve");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EOPNOTSUPP, kmsgpipe_commit_compressed(&buf, &span, 8, 30, third_uid, third_gid, third_ts), "Failed on compressed commit to a slot ring");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&buf), "Failed on slot ring left empty");
+}
+
+void should_collapse_repeats_of_newest_message(void)
+{
+    kmsgpipe_buffer_t resized;
+    kmsgpipe_span_t span;
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(24, sizeof(kmsg_record_t), "Failed on repeat count fitting record padding");
+    kmsgpipe_init_packed(&packed_buf, packed_base, TEST_PACKED_SIZE, TEST_DATA_SIZE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, kmsgpipe_init_dedup(&packed_buf), "Failed on refusing packed layout");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_init_dedup(&buf), "Failed on enabling dedup");
+
+    for (int i = 0; i < 3; i++)
+        TEST_ASSERT_EQUAL_INT_MESSAGE(10, kmsgpipe_push(&buf, first_data, 10, first_uid, first_gid, first_ts + i), "Failed on repeated push");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_get_message_count(&buf), "Failed on repeats sharing one slot");
+    /* Same payload from someone else, or a shorter prefix, is a new message */
+    kmsgpipe_push(&buf, first_data, 10, second_uid, first_gid, second_ts);
+    kmsgpipe_push(&buf, first_data, 9, second_uid, first_gid, second_ts);
+    /* Only the newest message collapses copies */
+    kmsgpipe_push(&buf, first_data, 10, first_uid, first_gid, third_ts);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, kmsgpipe_get_message_count(&buf), "Failed on distinct messages taking slots");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENOSPC, kmsgpipe_push(&buf, first_data, 10, first_uid, first_gid, third_ts), "Failed on full ring refusing a copy");
+    assert_occupancy_matches_records();
+
+    kmsgpipe_init(&resized, resize_base, resize_records, resize_occupancy, TEST_RESIZE_CAPACITY, TEST_DATA_SIZE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, kmsgpipe_migrate(&resized, &buf), "Failed on migration");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_peek(&resized, first_uid, first_gid, &span), "Failed on peek");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(2, span.repeats, "Failed on repeat count");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(first_ts, resize_records[0].timestamp, "Failed on keeping first timestamp");
+    kmsgpipe_peek_release(&resized, &span, true);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_peek(&resized, second_uid, first_gid, &span), "Failed on peek");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, span.repeats, "Failed on single message");
+
+    /* A slot reused after a pop starts with no repeats */
+    kmsgpipe_pop(&buf, out_buf, 0, 0);
+    kmsgpipe_push(&buf, second_data, 6, second_uid, second_gid, forth_ts);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, record_buf[0].repeats, "Failed on reset repeat count");
+}
+
+static kmsgpipe_wheel_t wheel;
+static kmsg_timer_t timers[TEST_RESIZE_CAPACITY];
+
+static ssize_t push_with_deadline(kmsgpipe_buffer_t *ring, const uint8_t *data, size_t len, ktime_t timestamp, ktime_t deadline)
+{
+    kmsgpipe_span_t span;
+    int ret = kmsgpipe_reserve(ring, len, &span);
+
+    if (ret)
+        return ret;
+    memcpy(span.data, data, len);
+    return kmsgpipe_commit_deadline(ring, &span, len, first_uid, first_gid, timestamp, deadline);
+}
+
+void should_expire_deadlines_behind_long_lived_message(void)
+{
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EOPNOTSUPP, push_with_deadline(&buf, first_data, 4, first_ts, second_ts), "Failed on deadline without wheel");
+    kmsgpipe_init_packed(&packed_buf, packed_base, TEST_PACKED_SIZE, TEST_DATA_SIZE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, kmsgpipe_init_wheel(&packed_buf, &wheel, timers, 0, 0), "Failed on rejecting packed wheel");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_init_wheel(&buf, &wheel, timers, 0, 0), "Failed on wheel init");
+
+    push_with_deadline(&buf, first_data, 4, first_ts, KMSGPIPE_NO_DEADLINE);
+    push_with_deadline(&buf, second_data, 4, second_ts, 100);
+    push_with_deadline(&buf, third_data, 4, third_ts, 5000);
+    push_with_deadline(&buf, forth_data, 4, forth_ts, KMSGPIPE_NO_DEADLINE);
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_expire_deadlines(&buf, 99), "Failed on expiring before deadline");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_expire_deadlines(&buf, 100), "Failed on expiring behind live tail");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, kmsgpipe_get_message_count(&buf), "Failed on count after expiry");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_full(&buf), "Failed on hole still holding its slot");
+    TEST_ASSERT_FALSE_MESSAGE(slot_occupied(1), "Failed on hole occupancy");
+
+    /* Consuming the tail steps over the hole */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, kmsgpipe_pop(&buf, out_buf, first_uid, first_gid), "Failed on pop before hole");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, buf.tail, "Failed on tail skipping hole");
+    TEST_ASSERT_FALSE_MESSAGE(kmsgpipe_is_full(&buf), "Failed on hole reclaimed");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_expire_deadlines(&buf, 5000), "Failed on expiring at tail");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, buf.tail, "Failed on tail after expiring at tail");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, kmsgpipe_pop(&buf, out_buf, first_uid, first_gid), "Failed on last pop");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(forth_data, out_buf, 4, "Failed on last payload");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&buf), "Failed on empty ring");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, wheel.armed, "Failed on wheel drained");
+}
+
+void should_cascade_far_deadlines_through_wheel_levels(void)
+{
+    const ktime_t level3 = 5 * (1 << 18) + 7;
+    const ktime_t beyond = 3 * (1 << 24) + 11;
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    kmsgpipe_init_wheel(&buf, &wheel, timers, 0, 0);
+    push_with_deadline(&buf, first_data, 4, first_ts, KMSGPIPE_NO_DEADLINE);
+    push_with_deadline(&buf, second_data, 4, second_ts, beyond);
+    push_with_deadline(&buf, third_data, 4, third_ts, level3);
+    push_with_deadline(&buf, forth_data, 4, forth_ts, 70);
+
+    /* Consuming an armed message takes its timer out of the wheel */
+    kmsgpipe_pop(&buf, out_buf, first_uid, first_gid);
+    kmsgpipe_pop(&buf, out_buf, first_uid, first_gid);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, wheel.armed, "Failed on disarming consumed message");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_expire_deadlines(&buf, 69), "Failed on level 1 before deadline");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_expire_deadlines(&buf, 70), "Failed on level 1 deadline");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_expire_deadlines(&buf, level3 - 1), "Failed on level 3 before deadline");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_expire_deadlines(&buf, level3), "Failed on level 3 deadline");
+
+    kmsgpipe_init_wheel(&buf, &wheel, timers, 0, 0);
+    kmsgpipe_clear(&buf);
+    push_with_deadline(&buf, first_data, 4, first_ts, beyond);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_expire_deadlines(&buf, beyond - 1), "Failed on deadline beyond wheel range");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_expire_deadlines(&buf, beyond), "Failed on re-filed far deadline");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&buf), "Failed on empty ring after far deadline");
+}
+
+void should_expire_exactly_the_due_deadlines(void)
+{
+    kmsgpipe_buffer_t ttl_buf;
+    ktime_t deadline[TEST_RESIZE_CAPACITY];
+    uint32_t state = 7;
+    ktime_t now = 1000;
+    ssize_t expired = 0;
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    kmsgpipe_init(&ttl_buf, resize_base, resize_records, resize_occupancy, TEST_RESIZE_CAPACITY, TEST_DATA_SIZE);
+    kmsgpipe_init_wheel(&ttl_buf, &wheel, timers, 2, now);
+
+    for (int round = 0; round < 20000; round++)
+    {
+        ssize_t due = 0;
+
+        state = state * 1103515245u + 12345u;
+        if (!kmsgpipe_is_full(&ttl_buf))
+        {
+            size_t slot = ttl_buf.head;
+            /* At least one tick, so the deadline is never in an already processed tick */
+            ktime_t ttl = 4 + (state >> 4) % (1 << ((state >> 24) % 22));
+
+            push_with_deadline(&ttl_buf, first_data, 4, now, now + ttl);
+            deadline[slot] = now + ttl;
+        }
+        if ((state >> 8) % 5 == 0)
+            kmsgpipe_pop(&ttl_buf, out_buf, 0, 0);
+
+        now += (state >> 12) % (1 << ((state >> 20) % 16));
+        for (int i = 0; i < TEST_RESIZE_CAPACITY; i++)
+        {
+            if (resize_occupancy[1] == ttl_buf.generation && (resize_occupancy[0] & (1UL << i)) &&
+                (uint64_t)deadline[i] >> 2 <= (uint64_t)now >> 2)
+                due++;
+        }
+        TEST_ASSERT_EQUAL_INT_MESSAGE(due, kmsgpipe_expire_deadlines(&ttl_buf, now), "Failed on expiring exactly the due messages");
+        expired += due;
+    }
+    TEST_ASSERT_TRUE_MESSAGE(expired > 1000, "Failed on exercising expiry");
+}
+
+#define TEST_LANES 3
+
+static kmsgpipe_lanes_t lanes;
+static kmsgpipe_buffer_t lane_bufs[TEST_LANES];
+static uint8_t lane_base[TEST_LANES][TEST_PACKED_SIZE];
+
+static void init_lanes(unsigned int age_limit)
+{
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_lanes_init(&lanes, TEST_LANES, age_limit), "Failed on lanes init");
+    for (int lane = 0; lane < TEST_LANES; lane++)
+        kmsgpipe_init_packed(&lane_bufs[lane], lane_base[lane], TEST_PACKED_SIZE, TEST_DATA_SIZE);
+}
+
+/* Pop from the lane the scheduler picks, returning that lane */
+static int pop_next_lane(uint8_t *out_buf)
+{
+    int lane = kmsgpipe_lanes_pick(&lanes, lane_bufs);
+
+    if (lane < 0)
+        return lane;
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_pop(&lane_bufs[lane], out_buf, first_uid, first_gid) > 0, "Failed on pop from picked lane");
+    kmsgpipe_lanes_served(&lanes, lane_bufs, lane);
+    return lane;
+}
+
+void should_read_highest_non_empty_lane_first(void)
+{
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, kmsgpipe_lanes_init(&lanes, 0, 0), "Failed on zero lanes");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, kmsgpipe_lanes_init(&lanes, KMSGPIPE_MAX_LANES + 1, 0), "Failed on too many lanes");
+    init_lanes(0);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENODATA, kmsgpipe_lanes_pick(&lanes, lane_bufs), "Failed on all lanes empty");
+
+    kmsgpipe_push(&lane_bufs[2], third_data, 8, first_uid, first_gid, first_ts);
+    kmsgpipe_push(&lane_bufs[2], third_data, 8, first_uid, first_gid, first_ts);
+    kmsgpipe_push(&lane_bufs[1], second_data, 6, first_uid, first_gid, second_ts);
+    kmsgpipe_push(&lane_bufs[0], first_data, 10, first_uid, first_gid, third_ts);
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, pop_next_lane(out_buf), "Failed on lane 0 first");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(first_data, out_buf, 10, "Failed on lane 0 payload");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, pop_next_lane(out_buf), "Failed on lane 1 next");
+    /* A late high priority message overtakes the queued bulk */
+    kmsgpipe_push(&lane_bufs[0], forth_data, 5, first_uid, first_gid, forth_ts);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, pop_next_lane(out_buf), "Failed on late lane 0 message");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, pop_next_lane(out_buf), "Failed on lane 2");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, pop_next_lane(out_buf), "Failed on lane 2 again");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENODATA, pop_next_lane(out_buf), "Failed on drained lanes");
+}
+
+void should_age_starved_lanes_ahead_of_busy_ones(void)
+{
+    uint8_t out_buf[TEST_DATA_SIZE];
+    int served[3] = {0};
+
+    init_lanes(2);
+    kmsgpipe_push(&lane_bufs[2], third_data, 8, first_uid, first_gid, first_ts);
+    kmsgpipe_push(&lane_bufs[1], second_data, 6, first_uid, first_gid, first_ts);
+
+    /* Keep lane 0 busy: every read is followed by a fresh lane 0 message */
+    for (int i = 0; i < 8; i++)
+    {
+        kmsgpipe_push(&lane_bufs[0], first_data, 10, first_uid, first_gid, first_ts);
+        served[i < 3 ? 0 : i < 6 ? 1 : 2] += pop_next_lane(out_buf) != 0;
+    }
+    /* Lane 1 then lane 2 get through after being passed over twice */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, served[0], "Failed on lane 1 aged in");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, served[1], "Failed on lane 2 aged in");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, served[2], "Failed on lane 0 only once aged lanes drained");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&lane_bufs[1]) && kmsgpipe_is_empty(&lane_bufs[2]), "Failed on aged lanes drained");
+}
+
+#define TEST_OWNER_QUEUES 4
+
+static kmsgpipe_owners_t owners;
+static kmsg_owner_queue_t owner_queues[2 * TEST_OWNER_QUEUES];
+static kmsg_owner_link_t owner_links[TEST_RESIZE_CAPACITY];
+
+void should_read_own_message_past_foreign_tail(void)
+{
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, kmsgpipe_init_owners(&buf, &owners, owner_queues, owner_links, 3), "Failed on queues not a power of two");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_init_owners(&buf, &owners, owner_queues, owner_links, TEST_OWNER_QUEUES), "Failed on owners init");
+
+    kmsgpipe_push(&buf, first_data, 10, first_uid, first_gid, first_ts);
+    kmsgpipe_push(&buf, second_data, 6, second_uid, second_gid, second_ts);
+    kmsgpipe_push(&buf, third_data, 8, first_uid, first_gid, third_ts);
+    kmsgpipe_push(&buf, forth_data, 5, third_uid, second_gid, forth_ts);
+
+    /* Nothing for forth_uid: no message, rather than somebody else's error */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENODATA, kmsgpipe_pop(&buf, out_buf, forth_uid, forth_gid), "Failed on nothing readable");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(6, kmsgpipe_pop(&buf, out_buf, second_uid, second_gid), "Failed on reading past foreign tail");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(second_data, out_buf, 6, "Failed on second payload");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, buf.tail, "Failed on tail staying at the older message");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_full(&buf), "Failed on hole holding its slot");
+
+    /* Same gid, different uid */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(5, kmsgpipe_pop(&buf, out_buf, forth_uid, second_gid), "Failed on reading by gid");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(forth_data, out_buf, 5, "Failed on forth payload");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENODATA, kmsgpipe_pop(&buf, out_buf, second_uid, second_gid), "Failed on second owner drained");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(10, kmsgpipe_pop(&buf, out_buf, first_uid, first_gid), "Failed on first owner oldest");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, buf.tail, "Failed on tail skipping hole");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(8, kmsgpipe_pop(&buf, out_buf, 0, 0), "Failed on root read");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&buf), "Failed on empty ring");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, owners.used[KMSGPIPE_OWNER_UID] + owners.used[KMSGPIPE_OWNER_GID], "Failed on queues freed");
+}
+
+void should_refuse_owner_beyond_queue_table(void)
+{
+    kmsgpipe_span_t span;
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    kmsgpipe_init_owners(&buf, &owners, owner_queues, owner_links, 2);
+    kmsgpipe_push(&buf, first_data, 10, first_uid, first_gid, first_ts);
+    kmsgpipe_push(&buf, second_data, 6, first_uid, first_gid, second_ts);
+
+    /* One queue per table: a second uid does not fit, a second gid of first_uid neither */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_reserve(&buf, 8, &span), "Failed on reserve");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EUSERS, kmsgpipe_commit(&buf, &span, 8, second_uid, first_gid, third_ts), "Failed on uid table full");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EUSERS, kmsgpipe_push(&buf, third_data, 8, first_uid, second_gid, third_ts), "Failed on gid table full");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, kmsgpipe_get_message_count(&buf), "Failed on count after refused commits");
+
+    kmsgpipe_pop(&buf, out_buf, first_uid, first_gid);
+    kmsgpipe_pop(&buf, out_buf, first_uid, first_gid);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(8, kmsgpipe_push(&buf, third_data, 8, second_uid, second_gid, third_ts), "Failed on table reused");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(8, kmsgpipe_pop(&buf, out_buf, second_uid, forth_gid), "Failed on new owner read");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(third_data, out_buf, 8, "Failed on new owner payload");
+}
+
+void should_hand_each_reader_its_oldest_readable_message(void)
+{
+    kmsgpipe_buffer_t owned_buf;
+    uint32_t seq_at[TEST_RESIZE_CAPACITY];
+    uint32_t state = 11, next_seq = 0;
+    const uint8_t nobody = 255;
+
+    kmsgpipe_init(&owned_buf, resize_base, resize_records, resize_occupancy, TEST_RESIZE_CAPACITY, TEST_DATA_SIZE);
+    kmsgpipe_init_owners(&owned_buf, &owners, owner_queues, owner_links, TEST_OWNER_QUEUES);
+
+    for (int round = 0; round < 50000; round++)
+    {
+        uid_t uid = 1 + (state >> 16) % 3;
+        gid_t gid = 1 + (state >> 20) % 3;
+
+        state = state * 1103515245u + 12345u;
+        if ((state >> 8) % 2 == 0)
+        {
+            uint8_t data[4];
+            size_t slot = owned_buf.head;
+
+            memcpy(data, &next_seq, sizeof(data));
+            if (kmsgpipe_push(&owned_buf, data, sizeof(data), uid, gid, 0) == sizeof(data))
+                seq_at[slot] = next_seq++;
+        }
+        else
+        {
+            uint32_t expect = UINT32_MAX, got;
+            uint8_t out_buf[TEST_DATA_SIZE];
+            uid_t reader_uid = (state >> 12) % 8 == 0 ? 0 : 1 + (state >> 24) % 3;
+            gid_t reader_gid = (state >> 4) % 2 ? nobody : 1 + (state >> 28) % 3;
+            kmsgpipe_span_t span;
+
+            /* Model: oldest queued message this reader may read */
+            for (size_t slot = 0; slot < TEST_RESIZE_CAPACITY; slot++)
+            {
+                kmsg_record_t *rec = &resize_records[slot];
+
+                if (rec->valid && resize_occupancy[1] == owned_buf.generation && (resize_occupancy[0] & (1UL << slot)) &&
+                    kmsgpipe_may_read(reader_uid, reader_gid, rec->owner_uid, rec->owner_gid) && seq_at[slot] < expect)
+                    expect = seq_at[slot];
+            }
+            if (expect == UINT32_MAX)
+            {
+                TEST_ASSERT_EQUAL_INT_MESSAGE(-ENODATA, kmsgpipe_peek(&owned_buf, reader_uid, reader_gid, &span), "Failed on nothing readable");
+                continue;
+            }
+            TEST_ASSERT_EQUAL_INT_MESSAGE(4, kmsgpipe_pop(&owned_buf, out_buf, reader_uid, reader_gid), "Failed on owner pop");
+            memcpy(&got, out_buf, sizeof(got));
+            TEST_ASSERT_EQUAL_UINT32_MESSAGE(expect, got, "Failed on oldest readable message");
+        }
+    }
+    TEST_ASSERT_TRUE_MESSAGE(next_seq > 10000, "Failed on exercising the ring");
+}
+
+void should_rebase_messages_past_holes_in_compact_layout(void)
+{
+    kmsgpipe_buffer_t compact_buf;
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    kmsgpipe_init_compact(&compact_buf, base_buffer, compact_meta, TEST_CAPACITY, TEST_DATA_SIZE, TEST_COMPACT_CREDS, 0);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_init_owners(&compact_buf, &owners, owner_queues, owner_links, TEST_OWNER_QUEUES), "Failed on owners init");
+    kmsgpipe_push(&compact_buf, first_data, 4, first_uid, first_gid, first_ts);
+    kmsgpipe_push(&compact_buf, second_data, 4, first_uid, first_gid, second_ts);
+    kmsgpipe_push(&compact_buf, third_data, 4, second_uid, second_gid, third_ts);
+    kmsgpipe_push(&compact_buf, forth_data, 4, second_uid, second_gid, forth_ts);
+
+    /* Move tail off the epoch, then leave a hole between tail and the newest message */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, kmsgpipe_pop(&compact_buf, out_buf, 0, 0), "Failed on root pop");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, kmsgpipe_pop(&compact_buf, out_buf, second_uid, second_gid), "Failed on owner pop past tail");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(third_data, out_buf, 4, "Failed on owner payload");
+
+    ktime_t newest_ts = second_ts + KMSGPIPE_COMPACT_TS_MAX;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, kmsgpipe_push(&compact_buf, first_data, 4, first_uid, first_gid, newest_ts), "Failed on push past 32-bit delta");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(second_ts, compact_buf.epoch, "Failed on rebased epoch");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(forth_ts - second_ts, compact_buf.ts_delta[3], "Failed on rebasing past the hole");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_cleanup_expired(&compact_buf, forth_ts), "Failed on expiring the oldest");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_cleanup_expired(&compact_buf, forth_ts + 1), "Failed on expiring past the hole");
+}
+
+KMSGPIPE_DEFINE_FIXED_RING(test_fixed, TEST_CAPACITY, TEST_DATA_SIZE);
+
+static test_fixed_t fixed_ring;
+
+void should_interleave_fixed_geometry_calls_with_generic_ones(void)
+{
+    uint8_t out_buf[TEST_DATA_SIZE];
+    uint8_t big[TEST_DATA_SIZE + 1] = {0};
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, test_fixed_init(&fixed_ring), "Failed on typed ring init");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EMSGSIZE, test_fixed_push(&fixed_ring.buf, big, sizeof(big), first_uid, first_gid, first_ts), "Failed on oversized push");
+
+    /* Wrap head and tail so the mask is exercised, mixing both paths */
+    for (int round = 0; round < 3; round++)
+    {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(10, test_fixed_push(&buf, first_data, 10, first_uid, first_gid, first_ts), "Failed on fixed push");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(6, kmsgpipe_push(&buf, second_data, 6, second_uid, second_gid, second_ts), "Failed on generic push");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(8, test_fixed_push(&buf, third_data, 8, third_uid, third_gid, third_ts), "Failed on fixed push");
+        assert_occupancy_matches_records();
+
+        TEST_ASSERT_EQUAL_INT_MESSAGE(10, kmsgpipe_pop(&buf, out_buf, first_uid, first_gid), "Failed on generic pop");
+        TEST_ASSERT_EQUAL_MEMORY_MESSAGE(first_data, out_buf, 10, "Failed on generic pop payload");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(-EACCES, test_fixed_pop(&buf, out_buf, third_uid, third_gid), "Failed on fixed access check");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(6, test_fixed_pop(&buf, out_buf, second_uid, second_gid), "Failed on fixed pop");
+        TEST_ASSERT_EQUAL_MEMORY_MESSAGE(second_data, out_buf, 6, "Failed on fixed pop payload");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(8, test_fixed_pop(&buf, out_buf, 0, 0), "Failed on fixed root pop");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(-ENODATA, test_fixed_pop(&buf, out_buf, 0, 0), "Failed on fixed empty pop");
+        assert_occupancy_matches_records();
+    }
+
+    for (int i = 0; i < TEST_CAPACITY; i++)
+        TEST_ASSERT_EQUAL_INT_MESSAGE(5, test_fixed_push(&buf, forth_data, 5, forth_uid, forth_gid, forth_ts), "Failed on filling");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENOSPC, test_fixed_push(&buf, forth_data, 5, forth_uid, forth_gid, forth_ts), "Failed on full ring");
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_full(&buf), "Failed on generic view of full ring");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(TEST_CAPACITY, kmsgpipe_cleanup_expired(&buf, forth_ts + 1), "Failed on generic expiry");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENODATA, test_fixed_pop(&buf, out_buf, 0, 0), "Failed on fixed pop after expiry");
+
+    /* Any other ring goes through the generic calls */
+    kmsgpipe_init_packed(&packed_buf, packed_base, TEST_PACKED_SIZE, TEST_DATA_SIZE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(10, test_fixed_push(&packed_buf, first_data, 10, first_uid, first_gid, first_ts), "Failed on packed fallback push");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(10, test_fixed_pop(&packed_buf, out_buf, first_uid, first_gid), "Failed on packed fallback pop");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(first_data, out_buf, 10, "Failed on packed fallback payload");
+}
+
+void should_leave_no_peek_field_unset_on_fixed_path(void)
+{
+    kmsgpipe_span_t span;
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(10, test_fixed_push(&buf, first_data, 10, first_uid, first_gid, first_ts), "Failed on fixed push");
+    /* Callers peek into stack spans: nothing may survive from before */
+    memset(&span, 0xA5, sizeof(span));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, test_fixed_peek(&buf, first_uid, first_gid, &span), "Failed on fixed peek");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(10, span.len, "Failed on fixed peek length");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, span.raw_len, "Failed on fixed peek raw length");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(0, span.seq, "Failed on fixed peek sequence number");
+    TEST_ASSERT_NULL_MESSAGE(span.chain, "Failed on fixed peek chain");
+    test_fixed_peek_release(&buf, &span, true);
+}
+
+#define TEST_KEY_ENTRIES (2 * TEST_RESIZE_CAPACITY)
+
+static kmsgpipe_keys_t keys;
+static kmsg_key_entry_t key_table[TEST_KEY_ENTRIES];
+static uint64_t slot_keys[TEST_RESIZE_CAPACITY];
+
+static ssize_t push_keyed(kmsgpipe_buffer_t *ring, const uint8_t *data, size_t len, uint64_t key, ktime_t deadline)
+{
+    kmsgpipe_span_t span;
+    int ret = kmsgpipe_reserve(ring, len, &span);
+
+    if (ret)
+        return ret;
+    memcpy(span.data, data, len);
+    return kmsgpipe_commit_keyed(ring, &span, len, key, first_uid, first_gid, first_ts, deadline);
+}
+
+void should_keep_only_newest_message_per_key(void)
+{
+    static kmsgpipe_keys_t resized_keys;
+    static kmsg_key_entry_t resized_key_table[TEST_KEY_ENTRIES];
+    static uint64_t resized_slot_keys[TEST_RESIZE_CAPACITY];
+    kmsgpipe_buffer_t resized;
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EOPNOTSUPP, push_keyed(&buf, first_data, 10, 1, KMSGPIPE_NO_DEADLINE), "Failed on key without index");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, kmsgpipe_init_keys(&buf, &keys, key_table, slot_keys, TEST_CAPACITY), "Failed on table no larger than ring");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_init_keys(&buf, &keys, key_table, slot_keys, TEST_KEY_ENTRIES), "Failed on keys init");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, kmsgpipe_init_dedup(&buf), "Failed on refusing dedup beside keys");
+    kmsgpipe_init_wheel(&buf, &wheel, timers, 0, 0);
+
+    push_keyed(&buf, first_data, 10, 1, KMSGPIPE_NO_DEADLINE);
+    push_keyed(&buf, second_data, 6, 2, 100);
+    kmsgpipe_push(&buf, third_data, 8, first_uid, first_gid, third_ts);
+    /* Replacing the tail's message moves tail on; replacing one with a deadline disarms it */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(5, push_keyed(&buf, forth_data, 5, 1, KMSGPIPE_NO_DEADLINE), "Failed on keyed push");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, buf.tail, "Failed on tail skipping replaced message");
+    push_keyed(&buf, first_data, 10, 2, KMSGPIPE_NO_DEADLINE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, kmsgpipe_get_message_count(&buf), "Failed on one message per key");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, keys.replaced, "Failed on replaced count");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_expire_deadlines(&buf, 100), "Failed on replaced deadline not firing");
+    assert_occupancy_matches_records();
+
+    kmsgpipe_init(&resized, resize_base, resize_records, resize_occupancy, TEST_RESIZE_CAPACITY, TEST_DATA_SIZE);
+    kmsgpipe_init_keys(&resized, &resized_keys, resized_key_table, resized_slot_keys, TEST_KEY_ENTRIES);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, kmsgpipe_migrate(&resized, &buf), "Failed on migration");
+    /* Keys came along; the unkeyed message stays */
+    push_keyed(&resized, second_data, 6, 1, KMSGPIPE_NO_DEADLINE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, kmsgpipe_get_message_count(&resized), "Failed on key kept by migration");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(8, kmsgpipe_pop(&resized, out_buf, first_uid, first_gid), "Failed on unkeyed message");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(10, kmsgpipe_pop(&resized, out_buf, first_uid, first_gid), "Failed on key 2");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(6, kmsgpipe_pop(&resized, out_buf, first_uid, first_gid), "Failed on key 1");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(second_data, out_buf, 6, "Failed on newest payload of key 1");
+
+    /* An expired or read message no longer holds its key */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(8, kmsgpipe_pop(&buf, out_buf, first_uid, first_gid), "Failed on pop");
+    push_keyed(&buf, second_data, 6, 3, 200);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_expire_deadlines(&buf, 200), "Failed on keyed deadline");
+    push_keyed(&buf, third_data, 8, 3, KMSGPIPE_NO_DEADLINE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, kmsgpipe_get_message_count(&buf), "Failed on expired key not replacing");
+
+    kmsgpipe_clear(&buf);
+    push_keyed(&buf, first_data, 10, 1, KMSGPIPE_NO_DEADLINE);
+    push_keyed(&buf, second_data, 6, 2, KMSGPIPE_NO_DEADLINE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, kmsgpipe_get_message_count(&buf), "Failed on keys forgotten by clear");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, keys.replaced, "Failed on no replacement after clear");
+}
+
+static kmsgpipe_history_t history;
+static uint64_t history_seqs[TEST_RESIZE_CAPACITY];
+
+void should_replay_read_messages_by_sequence_and_time(void)
+{
+    static kmsgpipe_history_t resized_history;
+    static uint64_t resized_seqs[TEST_RESIZE_CAPACITY];
+    kmsgpipe_buffer_t resized;
+    kmsgpipe_span_t span;
+    uint8_t out_buf[TEST_DATA_SIZE];
+    uint64_t seq;
+
+    kmsgpipe_init_packed(&packed_buf, packed_base, TEST_PACKED_SIZE, TEST_DATA_SIZE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, kmsgpipe_init_history(&packed_buf, &history, history_seqs), "Failed on refusing packed layout");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EOPNOTSUPP, kmsgpipe_history_peek(&buf, 0, first_uid, first_gid, &span), "Failed on replay without history");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_init_history(&buf, &history, history_seqs), "Failed on history init");
+
+    kmsgpipe_push(&buf, first_data, 10, first_uid, first_gid, first_ts);
+    kmsgpipe_push(&buf, second_data, 6, first_uid, first_gid, second_ts);
+    kmsgpipe_push(&buf, third_data, 8, second_uid, second_gid, third_ts);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_peek(&buf, first_uid, first_gid, &span), "Failed on peek");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(0, span.seq, "Failed on first sequence number");
+    kmsgpipe_peek_release(&buf, &span, true);
+
+    /* A read message replays until its slot is written over */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_history_peek(&buf, 0, first_uid, first_gid, &span), "Failed on replaying read message");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(first_data, span.data, 10, "Failed on replayed payload");
+    kmsgpipe_push(&buf, forth_data, 5, first_uid, first_gid, forth_ts);
+    kmsgpipe_push(&buf, first_data, 10, first_uid, first_gid, forth_ts + 10);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_history_peek(&buf, 0, first_uid, first_gid, &span), "Failed on replay from before history");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(1, span.seq, "Failed on oldest retained message");
+
+    /* Replay steps over messages the reader may not see */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_history_peek(&buf, 2, first_uid, first_gid, &span), "Failed on replay past foreign message");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(3, span.seq, "Failed on skipping foreign message");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_history_peek(&buf, 4, first_uid, first_gid, &span), "Failed on replaying newest");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENODATA, kmsgpipe_history_peek(&buf, 5, first_uid, first_gid, &span), "Failed on replay past newest");
+
+    kmsgpipe_history_seek_time(&buf, third_ts - 1, &seq);
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(2, seq, "Failed on seeking by time");
+    kmsgpipe_history_seek_time(&buf, forth_ts + 11, &seq);
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(5, seq, "Failed on seeking past newest");
+
+    /* FIFO readers were not disturbed */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, kmsgpipe_get_message_count(&buf), "Failed on count after replay");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(6, kmsgpipe_pop(&buf, out_buf, first_uid, first_gid), "Failed on FIFO read after replay");
+
+    kmsgpipe_init(&resized, resize_base, resize_records, resize_occupancy, TEST_RESIZE_CAPACITY, TEST_DATA_SIZE);
+    kmsgpipe_init_history(&resized, &resized_history, resized_seqs);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, kmsgpipe_migrate(&resized, &buf), "Failed on migration");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_peek(&resized, 0, 0, &span), "Failed on peek after migration");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(2, span.seq, "Failed on number kept by migration");
+    kmsgpipe_push(&resized, second_data, 6, first_uid, first_gid, forth_ts + 20);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_history_peek(&resized, 5, first_uid, first_gid, &span), "Failed on replay after migration");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(5, span.seq, "Failed on numbering carried on after migration");
+
+    kmsgpipe_clear(&buf);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ENODATA, kmsgpipe_history_peek(&buf, 0, first_uid, first_gid, &span), "Failed on history dropped by clear");
+    kmsgpipe_push(&buf, second_data, 6, first_uid, first_gid, forth_ts + 20);
+    kmsgpipe_peek(&buf, first_uid, first_gid, &span);
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(5, span.seq, "Failed on numbering carried on after clear");
+}
+
+/* A chained payload as a caller might build one: length plus bytes kept elsewhere */
+typedef struct test_chain
+{
+    size_t len;
+    uint8_t bytes[4 * TEST_DATA_SIZE];
+} test_chain_t;
+
+static test_chain_t test_chains[3];
+static size_t chains_freed;
+
+static void test_chain_free(void *chain)
+{
+    (void)chain;
+    chains_freed++;
+}
+
+static kmsgpipe_chains_t chains;
+static void *chain_slots[TEST_RESIZE_CAPACITY];
+
+static ssize_t push_chain(kmsgpipe_buffer_t *ring, test_chain_t *chain, ktime_t deadline)
+{
+    kmsgpipe_span_t span;
+    int ret = kmsgpipe_reserve(ring, 0, &span);
+
+    if (ret)
+        return ret;
+    return kmsgpipe_commit_chain(ring, &span, chain, first_uid, first_gid, first_ts, deadline);
+}
+
+void should_hand_large_payload_chains_back_once_done(void)
+{
+    static kmsgpipe_chains_t resized_chains;
+    static void *resized_chain_slots[TEST_RESIZE_CAPACITY];
+    kmsgpipe_buffer_t resized;
+    kmsgpipe_span_t span;
+    uint8_t out_buf[TEST_DATA_SIZE];
+
+    chains_freed = 0;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EOPNOTSUPP, push_chain(&buf, &test_chains[0], KMSGPIPE_NO_DEADLINE), "Failed on chain without chains");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, kmsgpipe_init_chains(&buf, &chains, chain_slots, NULL), "Failed on missing free callback");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_init_chains(&buf, &chains, chain_slots, test_chain_free), "Failed on chains init");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, kmsgpipe_init_dedup(&buf), "Failed on refusing dedup beside chains");
+    kmsgpipe_init_wheel(&buf, &wheel, timers, 0, 0);
+
+    test_chains[0].len = sizeof(test_chains[0].bytes);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, push_chain(&buf, &test_chains[0], KMSGPIPE_NO_DEADLINE), "Failed on chained push");
+    kmsgpipe_push(&buf, first_data, 10, first_uid, first_gid, second_ts);
+    push_chain(&buf, &test_chains[1], 100);
+    push_chain(&buf, &test_chains[2], KMSGPIPE_NO_DEADLINE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, chains.live, "Failed on live chains");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_peek(&buf, first_uid, first_gid, &span), "Failed on peeking chained message");
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(&test_chains[0], span.chain, "Failed on chain handed to reader");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, span.len, "Failed on chained message taking no slot bytes");
+    kmsgpipe_peek_release(&buf, &span, false);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, chains_freed, "Failed on chain kept by peek without consume");
+    kmsgpipe_peek_release(&buf, &span, true);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, chains_freed, "Failed on chain freed once read");
+
+    /* Small messages stay in their slot */
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_peek(&buf, first_uid, first_gid, &span), "Failed on peeking slot message");
+    TEST_ASSERT_NULL_MESSAGE(span.chain, "Failed on slot message without chain");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(10, span.len, "Failed on slot message length");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_expire_deadlines(&buf, 100), "Failed on expiring chained message");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, chains_freed, "Failed on chain freed once expired");
+
+    /* Migration hands chains on without freeing them */
+    kmsgpipe_init(&resized, resize_base, resize_records, resize_occupancy, TEST_RESIZE_CAPACITY, TEST_DATA_SIZE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EOPNOTSUPP, kmsgpipe_migrate(&resized, &buf), "Failed on migrating chains to a ring without");
+    kmsgpipe_init(&resized, resize_base, resize_records, resize_occupancy, TEST_RESIZE_CAPACITY, TEST_DATA_SIZE);
+    kmsgpipe_init_chains(&resized, &resized_chains, resized_chain_slots, test_chain_free);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, kmsgpipe_migrate(&resized, &buf), "Failed on migration");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, chains_freed, "Failed on migration freeing nothing");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(10, kmsgpipe_pop(&resized, out_buf, first_uid, first_gid), "Failed on migrated slot message");
+    kmsgpipe_peek(&resized, first_uid, first_gid, &span);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(&test_chains[2], span.chain, "Failed on migrated chain");
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, kmsgpipe_clear(&resized), "Failed on clear");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, chains_freed, "Failed on chain freed by clear");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, resized_chains.live, "Failed on no live chains after clear");
+}
+
+/* Map @size bytes of one memfd twice, back to back, as a driver would with vmap() */
+static uint8_t *map_mirrored(size_t size)
+{
+    int fd = memfd_create("kmsgpipe_test", 0);
+    uint8_t *base = MAP_FAILED;
+
+    if (fd >= 0 && ftruncate(fd, size) == 0)
+        base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base != MAP_FAILED &&
+        (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+         mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED))
+    {
+        munmap(base, 2 * size);
+        base = MAP_FAILED;
+    }
+    if (fd >= 0)
+        close(fd);
+    return base == MAP_FAILED ? NULL : base;
+}
+
+void should_run_records_past_the_end_of_a_mirrored_ring(void)
+{
+    size_t size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t len = 3 * TEST_DATA_SIZE;
+    size_t rec = KMSGPIPE_PACKED_RECORD_SIZE(len);
+    uint8_t *base = map_mirrored(size);
+    uint8_t data[3 * TEST_DATA_SIZE];
+    uint8_t out_buf[3 * TEST_DATA_SIZE];
+    kmsgpipe_span_t span;
+    size_t pushed = 0, head;
+
+    TEST_ASSERT_NOT_NULL_MESSAGE(base, "Failed on mapping the ring twice");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, kmsgpipe_init_packed_mirrored(&packed_buf, base, size - 1, len), "Failed on rejecting unaligned mirrored ring size");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_init_packed_mirrored(&packed_buf, base, size, len), "Failed on mirrored init");
+
+    for (size_t i = 0; i < len; i++)
+        data[i] = (uint8_t)i;
+    while (kmsgpipe_push(&packed_buf, data, len, first_uid, first_gid, first_ts) == (ssize_t)len)
+        pushed++;
+    TEST_ASSERT_TRUE_MESSAGE(size - packed_buf.head < rec, "Failed on test precondition for a record past the end");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(pushed * rec, packed_buf.used, "Failed on used bytes before the end");
+
+    /* Freeing one record is enough: the next one starts at head, not offset 0 */
+    kmsgpipe_pop(&packed_buf, out_buf, first_uid, first_gid);
+    head = packed_buf.head;
+    data[0] = 'M';
+    TEST_ASSERT_EQUAL_INT_MESSAGE(len, kmsgpipe_push(&packed_buf, data, len, second_uid, second_gid, second_ts), "Failed on push past the end");
+    TEST_ASSERT_EQUAL_INT_MESSAGE((head + rec) % size, packed_buf.head, "Failed on head after record past the end");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(pushed * rec, packed_buf.used, "Failed on no padding counted as used");
+    TEST_ASSERT_EQUAL_INT_MESSAGE('M', base[(head + sizeof(kmsg_packed_hdr_t)) % size], "Failed on payload start written through the mirror");
+
+    for (size_t i = 1; i < pushed; i++)
+        kmsgpipe_pop(&packed_buf, out_buf, first_uid, first_gid);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, kmsgpipe_peek(&packed_buf, second_uid, second_gid, &span), "Failed on peeking record past the end");
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(base + head + sizeof(kmsg_packed_hdr_t), span.data, "Failed on contiguous payload pointer");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(data, span.data, len, "Failed on payload read through the second mapping");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(data[len - 1], base[(head + sizeof(kmsg_packed_hdr_t) + len - 1) % size], "Failed on payload end aliasing the first mapping");
+    kmsgpipe_peek_release(&packed_buf, &span, true);
+    TEST_ASSERT_TRUE_MESSAGE(kmsgpipe_is_empty(&packed_buf), "Failed on empty mirrored ring");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, packed_buf.used, "Failed on used bytes after draining");
+
+    munmap(base, 2 * size);
 }
 
 int main(void)
@@ -281,6 +1853,50 @@ int main(void)
     RUN_TEST(should_get_correct_data_item_count_from_buffer);
     RUN_TEST(should_get_correct_data_item_count_from_buffer_when_head_is_wrapped_around);
     RUN_TEST(should_clear_all_messages_from_buffer);
+    RUN_TEST(should_not_leak_stale_payload_after_clear);
+    RUN_TEST(should_reset_occupancy_when_generation_wraps);
+    RUN_TEST(should_keep_count_and_occupancy_through_wraparound);
+    RUN_TEST(should_keep_count_and_occupancy_through_expiry);
+    RUN_TEST(should_reject_packed_ring_that_cannot_hold_largest_message);
+    RUN_TEST(should_pack_messages_by_length_in_packed_layout);
+    RUN_TEST(should_wrap_packed_records_with_padding);
+    RUN_TEST(should_expire_and_clear_packed_records);
+    RUN_TEST(should_reject_spsc_ring_with_non_power_of_two_capacity);
+    RUN_TEST(should_push_and_pop_in_order_with_free_running_spsc_indices);
+    RUN_TEST(should_report_full_and_expire_in_spsc_ring);
+    RUN_TEST(should_deliver_every_message_in_order_across_spsc_threads);
+    RUN_TEST(should_deliver_every_message_in_order_across_split_sides);
+    RUN_TEST(should_push_and_pop_in_order_in_mpmc_ring);
+    RUN_TEST(should_expire_and_clear_mpmc_ring);
+    RUN_TEST(should_deliver_every_message_exactly_once_across_mpmc_threads);
+    RUN_TEST(should_reserve_commit_and_cancel_in_slot_layout);
+    RUN_TEST(should_interleave_one_reservation_with_one_peek);
+    RUN_TEST(should_reserve_across_wrap_padding_in_packed_layout);
+    RUN_TEST(should_keep_message_on_release_without_consume_in_spsc_ring);
+    RUN_TEST(should_skip_cancelled_reservation_in_mpmc_ring);
+    RUN_TEST(should_push_pop_and_check_access_in_compact_layout);
+    RUN_TEST(should_expire_by_timestamp_delta_in_compact_layout);
+    RUN_TEST(should_store_small_messages_inline_and_large_in_slots);
+    RUN_TEST(should_run_inline_ring_without_payload_area);
+    RUN_TEST(should_migrate_messages_in_fifo_order_across_layouts);
+    RUN_TEST(should_fail_migration_without_losing_messages);
+    RUN_TEST(should_keep_compressed_length_through_peek_and_migration);
+    RUN_TEST(should_collapse_repeats_of_newest_message);
+    RUN_TEST(should_expire_deadlines_behind_long_lived_message);
+    RUN_TEST(should_cascade_far_deadlines_through_wheel_levels);
+    RUN_TEST(should_expire_exactly_the_due_deadlines);
+    RUN_TEST(should_read_highest_non_empty_lane_first);
+    RUN_TEST(should_age_starved_lanes_ahead_of_busy_ones);
+    RUN_TEST(should_read_own_message_past_foreign_tail);
+    RUN_TEST(should_refuse_owner_beyond_queue_table);
+    RUN_TEST(should_hand_each_reader_its_oldest_readable_message);
+    RUN_TEST(should_rebase_messages_past_holes_in_compact_layout);
+    RUN_TEST(should_interleave_fixed_geometry_calls_with_generic_ones);
+    RUN_TEST(should_leave_no_peek_field_unset_on_fixed_path);
+    RUN_TEST(should_keep_only_newest_message_per_key);
+    RUN_TEST(should_replay_read_messages_by_sequence_and_time);
+    RUN_TEST(should_hand_large_payload_chains_back_once_done);
+    RUN_TEST(should_run_records_past_the_end_of_a_mirrored_ring);
 
     return UNITY_END();
 }
\ No newline at end of file